@@ -80,6 +80,10 @@ int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
                     const Value* patch,
                     SinkFn sink, void* token, SHA_CTX* ctx,
                     const Value* bonus_data);
+int ApplyImagePatchThreads(const unsigned char* old_data, ssize_t old_size,
+                           const Value* patch,
+                           SinkFn sink, void* token, SHA_CTX* ctx,
+                           const Value* bonus_data, int max_threads);
 
 // freecache.c
 int MakeFreeSpaceOnCache(size_t bytes_needed);
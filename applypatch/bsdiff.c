@@ -50,6 +50,7 @@
 #include <bzlib.h>
 #include <err.h>
 #include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -57,6 +58,136 @@
 
 #define MIN(x,y) (((x)<(y)) ? (x) : (y))
 
+/*
+ * Suffix arrays of inputs shorter than SAIDX_MAX use 32-bit entries
+ * and are built in linear time by SA-IS (Nong, Zhang and Chan, "Two
+ * Efficient Algorithms for Linear Time Suffix Array Construction").
+ * Anything bigger falls back to qsufsort() with off_t entries.  Both
+ * produce the same (unique) array, so the patches are identical.
+ */
+typedef int32_t saidx_t;
+#define SAIDX_MAX INT32_MAX
+
+#define SAIS_CHR(i) (cs==1 ? (saidx_t)((const u_char *)T)[i] : ((const saidx_t *)T)[i])
+#define SAIS_TGET(i) ((t[(i)>>3]>>((i)&7))&1)
+#define SAIS_TSET(i,b) (t[(i)>>3]=(b) ? t[(i)>>3]|(1<<((i)&7)) : t[(i)>>3]&~(1<<((i)&7)))
+#define SAIS_LMS(i) ((i)==n || ((i)>0 && SAIS_TGET(i) && !SAIS_TGET((i)-1)))
+
+static void sais_buckets(const void *T,int cs,saidx_t n,saidx_t *C,saidx_t *B,saidx_t k,int end)
+{
+	saidx_t i,sum=0;
+
+	/* C and B may be the same array */
+	for(i=0;i<k;i++) C[i]=0;
+	for(i=0;i<n;i++) C[SAIS_CHR(i)]++;
+	for(i=0;i<k;i++) {
+		sum+=C[i];
+		B[i]=end ? sum : sum-C[i];
+	};
+}
+
+/* Sort the L suffixes from the LMS ones, then the S suffixes from
+   the L ones.  The sentinel suffix (n) is implicitly first. */
+static void sais_induce(const void *T,int cs,const u_char *t,saidx_t *SA,saidx_t n,
+		saidx_t *C,saidx_t *B,saidx_t k)
+{
+	saidx_t i,j;
+
+	sais_buckets(T,cs,n,C,B,k,0);
+	SA[B[SAIS_CHR(n-1)]++]=n-1;
+	for(i=0;i<n;i++) {
+		j=SA[i]-1;
+		if(j>=0 && !SAIS_TGET(j)) SA[B[SAIS_CHR(j)]++]=j;
+	};
+
+	sais_buckets(T,cs,n,C,B,k,1);
+	for(i=n-1;i>=0;i--) {
+		j=SA[i]-1;
+		if(j>=0 && SAIS_TGET(j)) SA[--B[SAIS_CHR(j)]]=j;
+	};
+}
+
+/* Sorts the suffixes of T[0..n), characters of size cs (1 or
+   sizeof(saidx_t)) in [0,k), into SA[0..n).  The worklen entries at
+   work are free to hold the buckets, if there's room. */
+static void sais(const void *T,saidx_t *SA,saidx_t n,saidx_t k,int cs,
+		saidx_t *work,saidx_t worklen)
+{
+	u_char *t;
+	saidx_t *C,*B,*bkt;
+	saidx_t i,j,n1,name,prev,pos,d;
+	int diff;
+
+	if(n==0) return;
+	if(n==1) { SA[0]=0; return; };
+
+	/* t[i] is 1 for S suffixes, 0 for L; the last is L, being
+	   bigger than the sentinel */
+	if((t=calloc(n/8+1,1))==NULL) err(1,NULL);
+	for(i=n-2;i>=0;i--)
+		SAIS_TSET(i,SAIS_CHR(i)<SAIS_CHR(i+1) ||
+			(SAIS_CHR(i)==SAIS_CHR(i+1) && SAIS_TGET(i+1)));
+
+	bkt=NULL;
+	if(worklen>=2*k) {
+		C=work;B=work+k;
+	} else if(worklen>=k) {
+		C=B=work;
+	} else {
+		if((bkt=malloc(2*k*sizeof(saidx_t)))==NULL) err(1,NULL);
+		C=bkt;B=bkt+k;
+	};
+
+	/* Sort the LMS substrings */
+	sais_buckets(T,cs,n,C,B,k,1);
+	for(i=0;i<n;i++) SA[i]=-1;
+	for(i=1;i<n;i++) if(SAIS_LMS(i)) SA[--B[SAIS_CHR(i)]]=i;
+	sais_induce(T,cs,t,SA,n,C,B,k);
+
+	/* Name them, in order; equal substrings get equal names */
+	n1=0;
+	for(i=0;i<n;i++) if(SAIS_LMS(SA[i])) SA[n1++]=SA[i];
+	for(i=n1;i<n;i++) SA[i]=-1;
+	name=0;prev=-1;
+	for(i=0;i<n1;i++) {
+		pos=SA[i];diff=0;
+		for(d=0;;d++) {
+			if(prev==-1 || pos+d==n || prev+d==n ||
+					SAIS_CHR(pos+d)!=SAIS_CHR(prev+d) ||
+					SAIS_TGET(pos+d)!=SAIS_TGET(prev+d)) {
+				diff=1;
+				break;
+			} else if(d>0 && (SAIS_LMS(pos+d) || SAIS_LMS(prev+d))) {
+				break;
+			};
+		};
+		if(diff) { name++; prev=pos; };
+		SA[n1+pos/2]=name-1;
+	};
+	for(i=n-1,j=n-1;i>=n1;i--) if(SA[i]>=0) SA[j--]=SA[i];
+
+	/* Sort the LMS suffixes by sorting the string of names */
+	if(name<n1) {
+		sais(SA+n-n1,SA,n1,name,sizeof(saidx_t),SA+n1,n-2*n1);
+	} else {
+		for(i=0;i<n1;i++) SA[SA[n-n1+i]]=i;
+	};
+
+	/* Put them at the ends of their buckets, in order, and induce */
+	for(i=1,j=0;i<n;i++) if(SAIS_LMS(i)) SA[n-n1+j++]=i;
+	for(i=0;i<n1;i++) SA[i]=SA[n-n1+SA[i]];
+	for(i=n1;i<n;i++) SA[i]=-1;
+	sais_buckets(T,cs,n,C,B,k,1);
+	for(i=n1-1;i>=0;i--) {
+		j=SA[i];SA[i]=-1;
+		SA[--B[SAIS_CHR(j)]]=j;
+	};
+	sais_induce(T,cs,t,SA,n,C,B,k);
+
+	free(bkt);
+	free(t);
+}
+
 static void split(off_t *I,off_t *V,off_t start,off_t len,off_t h)
 {
 	off_t i,j,k,x,tmp,jj,kk;
@@ -156,6 +287,33 @@ static void qsufsort(off_t *I,off_t *V,u_char *old,off_t oldsize)
 	for(i=0;i<oldsize+1;i++) I[V[i]]=i;
 }
 
+static off_t sa_at(const void *I,off_t oldsize,off_t i)
+{
+	if(oldsize<SAIDX_MAX) return ((const saidx_t *)I)[i];
+	return ((const off_t *)I)[i];
+}
+
+// Builds the suffix array bsdiff() searches: oldsize+1 entries, the
+// first being the empty suffix (oldsize).  Entries are saidx_t if
+// oldsize < SAIDX_MAX, and off_t otherwise.
+void* bsdiff_suffix_array(u_char* old, off_t oldsize)
+{
+	if(oldsize<SAIDX_MAX) {
+		saidx_t *I;
+		if((I=malloc((oldsize+1)*sizeof(saidx_t)))==NULL) err(1,NULL);
+		I[0]=oldsize;
+		sais(old,I+1,oldsize,256,1,NULL,0);
+		return I;
+	} else {
+		off_t *I,*V;
+		if(((I=malloc((oldsize+1)*sizeof(off_t)))==NULL) ||
+			((V=malloc((oldsize+1)*sizeof(off_t)))==NULL)) err(1,NULL);
+		qsufsort(I,V,old,oldsize);
+		free(V);
+		return I;
+	};
+}
+
 static off_t matchlen(u_char *old,off_t oldsize,u_char *new,off_t newsize)
 {
 	off_t i;
@@ -166,26 +324,29 @@ static off_t matchlen(u_char *old,off_t oldsize,u_char *new,off_t newsize)
 	return i;
 }
 
-static off_t search(off_t *I,u_char *old,off_t oldsize,
+static off_t search(const void *I,u_char *old,off_t oldsize,
 		u_char *new,off_t newsize,off_t st,off_t en,off_t *pos)
 {
-	off_t x,y;
+	off_t x,y,ist,ien,ix;
 
 	if(en-st<2) {
-		x=matchlen(old+I[st],oldsize-I[st],new,newsize);
-		y=matchlen(old+I[en],oldsize-I[en],new,newsize);
+		ist=sa_at(I,oldsize,st);
+		ien=sa_at(I,oldsize,en);
+		x=matchlen(old+ist,oldsize-ist,new,newsize);
+		y=matchlen(old+ien,oldsize-ien,new,newsize);
 
 		if(x>y) {
-			*pos=I[st];
+			*pos=ist;
 			return x;
 		} else {
-			*pos=I[en];
+			*pos=ien;
 			return y;
 		}
 	};
 
 	x=st+(en-st)/2;
-	if(memcmp(old+I[x],new,MIN(oldsize-I[x],newsize))<0) {
+	ix=sa_at(I,oldsize,x);
+	if(memcmp(old+ix,new,MIN(oldsize-ix,newsize))<0) {
 		return search(I,old,oldsize,new,newsize,x,en,pos);
 	} else {
 		return search(I,old,oldsize,new,newsize,st,x,pos);
@@ -218,14 +379,15 @@ static void offtout(off_t x,u_char *buf)
 //
 //    - the "I" block of memory is owned by the caller, who passes a
 //      pointer to *I, which can be NULL.  This way if we call
-//      bsdiff() multiple times with the same 'old' data, we only do
-//      the qsufsort() step the first time.
+//      bsdiff() multiple times with the same 'old' data, we only
+//      sort its suffixes the first time.  The caller can also build
+//      it ahead of time with bsdiff_suffix_array().
 //
-int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
+int bsdiff(u_char* old, off_t oldsize, void** IP, u_char* new, off_t newsize,
            const char* patch_filename)
 {
 	int fd;
-	off_t *I;
+	void *I;
 	off_t scan,pos,len;
 	off_t lastscan,lastpos,lastoffset;
 	off_t oldscore,scsc;
@@ -241,11 +403,7 @@ int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
 	int bz2err;
 
         if (*IP == NULL) {
-            off_t* V;
-            *IP = malloc((oldsize+1) * sizeof(off_t));
-            V = malloc((oldsize+1) * sizeof(off_t));
-            qsufsort(*IP, V, old, oldsize);
-            free(V);
+            *IP = bsdiff_suffix_array(old, oldsize);
         }
         I = *IP;
 
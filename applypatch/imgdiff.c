@@ -122,6 +122,7 @@
  */
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -143,7 +144,7 @@ typedef struct {
   size_t source_start;
   size_t source_len;
 
-  off_t* I;             // used by bsdiff
+  void* I;              // suffix array, used by bsdiff
 
   // --- for CHUNK_DEFLATE chunks only: ---
 
@@ -179,7 +180,8 @@ static int fileentry_compare(const void* a, const void* b) {
 }
 
 // from bsdiff.c
-int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
+void* bsdiff_suffix_array(u_char* old, off_t oldsize);
+int bsdiff(u_char* old, off_t oldsize, void** IP, u_char* new, off_t newsize,
            const char* patch_filename);
 
 unsigned char* ReadZip(const char* filename,
@@ -598,6 +600,14 @@ int ReconstructDeflateChunk(ImageChunk* chunk) {
   return -1;
 }
 
+/*
+ * Whether MakePatch() will run bsdiff for this target chunk (rather
+ * than just storing it raw).
+ */
+int NeedsBsdiff(ImageChunk* tgt) {
+  return !(tgt->type == CHUNK_NORMAL && tgt->len <= 160);
+}
+
 /*
  * Given source and target chunks, compute a bsdiff patch between them
  * by running bsdiff in a subprocess.  Return the patch data, placing
@@ -605,12 +615,10 @@ int ReconstructDeflateChunk(ImageChunk* chunk) {
  * program to be in the path.
  */
 unsigned char* MakePatch(ImageChunk* src, ImageChunk* tgt, size_t* size) {
-  if (tgt->type == CHUNK_NORMAL) {
-    if (tgt->len <= 160) {
-      tgt->type = CHUNK_RAW;
-      *size = tgt->len;
-      return tgt->data;
-    }
+  if (!NeedsBsdiff(tgt)) {
+    tgt->type = CHUNK_RAW;
+    *size = tgt->len;
+    return tgt->data;
   }
 
   char ptemp[] = "/tmp/imgdiff-patch-XXXXXX";
@@ -668,6 +676,102 @@ unsigned char* MakePatch(ImageChunk* src, ImageChunk* tgt, size_t* size) {
   return data;
 }
 
+/*
+ * MakePatches() runs MakePatch() for every target chunk, spread over
+ * a thread per CPU.  The chunks are independent except that several
+ * targets may share a source, so the sources' suffix arrays are all
+ * built (again in parallel) before any patch is made.
+ */
+typedef struct {
+  ImageChunk** srcs;          // source for each target
+  ImageChunk* tgts;
+  int num_chunks;
+  unsigned char** patch_data;
+  size_t* patch_size;
+
+  ImageChunk** sort;          // distinct sources needing suffix arrays
+  int num_sort;
+
+  int next;
+  pthread_mutex_t mu;
+} PatchWork;
+
+static int NextWorkItem(PatchWork* work, int limit) {
+  pthread_mutex_lock(&work->mu);
+  int i = work->next < limit ? work->next++ : -1;
+  pthread_mutex_unlock(&work->mu);
+  return i;
+}
+
+static void* SortWorker(void* cookie) {
+  PatchWork* work = (PatchWork*) cookie;
+  int i;
+  while ((i = NextWorkItem(work, work->num_sort)) >= 0) {
+    ImageChunk* src = work->sort[i];
+    src->I = bsdiff_suffix_array(src->data, src->len);
+  }
+  return NULL;
+}
+
+static void* PatchWorker(void* cookie) {
+  PatchWork* work = (PatchWork*) cookie;
+  int i;
+  while ((i = NextWorkItem(work, work->num_chunks)) >= 0) {
+    work->patch_data[i] = MakePatch(work->srcs[i], work->tgts+i, work->patch_size+i);
+  }
+  return NULL;
+}
+
+static void RunWorkers(void* (*worker)(void*), PatchWork* work, int items) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int num_threads = cpus < 1 ? 1 : (cpus > items ? items : (int)cpus);
+  pthread_t* threads = malloc(num_threads * sizeof(pthread_t));
+  int i;
+
+  work->next = 0;
+  for (i = 0; i < num_threads; ++i) {
+    if (pthread_create(threads+i, NULL, worker, work) != 0) {
+      break;
+    }
+  }
+  if (i == 0) {
+    worker(work);
+  }
+  while (i > 0) {
+    pthread_join(threads[--i], NULL);
+  }
+  free(threads);
+}
+
+void MakePatches(ImageChunk** srcs, ImageChunk* tgts, int num_chunks,
+                 unsigned char** patch_data, size_t* patch_size) {
+  PatchWork work;
+  int i, j;
+
+  work.srcs = srcs;
+  work.tgts = tgts;
+  work.num_chunks = num_chunks;
+  work.patch_data = patch_data;
+  work.patch_size = patch_size;
+  work.sort = malloc(num_chunks * sizeof(ImageChunk*));
+  work.num_sort = 0;
+  pthread_mutex_init(&work.mu, NULL);
+
+  for (i = 0; i < num_chunks; ++i) {
+    if (!NeedsBsdiff(tgts+i) || srcs[i]->I != NULL) continue;
+    for (j = 0; j < work.num_sort && work.sort[j] != srcs[i]; ++j) ;
+    if (j == work.num_sort) {
+      work.sort[work.num_sort++] = srcs[i];
+    }
+  }
+
+  RunWorkers(SortWorker, &work, work.num_sort);
+  RunWorkers(PatchWorker, &work, num_chunks);
+
+  pthread_mutex_destroy(&work.mu);
+  free(work.sort);
+}
+
 /*
  * Cause a gzip chunk to be treated as a normal chunk (ie, as a blob
  * of uninterpreted data).  The resulting patch will likely be about
@@ -946,15 +1050,16 @@ int main(int argc, char** argv) {
   printf("Construct patches for %d chunks...\n", num_tgt_chunks);
   unsigned char** patch_data = malloc(num_tgt_chunks * sizeof(unsigned char*));
   size_t* patch_size = malloc(num_tgt_chunks * sizeof(size_t));
+  ImageChunk** patch_src = malloc(num_tgt_chunks * sizeof(ImageChunk*));
   for (i = 0; i < num_tgt_chunks; ++i) {
     if (zip_mode) {
       ImageChunk* src;
       if (tgt_chunks[i].type == CHUNK_DEFLATE &&
           (src = FindChunkByName(tgt_chunks[i].filename, src_chunks,
                                  num_src_chunks))) {
-        patch_data[i] = MakePatch(src, tgt_chunks+i, patch_size+i);
+        patch_src[i] = src;
       } else {
-        patch_data[i] = MakePatch(src_chunks, tgt_chunks+i, patch_size+i);
+        patch_src[i] = src_chunks;
       }
     } else {
       if (i == 1 && bonus_data) {
@@ -964,8 +1069,11 @@ int main(int argc, char** argv) {
         src_chunks[i].len += bonus_size;
      }
 
-      patch_data[i] = MakePatch(src_chunks+i, tgt_chunks+i, patch_size+i);
+      patch_src[i] = src_chunks+i;
     }
+  }
+  MakePatches(patch_src, tgt_chunks, num_tgt_chunks, patch_data, patch_size);
+  for (i = 0; i < num_tgt_chunks; ++i) {
     printf("patch %3d is %d bytes (of %d)\n",
            i, patch_size[i], tgt_chunks[i].source_len);
   }
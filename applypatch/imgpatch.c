@@ -17,7 +17,10 @@
 // See imgdiff.c in this directory for a description of the patch file
 // format.
 
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/cdefs.h>
 #include <sys/stat.h>
 #include <errno.h>
@@ -30,44 +33,74 @@
 #include "imgdiff.h"
 #include "utils.h"
 
-/*
- * Apply the patch given in 'patch_filename' to the source data given
- * by (old_data, old_size).  Write the patched output to the 'output'
- * file, and update the SHA context with the output data as well.
- * Return 0 on success.
- */
-int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size __unused,
-                    const Value* patch,
-                    SinkFn sink, void* token, SHA_CTX* ctx,
-                    const Value* bonus_data) {
-    ssize_t pos = 12;
-    char* header = patch->data;
-    if (patch->size < 12) {
-        printf("patch too short to contain header\n");
-        return -1;
-    }
+// Chunks are independent of each other apart from the order of their
+// output, so ApplyImagePatch() first reads every chunk header, then
+// patches the normal and deflate chunks on up to IMGPATCH_MAX_THREADS
+// threads while the calling thread passes the finished chunks to the
+// sink in order.  Workers stay at most IMGPATCH_WINDOW chunks per thread
+// ahead of the sink, which bounds the memory held by finished chunks.
+#define IMGPATCH_MAX_THREADS 4
+#define IMGPATCH_WINDOW 2
 
-    // IMGDIFF2 uses CHUNK_NORMAL, CHUNK_DEFLATE, and CHUNK_RAW.
-    // (IMGDIFF1, which is no longer supported, used CHUNK_NORMAL and
-    // CHUNK_GZIP.)
-    if (memcmp(header, "IMGDIFF2", 8) != 0) {
-        printf("corrupt patch file header (magic number)\n");
-        return -1;
-    }
+typedef struct {
+    int type;
 
-    int num_chunks = Read4(header+8);
+    // CHUNK_NORMAL and CHUNK_DEFLATE
+    size_t src_start;
+    size_t src_len;
+    size_t patch_offset;
+
+    // CHUNK_DEFLATE
+    size_t expanded_len;
+    size_t target_len;
+    int level;
+    int method;
+    int windowBits;
+    int memLevel;
+    int strategy;
+    size_t bonus_size;
+
+    // The chunk's output: the raw data for CHUNK_RAW (pointing into the
+    // patch), a malloc'ed buffer for the other types once patched.
+    unsigned char* data;
+    ssize_t size;
+    bool done;
+    bool failed;        // done, but the output is not to be used
+} ChunkPatch;
 
+typedef struct {
+    const unsigned char* old_data;
+    const Value* patch;
+    const Value* bonus_data;
+    ChunkPatch* chunks;
+    int num_chunks;
+    int window;
+
+    pthread_mutex_t mu;
+    pthread_cond_t cv;
+    int next;           // next chunk to hand out to a worker
+    int emitted;        // chunks already passed to the sink
+    bool failed;
+} ChunkPool;
+
+// Read the chunk headers into 'chunks', which has room for num_chunks
+// entries.  Returns 0 on success.
+static int ReadChunkHeaders(const Value* patch, const Value* bonus_data,
+                            ChunkPatch* chunks, int num_chunks) {
+    ssize_t pos = 12;
     int i;
     for (i = 0; i < num_chunks; ++i) {
+        ChunkPatch* c = chunks + i;
+
         // each chunk's header record starts with 4 bytes.
         if (pos + 4 > patch->size) {
             printf("failed to read chunk %d record\n", i);
             return -1;
         }
-        int type = Read4(patch->data + pos);
+        c->type = Read4(patch->data + pos);
         pos += 4;
 
-        if (type == CHUNK_NORMAL) {
+        if (c->type == CHUNK_NORMAL) {
             char* normal_header = patch->data + pos;
             pos += 24;
             if (pos > patch->size) {
@@ -75,13 +108,10 @@ int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size __unused,
                 return -1;
             }
 
-            size_t src_start = Read8(normal_header);
-            size_t src_len = Read8(normal_header+8);
-            size_t patch_offset = Read8(normal_header+16);
-
-            ApplyBSDiffPatch(old_data + src_start, src_len,
-                             patch, patch_offset, sink, token, ctx);
-        } else if (type == CHUNK_RAW) {
+            c->src_start = Read8(normal_header);
+            c->src_len = Read8(normal_header+8);
+            c->patch_offset = Read8(normal_header+16);
+        } else if (c->type == CHUNK_RAW) {
             char* raw_header = patch->data + pos;
             pos += 4;
             if (pos > patch->size) {
@@ -95,14 +125,11 @@ int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size __unused,
                 printf("failed to read chunk %d raw data\n", i);
                 return -1;
             }
-            if (ctx) SHA_update(ctx, patch->data + pos, data_len);
-            if (sink((unsigned char*)patch->data + pos,
-                     data_len, token) != data_len) {
-                printf("failed to write chunk %d raw data\n", i);
-                return -1;
-            }
+            c->data = (unsigned char*)patch->data + pos;
+            c->size = data_len;
+            c->done = true;
             pos += data_len;
-        } else if (type == CHUNK_DEFLATE) {
+        } else if (c->type == CHUNK_DEFLATE) {
             // deflate chunks have an additional 60 bytes in their chunk header.
             char* deflate_header = patch->data + pos;
             pos += 60;
@@ -111,123 +138,355 @@ int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size __unused,
                 return -1;
             }
 
-            size_t src_start = Read8(deflate_header);
-            size_t src_len = Read8(deflate_header+8);
-            size_t patch_offset = Read8(deflate_header+16);
-            size_t expanded_len = Read8(deflate_header+24);
-            size_t target_len = Read8(deflate_header+32);
-            int level = Read4(deflate_header+40);
-            int method = Read4(deflate_header+44);
-            int windowBits = Read4(deflate_header+48);
-            int memLevel = Read4(deflate_header+52);
-            int strategy = Read4(deflate_header+56);
-
-            // Decompress the source data; the chunk header tells us exactly
-            // how big we expect it to be when decompressed.
+            c->src_start = Read8(deflate_header);
+            c->src_len = Read8(deflate_header+8);
+            c->patch_offset = Read8(deflate_header+16);
+            c->expanded_len = Read8(deflate_header+24);
+            c->target_len = Read8(deflate_header+32);
+            c->level = Read4(deflate_header+40);
+            c->method = Read4(deflate_header+44);
+            c->windowBits = Read4(deflate_header+48);
+            c->memLevel = Read4(deflate_header+52);
+            c->strategy = Read4(deflate_header+56);
 
             // Note: expanded_len will include the bonus data size if
             // the patch was constructed with bonus data.  The
             // deflation will come up 'bonus_size' bytes short; these
             // must be appended from the bonus_data value.
-            size_t bonus_size = (i == 1 && bonus_data != NULL) ? bonus_data->size : 0;
+            c->bonus_size = (i == 1 && bonus_data != NULL) ? bonus_data->size : 0;
+        } else {
+            printf("patch chunk %d is unknown type %d\n", i, c->type);
+            return -1;
+        }
+    }
+    return 0;
+}
 
-            unsigned char* expanded_source = malloc(expanded_len);
-            if (expanded_source == NULL) {
-                printf("failed to allocate %zu bytes for expanded_source\n",
-                       expanded_len);
-                return -1;
-            }
+// Produce the output of a normal or deflate chunk in c->data.  Only
+// reads the source and the patch, so chunks can be patched concurrently.
+// Returns 0 on success.
+static int PatchChunk(const unsigned char* old_data, const Value* patch,
+                      const Value* bonus_data, ChunkPatch* c, int i) {
+    if (c->type == CHUNK_NORMAL) {
+        return ApplyBSDiffPatchMem(old_data + c->src_start, c->src_len,
+                                   patch, c->patch_offset,
+                                   &c->data, &c->size) == 0 ? 0 : -1;
+    }
+
+    // Decompress the source data; the chunk header tells us exactly
+    // how big we expect it to be when decompressed.
+    size_t expanded_len = c->expanded_len;
+    unsigned char* expanded_source = malloc(expanded_len);
+    if (expanded_source == NULL) {
+        printf("failed to allocate %zu bytes for expanded_source\n",
+               expanded_len);
+        return -1;
+    }
+
+    z_stream strm;
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    strm.avail_in = c->src_len;
+    strm.next_in = (unsigned char*)(old_data + c->src_start);
+    strm.avail_out = expanded_len;
+    strm.next_out = expanded_source;
+
+    int ret;
+    ret = inflateInit2(&strm, -15);
+    if (ret != Z_OK) {
+        printf("failed to init source inflation: %d\n", ret);
+        free(expanded_source);
+        return -1;
+    }
+
+    // Because we've provided enough room to accommodate the output
+    // data, we expect one call to inflate() to suffice.
+    ret = inflate(&strm, Z_SYNC_FLUSH);
+    if (ret != Z_STREAM_END) {
+        printf("source inflation returned %d\n", ret);
+        inflateEnd(&strm);
+        free(expanded_source);
+        return -1;
+    }
+    // We should have filled the output buffer exactly, except
+    // for the bonus_size.
+    if (strm.avail_out != c->bonus_size) {
+        printf("source inflation short by %zu bytes\n", strm.avail_out-c->bonus_size);
+        inflateEnd(&strm);
+        free(expanded_source);
+        return -1;
+    }
+    inflateEnd(&strm);
+
+    if (c->bonus_size) {
+        memcpy(expanded_source + (expanded_len - c->bonus_size),
+               bonus_data->data, c->bonus_size);
+    }
 
-            z_stream strm;
-            strm.zalloc = Z_NULL;
-            strm.zfree = Z_NULL;
-            strm.opaque = Z_NULL;
-            strm.avail_in = src_len;
-            strm.next_in = (unsigned char*)(old_data + src_start);
-            strm.avail_out = expanded_len;
-            strm.next_out = expanded_source;
-
-            int ret;
-            ret = inflateInit2(&strm, -15);
-            if (ret != Z_OK) {
-                printf("failed to init source inflation: %d\n", ret);
+    // Next, apply the bsdiff patch (in memory) to the uncompressed
+    // data.
+    unsigned char* uncompressed_target_data;
+    ssize_t uncompressed_target_size;
+    ret = ApplyBSDiffPatchMem(expanded_source, expanded_len,
+                              patch, c->patch_offset,
+                              &uncompressed_target_data,
+                              &uncompressed_target_size);
+    free(expanded_source);
+    if (ret != 0) {
+        return -1;
+    }
+
+    // Now compress the target data.  The header records the size of the
+    // compressed target; the buffer only grows if this zlib disagrees.
+    size_t capacity = c->target_len < 32768 ? 32768 : c->target_len;
+    unsigned char* target = malloc(capacity);
+    if (target == NULL) {
+        printf("failed to allocate %zu bytes for chunk %d\n", capacity, i);
+        free(uncompressed_target_data);
+        return -1;
+    }
+
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    strm.avail_in = uncompressed_target_size;
+    strm.next_in = uncompressed_target_data;
+    ret = deflateInit2(&strm, c->level, c->method, c->windowBits,
+                       c->memLevel, c->strategy);
+    if (ret != Z_OK) {
+        printf("failed to init target deflation: %d\n", ret);
+        free(target);
+        free(uncompressed_target_data);
+        return -1;
+    }
+    do {
+        if (strm.total_out == capacity) {
+            unsigned char* bigger = realloc(target, capacity * 2);
+            if (bigger == NULL) {
+                printf("failed to allocate %zu bytes for chunk %d\n",
+                       capacity * 2, i);
+                deflateEnd(&strm);
+                free(target);
+                free(uncompressed_target_data);
                 return -1;
             }
+            target = bigger;
+            capacity *= 2;
+        }
+        strm.next_out = target + strm.total_out;
+        strm.avail_out = capacity - strm.total_out;
+        ret = deflate(&strm, Z_FINISH);
+    } while (ret == Z_OK);
+    c->size = strm.total_out;
+    deflateEnd(&strm);
+    free(uncompressed_target_data);
 
-            // Because we've provided enough room to accommodate the output
-            // data, we expect one call to inflate() to suffice.
-            ret = inflate(&strm, Z_SYNC_FLUSH);
-            if (ret != Z_STREAM_END) {
-                printf("source inflation returned %d\n", ret);
-                return -1;
+    if (ret != Z_STREAM_END) {
+        printf("target deflation returned %d\n", ret);
+        free(target);
+        return -1;
+    }
+    c->data = target;
+    return 0;
+}
+
+static int EmitChunk(ChunkPatch* c, int i, SinkFn sink, void* token,
+                     SHA_CTX* ctx) {
+    if (sink(c->data, c->size, token) != c->size) {
+        printf("failed to write %ld bytes of chunk %d to output\n",
+               (long)c->size, i);
+        return -1;
+    }
+    if (ctx) SHA_update(ctx, c->data, c->size);
+    return 0;
+}
+
+static void* ChunkWorker(void* cookie) {
+    ChunkPool* pool = (ChunkPool*)cookie;
+
+    pthread_mutex_lock(&pool->mu);
+    while (true) {
+        while (!pool->failed && pool->next < pool->num_chunks &&
+               pool->next >= pool->emitted + pool->window) {
+            pthread_cond_wait(&pool->cv, &pool->mu);
+        }
+        if (pool->failed || pool->next >= pool->num_chunks) {
+            break;
+        }
+        int i = pool->next++;
+        ChunkPatch* c = pool->chunks + i;
+        if (c->done) {
+            continue;
+        }
+        pthread_mutex_unlock(&pool->mu);
+
+        int result = PatchChunk(pool->old_data, pool->patch,
+                                pool->bonus_data, c, i);
+
+        pthread_mutex_lock(&pool->mu);
+        c->done = true;
+        if (result != 0) {
+            c->failed = true;
+            pool->failed = true;
+        }
+        pthread_cond_broadcast(&pool->cv);
+    }
+    pthread_mutex_unlock(&pool->mu);
+    return NULL;
+}
+
+/*
+ * Apply the patch given in 'patch_filename' to the source data given
+ * by (old_data, old_size).  Write the patched output to the 'output'
+ * file, and update the SHA context with the output data as well.
+ * Chunks are patched on up to max_threads threads (0 picks one per CPU,
+ * 1 patches them one at a time on the calling thread); the sink is only
+ * called from the calling thread, in order.  Return 0 on success.
+ */
+int ApplyImagePatchThreads(const unsigned char* old_data,
+                           ssize_t old_size __unused,
+                           const Value* patch,
+                           SinkFn sink, void* token, SHA_CTX* ctx,
+                           const Value* bonus_data, int max_threads) {
+    char* header = patch->data;
+    if (patch->size < 12) {
+        printf("patch too short to contain header\n");
+        return -1;
+    }
+
+    // IMGDIFF2 uses CHUNK_NORMAL, CHUNK_DEFLATE, and CHUNK_RAW.
+    // (IMGDIFF1, which is no longer supported, used CHUNK_NORMAL and
+    // CHUNK_GZIP.)
+    if (memcmp(header, "IMGDIFF2", 8) != 0) {
+        printf("corrupt patch file header (magic number)\n");
+        return -1;
+    }
+
+    int num_chunks = Read4(header+8);
+    if (num_chunks < 0 || num_chunks > (patch->size - 12) / 4) {
+        printf("corrupt patch file header (%d chunks)\n", num_chunks);
+        return -1;
+    }
+
+    ChunkPatch* chunks = calloc(num_chunks ? num_chunks : 1, sizeof(ChunkPatch));
+    if (chunks == NULL) {
+        printf("failed to allocate %d chunk records\n", num_chunks);
+        return -1;
+    }
+    if (ReadChunkHeaders(patch, bonus_data, chunks, num_chunks) != 0) {
+        free(chunks);
+        return -1;
+    }
+
+    int work = 0;
+    int i;
+    for (i = 0; i < num_chunks; ++i) {
+        if (!chunks[i].done) ++work;
+    }
+    if (max_threads <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        max_threads = cpus < 1 ? 1 : (cpus > IMGPATCH_MAX_THREADS ? IMGPATCH_MAX_THREADS : (int)cpus);
+    }
+    if (max_threads > work) {
+        max_threads = work;
+    }
+
+    int result = 0;
+    if (max_threads <= 1) {
+        for (i = 0; i < num_chunks && result == 0; ++i) {
+            ChunkPatch* c = chunks + i;
+            if (!c->done && PatchChunk(old_data, patch, bonus_data, c, i) != 0) {
+                result = -1;
+            } else {
+                result = EmitChunk(c, i, sink, token, ctx);
             }
-            // We should have filled the output buffer exactly, except
-            // for the bonus_size.
-            if (strm.avail_out != bonus_size) {
-                printf("source inflation short by %zu bytes\n", strm.avail_out-bonus_size);
-                return -1;
+            if (c->type != CHUNK_RAW) {
+                free(c->data);
+                c->data = NULL;
             }
-            inflateEnd(&strm);
+        }
+        free(chunks);
+        return result;
+    }
 
-            if (bonus_size) {
-                memcpy(expanded_source + (expanded_len - bonus_size),
-                       bonus_data->data, bonus_size);
-            }
+    ChunkPool pool;
+    pool.old_data = old_data;
+    pool.patch = patch;
+    pool.bonus_data = bonus_data;
+    pool.chunks = chunks;
+    pool.num_chunks = num_chunks;
+    pool.window = max_threads * IMGPATCH_WINDOW;
+    pthread_mutex_init(&pool.mu, NULL);
+    pthread_cond_init(&pool.cv, NULL);
+    pool.next = 0;
+    pool.emitted = 0;
+    pool.failed = false;
 
-            // Next, apply the bsdiff patch (in memory) to the uncompressed
-            // data.
-            unsigned char* uncompressed_target_data;
-            ssize_t uncompressed_target_size;
-            if (ApplyBSDiffPatchMem(expanded_source, expanded_len,
-                                    patch, patch_offset,
-                                    &uncompressed_target_data,
-                                    &uncompressed_target_size) != 0) {
-                return -1;
-            }
+    pthread_t threads[IMGPATCH_MAX_THREADS];
+    int num_threads = 0;
+    while (num_threads < max_threads && num_threads < IMGPATCH_MAX_THREADS &&
+           pthread_create(&threads[num_threads], NULL, ChunkWorker, &pool) == 0) {
+        ++num_threads;
+    }
+    for (i = 0; i < num_chunks; ++i) {
+        ChunkPatch* c = chunks + i;
 
-            // Now compress the target data and append it to the output.
-
-            // we're done with the expanded_source data buffer, so we'll
-            // reuse that memory to receive the output of deflate.
-            unsigned char* temp_data = expanded_source;
-            ssize_t temp_size = expanded_len;
-            if (temp_size < 32768) {
-                // ... unless the buffer is too small, in which case we'll
-                // allocate a fresh one.
-                free(temp_data);
-                temp_data = malloc(32768);
-                temp_size = 32768;
-            }
+        pthread_mutex_lock(&pool.mu);
+        while (num_threads > 0 && !c->done && !pool.failed) {
+            pthread_cond_wait(&pool.cv, &pool.mu);
+        }
+        bool ready = c->done && !c->failed;
+        pthread_mutex_unlock(&pool.mu);
 
-            // now the deflate stream
-            strm.zalloc = Z_NULL;
-            strm.zfree = Z_NULL;
-            strm.opaque = Z_NULL;
-            strm.avail_in = uncompressed_target_size;
-            strm.next_in = uncompressed_target_data;
-            ret = deflateInit2(&strm, level, method, windowBits, memLevel, strategy);
-            do {
-                strm.avail_out = temp_size;
-                strm.next_out = temp_data;
-                ret = deflate(&strm, Z_FINISH);
-                ssize_t have = temp_size - strm.avail_out;
-
-                if (sink(temp_data, have, token) != have) {
-                    printf("failed to write %ld compressed bytes to output\n",
-                           (long)have);
-                    return -1;
-                }
-                if (ctx) SHA_update(ctx, temp_data, have);
-            } while (ret != Z_STREAM_END);
-            deflateEnd(&strm);
-
-            free(temp_data);
-            free(uncompressed_target_data);
+        // Without any threads, patch the chunks as the sink needs them.
+        if (!ready && num_threads == 0) {
+            ready = PatchChunk(old_data, patch, bonus_data, c, i) == 0;
+        }
+        if (!ready) {
+            // A worker may still be patching this chunk; its buffer is
+            // freed after the join below.
+            result = -1;
         } else {
-            printf("patch chunk %d is unknown type %d\n", i, type);
-            return -1;
+            result = EmitChunk(c, i, sink, token, ctx);
+            if (c->type != CHUNK_RAW) {
+                free(c->data);
+                c->data = NULL;
+            }
+        }
+
+        pthread_mutex_lock(&pool.mu);
+        pool.emitted = i + 1;
+        if (result != 0) {
+            pool.failed = true;
+        }
+        pthread_cond_broadcast(&pool.cv);
+        pthread_mutex_unlock(&pool.mu);
+        if (result != 0) {
+            break;
         }
     }
 
-    return 0;
+    for (i = 0; i < num_threads; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_cond_destroy(&pool.cv);
+    pthread_mutex_destroy(&pool.mu);
+
+    // A failure leaves finished chunks behind that were never emitted.
+    for (i = 0; i < num_chunks; ++i) {
+        if (chunks[i].type != CHUNK_RAW) {
+            free(chunks[i].data);
+        }
+    }
+    free(chunks);
+    return result;
+}
+
+int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
+                    const Value* patch,
+                    SinkFn sink, void* token, SHA_CTX* ctx,
+                    const Value* bonus_data) {
+    return ApplyImagePatchThreads(old_data, old_size, patch, sink, token,
+                                  ctx, bonus_data, 0);
 }
@@ -20,7 +20,7 @@ include $(BUILD_STATIC_LIBRARY)
 include $(CLEAR_VARS)
 
 BOARD_RECOVERY_DEFINES := BOARD_BML_BOOT BOARD_BML_RECOVERY
-LOCAL_SHARED_LIBRARIES := libcrecovery
+LOCAL_SHARED_LIBRARIES := libcrecovery libmmcutils
 
 $(foreach board_define,$(BOARD_RECOVERY_DEFINES), \
   $(if $($(board_define)), \
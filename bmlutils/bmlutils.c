@@ -23,6 +23,7 @@
 #include <bmlutils.h>
 
 #include "../libcrecovery/common.h"
+#include "../mmcutils/zero_range.h"
 
 static int restore_internal(const char* bml, const char* filename)
 {
@@ -180,12 +181,15 @@ int format_rfs_device (const char *device, const char *path) {
 
     // dump 10KB of zeros to partition before format due to fat.format bug
     char cmd[PATH_MAX];
+    int fd = open(device, O_WRONLY);
 
-    sprintf(cmd, "/sbin/dd if=/dev/zero of=%s bs=4096 count=10", device);
-    if(__system(cmd)) {
+    if (fd < 0 || zero_range(fd, 0, 4096 * 10) < 0 || fsync(fd) < 0) {
         printf("failure while zeroing rfs partition.\n");
+        if (fd >= 0)
+            close(fd);
         return -1;
     }
+    close(fd);
 
     // Run fat.format
     sprintf(cmd, "/sbin/fat.format -F %s -S 4096 -s %s %s", fatsize, sectorsize, device);
@@ -32,6 +32,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <errno.h>
 
 #include <string>
 #include <utility>
@@ -69,14 +70,25 @@ extern "C"
 
 using namespace std;
 
-map<string, DataManager::TStrIntPair>   DataManager::mValues;
-map<string, string>                     DataManager::mConstValues;
+vector<DataManager::Variable*>          DataManager::mVars;
+map<string, DataManager::VarId>         DataManager::mVarIds;
 string                                  DataManager::mBackingFile;
 int                                     DataManager::mInitialized = 0;
 
 extern bool datamedia;
 
-pthread_mutex_t DataManager::m_valuesLock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER;
+// Readers vastly outnumber writers (every rendered text resolves its
+// variables), so they only take the lock shared
+pthread_rwlock_t DataManager::m_valuesLock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Settings writes are deferred to a background thread
+#define SAVE_DELAY_MS 1000
+
+bool            DataManager::mSaveDirty = false;
+bool            DataManager::mSaveThreadStarted = false;
+pthread_mutex_t DataManager::m_saveLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t  DataManager::m_saveCond = PTHREAD_COND_INITIALIZER;
+pthread_mutex_t DataManager::m_saveFileLock = PTHREAD_MUTEX_INITIALIZER;
 
 // Device ID functions
 void DataManager::sanitize_device_id(char* device_id) {
@@ -152,7 +164,7 @@ void DataManager::get_device_id(void) {
 			snprintf(device_id, DEVID_MAX, "%s_%s", model_id, hardware_id);
 
 		sanitize_device_id(device_id);
-		mConstValues.insert(make_pair("device_id", device_id));
+		SetConst("device_id", device_id);
 		LOGINFO("=> using device id: '%s'\n", device_id);
 		return;
 	}
@@ -171,7 +183,7 @@ void DataManager::get_device_id(void) {
 				token += CMDLINE_SERIALNO_LEN;
 				snprintf(device_id, DEVID_MAX, "%s", token);
 				sanitize_device_id(device_id); // also removes newlines
-				mConstValues.insert(make_pair("device_id", device_id));
+				SetConst("device_id", device_id);
 				return;
 			}
 			token = strtok(NULL, " ");
@@ -193,7 +205,7 @@ void DataManager::get_device_id(void) {
 					snprintf(device_id, DEVID_MAX, "%s", token);
 					sanitize_device_id(device_id); // also removes newlines
 					LOGINFO("=> serial from cpuinfo: '%s'\n", device_id);
-					mConstValues.insert(make_pair("device_id", device_id));
+					SetConst("device_id", device_id);
 					fclose(fp);
 					return;
 				}
@@ -219,23 +231,31 @@ void DataManager::get_device_id(void) {
 		LOGINFO("\nusing hardware id for device id: '%s'\n", hardware_id);
 		snprintf(device_id, DEVID_MAX, "%s", hardware_id);
 		sanitize_device_id(device_id);
-		mConstValues.insert(make_pair("device_id", device_id));
+		SetConst("device_id", device_id);
 		return;
 	}
 
 	strcpy(device_id, "serialno");
 	LOGERR("=> device id not found, using '%s'\n", device_id);
-	mConstValues.insert(make_pair("device_id", device_id));
+	SetConst("device_id", device_id);
 	return;
 }
 
 int DataManager::ResetDefaults()
 {
-	pthread_mutex_lock(&m_valuesLock);
-	mValues.clear();
-	pthread_mutex_unlock(&m_valuesLock);
+	// Variables are never freed so that interned ids stay valid
+	pthread_rwlock_wrlock(&m_valuesLock);
+	for (vector<Variable*>::iterator iter = mVars.begin(); iter != mVars.end(); ++iter)
+	{
+		(*iter)->isSet = false;
+		(*iter)->isConst = false;
+		(*iter)->persist = 0;
+		(*iter)->type = TYPE_STRING;
+		(*iter)->str.clear();
+		(*iter)->num = 0;
+	}
+	pthread_rwlock_unlock(&m_valuesLock);
 
-	mConstValues.clear();
 	SetDefaultValues();
 	return 0;
 }
@@ -281,20 +301,23 @@ int DataManager::LoadValues(const string filename)
 		if (fread(array, 1, length, in) != length)										goto error;
 		Value = array;
 
-		map<string, TStrIntPair>::iterator pos;
+		VarId id = FindVar(Name, true);
+		if (id < 0)
+			continue;
 
-		pthread_mutex_lock(&m_valuesLock);
+		pthread_rwlock_wrlock(&m_valuesLock);
 
-		pos = mValues.find(Name);
-		if (pos != mValues.end())
+		Variable* var = mVars[id];
+		if (!var->isConst)
 		{
-			pos->second.first = Value;
-			pos->second.second = 1;
+			var->str = Value;
+			var->num = strtoll(Value.c_str(), NULL, 10);
+			var->type = TYPE_STRING;
+			var->isSet = true;
+			var->persist = 1;
 		}
-		else
-			mValues.insert(TNameValuePair(Name, TStrIntPair(Value, 1)));
 
-		pthread_mutex_unlock(&m_valuesLock);
+		pthread_rwlock_unlock(&m_valuesLock);
 
 #ifndef TW_NO_SCREEN_TIMEOUT
 		if (Name == "tw_screen_timeout_secs")
@@ -318,57 +341,162 @@ error:
 
 int DataManager::Flush()
 {
+	// Anything pending is about to be written, so the save thread can skip it
+	pthread_mutex_lock(&m_saveLock);
+	mSaveDirty = false;
+	pthread_mutex_unlock(&m_saveLock);
+
 	return SaveValues();
 }
 
-int DataManager::SaveValues()
+// Marks the settings as modified. The actual write is done by the save
+// thread SAVE_DELAY_MS after the first change, so a burst of changes
+// (dragging a slider, toggling several options) only writes the file once.
+void DataManager::ScheduleSave()
+{
+	pthread_mutex_lock(&m_saveLock);
+	mSaveDirty = true;
+	if (!mSaveThreadStarted)
+	{
+		pthread_t thread;
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		if (pthread_create(&thread, &attr, save_thread, NULL) == 0)
+			mSaveThreadStarted = true;
+		pthread_attr_destroy(&attr);
+	}
+	pthread_cond_signal(&m_saveCond);
+	bool started = mSaveThreadStarted;
+	pthread_mutex_unlock(&m_saveLock);
+
+	if (!started)
+	{
+		LOGINFO("Unable to start settings save thread, saving now.\n");
+		Flush();
+	}
+}
+
+void* DataManager::save_thread(void *cookie)
+{
+	pthread_mutex_lock(&m_saveLock);
+	for (;;)
+	{
+		while (!mSaveDirty)
+			pthread_cond_wait(&m_saveCond, &m_saveLock);
+
+		// Coalesce everything that comes in during the delay window
+		timeval now;
+		timespec deadline;
+		gettimeofday(&now, NULL);
+		deadline.tv_sec = now.tv_sec + SAVE_DELAY_MS / 1000;
+		deadline.tv_nsec = (now.tv_usec + (SAVE_DELAY_MS % 1000) * 1000) * 1000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		while (pthread_cond_timedwait(&m_saveCond, &m_saveLock, &deadline) != ETIMEDOUT)
+			;
+
+		// Flush() may have beaten us to it
+		if (!mSaveDirty)
+			continue;
+		mSaveDirty = false;
+
+		pthread_mutex_unlock(&m_saveLock);
+		int ret = SaveValues(false);
+		pthread_mutex_lock(&m_saveLock);
+		// Storage was not mounted; try again later unless Flush() gets there
+		// first. Mounting is left to the main thread, which also wipes and
+		// formats.
+		if (ret == 1)
+			mSaveDirty = true;
+	}
+	return NULL;
+}
+
+// Writes the persisted values to the settings file. Mount_Storage is false
+// on the save thread, which only writes if the storage is already mounted
+// and returns 1 if it is not.
+int DataManager::SaveValues(bool Mount_Storage)
 {
 #ifndef TW_OEM_BUILD
 	if (mBackingFile.empty())
 		return -1;
 
-	string mount_path = GetSettingsStoragePath();
-	PartitionManager.Mount_By_Path(mount_path.c_str(), false);
+	// The values are serialized with the file lock held, so that of two
+	// concurrent saves the one that renames last also has the newest values
+	pthread_mutex_lock(&m_saveFileLock);
 
-	FILE* out = fopen(mBackingFile.c_str(), "wb");
-	if (!out)
-		return -1;
+	string mount_path = GetSettingsStoragePath();
+	if (Mount_Storage) {
+		PartitionManager.Mount_By_Path(mount_path.c_str(), false);
+	} else {
+		TWPartition* Part = PartitionManager.Find_Partition_By_Path(mount_path);
+		if (Part && !Part->Is_Mounted()) {
+			pthread_mutex_unlock(&m_saveFileLock);
+			return 1;
+		}
+	}
 
+	// The values lock isn't held while we wait on storage
+	string data;
 	int file_version = FILE_VERSION;
-	fwrite(&file_version, 1, sizeof(int), out);
+	data.append((const char*) &file_version, sizeof(int));
 
-	pthread_mutex_lock(&m_valuesLock);
+	pthread_rwlock_rdlock(&m_valuesLock);
 
-	map<string, TStrIntPair>::iterator iter;
-	for (iter = mValues.begin(); iter != mValues.end(); ++iter)
+	map<string, VarId>::iterator iter;
+	for (iter = mVarIds.begin(); iter != mVarIds.end(); ++iter)
 	{
 		// Save only the persisted data
-		if (iter->second.second != 0)
+		Variable* var = mVars[iter->second];
+		if (var->isSet && !var->isConst && var->persist != 0)
 		{
-			unsigned short length = (unsigned short) iter->first.length() + 1;
-			fwrite(&length, 1, sizeof(unsigned short), out);
-			fwrite(iter->first.c_str(), 1, length, out);
-			length = (unsigned short) iter->second.first.length() + 1;
-			fwrite(&length, 1, sizeof(unsigned short), out);
-			fwrite(iter->second.first.c_str(), 1, length, out);
+			unsigned short length = (unsigned short) var->name.length() + 1;
+			data.append((const char*) &length, sizeof(unsigned short));
+			data.append(var->name.c_str(), length);
+			length = (unsigned short) var->str.length() + 1;
+			data.append((const char*) &length, sizeof(unsigned short));
+			data.append(var->str.c_str(), length);
 		}
 	}
 
-	pthread_mutex_unlock(&m_valuesLock);
+	pthread_rwlock_unlock(&m_valuesLock);
 
+	// Write a temporary file and rename it over the old one so that an
+	// interrupted save never leaves a truncated settings file behind
+	string temp_file = mBackingFile + ".tmp";
+	FILE* out = fopen(temp_file.c_str(), "wb");
+	if (!out) {
+		pthread_mutex_unlock(&m_saveFileLock);
+		return -1;
+	}
+
+	bool ok = (fwrite(data.data(), 1, data.size(), out) == data.size());
+	ok = (fflush(out) == 0) && ok;
+	ok = (fsync(fileno(out)) == 0) && ok;
 	fclose(out);
+
+	if (!ok || rename(temp_file.c_str(), mBackingFile.c_str()) != 0) {
+		LOGINFO("Unable to save settings to '%s'\n", mBackingFile.c_str());
+		unlink(temp_file.c_str());
+		pthread_mutex_unlock(&m_saveFileLock);
+		return -1;
+	}
 	tw_set_default_metadata(mBackingFile.c_str());
+
+	pthread_mutex_unlock(&m_saveFileLock);
 #endif // ifdef TW_OEM_BUILD
 	return 0;
 }
 
-int DataManager::GetValue(const string varName, string& value)
+// Looks up the interned id of a variable. Unknown plain variables are only
+// created when asked to, magic and property names are always interned.
+DataManager::VarId DataManager::FindVar(const string& varName, bool create)
 {
 	string localStr = varName;
 
-	if (!mInitialized)
-		SetDefaultValues();
-
 	// Strip off leading and trailing '%' if provided
 	if (localStr.length() > 2 && localStr[0] == '%' && localStr[localStr.length()-1] == '%')
 	{
@@ -376,44 +504,145 @@ int DataManager::GetValue(const string varName, string& value)
 		localStr.erase(localStr.length() - 1, 1);
 	}
 
-	// Handle magic values
-	if (GetMagicValue(localStr, value) == 0)
-		return 0;
+	if (localStr.empty())
+		return -1;
 
-	// Handle property
-	if (localStr.length() > 9 && localStr.substr(0, 9) == "property.") {
+	pthread_rwlock_rdlock(&m_valuesLock);
+	map<string, VarId>::iterator pos = mVarIds.find(localStr);
+	VarId id = (pos != mVarIds.end() ? pos->second : -1);
+	pthread_rwlock_unlock(&m_valuesLock);
+	if (id >= 0)
+		return id;
+
+	VarKind kind = VAR_NORMAL;
+	if (localStr.length() > 9 && localStr.substr(0, 9) == "property.")
+		kind = VAR_PROPERTY;
+	else if (localStr == "tw_time")
+		kind = VAR_MAGIC_TIME;
+	else if (localStr == "tw_cpu_temp")
+		kind = VAR_MAGIC_CPU_TEMP;
+	else if (localStr == "tw_battery")
+		kind = VAR_MAGIC_BATTERY;
+	else if (localStr == "tw_mtp_progress")
+		kind = VAR_MAGIC_MTP_PROGRESS;
+	else if (localStr == "tw_mtp_transferred")
+		kind = VAR_MAGIC_MTP_TRANSFERRED;
+
+	if (!create && kind == VAR_NORMAL)
+		return -1;
+
+	pthread_rwlock_wrlock(&m_valuesLock);
+	pos = mVarIds.find(localStr);
+	if (pos != mVarIds.end())
+	{
+		id = pos->second;
+	}
+	else
+	{
+		Variable* var = new Variable;
+		var->name = localStr;
+		var->kind = kind;
+		var->type = TYPE_STRING;
+		var->isSet = false;
+		var->isConst = false;
+		var->persist = 0;
+		var->num = 0;
+		id = mVars.size();
+		mVars.push_back(var);
+		mVarIds.insert(make_pair(localStr, id));
+	}
+	pthread_rwlock_unlock(&m_valuesLock);
+	return id;
+}
+
+DataManager::VarId DataManager::GetVarId(const string varName)
+{
+	if (!mInitialized)
+		SetDefaultValues();
+
+	return FindVar(varName, true);
+}
+
+int DataManager::GetValue(VarId varId, string& value)
+{
+	if (varId < 0)
+		return -1;
+
+	pthread_rwlock_rdlock(&m_valuesLock);
+	Variable* var = mVars[varId];
+	VarKind kind = var->kind;
+	bool isSet = var->isSet;
+	if (isSet)
+		value = var->str;
+	pthread_rwlock_unlock(&m_valuesLock);
+
+	if (kind == VAR_PROPERTY) {
 		char property_value[PROPERTY_VALUE_MAX];
-		property_get(localStr.substr(9).c_str(), property_value, "");
+		property_get(var->name.c_str() + 9, property_value, "");
 		value = property_value;
 		return 0;
 	}
+	if (kind != VAR_NORMAL)
+		return GetMagicValue(kind, value);
 
-	map<string, string>::iterator constPos;
-	constPos = mConstValues.find(localStr);
-	if (constPos != mConstValues.end())
-	{
-		value = constPos->second;
+	return isSet ? 0 : -1;
+}
+
+int DataManager::GetIntValue(VarId varId)
+{
+	if (varId < 0)
 		return 0;
-	}
 
-	pthread_mutex_lock(&m_valuesLock);
-	map<string, TStrIntPair>::iterator pos;
-	pos = mValues.find(localStr);
-	if (pos == mValues.end()){
-		pthread_mutex_unlock(&m_valuesLock);
-		return -1;
+	pthread_rwlock_rdlock(&m_valuesLock);
+	Variable* var = mVars[varId];
+	if (var->kind == VAR_NORMAL)
+	{
+		int value = var->isSet ? (int) var->num : 0;
+		pthread_rwlock_unlock(&m_valuesLock);
+		return value;
 	}
+	pthread_rwlock_unlock(&m_valuesLock);
 
-	value = pos->second.first;
-	pthread_mutex_unlock(&m_valuesLock);
-	return 0;
+	string str;
+	GetValue(varId, str);
+	return atoi(str.c_str());
+}
+
+int DataManager::GetValue(const string varName, string& value)
+{
+	if (!mInitialized)
+		SetDefaultValues();
+
+	return GetValue(FindVar(varName, false), value);
 }
 
 int DataManager::GetValue(const string varName, int& value)
 {
+	if (!mInitialized)
+		SetDefaultValues();
+
+	VarId id = FindVar(varName, false);
+	if (id < 0)
+		return -1;
+
+	pthread_rwlock_rdlock(&m_valuesLock);
+	Variable* var = mVars[id];
+	if (var->kind == VAR_NORMAL)
+	{
+		int ret = -1;
+		if (var->isSet)
+		{
+			value = (int) var->num;
+			ret = 0;
+		}
+		pthread_rwlock_unlock(&m_valuesLock);
+		return ret;
+	}
+	pthread_rwlock_unlock(&m_valuesLock);
+
 	string data;
 
-	if (GetValue(varName,data) != 0)
+	if (GetValue(id, data) != 0)
 		return -1;
 
 	value = atoi(data.c_str());
@@ -433,9 +662,31 @@ int DataManager::GetValue(const string varName, float& value)
 
 unsigned long long DataManager::GetValue(const string varName, unsigned long long& value)
 {
+	if (!mInitialized)
+		SetDefaultValues();
+
+	VarId id = FindVar(varName, false);
+	if (id < 0)
+		return -1;
+
+	pthread_rwlock_rdlock(&m_valuesLock);
+	Variable* var = mVars[id];
+	if (var->kind == VAR_NORMAL && var->type == TYPE_UINT64)
+	{
+		int ret = -1;
+		if (var->isSet)
+		{
+			value = (unsigned long long) var->num;
+			ret = 0;
+		}
+		pthread_rwlock_unlock(&m_valuesLock);
+		return ret;
+	}
+	pthread_rwlock_unlock(&m_valuesLock);
+
 	string data;
 
-	if (GetValue(varName,data) != 0)
+	if (GetValue(id, data) != 0)
 		return -1;
 
 	value = strtoull(data.c_str(), NULL, 10);
@@ -454,13 +705,13 @@ string DataManager::GetStrValue(const string varName)
 // This function will return 0 if the value doesn't exist
 int DataManager::GetIntValue(const string varName)
 {
-	string retVal;
+	if (!mInitialized)
+		SetDefaultValues();
 
-	GetValue(varName, retVal);
-	return atoi(retVal.c_str());
+	return GetIntValue(FindVar(varName, false));
 }
 
-int DataManager::SetValue(const string varName, string value, int persist /* = 0 */)
+int DataManager::SetVar(const string& varName, const string& value, long long num, VarType type, int persist)
 {
 	if (!mInitialized)
 		SetDefaultValues();
@@ -477,24 +728,33 @@ int DataManager::SetValue(const string varName, string value, int persist /* = 0
 	if (varName.empty() || (varName[0] >= '0' && varName[0] <= '9'))
 		return -1;
 
-	map<string, string>::iterator constChk;
-	constChk = mConstValues.find(varName);
-	if (constChk != mConstValues.end())
+	VarId id = FindVar(varName, true);
+	if (id < 0)
 		return -1;
 
-	pthread_mutex_lock(&m_valuesLock);
+	pthread_rwlock_wrlock(&m_valuesLock);
 
-	map<string, TStrIntPair>::iterator pos;
-	pos = mValues.find(varName);
-	if (pos == mValues.end())
-		pos = (mValues.insert(TNameValuePair(varName, TStrIntPair(value, persist)))).first;
-	else
-		pos->second.first = value;
+	Variable* var = mVars[id];
+	if (var->isConst || var->kind != VAR_NORMAL)
+	{
+		pthread_rwlock_unlock(&m_valuesLock);
+		return -1;
+	}
 
-	if (pos->second.second != 0)
-		SaveValues();
+	if (!var->isSet)
+	{
+		var->isSet = true;
+		var->persist = persist;
+	}
+	var->str = value;
+	var->num = num;
+	var->type = type;
+	bool save = (var->persist != 0);
 
-	pthread_mutex_unlock(&m_valuesLock);
+	pthread_rwlock_unlock(&m_valuesLock);
+
+	if (save)
+		ScheduleSave();
 
 #ifndef TW_NO_SCREEN_TIMEOUT
 	if (varName == "tw_screen_timeout_secs") {
@@ -508,6 +768,52 @@ int DataManager::SetValue(const string varName, string value, int persist /* = 0
 	return 0;
 }
 
+// Default values don't replace values that are already set (e.g. loaded
+// from the settings file)
+void DataManager::SetDefault(const string& varName, const string& value, int persist)
+{
+	VarId id = FindVar(varName, true);
+	if (id < 0)
+		return;
+
+	pthread_rwlock_wrlock(&m_valuesLock);
+	Variable* var = mVars[id];
+	if (!var->isSet)
+	{
+		var->str = value;
+		var->num = strtoll(value.c_str(), NULL, 10);
+		var->type = TYPE_STRING;
+		var->isSet = true;
+		var->persist = persist;
+	}
+	pthread_rwlock_unlock(&m_valuesLock);
+}
+
+void DataManager::SetConst(const string& varName, const string& value)
+{
+	VarId id = FindVar(varName, true);
+	if (id < 0)
+		return;
+
+	pthread_rwlock_wrlock(&m_valuesLock);
+	Variable* var = mVars[id];
+	if (!var->isConst)
+	{
+		var->str = value;
+		var->num = strtoll(value.c_str(), NULL, 10);
+		var->type = TYPE_STRING;
+		var->isSet = true;
+		var->isConst = true;
+		var->persist = 0;
+	}
+	pthread_rwlock_unlock(&m_valuesLock);
+}
+
+int DataManager::SetValue(const string varName, string value, int persist /* = 0 */)
+{
+	return SetVar(varName, value, strtoll(value.c_str(), NULL, 10), TYPE_STRING, persist);
+}
+
 int DataManager::SetValue(const string varName, int value, int persist /* = 0 */)
 {
 	ostringstream valStr;
@@ -528,21 +834,21 @@ int DataManager::SetValue(const string varName, int value, int persist /* = 0 */
 
 		SetValue("tw_storage_path", str);
 	}
-	return SetValue(varName, valStr.str(), persist);
+	return SetVar(varName, valStr.str(), value, TYPE_INT, persist);
 }
 
 int DataManager::SetValue(const string varName, float value, int persist /* = 0 */)
 {
 	ostringstream valStr;
 	valStr << value;
-	return SetValue(varName, valStr.str(), persist);;
+	return SetVar(varName, valStr.str(), (long long) value, TYPE_STRING, persist);
 }
 
 int DataManager::SetValue(const string varName, unsigned long long value, int persist /* = 0 */)
 {
 	ostringstream valStr;
 	valStr << value;
-	return SetValue(varName, valStr.str(), persist);
+	return SetVar(varName, valStr.str(), (long long) value, TYPE_UINT64, persist);
 }
 
 int DataManager::SetProgress(float Fraction) {
@@ -562,12 +868,16 @@ int DataManager::ShowProgress(float Portion, float Seconds)
 
 void DataManager::DumpValues()
 {
-	map<string, TStrIntPair>::iterator iter;
+	map<string, VarId>::iterator iter;
 	gui_print("Data Manager dump - Values with leading X are persisted.\n");
-	pthread_mutex_lock(&m_valuesLock);
-	for (iter = mValues.begin(); iter != mValues.end(); ++iter)
-		gui_print("%c %s=%s\n", iter->second.second ? 'X' : ' ', iter->first.c_str(), iter->second.first.c_str());
-	pthread_mutex_unlock(&m_valuesLock);
+	pthread_rwlock_rdlock(&m_valuesLock);
+	for (iter = mVarIds.begin(); iter != mVarIds.end(); ++iter)
+	{
+		Variable* var = mVars[iter->second];
+		if (var->isSet && !var->isConst)
+			gui_print("%c %s=%s\n", var->persist ? 'X' : ' ', var->name.c_str(), var->str.c_str());
+	}
+	pthread_rwlock_unlock(&m_valuesLock);
 }
 
 void DataManager::update_tz_environment_variables(void)
@@ -620,23 +930,22 @@ void DataManager::SetDefaultValues()
 
 	get_device_id();
 
-	pthread_mutex_lock(&m_valuesLock);
 
 	mInitialized = 1;
 
-	mConstValues.insert(make_pair("true", "1"));
-	mConstValues.insert(make_pair("false", "0"));
+	SetConst("true", "1");
+	SetConst("false", "0");
 
-	mConstValues.insert(make_pair(TW_VERSION_VAR, TW_VERSION_STR));
-	mValues.insert(make_pair("tw_button_vibrate", make_pair("80", 1)));
-	mValues.insert(make_pair("tw_keyboard_vibrate", make_pair("40", 1)));
-	mValues.insert(make_pair("tw_action_vibrate", make_pair("160", 1)));
+	SetConst(TW_VERSION_VAR, TW_VERSION_STR);
+	SetDefault("tw_button_vibrate", "80", 1);
+	SetDefault("tw_keyboard_vibrate", "40", 1);
+	SetDefault("tw_action_vibrate", "160", 1);
 
 	TWPartition *store = PartitionManager.Get_Default_Storage_Partition();
 	if(store)
-		mValues.insert(make_pair("tw_storage_path", make_pair(store->Storage_Path.c_str(), 1)));
+		SetDefault("tw_storage_path", store->Storage_Path.c_str(), 1);
 	else
-		mValues.insert(make_pair("tw_storage_path", make_pair("/", 1)));
+		SetDefault("tw_storage_path", "/", 1);
 
 #ifdef TW_FORCE_CPUINFO_FOR_DEVICE_ID
 	printf("TW_FORCE_CPUINFO_FOR_DEVICE_ID := true\n");
@@ -644,16 +953,16 @@ void DataManager::SetDefaultValues()
 
 #ifdef BOARD_HAS_NO_REAL_SDCARD
 	printf("BOARD_HAS_NO_REAL_SDCARD := true\n");
-	mConstValues.insert(make_pair(TW_ALLOW_PARTITION_SDCARD, "0"));
+	SetConst(TW_ALLOW_PARTITION_SDCARD, "0");
 #else
-	mConstValues.insert(make_pair(TW_ALLOW_PARTITION_SDCARD, "1"));
+	SetConst(TW_ALLOW_PARTITION_SDCARD, "1");
 #endif
 
 #ifdef TW_INCLUDE_DUMLOCK
 	printf("TW_INCLUDE_DUMLOCK := true\n");
-	mConstValues.insert(make_pair(TW_SHOW_DUMLOCK, "1"));
+	SetConst(TW_SHOW_DUMLOCK, "1");
 #else
-	mConstValues.insert(make_pair(TW_SHOW_DUMLOCK, "0"));
+	SetConst(TW_SHOW_DUMLOCK, "0");
 #endif
 
 	str = GetCurrentStoragePath();
@@ -666,38 +975,38 @@ void DataManager::SetDefaultValues()
 	str += dev_id;
 	SetValue(TW_BACKUPS_FOLDER_VAR, str, 0);
 
-	mConstValues.insert(make_pair(TW_REBOOT_SYSTEM, "1"));
+	SetConst(TW_REBOOT_SYSTEM, "1");
 #ifdef TW_NO_REBOOT_RECOVERY
 	printf("TW_NO_REBOOT_RECOVERY := true\n");
-	mConstValues.insert(make_pair(TW_REBOOT_RECOVERY, "0"));
+	SetConst(TW_REBOOT_RECOVERY, "0");
 #else
-	mConstValues.insert(make_pair(TW_REBOOT_RECOVERY, "1"));
+	SetConst(TW_REBOOT_RECOVERY, "1");
 #endif
-	mConstValues.insert(make_pair(TW_REBOOT_POWEROFF, "1"));
+	SetConst(TW_REBOOT_POWEROFF, "1");
 #ifdef TW_NO_REBOOT_BOOTLOADER
 	printf("TW_NO_REBOOT_BOOTLOADER := true\n");
-	mConstValues.insert(make_pair(TW_REBOOT_BOOTLOADER, "0"));
+	SetConst(TW_REBOOT_BOOTLOADER, "0");
 #else
-	mConstValues.insert(make_pair(TW_REBOOT_BOOTLOADER, "1"));
+	SetConst(TW_REBOOT_BOOTLOADER, "1");
 #endif
 #ifdef RECOVERY_SDCARD_ON_DATA
 	printf("RECOVERY_SDCARD_ON_DATA := true\n");
-	mConstValues.insert(make_pair(TW_HAS_DATA_MEDIA, "1"));
-	mConstValues.insert(make_pair("tw_has_internal", "1"));
+	SetConst(TW_HAS_DATA_MEDIA, "1");
+	SetConst("tw_has_internal", "1");
 	datamedia = true;
 #else
-	mValues.insert(make_pair(TW_HAS_DATA_MEDIA, make_pair("0", 0)));
-	mValues.insert(make_pair("tw_has_internal", make_pair("0", 0)));
+	SetDefault(TW_HAS_DATA_MEDIA, "0", 0);
+	SetDefault("tw_has_internal", "0", 0);
 #endif
 #ifdef TW_NO_BATT_PERCENT
 	printf("TW_NO_BATT_PERCENT := true\n");
-	mConstValues.insert(make_pair(TW_NO_BATTERY_PERCENT, "1"));
+	SetConst(TW_NO_BATTERY_PERCENT, "1");
 #else
-	mConstValues.insert(make_pair(TW_NO_BATTERY_PERCENT, "0"));
+	SetConst(TW_NO_BATTERY_PERCENT, "0");
 #endif
 #ifdef TW_NO_CPU_TEMP
 	printf("TW_NO_CPU_TEMP := true\n");
-	mConstValues.insert(make_pair("tw_no_cpu_temp", "1"));
+	SetConst("tw_no_cpu_temp", "1");
 #else
 	string cpu_temp_file;
 #ifdef TW_CUSTOM_CPU_TEMP_PATH
@@ -706,31 +1015,31 @@ void DataManager::SetDefaultValues()
 	cpu_temp_file = "/sys/class/thermal/thermal_zone0/temp";
 #endif
 	if (TWFunc::Path_Exists(cpu_temp_file)) {
-		mConstValues.insert(make_pair("tw_no_cpu_temp", "0"));
+		SetConst("tw_no_cpu_temp", "0");
 	} else {
 		LOGINFO("CPU temperature file '%s' not found, disabling CPU temp.\n", cpu_temp_file.c_str());
-		mConstValues.insert(make_pair("tw_no_cpu_temp", "1"));
+		SetConst("tw_no_cpu_temp", "1");
 	}
 #endif
 #ifdef TW_CUSTOM_POWER_BUTTON
 	printf("TW_POWER_BUTTON := %s\n", EXPAND(TW_CUSTOM_POWER_BUTTON));
-	mConstValues.insert(make_pair(TW_POWER_BUTTON, EXPAND(TW_CUSTOM_POWER_BUTTON)));
+	SetConst(TW_POWER_BUTTON, EXPAND(TW_CUSTOM_POWER_BUTTON));
 #else
-	mConstValues.insert(make_pair(TW_POWER_BUTTON, "0"));
+	SetConst(TW_POWER_BUTTON, "0");
 #endif
 #ifdef TW_ALWAYS_RMRF
 	printf("TW_ALWAYS_RMRF := true\n");
-	mConstValues.insert(make_pair(TW_RM_RF_VAR, "1"));
+	SetConst(TW_RM_RF_VAR, "1");
 #endif
 #ifdef TW_NEVER_UNMOUNT_SYSTEM
 	printf("TW_NEVER_UNMOUNT_SYSTEM := true\n");
-	mConstValues.insert(make_pair(TW_DONT_UNMOUNT_SYSTEM, "1"));
+	SetConst(TW_DONT_UNMOUNT_SYSTEM, "1");
 #else
-	mConstValues.insert(make_pair(TW_DONT_UNMOUNT_SYSTEM, "0"));
+	SetConst(TW_DONT_UNMOUNT_SYSTEM, "0");
 #endif
 #ifdef TW_NO_USB_STORAGE
 	printf("TW_NO_USB_STORAGE := true\n");
-	mConstValues.insert(make_pair(TW_HAS_USB_STORAGE, "0"));
+	SetConst(TW_HAS_USB_STORAGE, "0");
 #else
 	char lun_file[255];
 	string Lun_File_str = CUSTOM_LUN_FILE;
@@ -741,90 +1050,90 @@ void DataManager::SetDefaultValues()
 	}
 	if (!TWFunc::Path_Exists(Lun_File_str)) {
 		LOGINFO("Lun file '%s' does not exist, USB storage mode disabled\n", Lun_File_str.c_str());
-		mConstValues.insert(make_pair(TW_HAS_USB_STORAGE, "0"));
+		SetConst(TW_HAS_USB_STORAGE, "0");
 	} else {
 		LOGINFO("Lun file '%s'\n", Lun_File_str.c_str());
-		mConstValues.insert(make_pair(TW_HAS_USB_STORAGE, "1"));
+		SetConst(TW_HAS_USB_STORAGE, "1");
 	}
 #endif
 #ifdef TW_INCLUDE_INJECTTWRP
 	printf("TW_INCLUDE_INJECTTWRP := true\n");
-	mConstValues.insert(make_pair(TW_HAS_INJECTTWRP, "1"));
-	mValues.insert(make_pair(TW_INJECT_AFTER_ZIP, make_pair("1", 1)));
+	SetConst(TW_HAS_INJECTTWRP, "1");
+	SetDefault(TW_INJECT_AFTER_ZIP, "1", 1);
 #else
-	mConstValues.insert(make_pair(TW_HAS_INJECTTWRP, "0"));
-	mValues.insert(make_pair(TW_INJECT_AFTER_ZIP, make_pair("0", 1)));
+	SetConst(TW_HAS_INJECTTWRP, "0");
+	SetDefault(TW_INJECT_AFTER_ZIP, "0", 1);
 #endif
 #ifdef TW_HAS_DOWNLOAD_MODE
 	printf("TW_HAS_DOWNLOAD_MODE := true\n");
-	mConstValues.insert(make_pair(TW_DOWNLOAD_MODE, "1"));
+	SetConst(TW_DOWNLOAD_MODE, "1");
 #endif
 #ifdef TW_INCLUDE_CRYPTO
-	mConstValues.insert(make_pair(TW_HAS_CRYPTO, "1"));
+	SetConst(TW_HAS_CRYPTO, "1");
 	printf("TW_INCLUDE_CRYPTO := true\n");
 #endif
 #ifdef TW_SDEXT_NO_EXT4
 	printf("TW_SDEXT_NO_EXT4 := true\n");
-	mConstValues.insert(make_pair(TW_SDEXT_DISABLE_EXT4, "1"));
+	SetConst(TW_SDEXT_DISABLE_EXT4, "1");
 #else
-	mConstValues.insert(make_pair(TW_SDEXT_DISABLE_EXT4, "0"));
+	SetConst(TW_SDEXT_DISABLE_EXT4, "0");
 #endif
 
 #ifdef TW_HAS_NO_BOOT_PARTITION
-	mValues.insert(make_pair("tw_backup_list", make_pair("/system;/data;", 1)));
+	SetDefault("tw_backup_list", "/system;/data;", 1);
 #else
-	mValues.insert(make_pair("tw_backup_list", make_pair("/system;/data;/boot;", 1)));
+	SetDefault("tw_backup_list", "/system;/data;/boot;", 1);
 #endif
-	mConstValues.insert(make_pair(TW_MIN_SYSTEM_VAR, TW_MIN_SYSTEM_SIZE));
-	mValues.insert(make_pair(TW_BACKUP_NAME, make_pair("(Auto Generate)", 0)));
-
-	mValues.insert(make_pair(TW_REBOOT_AFTER_FLASH_VAR, make_pair("0", 1)));
-	mValues.insert(make_pair(TW_SIGNED_ZIP_VERIFY_VAR, make_pair("0", 1)));
-	mValues.insert(make_pair(TW_FORCE_MD5_CHECK_VAR, make_pair("0", 1)));
-	mValues.insert(make_pair(TW_COLOR_THEME_VAR, make_pair("0", 1)));
-	mValues.insert(make_pair(TW_USE_COMPRESSION_VAR, make_pair("0", 1)));
-	mValues.insert(make_pair(TW_SHOW_SPAM_VAR, make_pair("0", 1)));
-	mValues.insert(make_pair(TW_TIME_ZONE_VAR, make_pair("CST6CDT,M3.2.0,M11.1.0", 1)));
-	mValues.insert(make_pair(TW_SORT_FILES_BY_DATE_VAR, make_pair("0", 1)));
-	mValues.insert(make_pair(TW_GUI_SORT_ORDER, make_pair("1", 1)));
-	mValues.insert(make_pair(TW_RM_RF_VAR, make_pair("0", 1)));
-	mValues.insert(make_pair(TW_SKIP_MD5_CHECK_VAR, make_pair("0", 1)));
-	mValues.insert(make_pair(TW_SKIP_MD5_GENERATE_VAR, make_pair("0", 1)));
-	mValues.insert(make_pair(TW_SDEXT_SIZE, make_pair("512", 1)));
-	mValues.insert(make_pair(TW_SWAP_SIZE, make_pair("32", 1)));
-	mValues.insert(make_pair(TW_SDPART_FILE_SYSTEM, make_pair("ext3", 1)));
-	mValues.insert(make_pair(TW_TIME_ZONE_GUISEL, make_pair("CST6;CDT,M3.2.0,M11.1.0", 1)));
-	mValues.insert(make_pair(TW_TIME_ZONE_GUIOFFSET, make_pair("0", 1)));
-	mValues.insert(make_pair(TW_TIME_ZONE_GUIDST, make_pair("1", 1)));
-	mValues.insert(make_pair(TW_ACTION_BUSY, make_pair("0", 0)));
-	mValues.insert(make_pair("tw_wipe_cache", make_pair("0", 0)));
-	mValues.insert(make_pair("tw_wipe_dalvik", make_pair("0", 0)));
+	SetConst(TW_MIN_SYSTEM_VAR, TW_MIN_SYSTEM_SIZE);
+	SetDefault(TW_BACKUP_NAME, "(Auto Generate)", 0);
+
+	SetDefault(TW_REBOOT_AFTER_FLASH_VAR, "0", 1);
+	SetDefault(TW_SIGNED_ZIP_VERIFY_VAR, "0", 1);
+	SetDefault(TW_FORCE_MD5_CHECK_VAR, "0", 1);
+	SetDefault(TW_COLOR_THEME_VAR, "0", 1);
+	SetDefault(TW_USE_COMPRESSION_VAR, "0", 1);
+	SetDefault(TW_SHOW_SPAM_VAR, "0", 1);
+	SetDefault(TW_TIME_ZONE_VAR, "CST6CDT,M3.2.0,M11.1.0", 1);
+	SetDefault(TW_SORT_FILES_BY_DATE_VAR, "0", 1);
+	SetDefault(TW_GUI_SORT_ORDER, "1", 1);
+	SetDefault(TW_RM_RF_VAR, "0", 1);
+	SetDefault(TW_SKIP_MD5_CHECK_VAR, "0", 1);
+	SetDefault(TW_SKIP_MD5_GENERATE_VAR, "0", 1);
+	SetDefault(TW_SDEXT_SIZE, "512", 1);
+	SetDefault(TW_SWAP_SIZE, "32", 1);
+	SetDefault(TW_SDPART_FILE_SYSTEM, "ext3", 1);
+	SetDefault(TW_TIME_ZONE_GUISEL, "CST6;CDT,M3.2.0,M11.1.0", 1);
+	SetDefault(TW_TIME_ZONE_GUIOFFSET, "0", 1);
+	SetDefault(TW_TIME_ZONE_GUIDST, "1", 1);
+	SetDefault(TW_ACTION_BUSY, "0", 0);
+	SetDefault("tw_wipe_cache", "0", 0);
+	SetDefault("tw_wipe_dalvik", "0", 0);
 	if (GetIntValue(TW_HAS_INTERNAL) == 1 && GetIntValue(TW_HAS_DATA_MEDIA) == 1 && GetIntValue(TW_HAS_EXTERNAL) == 0)
 		SetValue(TW_HAS_USB_STORAGE, 0, 0);
 	else
 		SetValue(TW_HAS_USB_STORAGE, 1, 0);
-	mValues.insert(make_pair(TW_ZIP_INDEX, make_pair("0", 0)));
-	mValues.insert(make_pair(TW_ZIP_QUEUE_COUNT, make_pair("0", 0)));
-	mValues.insert(make_pair(TW_FILENAME, make_pair("/sdcard", 0)));
-	mValues.insert(make_pair(TW_SIMULATE_ACTIONS, make_pair("0", 1)));
-	mValues.insert(make_pair(TW_SIMULATE_FAIL, make_pair("0", 1)));
-	mValues.insert(make_pair(TW_IS_ENCRYPTED, make_pair("0", 0)));
-	mValues.insert(make_pair(TW_IS_DECRYPTED, make_pair("0", 0)));
-	mValues.insert(make_pair(TW_CRYPTO_PASSWORD, make_pair("0", 0)));
-	mValues.insert(make_pair(TW_DATA_BLK_DEVICE, make_pair("0", 0)));
-	mValues.insert(make_pair("tw_terminal_state", make_pair("0", 0)));
-	mValues.insert(make_pair("tw_background_thread_running", make_pair("0", 0)));
-	mValues.insert(make_pair(TW_RESTORE_FILE_DATE, make_pair("0", 0)));
-	mValues.insert(make_pair("tw_military_time", make_pair("0", 1)));
+	SetDefault(TW_ZIP_INDEX, "0", 0);
+	SetDefault(TW_ZIP_QUEUE_COUNT, "0", 0);
+	SetDefault(TW_FILENAME, "/sdcard", 0);
+	SetDefault(TW_SIMULATE_ACTIONS, "0", 1);
+	SetDefault(TW_SIMULATE_FAIL, "0", 1);
+	SetDefault(TW_IS_ENCRYPTED, "0", 0);
+	SetDefault(TW_IS_DECRYPTED, "0", 0);
+	SetDefault(TW_CRYPTO_PASSWORD, "0", 0);
+	SetDefault(TW_DATA_BLK_DEVICE, "0", 0);
+	SetDefault("tw_terminal_state", "0", 0);
+	SetDefault("tw_background_thread_running", "0", 0);
+	SetDefault(TW_RESTORE_FILE_DATE, "0", 0);
+	SetDefault("tw_military_time", "0", 1);
 #ifdef TW_NO_SCREEN_TIMEOUT
-	mValues.insert(make_pair("tw_screen_timeout_secs", make_pair("0", 1)));
-	mValues.insert(make_pair("tw_no_screen_timeout", make_pair("1", 1)));
+	SetDefault("tw_screen_timeout_secs", "0", 1);
+	SetDefault("tw_no_screen_timeout", "1", 1);
 #else
-	mValues.insert(make_pair("tw_screen_timeout_secs", make_pair("60", 1)));
-	mValues.insert(make_pair("tw_no_screen_timeout", make_pair("0", 1)));
+	SetDefault("tw_screen_timeout_secs", "60", 1);
+	SetDefault("tw_no_screen_timeout", "0", 1);
 #endif
-	mValues.insert(make_pair("tw_gui_done", make_pair("0", 0)));
-	mValues.insert(make_pair("tw_encrypt_backup", make_pair("0", 0)));
+	SetDefault("tw_gui_done", "0", 0);
+	SetDefault("tw_encrypt_backup", "0", 0);
 #ifdef TW_BRIGHTNESS_PATH
 	string findbright;
 	if (strcmp(EXPAND(TW_BRIGHTNESS_PATH), "/nobrightness") != 0) {
@@ -842,21 +1151,21 @@ void DataManager::SetDefaultValues()
 	}
 	if (findbright.empty()) {
 		LOGINFO("Unable to locate brightness file\n");
-		mConstValues.insert(make_pair("tw_has_brightnesss_file", "0"));
+		SetConst("tw_has_brightnesss_file", "0");
 	} else {
 		LOGINFO("Found brightness file at '%s'\n", findbright.c_str());
-		mConstValues.insert(make_pair("tw_has_brightnesss_file", "1"));
-		mConstValues.insert(make_pair("tw_brightness_file", findbright));
+		SetConst("tw_has_brightnesss_file", "1");
+		SetConst("tw_brightness_file", findbright);
 		ostringstream maxVal;
 		maxVal << TW_MAX_BRIGHTNESS;
-		mConstValues.insert(make_pair("tw_brightness_max", maxVal.str()));
-		mValues.insert(make_pair("tw_brightness", make_pair(maxVal.str(), 1)));
-		mValues.insert(make_pair("tw_brightness_pct", make_pair("100", 1)));
+		SetConst("tw_brightness_max", maxVal.str());
+		SetDefault("tw_brightness", maxVal.str(), 1);
+		SetDefault("tw_brightness_pct", "100", 1);
 #ifdef TW_SECONDARY_BRIGHTNESS_PATH
 		string secondfindbright = EXPAND(TW_SECONDARY_BRIGHTNESS_PATH);
 		if (secondfindbright != "" && TWFunc::Path_Exists(secondfindbright)) {
 			LOGINFO("Will use a second brightness file at '%s'\n", secondfindbright.c_str());
-			mConstValues.insert(make_pair("tw_secondary_brightness_file", secondfindbright));
+			SetConst("tw_secondary_brightness_file", secondfindbright);
 		} else {
 			LOGINFO("Specified secondary brightness file '%s' not found.\n", secondfindbright.c_str());
 		}
@@ -865,45 +1174,43 @@ void DataManager::SetDefaultValues()
 		TWFunc::Set_Brightness(max_bright);
 	}
 #endif
-	mValues.insert(make_pair(TW_MILITARY_TIME, make_pair("0", 1)));
+	SetDefault(TW_MILITARY_TIME, "0", 1);
 
 #ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
-	mValues.insert(make_pair("tw_include_encrypted_backup", make_pair("1", 0)));
+	SetDefault("tw_include_encrypted_backup", "1", 0);
 #else
 	LOGINFO("TW_EXCLUDE_ENCRYPTED_BACKUPS := true\n");
-	mValues.insert(make_pair("tw_include_encrypted_backup", make_pair("0", 0)));
+	SetDefault("tw_include_encrypted_backup", "0", 0);
 #endif
 #ifdef TW_HAS_MTP
-	mConstValues.insert(make_pair("tw_has_mtp", "1"));
-	mValues.insert(make_pair("tw_mtp_enabled", make_pair("1", 1)));
-	mValues.insert(make_pair("tw_mtp_debug", make_pair("0", 1)));
+	SetConst("tw_has_mtp", "1");
+	SetDefault("tw_mtp_enabled", "1", 1);
+	SetDefault("tw_mtp_debug", "0", 1);
 #else
 	LOGINFO("TW_EXCLUDE_MTP := true\n");
-	mConstValues.insert(make_pair("tw_has_mtp", "0"));
-	mConstValues.insert(make_pair("tw_mtp_enabled", "0"));
+	SetConst("tw_has_mtp", "0");
+	SetConst("tw_mtp_enabled", "0");
 #endif
-	mValues.insert(make_pair("tw_mount_system_ro", make_pair("1", 1)));
-	mValues.insert(make_pair("tw_never_show_system_ro_page", make_pair("0", 1)));
+	SetDefault("tw_mount_system_ro", "1", 1);
+	SetDefault("tw_never_show_system_ro_page", "0", 1);
 
 #if defined(TW_HAS_LANDSCAPE) && defined(TW_DEFAULT_ROTATION)
-	mValues.insert(make_pair(TW_ROTATION, make_pair(EXPAND(TW_DEFAULT_ROTATION), 1)));
+	SetDefault(TW_ROTATION, EXPAND(TW_DEFAULT_ROTATION), 1);
 #else
-	mValues.insert(make_pair(TW_ROTATION, make_pair("0", 1)));
+	SetDefault(TW_ROTATION, "0", 1);
 #endif
-	mValues.insert(make_pair(TW_ENABLE_ROTATION, make_pair("0", 0)));
-
-	mConstValues.insert(make_pair("tw_device_name", TARGET_DEVICE));
+	SetDefault(TW_ENABLE_ROTATION, "0", 0);
 
-	mValues.insert(make_pair(TW_AUTO_INJECT_MROM, make_pair("1", 1)));
+	SetConst("tw_device_name", TARGET_DEVICE);
 
-	pthread_mutex_unlock(&m_valuesLock);
+	SetDefault(TW_AUTO_INJECT_MROM, "1", 1);
 }
 
 // Magic Values
-int DataManager::GetMagicValue(const string varName, string& value)
+int DataManager::GetMagicValue(VarKind kind, string& value)
 {
 	// Handle special dynamic cases
-	if (varName == "tw_time")
+	if (kind == VAR_MAGIC_TIME)
 	{
 		char tmp[32];
 
@@ -930,7 +1237,7 @@ int DataManager::GetMagicValue(const string varName, string& value)
 		value = tmp;
 		return 0;
 	}
-	else if (varName == "tw_cpu_temp")
+	else if (kind == VAR_MAGIC_CPU_TEMP)
 	{
 	   int tw_no_cpu_temp;
 	   GetValue("tw_no_cpu_temp", tw_no_cpu_temp);
@@ -965,7 +1272,7 @@ int DataManager::GetMagicValue(const string varName, string& value)
 	   value = TWFunc::to_string(convert_temp);
 	   return 0;
 	}
-	else if (varName == "tw_battery")
+	else if (kind == VAR_MAGIC_BATTERY)
 	{
 		char tmp[16];
 		static char charging = ' ';
@@ -1012,6 +1319,21 @@ int DataManager::GetMagicValue(const string varName, string& value)
 		value = tmp;
 		return 0;
 	}
+	else if (kind == VAR_MAGIC_MTP_PROGRESS || kind == VAR_MAGIC_MTP_TRANSFERRED)
+	{
+		// percent and MB of the current MTP file transfer
+		uint64_t transferred, total;
+		if (!PartitionManager.Get_MTP_Transfer_Progress(transferred, total))
+			return -1;
+
+		char tmp[32];
+		if (kind == VAR_MAGIC_MTP_PROGRESS)
+			sprintf(tmp, "%i", total ? (int)(transferred * 100 / total) : 0);
+		else
+			sprintf(tmp, "%llu", (unsigned long long)(transferred / 1048576));
+		value = tmp;
+		return 0;
+	}
 	return -1;
 }
 
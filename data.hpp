@@ -22,12 +22,19 @@
 #include <string>
 #include <utility>
 #include <map>
+#include <vector>
+#include <pthread.h>
 
 using namespace std;
 
 class DataManager
 {
 public:
+	// Interned variable handle. Resolve a name once with GetVarId() (e.g.
+	// while loading the theme) and use the handle on hot paths to skip the
+	// name parsing and lookup.
+	typedef int VarId;
+
 	static int ResetDefaults();
 	static int LoadValues(const string filename);
 	static int Flush();
@@ -42,6 +49,11 @@ public:
 	static string GetStrValue(const string varName);
 	static int GetIntValue(const string varName);
 
+	// Interned access
+	static VarId GetVarId(const string varName);
+	static int GetValue(VarId varId, string& value);
+	static int GetIntValue(VarId varId);
+
 	// Core set routines
 	static int SetValue(const string varName, string value, int persist = 0);
 	static int SetValue(const string varName, int value, int persist = 0);
@@ -62,24 +74,63 @@ public:
 	static string GetSettingsStoragePath(void);
 
 protected:
-	typedef pair<string, int> TStrIntPair;
-	typedef pair<string, TStrIntPair> TNameValuePair;
-	static map<string, TStrIntPair> mValues;
+	enum VarKind {
+		VAR_NORMAL = 0,
+		VAR_PROPERTY,
+		VAR_MAGIC_TIME,
+		VAR_MAGIC_CPU_TEMP,
+		VAR_MAGIC_BATTERY,
+		VAR_MAGIC_MTP_PROGRESS,
+		VAR_MAGIC_MTP_TRANSFERRED,
+	};
+
+	enum VarType {
+		TYPE_STRING = 0,
+		TYPE_INT,
+		TYPE_UINT64,
+	};
+
+	// A variable keeps both its string form and its number so that
+	// integer reads never have to parse
+	struct Variable {
+		string name;
+		VarKind kind;
+		VarType type;
+		bool isSet;
+		bool isConst;
+		int persist;
+		string str;
+		long long num;
+	};
+
+	static vector<Variable*> mVars;
+	static map<string, VarId> mVarIds;
 	static string mBackingFile;
 	static int mInitialized;
 
-	static map<string, string> mConstValues;
-
 protected:
-	static int SaveValues();
+	static int SaveValues(bool Mount_Storage = true);
+	static void ScheduleSave();
+	static void* save_thread(void *cookie);
 
-	static int GetMagicValue(string varName, string& value);
+	static VarId FindVar(const string& varName, bool create);
+	static int SetVar(const string& varName, const string& value, long long num, VarType type, int persist);
+	static void SetDefault(const string& varName, const string& value, int persist);
+	static void SetConst(const string& varName, const string& value);
+
+	static int GetMagicValue(VarKind kind, string& value);
 
 private:
 	static void sanitize_device_id(char* device_id);
 	static void get_device_id(void);
 
-	static pthread_mutex_t m_valuesLock;
+	static pthread_rwlock_t m_valuesLock;
+
+	static bool mSaveDirty;
+	static bool mSaveThreadStarted;
+	static pthread_mutex_t m_saveLock;
+	static pthread_cond_t m_saveCond;
+	static pthread_mutex_t m_saveFileLock;
 };
 
 #endif // _DATAMANAGER_HPP_HEADER
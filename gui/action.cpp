@@ -402,7 +402,7 @@ void GUIAction::simulate_progress_bar(void)
 	}
 }
 
-int GUIAction::flash_zip(std::string filename, int* wipe_cache)
+int GUIAction::flash_zip(std::string filename, int* wipe_cache, TWInstallQueue* queue)
 {
 	int ret_val = 0;
 
@@ -420,7 +420,7 @@ int GUIAction::flash_zip(std::string filename, int* wipe_cache)
 	if (simulate) {
 		simulate_progress_bar();
 	} else {
-		ret_val = TWinstall_zip(filename.c_str(), wipe_cache);
+		ret_val = queue->Install(filename, wipe_cache);
 
 		// Now, check if we need to ensure TWRP remains installed...
 		struct stat st;
@@ -1027,6 +1027,7 @@ void GUIAction::reinject_after_flash()
 int GUIAction::flash(std::string arg)
 {
 	int i, ret_val = 0, wipe_cache = 0;
+	TWInstallQueue install_queue;
 	// We're going to jump to this page first, like a loading page
 	gui_changePage(arg);
 	for (i=0; i<zip_queue_index; i++) {
@@ -1039,9 +1040,12 @@ int GUIAction::flash(std::string arg)
 		DataManager::SetValue(TW_ZIP_INDEX, (i + 1));
 
 		TWFunc::SetPerformanceMode(true);
-		ret_val = flash_zip(zip_path, &wipe_cache);
+		install_queue.Set_Next(i + 1 < zip_queue_index ? zip_queue[i + 1] : "");
+		ret_val = flash_zip(zip_path, &wipe_cache, &install_queue);
 		TWFunc::SetPerformanceMode(false);
 		if (ret_val != 0) {
+			// Whatever was prepared for the next zip is no longer needed
+			install_queue.Cancel();
 			gui_print("Error flashing zip '%s'\n", zip_path.c_str());
 			ret_val = 1;
 			break;
@@ -62,6 +62,7 @@ extern "C" void __gui_print(const char *color, char *buf)
 		fprintf(ors_file, "%s\n", buf);
 		fflush(ors_file);
 	}
+	gui_wake();
 }
 
 extern "C" void gui_print(const char *fmt, ...)
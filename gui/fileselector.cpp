@@ -207,6 +207,15 @@ int GUIFileSelector::NotifyVarChange(const std::string& varName, const std::stri
 	return 0;
 }
 
+bool GUIFileSelector::GetVariableSubscriptions(std::set<std::string>& vars)
+{
+	GUIScrollList::GetVariableSubscriptions(vars);
+
+	vars.insert(mPathVar);
+	vars.insert(mSortVariable);
+	return true;
+}
+
 bool GUIFileSelector::fileSort(FileData d1, FileData d2)
 {
 	if (d1.fileName == ".")
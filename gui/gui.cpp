@@ -31,6 +31,9 @@
 #include <sys/types.h>
 #include <sys/ioctl.h>
 #include <sys/mount.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <time.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -84,6 +87,31 @@ int gGuiRunning = 0;
 
 static int gRecorder = -1;
 
+// Event sources for the main loop. Input devices, the ORS command pipe, an
+// eventfd kicked by gui_wake() and a timerfd that paces animations are all
+// waited on through a single epoll instance, so an idle GUI sleeps instead
+// of polling.
+enum EventSources
+{
+  EV_SRC_INPUT     = 0x01,
+  EV_SRC_ORS       = 0x02,
+  EV_SRC_WAKE      = 0x04,
+  EV_SRC_TIMER     = 0x08,
+  EV_SRC_ALL       = 0x0F,
+};
+
+// Frame interval while animating and wakeup interval while idle (the idle
+// tick keeps the clock, battery and screen blank timer up to date)
+const static int FRAME_INTERVAL_NS = 33333333;
+const static int IDLE_TICK_MS = 1000;
+
+static int gEpollFd = -1;
+static int gWakeFd = -1;
+static int gTimerFd = -1;
+static int gEpollOrsFd = -1;
+static unsigned gEpollInputGen = 0;
+static bool gTimerArmed = false;
+
 enum RenderStates
 {
   RENDER_NORMAL    = 0x00,
@@ -222,6 +250,9 @@ public:
 
 	void handleDrag();
 
+	// true while a touch or key is held down and hold/repeat must be polled
+	bool isHolding() { return touch_status != TS_NONE || key_status != KS_NONE; }
+
 private:
 	// timeouts for touch/key hold and repeat
 	int touch_hold_ms;
@@ -554,6 +585,7 @@ static void ors_command_read()
 				}
 				gui_set_FILE(NULL);
 				gGuiConsoleTerminate.set_value(1);
+				gui_wake();
 			}
 		}
 		fclose(orsout);
@@ -569,54 +601,139 @@ static void ors_command_read()
 		}
 	} else {
 		LOGINFO("ORS command line read returned an error: %i, %i, %s\n", read_ret, errno, strerror(errno));
+		if (read_ret == 0) {
+			// The writer hung up without sending anything. Reopen the
+			// pipe, otherwise it will keep reporting ready to read.
+			close(ors_read_fd);
+			setup_ors_command();
+		}
 	}
 	return;
 }
 
-// This special function will return immediately the first time, but then
-// always returns 1/30th of a second (or immediately if called later) from
-// the last time it was called
-static void loopTimer(int input_timeout_ms)
+static void eventLoopAdd(int fd, uint32_t source)
 {
-	static timespec lastCall;
-	static int initialized = 0;
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u32 = source;
+	if (epoll_ctl(gEpollFd, EPOLL_CTL_ADD, fd, &ev) != 0 && errno != EEXIST)
+		LOGINFO("Unable to add fd %i to the GUI event loop: %s\n", fd, strerror(errno));
+}
 
-	if (!initialized)
-	{
-		clock_gettime(CLOCK_MONOTONIC, &lastCall);
-		initialized = 1;
+static void eventLoopInit()
+{
+	gEpollFd = epoll_create1(EPOLL_CLOEXEC);
+	if (gEpollFd < 0) {
+		LOGINFO("epoll_create1 failed (%s), falling back to polling\n", strerror(errno));
 		return;
 	}
 
-	do
-	{
-		bool got_event = input_handler.processInput(input_timeout_ms); // get inputs but don't send drag notices
-		timespec curTime;
-		clock_gettime(CLOCK_MONOTONIC, &curTime);
+	gWakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (gWakeFd >= 0)
+		eventLoopAdd(gWakeFd, EV_SRC_WAKE);
 
-		timespec diff = TWFunc::timespec_diff(lastCall, curTime);
+	gTimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (gTimerFd >= 0)
+		eventLoopAdd(gTimerFd, EV_SRC_TIMER);
 
-		// This is really 2 or 30 times per second
-		// As long as we get events, increase the timeout so we can catch up with input
-		long timeout = got_event ? 500000000 : 33333333;
+	gEpollInputGen = ev_get_generation() - 1;
+}
 
-		if (diff.tv_sec || diff.tv_nsec > timeout)
-		{
-			// int32_t input_time = TWFunc::timespec_diff_ms(lastCall, curTime);
-			// LOGINFO("loopTimer(): %u ms, count: %u\n", input_time, count);
+// Keeps the epoll set in line with the currently opened input devices and
+// ORS pipe. Closed fds drop out of the set by themselves.
+static void eventLoopSyncSources()
+{
+	unsigned gen = ev_get_generation();
+	if (gen != gEpollInputGen) {
+		int fd;
+		for (unsigned i = 0; (fd = ev_get_fd(i)) >= 0; i++)
+			eventLoopAdd(fd, EV_SRC_INPUT);
+		gEpollInputGen = gen;
+	}
 
-			lastCall = curTime;
-			input_handler.handleDrag(); // send only drag notices if needed
-			return;
+	if (ors_read_fd != gEpollOrsFd) {
+		if (gEpollOrsFd > 0)
+			epoll_ctl(gEpollFd, EPOLL_CTL_DEL, gEpollOrsFd, NULL);
+		gEpollOrsFd = ors_read_fd;
+		if (gEpollOrsFd > 0)
+			eventLoopAdd(gEpollOrsFd, EV_SRC_ORS);
+	}
+}
+
+static void eventLoopSetTimer(bool armed)
+{
+	if (gTimerFd < 0 || armed == gTimerArmed)
+		return;
+
+	struct itimerspec spec;
+	memset(&spec, 0, sizeof(spec));
+	if (armed) {
+		spec.it_value.tv_nsec = FRAME_INTERVAL_NS;
+		spec.it_interval.tv_nsec = FRAME_INTERVAL_NS;
+	}
+	timerfd_settime(gTimerFd, 0, &spec, NULL);
+	gTimerArmed = armed;
+}
+
+// Blocks until one of the event sources fires or the timeout expires.
+// Returns a mask of EventSources that are ready.
+static int eventLoopWait(int timeout_ms)
+{
+	if (gEpollFd < 0) {
+		// No epoll, behave like the old polling loop
+		usleep(gTimerArmed || timeout_ms == 0 ? 0 : FRAME_INTERVAL_NS / 1000);
+		return EV_SRC_ALL;
+	}
+
+	eventLoopSyncSources();
+
+	struct epoll_event events[16];
+	int count = epoll_wait(gEpollFd, events, 16, timeout_ms);
+	int fired = 0;
+	for (int i = 0; i < count; i++) {
+		uint64_t val;
+		switch (events[i].data.u32) {
+		case EV_SRC_WAKE:
+			read(gWakeFd, &val, sizeof(val));
+			break;
+		case EV_SRC_TIMER:
+			read(gTimerFd, &val, sizeof(val));
+			break;
 		}
+		fired |= events[i].data.u32;
+	}
+	return fired;
+}
 
-		// We need to sleep some period time microseconds
-		//unsigned int sleepTime = 33333 -(diff.tv_nsec / 1000);
-		//usleep(sleepTime); // removed so we can scan for input
-		input_timeout_ms = 0;
-	} while (1);
+// Waits for the next batch of work and dispatches any pending input. The
+// frame timer only runs while something on screen is animating or a touch
+// or key is held, otherwise we sleep until input, an ORS command or a
+// gui_wake() comes in.
+static int loopWait(bool animating)
+{
+	eventLoopSetTimer(animating || input_handler.isHolding());
+
+	int fired = eventLoopWait(IDLE_TICK_MS);
+
+	// ev_get() also takes care of reloading input devices, so let it run on
+	// idle ticks too
+	if (fired & (EV_SRC_INPUT | EV_SRC_TIMER) || fired == 0) {
+		// Drain the queue, but don't starve rendering on an event storm
+		for (int i = 0; i < 256 && input_handler.processInput(0); i++)
+			;
+		input_handler.handleDrag(); // send only drag notices if needed
+	}
+	return fired;
 }
 
+extern "C" void gui_wake(void)
+{
+	if (gWakeFd >= 0) {
+		uint64_t val = 1;
+		write(gWakeFd, &val, sizeof(val));
+	}
+}
 
 static int runPages(const char *page_name, const int stop_on_page_done)
 {
@@ -641,28 +758,15 @@ static int runPages(const char *page_name, const int stop_on_page_done)
 
 	DataManager::SetValue("tw_loaded", 1);
 
-#ifndef TW_OEM_BUILD
-	struct timeval timeout;
-	fd_set fdset;
-	int has_data = 0;
-#endif
-
-	int input_timeout_ms = 0;
 	int idle_frames = 0;
 
 	for (;;)
 	{
-		loopTimer(input_timeout_ms);
+		// due to possible animation objects, we need to delay stopping the frame timer
+		int fired = loopWait(idle_frames <= 15);
 #ifndef TW_OEM_BUILD
-		if (ors_read_fd > 0) {
-			FD_ZERO(&fdset);
-			FD_SET(ors_read_fd, &fdset);
-			timeout.tv_sec = 0;
-			timeout.tv_usec = 1;
-			has_data = select(ors_read_fd+1, &fdset, NULL, NULL, &timeout);
-			if (has_data > 0) {
-				ors_command_read();
-			}
+		if (ors_read_fd > 0 && (fired & EV_SRC_ORS)) {
+			ors_command_read();
 		}
 #endif
 
@@ -680,8 +784,6 @@ static int runPages(const char *page_name, const int stop_on_page_done)
 				++idle_frames;
 			else
 				idle_frames = 0;
-			// due to possible animation objects, we need to delay activating the input timeout
-			input_timeout_ms = idle_frames > 15 ? 1000 : 0;
 
 #ifndef PRINT_RENDER_TIME
 			if (ret > 1)
@@ -714,7 +816,7 @@ static int runPages(const char *page_name, const int stop_on_page_done)
 			gForceRender.set_value(0);
 			PageManager::Render();
 			flip();
-			input_timeout_ms = 0;
+			idle_frames = 0;
 		}
 
 		blankTimer.checkForTimeout();
@@ -736,6 +838,7 @@ static int runPages(const char *page_name, const int stop_on_page_done)
 int gui_forceRender(void)
 {
 	gForceRender.set_value(1);
+	gui_wake();
 	return 0;
 }
 
@@ -749,7 +852,7 @@ int gui_changePage(std::string newPage)
 {
 	LOGINFO("Set page: '%s'\n", newPage.c_str());
 	PageManager::ChangePage(newPage);
-	gForceRender.set_value(1);
+	gui_forceRender();
 	return 0;
 }
 
@@ -757,14 +860,14 @@ int gui_changeOverlay(std::string overlay)
 {
 	LOGINFO("Set overlay: '%s'\n", overlay.c_str());
 	PageManager::ChangeOverlay(overlay);
-	gForceRender.set_value(1);
+	gui_forceRender();
 	return 0;
 }
 
 int gui_changePackage(std::string newPackage)
 {
 	PageManager::SelectPackage(newPackage);
-	gForceRender.set_value(1);
+	gui_forceRender();
 	return 0;
 }
 
@@ -806,6 +909,90 @@ std::string gui_parse_text(std::string str)
 	}
 }
 
+void TextTemplate::Parse(const std::string& text)
+{
+	// Same syntax as gui_parse_text(), but split up once so rendering only
+	// has to look up interned variables
+	size_t pos = 0;
+	Token literal;
+	literal.type = TOKEN_LITERAL;
+	literal.var = -1;
+
+	mTokens.clear();
+	while (1)
+	{
+		size_t next = text.find('%', pos);
+		size_t end = (next == std::string::npos ? next : text.find('%', next + 1));
+		if (end == std::string::npos)
+		{
+			literal.text += text.substr(pos);
+			break;
+		}
+
+		literal.text += text.substr(pos, next - pos);
+		if (next + 1 == end)
+			literal.text += '%';
+		else
+		{
+			Token token;
+			std::string var = text.substr(next + 1, (end - next) - 1);
+			if (var[0] == '@') {
+				token.type = TOKEN_RESOURCE;
+				token.text = var.substr(1);
+				token.var = -1;
+			} else {
+				token.type = TOKEN_VARIABLE;
+				token.text = var;
+				token.var = DataManager::GetVarId(var);
+			}
+			if (!literal.text.empty())
+				mTokens.push_back(literal);
+			literal.text.clear();
+			mTokens.push_back(token);
+		}
+		pos = end + 1;
+	}
+	if (!literal.text.empty())
+		mTokens.push_back(literal);
+}
+
+std::string TextTemplate::Expand() const
+{
+	std::string str, value;
+	std::vector<Token>::const_iterator iter;
+	for (iter = mTokens.begin(); iter != mTokens.end(); ++iter)
+	{
+		if (iter->type == TOKEN_LITERAL)
+			str += iter->text;
+		else if (iter->type == TOKEN_RESOURCE)
+			str += PageManager::GetResources()->FindString(iter->text);
+		else if (DataManager::GetValue(iter->var, value) == 0)
+			str += value;
+	}
+	return str;
+}
+
+bool TextTemplate::IsStatic() const
+{
+	std::vector<Token>::const_iterator iter;
+	for (iter = mTokens.begin(); iter != mTokens.end(); ++iter)
+	{
+		if (iter->type != TOKEN_LITERAL)
+			return false;
+	}
+	return true;
+}
+
+void TextTemplate::GetVariables(std::set<std::string>& vars) const
+{
+	std::vector<Token>::const_iterator iter;
+	for (iter = mTokens.begin(); iter != mTokens.end(); ++iter)
+	{
+		if (iter->type == TOKEN_VARIABLE)
+			vars.insert(iter->text);
+	}
+}
+
 extern "C" int gui_init(void)
 {
 	gr_init();
@@ -834,6 +1021,7 @@ extern "C" int gui_init(void)
 	curtainSet();
 
 	ev_init();
+	eventLoopInit();
 	return 0;
 }
 
@@ -897,6 +1085,7 @@ extern "C" int gui_startPage(const char *page_name, const int allow_commands, in
 		return -1;
 
 	gGuiConsoleTerminate.set_value(1);
+	gui_wake();
 
 	while (gGuiConsoleRunning.get_value())
 		usleep(10000);
@@ -924,15 +1113,22 @@ static void * console_thread(void *cookie)
 {
 	PageManager::SwitchToConsole();
 
+	int idle_frames = 0;
+
 	while (!gGuiConsoleTerminate.get_value())
 	{
-		loopTimer(0);
+		loopWait(idle_frames <= 15);
 
 		if (!gForceRender.get_value())
 		{
 			int ret;
 
 			ret = PageManager::Update();
+			if (ret == 0)
+				++idle_frames;
+			else
+				idle_frames = 0;
+
 			if (ret > 1)
 				PageManager::Render();
 
@@ -947,10 +1143,11 @@ static void * console_thread(void *cookie)
 			gForceRender.set_value(0);
 			PageManager::Render();
 			flip();
+			idle_frames = 0;
 		}
 	}
 	gGuiConsoleRunning.set_value(0);
-	gForceRender.set_value(1); // this will kickstart the GUI to render again
+	gui_forceRender(); // this will kickstart the GUI to render again
 	PageManager::EndConsole();
 	LOGINFO("Console stopping\n");
 	return NULL;
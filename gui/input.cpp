@@ -561,6 +561,14 @@ int GUIInput::NotifyVarChange(const std::string& varName, const std::string& val
 	return 0;
 }
 
+bool GUIInput::GetVariableSubscriptions(std::set<std::string>& vars)
+{
+	GUIObject::GetVariableSubscriptions(vars);
+
+	vars.insert(mVariable);
+	return true;
+}
+
 int GUIInput::NotifyKeyboard(int key)
 {
 	string variableValue;
@@ -159,6 +159,16 @@ int GUIListBox::NotifyVarChange(const std::string& varName, const std::string& v
 	return 0;
 }
 
+bool GUIListBox::GetVariableSubscriptions(std::set<std::string>& vars)
+{
+	GUIScrollList::GetVariableSubscriptions(vars);
+
+	vars.insert(mVariable);
+	if (!mItemsVar.empty())
+		vars.insert(mItemsVar);
+	return true;
+}
+
 void GUIListBox::SetPageFocus(int inFocus)
 {
 	GUIScrollList::SetPageFocus(inFocus);
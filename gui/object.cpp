@@ -57,6 +57,10 @@ GUIObject::GUIObject(xml_node<>* node)
 		attr = condition->first_attribute("var2");
 		if (attr)   cond.mVar2 = attr->value();
 
+		// Resolve the variables once instead of on every evaluation
+		if (!cond.mVar1.empty())   cond.mVar1Id = DataManager::GetVarId(cond.mVar1);
+		if (!cond.mVar2.empty())   cond.mVar2Id = DataManager::GetVarId(cond.mVar2);
+
 		mConditions.push_back(cond);
 
 		condition = condition->next_sibling("condition");
@@ -94,18 +98,18 @@ bool GUIObject::isConditionTrue(Condition* condition)
 	if (!condition->mCompareOp.empty() && condition->mCompareOp[0] == '!')
 		bTrue = false;
 
+	string var1, var2;
 	if (condition->mVar2.empty() && condition->mCompareOp != "modified")
 	{
-		if (!DataManager::GetStrValue(condition->mVar1).empty())
+		if (DataManager::GetValue(condition->mVar1Id, var1) == 0 && !var1.empty())
 			return bTrue;
 
 		return !bTrue;
 	}
 
-	string var1, var2;
-	if (DataManager::GetValue(condition->mVar1, var1))
+	if (DataManager::GetValue(condition->mVar1Id, var1))
 		var1 = condition->mVar1;
-	if (DataManager::GetValue(condition->mVar2, var2))
+	if (DataManager::GetValue(condition->mVar2Id, var2))
 		var2 = condition->mVar2;
 
 	// This is a special case, we stat the file and that determines our result
@@ -185,6 +189,19 @@ int GUIObject::NotifyVarChange(const std::string& varName, const std::string& va
 	return 0;
 }
 
+bool GUIObject::GetVariableSubscriptions(std::set<std::string>& vars)
+{
+	std::vector<Condition>::iterator iter;
+	for (iter = mConditions.begin(); iter != mConditions.end(); ++iter)
+	{
+		if (!iter->mVar1.empty())
+			vars.insert(iter->mVar1);
+		if (!iter->mVar2.empty())
+			vars.insert(iter->mVar2);
+	}
+	return true;
+}
+
 bool GUIObject::isMounted(string vol)
 {
 	FILE *fp;
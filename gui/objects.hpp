@@ -35,6 +35,8 @@ using namespace rapidxml;
 #include "pages.hpp"
 #include "../partitions.hpp"
 
+class TWInstallQueue;
+
 #ifndef TW_X_OFFSET
 #define TW_X_OFFSET 0
 #endif
@@ -133,16 +135,23 @@ public:
 	//  Returns 0 on success, <0 on error
 	virtual int NotifyVarChange(const std::string& varName, const std::string& value);
 
+	// GetVariableSubscriptions - Report the variables NotifyVarChange cares about
+	//  Returns true if vars is complete, false to be notified of every change
+	virtual bool GetVariableSubscriptions(std::set<std::string>& vars);
+
 protected:
 	class Condition
 	{
 	public:
 		Condition() {
 			mLastResult = true;
+			mVar1Id = mVar2Id = -1;
 		}
 
 		std::string mVar1;
 		std::string mVar2;
+		DataManager::VarId mVar1Id;
+		DataManager::VarId mVar2Id;
 		std::string mCompareOp;
 		std::string mLastVal;
 		bool mLastResult;
@@ -174,6 +183,35 @@ protected:
 	int HasInputFocus;
 };
 
+// TextTemplate - Text with %var% and %@resource% blocks, tokenized once so
+// that expanding it doesn't have to parse the string or look up names
+class TextTemplate
+{
+public:
+	TextTemplate() {}
+
+public:
+	void Parse(const std::string& text);
+	std::string Expand() const;
+	bool IsStatic() const;
+	void GetVariables(std::set<std::string>& vars) const;
+
+protected:
+	enum TokenType {
+		TOKEN_LITERAL = 0,
+		TOKEN_VARIABLE,
+		TOKEN_RESOURCE,
+	};
+
+	struct Token {
+		TokenType type;
+		std::string text;
+		DataManager::VarId var;
+	};
+
+	std::vector<Token> mTokens;
+};
+
 // Derived Objects
 // GUIText - Used for static text
 class GUIText : public GUIObject, public RenderObject, public ActionObject
@@ -196,6 +234,7 @@ public:
 
 	// Notify of a variable change
 	virtual int NotifyVarChange(const std::string& varName, const std::string& value);
+	virtual bool GetVariableSubscriptions(std::set<std::string>& vars);
 
 	// Set maximum width in pixels
 	virtual int SetMaxWidth(unsigned width);
@@ -207,7 +246,7 @@ public:
 	bool isHighlighted;
 
 protected:
-	std::string mText;
+	TextTemplate mText;
 	std::string mLastValue;
 	COLOR mColor;
 	COLOR mHighlightColor;
@@ -290,7 +329,7 @@ protected:
 	int doAction(Action action);
 	ThreadType getThreadType(const Action& action);
 	void simulate_progress_bar(void);
-	int flash_zip(std::string filename, int* wipe_cache);
+	int flash_zip(std::string filename, int* wipe_cache, TWInstallQueue* queue);
 	void reinject_after_flash();
 	void operation_start(const string operation_name);
 	void operation_end(const int operation_status);
@@ -498,6 +537,7 @@ public:
 
 	// NotifyVarChange - Notify of a variable change
 	virtual int NotifyVarChange(const std::string& varName, const std::string& value);
+	virtual bool GetVariableSubscriptions(std::set<std::string>& vars);
 
 	// SetPos - Update the position of the render object
 	//  Return 0 on success, <0 on error
@@ -545,7 +585,7 @@ protected:
 	// Header
 	COLOR mHeaderBackgroundColor;
 	COLOR mHeaderFontColor;
-	std::string mHeaderText; // Original header text without parsing any variables
+	TextTemplate mHeaderText; // Original header text without parsing any variables
 	std::string mLastHeaderValue; // Header text after parsing variables
 	bool mHeaderIsStatic; // indicates if the header is static (no need to check for changes in NotifyVarChange)
 	int mHeaderH; // actual header height including font, icon, padding, and separator heights
@@ -604,6 +644,7 @@ public:
 
 	// NotifyVarChange - Notify of a variable change
 	virtual int NotifyVarChange(const std::string& varName, const std::string& value);
+	virtual bool GetVariableSubscriptions(std::set<std::string>& vars);
 
 	// SetPageFocus - Notify when a page gains or loses focus
 	virtual void SetPageFocus(int inFocus);
@@ -660,6 +701,7 @@ public:
 
 	// NotifyVarChange - Notify of a variable change
 	virtual int NotifyVarChange(const std::string& varName, const std::string& value);
+	virtual bool GetVariableSubscriptions(std::set<std::string>& vars);
 
 	// SetPageFocus - Notify when a page gains or loses focus
 	virtual void SetPageFocus(int inFocus);
@@ -697,6 +739,7 @@ public:
 
 	// NotifyVarChange - Notify of a variable change
 	virtual int NotifyVarChange(const std::string& varName, const std::string& value);
+	virtual bool GetVariableSubscriptions(std::set<std::string>& vars);
 
 	// SetPageFocus - Notify when a page gains or loses focus
 	virtual void SetPageFocus(int inFocus);
@@ -812,6 +855,7 @@ public:
 	// NotifyVarChange - Notify of a variable change
 	//  Returns 0 on success, <0 on error
 	virtual int NotifyVarChange(const std::string& varName, const std::string& value);
+	virtual bool GetVariableSubscriptions(std::set<std::string>& vars);
 
 protected:
 	ImageResource* mEmptyBar;
@@ -961,6 +1005,7 @@ public:
 
 	// Notify of a variable change
 	virtual int NotifyVarChange(const std::string& varName, const std::string& value);
+	virtual bool GetVariableSubscriptions(std::set<std::string>& vars);
 
 	// NotifyTouch - Notify of a touch event
 	//  Return 0 on success, >0 to ignore remainder of touch, and <0 on error
@@ -1054,6 +1099,7 @@ public:
 
 	// Notify of a variable change
 	virtual int NotifyVarChange(const std::string& varName, const std::string& value);
+	virtual bool GetVariableSubscriptions(std::set<std::string>& vars);
 
 	// SetPageFocus - Notify when a page gains or loses focus
 	virtual void SetPageFocus(int inFocus);
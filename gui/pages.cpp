@@ -298,6 +298,7 @@ Page::Page(xml_node<>* page, std::vector<xml_node<>*> *templates /* = NULL */)
 	// This is a recursive routine for template handling
 	ProcessNode(page, templates);
 
+	BuildVarIndex();
 	return;
 }
 
@@ -307,6 +308,32 @@ Page::~Page()
 		delete *itr;
 }
 
+void Page::BuildVarIndex(void)
+{
+	std::vector<std::set<std::string> > subscriptions(mObjects.size());
+	std::vector<bool> wildcard(mObjects.size(), false);
+	std::set<std::string> names;
+
+	for (size_t i = 0; i < mObjects.size(); ++i)
+	{
+		if (!mObjects[i]->GetVariableSubscriptions(subscriptions[i]))
+		{
+			wildcard[i] = true;
+			mVarWildcards.push_back(mObjects[i]);
+		}
+		names.insert(subscriptions[i].begin(), subscriptions[i].end());
+	}
+
+	// Wildcard objects go into every list too so that a single list keeps
+	// the original notification order of the page
+	for (size_t i = 0; i < mObjects.size(); ++i)
+	{
+		const std::set<std::string>& vars = wildcard[i] ? names : subscriptions[i];
+		for (std::set<std::string>::const_iterator var = vars.begin(); var != vars.end(); ++var)
+			mVarSubscribers[*var].push_back(mObjects[i]);
+	}
+}
+
 bool Page::ProcessNode(xml_node<>* page, std::vector<xml_node<>*> *templates /* = NULL */, int depth /* = 0 */)
 {
 	if (depth == 10)
@@ -646,8 +673,16 @@ void Page::SetPageFocus(int inFocus)
 
 int Page::NotifyVarChange(std::string varName, std::string value)
 {
+	// An empty name is a full refresh that goes to everybody
+	std::vector<GUIObject*>* targets = &mObjects;
+	if (!varName.empty())
+	{
+		std::map<std::string, std::vector<GUIObject*> >::iterator sub = mVarSubscribers.find(varName);
+		targets = (sub != mVarSubscribers.end() ? &sub->second : &mVarWildcards);
+	}
+
 	std::vector<GUIObject*>::iterator iter;
-	for (iter = mObjects.begin(); iter != mObjects.end(); ++iter)
+	for (iter = targets->begin(); iter != targets->end(); ++iter)
 	{
 		if ((*iter)->NotifyVarChange(varName, value))
 			LOGERR("An action handler errored on NotifyVarChange.\n");
@@ -1491,6 +1526,9 @@ int PageManager::NotifyVarChange(std::string varName, std::string value)
 
 extern "C" void gui_notifyVarChange(const char *name, const char* value)
 {
+	// Let the main loop know that something may need to be redrawn
+	gui_wake();
+
 	if (!gGuiRunning)
 		return;
 
@@ -2,6 +2,7 @@
 #define _PAGES_HEADER
 
 void gui_notifyVarChange(const char *name, const char* value);
+void gui_wake(void);
 
 #endif  // _PAGES_HEADER
 
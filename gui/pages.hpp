@@ -6,6 +6,7 @@
 #include "../minzip/Zip.h"
 #include <vector>
 #include <map>
+#include <set>
 #include "rapidxml.hpp"
 using namespace rapidxml;
 
@@ -33,6 +34,7 @@ int gui_forceRender(void);
 int gui_setRenderEnabled(int enable);
 int gui_changePage(std::string newPage);
 int gui_changeOverlay(std::string newPage);
+extern "C" void gui_wake(void);
 std::string gui_parse_text(string inText);
 
 class Resource;
@@ -72,8 +74,14 @@ protected:
 	ActionObject* mTouchStart;
 	COLOR mBackground;
 
+	// Variable name -> objects to notify when it changes, in page order
+	std::map<std::string, std::vector<GUIObject*> > mVarSubscribers;
+	// Objects that want to hear about every variable change
+	std::vector<GUIObject*> mVarWildcards;
+
 protected:
 	bool ProcessNode(xml_node<>* page, std::vector<xml_node<>*> *templates = NULL, int depth = 0);
+	void BuildVarIndex(void);
 };
 
 class PageSet
@@ -147,6 +147,14 @@ int GUIPartitionList::NotifyVarChange(const std::string& varName, const std::str
 	return 0;
 }
 
+bool GUIPartitionList::GetVariableSubscriptions(std::set<std::string>& vars)
+{
+	GUIScrollList::GetVariableSubscriptions(vars);
+
+	vars.insert(mVariable);
+	return true;
+}
+
 void GUIPartitionList::SetPageFocus(int inFocus)
 {
 	GUIScrollList::SetPageFocus(inFocus);
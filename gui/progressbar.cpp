@@ -224,3 +224,12 @@ int GUIProgressBar::NotifyVarChange(const std::string& varName, const std::strin
 	}
 	return 0;
 }
+
+bool GUIProgressBar::GetVariableSubscriptions(std::set<std::string>& vars)
+{
+	GUIObject::GetVariableSubscriptions(vars);
+
+	vars.insert("ui_progress_portion");
+	vars.insert("ui_progress_frames");
+	return true;
+}
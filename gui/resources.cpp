@@ -5,13 +5,20 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 
 #include <string>
 #include <sstream>
 #include <iostream>
 #include <iomanip>
+#include <algorithm>
 
 #include "../minzip/Zip.h"
+#include "../minzip/SysUtil.h"
 extern "C" {
 #include "../twcommon.h"
 #include "../minuitwrp/minui.h"
@@ -20,61 +27,164 @@ extern "C" {
 
 #include "rapidxml.hpp"
 #include "objects.hpp"
+#include "../twrp-functions.hpp"
 
 #define TMP_RESOURCE_NAME   "/tmp/extract.bin"
 
-Resource::Resource(xml_node<>* node, ZipArchive* pZip)
+// Decoded and scaled images are kept here, named after their source and scaling
+#define THEME_CACHE_DIR       "/cache/recovery/theme-cache/"
+#define THEME_CACHE_MAX_SIZE  (48ULL * 1024 * 1024)
+#define MAX_LOADER_THREADS    4
+
+// Loads theme images on a small pool of worker threads. Image data is
+// decoded straight from the mapped zip or file, then scaled, and the
+// result is kept in an on-disk cache of ready-to-use surfaces when
+// /cache is mounted so the next load of the same theme skips both steps.
+class ImageLoader
 {
-	if (node && node->first_attribute("name"))
-		mName = node->first_attribute("name")->value();
+public:
+	ImageLoader(ZipArchive* pZip);
+	~ImageLoader();
+
+	// Queues an image, returns false if it does not exist
+	bool Add(const std::string& file, bool retain_aspect, gr_surface* target);
+	bool Exists(const std::string& file);
+	// Loads all queued images, returns when done
+	void Run();
+
+private:
+	struct Job
+	{
+		const ZipEntry* entry; // source in the theme zip, or...
+		std::string path;      // ...source file on disk
+		std::string key;       // identifies source and scaling for the cache
+		bool retain_aspect;
+		gr_surface* target;
+	};
+
+	bool Resolve(const std::string& file, Job& job);
+	void Load(const Job& job);
+	int Decode(const Job& job, gr_surface* surface);
+	void Scale(gr_surface source, gr_surface* destination, bool retain_aspect);
+	bool ReadCache(const std::string& name, gr_surface* surface);
+	void WriteCache(const std::string& name, gr_surface surface);
+	void PrepareCache();
+	static std::string Hash(const std::string& str);
+	static void* thread_work(void* cookie);
+
+	ZipArchive* mZip;
+	std::vector<Job> mJobs;
+	size_t mNextJob;
+	pthread_mutex_t mLock;
+	std::string mCacheDir; // empty when caching is disabled
+	bool mCacheWritable;
+};
+
+ImageLoader::ImageLoader(ZipArchive* pZip)
+{
+	mZip = pZip;
+	mNextJob = 0;
+	mCacheWritable = false;
+	pthread_mutex_init(&mLock, NULL);
 }
 
-int Resource::ExtractResource(ZipArchive* pZip, std::string folderName, std::string fileName, std::string fileExtn, std::string destFile)
+ImageLoader::~ImageLoader()
 {
-	if (!pZip)
-		return -1;
-
-	std::string src = folderName + "/" + fileName + fileExtn;
-
-	const ZipEntry* binary = mzFindZipEntry(pZip, src.c_str());
-	if (binary == NULL) {
-		return -1;
-	}
-
-	unlink(destFile.c_str());
-	int fd = creat(destFile.c_str(), 0666);
-	if (fd < 0)
-		return -1;
+	pthread_mutex_destroy(&mLock);
+}
 
-	int ret = 0;
-	if (!mzExtractZipEntryToFile(pZip, binary, fd))
-		ret = -1;
+bool ImageLoader::Add(const std::string& file, bool retain_aspect, gr_surface* target)
+{
+	Job job;
+	job.retain_aspect = retain_aspect;
+	job.target = target;
+	*target = NULL;
+	if (!Resolve(file, job))
+		return false;
+	mJobs.push_back(job);
+	return true;
+}
 
-	close(fd);
-	return ret;
+bool ImageLoader::Exists(const std::string& file)
+{
+	Job job;
+	job.retain_aspect = false;
+	job.target = NULL;
+	return Resolve(file, job);
 }
 
-void Resource::LoadImage(ZipArchive* pZip, std::string file, gr_surface* source)
+bool ImageLoader::Resolve(const std::string& file, Job& job)
 {
-	if (ExtractResource(pZip, "images", file, ".png", TMP_RESOURCE_NAME) == 0)
-	{
-		res_create_surface(TMP_RESOURCE_NAME, source);
-		unlink(TMP_RESOURCE_NAME);
-	}
-	else if (ExtractResource(pZip, "images", file, "", TMP_RESOURCE_NAME) == 0)
-	{
+	std::ostringstream key;
+
+	job.entry = NULL;
+	if (mZip) {
 		// JPG includes the .jpg extension in the filename so extension should be blank
-		res_create_surface(TMP_RESOURCE_NAME, source);
-		unlink(TMP_RESOURCE_NAME);
+		std::string name = "images/" + file + ".png";
+		job.entry = mzFindZipEntry(mZip, name.c_str());
+		if (!job.entry) {
+			name = "images/" + file;
+			job.entry = mzFindZipEntry(mZip, name.c_str());
+		}
+		if (!job.entry)
+			return false;
+		key << "zip:" << name << ':' << mzGetZipEntryCrc32(job.entry) << ':' << mzGetZipEntryUncompLen(job.entry);
+	} else {
+		// Same search order as res_create_surface()
+		std::string folder = TWRES "images/";
+#ifdef TW_HAS_LANDSCAPE
+		if (gr_get_rotation() % 180 != 0)
+			folder = TWRES "landscape/images/";
+#endif
+		std::string candidates[] = { folder + file + ".png", file, folder + file };
+		struct stat st;
+		for (size_t i = 0; i < sizeof(candidates) / sizeof(candidates[0]); i++) {
+			if (stat(candidates[i].c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+				job.path = candidates[i];
+				break;
+			}
+		}
+		if (job.path.empty())
+			return false;
+		key << "file:" << job.path << ':' << st.st_size << ':' << st.st_mtime;
 	}
-	else if (!pZip)
-	{
-		// File name in xml may have included .png so try without adding .png
-		res_create_surface(file.c_str(), source);
+	key << ':' << get_scale_w() << ':' << get_scale_h() << ':' << job.retain_aspect;
+	job.key = key.str();
+	return true;
+}
+
+int ImageLoader::Decode(const Job& job, gr_surface* surface)
+{
+	int ret;
+
+	if (!job.entry) {
+		MemMapping map;
+		if (sysMapFile(job.path.c_str(), &map) != 0)
+			return -1;
+		ret = res_create_surface_mem(map.addr, map.length, surface);
+		sysReleaseMap(&map);
+		return ret;
 	}
+
+	unsigned char* data;
+	size_t length;
+	// Stored entries are decoded in place, compressed ones are inflated to memory
+	if (mzGetStoredEntry(mZip, job.entry, &data, &length))
+		return res_create_surface_mem(data, length, surface);
+
+	length = mzGetZipEntryUncompLen(job.entry);
+	data = (unsigned char*) malloc(length);
+	if (!data)
+		return -1;
+	if (mzExtractZipEntryToBuffer(mZip, job.entry, data))
+		ret = res_create_surface_mem(data, length, surface);
+	else
+		ret = -1;
+	free(data);
+	return ret;
 }
 
-void Resource::CheckAndScaleImage(gr_surface source, gr_surface* destination, int retain_aspect)
+void ImageLoader::Scale(gr_surface source, gr_surface* destination, bool retain_aspect)
 {
 	if (!source) {
 		*destination = NULL;
@@ -97,6 +207,194 @@ void Resource::CheckAndScaleImage(gr_surface source, gr_surface* destination, in
 	}
 }
 
+void ImageLoader::Load(const Job& job)
+{
+	std::string name;
+	gr_surface surface = NULL;
+
+	if (!mCacheDir.empty()) {
+		name = mCacheDir + Hash(job.key);
+		if (ReadCache(name, job.target)) {
+			utimes(name.c_str(), NULL);
+			return;
+		}
+	}
+
+	if (Decode(job, &surface) != 0 || !surface)
+		return;
+	Scale(surface, job.target, job.retain_aspect);
+
+	if (!name.empty() && *job.target)
+		WriteCache(name, *job.target);
+}
+
+bool ImageLoader::ReadCache(const std::string& name, gr_surface* surface)
+{
+	int fd = open(name.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+	int ret = res_read_surface(fd, surface);
+	close(fd);
+	if (ret != 0) {
+		unlink(name.c_str());
+		return false;
+	}
+	return true;
+}
+
+void ImageLoader::WriteCache(const std::string& name, gr_surface surface)
+{
+	pthread_mutex_lock(&mLock);
+	bool writable = mCacheWritable;
+	pthread_mutex_unlock(&mLock);
+	if (!writable)
+		return;
+
+	std::string tmp = name + ".tmp";
+	int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd >= 0) {
+		int ret = res_write_surface(surface, fd);
+		if (close(fd) == 0 && ret == 0 && rename(tmp.c_str(), name.c_str()) == 0)
+			return;
+	}
+	// Most likely out of space, stop trying for this load
+	LOGINFO("Unable to write theme cache '%s'\n", name.c_str());
+	unlink(tmp.c_str());
+	pthread_mutex_lock(&mLock);
+	mCacheWritable = false;
+	pthread_mutex_unlock(&mLock);
+}
+
+struct CacheFile
+{
+	std::string name;
+	time_t mtime;
+	off_t size;
+	bool operator<(const CacheFile& other) const { return mtime > other.mtime; }
+};
+
+void ImageLoader::PrepareCache()
+{
+	mCacheDir.clear();
+	if (mJobs.empty() || !PartitionManager.Is_Mounted_By_Path("/cache"))
+		return;
+	if (!TWFunc::Recursive_Mkdir(THEME_CACHE_DIR))
+		return;
+
+	// Files are touched whenever they are used, drop the least recently
+	// used ones once the cache grows past its limit
+	DIR* d = opendir(THEME_CACHE_DIR);
+	if (!d)
+		return;
+	std::vector<CacheFile> files;
+	struct dirent* de;
+	while ((de = readdir(d)) != NULL) {
+		CacheFile file;
+		struct stat st;
+		file.name = std::string(THEME_CACHE_DIR) + de->d_name;
+		if (stat(file.name.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+			continue;
+		file.mtime = st.st_mtime;
+		file.size = st.st_size;
+		files.push_back(file);
+	}
+	closedir(d);
+
+	std::sort(files.begin(), files.end());
+	unsigned long long total = 0;
+	for (std::vector<CacheFile>::iterator it = files.begin(); it != files.end(); ++it) {
+		total += it->size;
+		if (total > THEME_CACHE_MAX_SIZE)
+			unlink(it->name.c_str());
+	}
+
+	mCacheDir = THEME_CACHE_DIR;
+	mCacheWritable = true;
+}
+
+std::string ImageLoader::Hash(const std::string& str)
+{
+	// 64-bit FNV-1a
+	unsigned long long hash = 14695981039346656037ULL;
+	for (std::string::const_iterator it = str.begin(); it != str.end(); ++it) {
+		hash ^= (unsigned char) *it;
+		hash *= 1099511628211ULL;
+	}
+	char buf[17];
+	snprintf(buf, sizeof(buf), "%016llx", hash);
+	return buf;
+}
+
+void* ImageLoader::thread_work(void* cookie)
+{
+	ImageLoader* loader = (ImageLoader*) cookie;
+
+	for (;;) {
+		pthread_mutex_lock(&loader->mLock);
+		size_t index = loader->mNextJob++;
+		pthread_mutex_unlock(&loader->mLock);
+		if (index >= loader->mJobs.size())
+			break;
+		loader->Load(loader->mJobs[index]);
+	}
+	return NULL;
+}
+
+void ImageLoader::Run()
+{
+	PrepareCache();
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t count = (cpus > MAX_LOADER_THREADS) ? MAX_LOADER_THREADS : (cpus > 1 ? cpus : 1);
+	if (count > mJobs.size())
+		count = mJobs.size();
+
+	// The calling thread takes part as well
+	std::vector<pthread_t> threads;
+	for (size_t i = 1; i < count; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, thread_work, this) == 0)
+			threads.push_back(thread);
+	}
+	thread_work(this);
+	for (std::vector<pthread_t>::iterator it = threads.begin(); it != threads.end(); ++it)
+		pthread_join(*it, NULL);
+
+	mJobs.clear();
+	mNextJob = 0;
+}
+
+Resource::Resource(xml_node<>* node, ZipArchive* pZip)
+{
+	if (node && node->first_attribute("name"))
+		mName = node->first_attribute("name")->value();
+}
+
+int Resource::ExtractResource(ZipArchive* pZip, std::string folderName, std::string fileName, std::string fileExtn, std::string destFile)
+{
+	if (!pZip)
+		return -1;
+
+	std::string src = folderName + "/" + fileName + fileExtn;
+
+	const ZipEntry* binary = mzFindZipEntry(pZip, src.c_str());
+	if (binary == NULL) {
+		return -1;
+	}
+
+	unlink(destFile.c_str());
+	int fd = creat(destFile.c_str(), 0666);
+	if (fd < 0)
+		return -1;
+
+	int ret = 0;
+	if (!mzExtractZipEntryToFile(pZip, binary, fd))
+		ret = -1;
+
+	close(fd);
+	return ret;
+}
+
 FontResource::FontResource(xml_node<>* node, ZipArchive* pZip)
  : Resource(node, pZip)
 {
@@ -179,11 +477,10 @@ FontResource::~FontResource()
 	}
 }
 
-ImageResource::ImageResource(xml_node<>* node, ZipArchive* pZip)
+ImageResource::ImageResource(xml_node<>* node, ZipArchive* pZip, ImageLoader* loader)
  : Resource(node, pZip)
 {
 	std::string file;
-	gr_surface temp_surface = NULL;
 
 	mSurface = NULL;
 	if (!node) {
@@ -200,8 +497,7 @@ ImageResource::ImageResource(xml_node<>* node, ZipArchive* pZip)
 
 	bool retain_aspect = (node->first_attribute("retainaspect") != NULL);
 	// the value does not matter, if retainaspect is present, we assume that we want to retain it
-	LoadImage(pZip, file, &temp_surface);
-	CheckAndScaleImage(temp_surface, &mSurface, retain_aspect);
+	loader->Add(file, retain_aspect, &mSurface);
 }
 
 ImageResource::~ImageResource()
@@ -210,7 +506,7 @@ ImageResource::~ImageResource()
 		res_free_surface(mSurface);
 }
 
-AnimationResource::AnimationResource(xml_node<>* node, ZipArchive* pZip)
+AnimationResource::AnimationResource(xml_node<>* node, ZipArchive* pZip, ImageLoader* loader)
  : Resource(node, pZip)
 {
 	std::string file;
@@ -228,20 +524,32 @@ AnimationResource::AnimationResource(xml_node<>* node, ZipArchive* pZip)
 
 	bool retain_aspect = (node->first_attribute("retainaspect") != NULL);
 	// the value does not matter, if retainaspect is present, we assume that we want to retain it
+	// Find out how many frames there are first, so the surfaces don't move
+	// while the loader fills them in
+	std::vector<std::string> frames;
 	for (;;)
 	{
 		std::ostringstream fileName;
 		fileName << file << std::setfill ('0') << std::setw (3) << fileNum;
 
-		gr_surface surface, temp_surface = NULL;
-		LoadImage(pZip, fileName.str(), &temp_surface);
-		CheckAndScaleImage(temp_surface, &surface, retain_aspect);
-		if (surface) {
-			mSurfaces.push_back(surface);
-			fileNum++;
-		} else
-			break; // Done loading animation images
+		if (!loader->Exists(fileName.str()))
+			break; // Done finding animation images
+		frames.push_back(fileName.str());
+		fileNum++;
 	}
+
+	mSurfaces.resize(frames.size(), NULL);
+	for (size_t i = 0; i < frames.size(); i++)
+		loader->Add(frames[i], retain_aspect, &mSurfaces[i]);
+}
+
+void AnimationResource::FinishLoading()
+{
+	// The animation ends at the first frame that failed to load
+	std::vector<gr_surface>::iterator it = std::find(mSurfaces.begin(), mSurfaces.end(), (gr_surface) NULL);
+	for (std::vector<gr_surface>::iterator it2 = it; it2 != mSurfaces.end(); ++it2)
+		res_free_surface(*it2);
+	mSurfaces.erase(it, mSurfaces.end());
 }
 
 AnimationResource::~AnimationResource()
@@ -256,26 +564,20 @@ AnimationResource::~AnimationResource()
 
 FontResource* ResourceManager::FindFont(const std::string& name) const
 {
-	for (std::vector<FontResource*>::const_iterator it = mFonts.begin(); it != mFonts.end(); ++it)
-		if (name == (*it)->GetName())
-			return *it;
-	return NULL;
+	std::map<std::string, FontResource*>::const_iterator it = mFontsByName.find(name);
+	return it != mFontsByName.end() ? it->second : NULL;
 }
 
 ImageResource* ResourceManager::FindImage(const std::string& name) const
 {
-	for (std::vector<ImageResource*>::const_iterator it = mImages.begin(); it != mImages.end(); ++it)
-		if (name == (*it)->GetName())
-			return *it;
-	return NULL;
+	std::map<std::string, ImageResource*>::const_iterator it = mImagesByName.find(name);
+	return it != mImagesByName.end() ? it->second : NULL;
 }
 
 AnimationResource* ResourceManager::FindAnimation(const std::string& name) const
 {
-	for (std::vector<AnimationResource*>::const_iterator it = mAnimations.begin(); it != mAnimations.end(); ++it)
-		if (name == (*it)->GetName())
-			return *it;
-	return NULL;
+	std::map<std::string, AnimationResource*>::const_iterator it = mAnimationsByName.find(name);
+	return it != mAnimationsByName.end() ? it->second : NULL;
 }
 
 std::string ResourceManager::FindString(const std::string& name) const
@@ -290,11 +592,30 @@ ResourceManager::ResourceManager()
 {
 }
 
+static void LogResourceError(xml_node<>* child, const std::string& type)
+{
+	std::string res_name;
+	if (child->first_attribute("name"))
+		res_name = child->first_attribute("name")->value();
+	if (res_name.empty() && child->first_attribute("filename"))
+		res_name = child->first_attribute("filename")->value();
+
+	if (!res_name.empty()) {
+		LOGERR("Resource (%s)-(%s) failed to load\n", type.c_str(), res_name.c_str());
+	} else
+		LOGERR("Resource type (%s) failed to load\n", type.c_str());
+}
+
 void ResourceManager::LoadResources(xml_node<>* resList, ZipArchive* pZip)
 {
 	if (!resList)
 		return;
 
+	// Images and animations are only queued here, and checked after the loader ran
+	ImageLoader loader(pZip);
+	std::vector<std::pair<xml_node<>*, ImageResource*> > images;
+	std::vector<std::pair<xml_node<>*, AnimationResource*> > animations;
+
 	for (xml_node<>* child = resList->first_node(); child; child = child->next_sibling())
 	{
 		std::string type = child->name();
@@ -308,32 +629,21 @@ void ResourceManager::LoadResources(xml_node<>* resList, ZipArchive* pZip)
 		if (type == "font")
 		{
 			FontResource* res = new FontResource(child, pZip);
-			if (res->GetResource())
+			if (res->GetResource()) {
 				mFonts.push_back(res);
-			else {
+				mFontsByName.insert(std::make_pair(res->GetName(), res));
+			} else {
 				error = true;
 				delete res;
 			}
 		}
 		else if (type == "image")
 		{
-			ImageResource* res = new ImageResource(child, pZip);
-			if (res->GetResource())
-				mImages.push_back(res);
-			else {
-				error = true;
-				delete res;
-			}
+			images.push_back(std::make_pair(child, new ImageResource(child, pZip, &loader)));
 		}
 		else if (type == "animation")
 		{
-			AnimationResource* res = new AnimationResource(child, pZip);
-			if (res->GetResourceCount())
-				mAnimations.push_back(res);
-			else {
-				error = true;
-				delete res;
-			}
+			animations.push_back(std::make_pair(child, new AnimationResource(child, pZip, &loader)));
 		}
 		else if (type == "string")
 		{
@@ -349,17 +659,33 @@ void ResourceManager::LoadResources(xml_node<>* resList, ZipArchive* pZip)
 		}
 
 		if (error)
-		{
-			std::string res_name;
-			if (child->first_attribute("name"))
-				res_name = child->first_attribute("name")->value();
-			if (res_name.empty() && child->first_attribute("filename"))
-				res_name = child->first_attribute("filename")->value();
-
-			if (!res_name.empty()) {
-				LOGERR("Resource (%s)-(%s) failed to load\n", type.c_str(), res_name.c_str());
-			} else
-				LOGERR("Resource type (%s) failed to load\n", type.c_str());
+			LogResourceError(child, type);
+	}
+
+	loader.Run();
+
+	for (size_t i = 0; i < images.size(); i++)
+	{
+		ImageResource* res = images[i].second;
+		if (res->GetResource()) {
+			mImages.push_back(res);
+			mImagesByName.insert(std::make_pair(res->GetName(), res));
+		} else {
+			LogResourceError(images[i].first, "image");
+			delete res;
+		}
+	}
+
+	for (size_t i = 0; i < animations.size(); i++)
+	{
+		AnimationResource* res = animations[i].second;
+		res->FinishLoading();
+		if (res->GetResourceCount()) {
+			mAnimations.push_back(res);
+			mAnimationsByName.insert(std::make_pair(res->GetName(), res));
+		} else {
+			LogResourceError(animations[i].first, "animation");
+			delete res;
 		}
 	}
 }
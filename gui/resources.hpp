@@ -8,6 +8,7 @@
 #include <map>
 
 struct ZipArchive;
+class ImageLoader;
 
 extern "C" {
 #include "../minuitwrp/minui.h"
@@ -28,8 +29,6 @@ private:
 
 protected:
 	static int ExtractResource(ZipArchive* pZip, std::string folderName, std::string fileName, std::string fileExtn, std::string destFile);
-	static void LoadImage(ZipArchive* pZip, std::string file, gr_surface* source);
-	static void CheckAndScaleImage(gr_surface source, gr_surface* destination, int retain_aspect);
 };
 
 class FontResource : public Resource
@@ -58,7 +57,8 @@ protected:
 class ImageResource : public Resource
 {
 public:
-	ImageResource(xml_node<>* node, ZipArchive* pZip);
+	// The surface is filled in once the loader has run
+	ImageResource(xml_node<>* node, ZipArchive* pZip, ImageLoader* loader);
 	virtual ~ImageResource();
 
 public:
@@ -73,9 +73,12 @@ protected:
 class AnimationResource : public Resource
 {
 public:
-	AnimationResource(xml_node<>* node, ZipArchive* pZip);
+	// The frames are filled in once the loader has run, call FinishLoading() afterwards
+	AnimationResource(xml_node<>* node, ZipArchive* pZip, ImageLoader* loader);
 	virtual ~AnimationResource();
 
+	void FinishLoading();
+
 public:
 	gr_surface GetResource() { return (!this || mSurfaces.empty()) ? NULL : mSurfaces.at(0); }
 	gr_surface GetResource(int entry) { return (!this || mSurfaces.empty()) ? NULL : mSurfaces.at(entry); }
@@ -104,6 +107,9 @@ private:
 	std::vector<FontResource*> mFonts;
 	std::vector<ImageResource*> mImages;
 	std::vector<AnimationResource*> mAnimations;
+	std::map<std::string, FontResource*> mFontsByName;
+	std::map<std::string, ImageResource*> mImagesByName;
+	std::map<std::string, AnimationResource*> mAnimationsByName;
 	std::map<std::string, std::string> mStrings;
 };
 
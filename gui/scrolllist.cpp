@@ -61,10 +61,9 @@ GUIScrollList::GUIScrollList(xml_node<>* node) : GUIObject(node)
 	// Load header text
 	// note: node can be NULL for the emergency console
 	child = node ? node->first_node("text") : NULL;
-	if (child)  mHeaderText = child->value();
-	// Simple way to check for static state
-	mLastHeaderValue = gui_parse_text(mHeaderText);
-	mHeaderIsStatic = (mLastHeaderValue == mHeaderText);
+	if (child)  mHeaderText.Parse(child->value());
+	mLastHeaderValue = mHeaderText.Expand();
+	mHeaderIsStatic = mHeaderText.IsStatic();
 
 	mHighlightColor = LoadAttrColor(FindNode(node, "highlight"), "color", &hasHighlightColor);
 
@@ -356,7 +355,7 @@ int GUIScrollList::Update(void)
 		return 0;
 
 	if (!mHeaderIsStatic) {
-		std::string newValue = gui_parse_text(mHeaderText);
+		std::string newValue = mHeaderText.Expand();
 		if (mLastHeaderValue != newValue) {
 			mLastHeaderValue = newValue;
 			mUpdate = 1;
@@ -573,7 +572,7 @@ int GUIScrollList::NotifyVarChange(const std::string& varName, const std::string
 		return 0;
 
 	if (!mHeaderIsStatic) {
-		std::string newValue = gui_parse_text(mHeaderText);
+		std::string newValue = mHeaderText.Expand();
 		if (mLastHeaderValue != newValue) {
 			mLastHeaderValue = newValue;
 			firstDisplayedItem = 0;
@@ -585,6 +584,14 @@ int GUIScrollList::NotifyVarChange(const std::string& varName, const std::string
 	return 0;
 }
 
+bool GUIScrollList::GetVariableSubscriptions(std::set<std::string>& vars)
+{
+	GUIObject::GetVariableSubscriptions(vars);
+
+	mHeaderText.GetVariables(vars);
+	return true;
+}
+
 int GUIScrollList::SetRenderPos(int x, int y, int w /* = 0 */, int h /* = 0 */)
 {
 	mRenderX = x;
@@ -416,6 +416,16 @@ int GUISliderValue::NotifyVarChange(const std::string& varName, const std::strin
 	return 0;
 }
 
+bool GUISliderValue::GetVariableSubscriptions(std::set<std::string>& vars)
+{
+	GUIObject::GetVariableSubscriptions(vars);
+
+	if (mLabel)
+		mLabel->GetVariableSubscriptions(vars);
+	vars.insert(mVariable);
+	return true;
+}
+
 void GUISliderValue::SetPageFocus(int inFocus)
 {
 	if (inFocus)
@@ -52,11 +52,10 @@ GUIText::GUIText(xml_node<>* node)
 	LoadPlacement(FindNode(node, "placement"), &mRenderX, &mRenderY, &mRenderW, &mRenderH, &mPlacement);
 
 	xml_node<>* child = FindNode(node, "text");
-	if (child)  mText = child->value();
+	if (child)  mText.Parse(child->value());
 
-	// Simple way to check for static state
-	mLastValue = gui_parse_text(mText);
-	if (mLastValue != mText)   mIsStatic = 0;
+	mLastValue = mText.Expand();
+	if (!mText.IsStatic())   mIsStatic = 0;
 
 	mFontHeight = mFont->GetHeight();
 }
@@ -70,7 +69,7 @@ int GUIText::Render(void)
 	if (mFont)
 		fontResource = mFont->GetResource();
 
-	mLastValue = gui_parse_text(mText);
+	mLastValue = mText.Expand();
 	string displayValue = mLastValue;
 
 	if (charSkip)
@@ -126,7 +125,7 @@ int GUIText::Update(void)
 	if (mIsStatic || !mVarChanged)
 		return 0;
 
-	std::string newValue = gui_parse_text(mText);
+	std::string newValue = mText.Expand();
 	if (mLastValue == newValue)
 		return 0;
 	else
@@ -142,7 +141,7 @@ int GUIText::GetCurrentBounds(int& w, int& h)
 		fontResource = mFont->GetResource();
 
 	h = mFontHeight;
-	mLastValue = gui_parse_text(mText);
+	mLastValue = mText.Expand();
 	w = gr_measureEx(mLastValue.c_str(), fontResource);
 	return 0;
 }
@@ -155,6 +154,14 @@ int GUIText::NotifyVarChange(const std::string& varName, const std::string& valu
 	return 0;
 }
 
+bool GUIText::GetVariableSubscriptions(std::set<std::string>& vars)
+{
+	GUIObject::GetVariableSubscriptions(vars);
+
+	mText.GetVariables(vars);
+	return true;
+}
+
 int GUIText::SetMaxWidth(unsigned width)
 {
 	maxWidth = width;
@@ -1,27 +1,37 @@
 # Copyright 2008 The Android Open Source Project
 #
+# The SHA-1/SHA-256 block functions are picked at run time: sha_x86.c
+# (SHA extensions) and sha_armv8.c (Crypto Extensions) build to nothing
+# on other architectures. -march=armv8-a+crypto only lets sha_armv8.c use
+# the intrinsics, the compiler never emits those instructions on its own.
+#
 LOCAL_PATH := $(call my-dir)
 
 include $(CLEAR_VARS)
 LOCAL_MODULE := libmincrypttwrp
 LOCAL_MODULE_TAGS := optional
 LOCAL_C_INCLUDES := $(commands_recovery_local_path)/libmincrypt/includes
-LOCAL_SRC_FILES := dsa_sig.c p256.c p256_ec.c p256_ecdsa.c rsa.c sha.c sha256.c
+LOCAL_SRC_FILES := dsa_sig.c p256.c p256_ec.c p256_ecdsa.c rsa.c sha.c sha256.c \
+    sha_impl.c sha_x86.c sha_armv8.c
 LOCAL_CFLAGS := -Wall -Werror
+LOCAL_CFLAGS_arm64 := -march=armv8-a+crypto
 include $(BUILD_STATIC_LIBRARY)
 
 include $(CLEAR_VARS)
 LOCAL_MODULE := libmincrypttwrp
 LOCAL_MODULE_TAGS := optional
 LOCAL_C_INCLUDES := $(commands_recovery_local_path)/libmincrypt/includes
-LOCAL_SRC_FILES := dsa_sig.c p256.c p256_ec.c p256_ecdsa.c rsa.c sha.c sha256.c
+LOCAL_SRC_FILES := dsa_sig.c p256.c p256_ec.c p256_ecdsa.c rsa.c sha.c sha256.c \
+    sha_impl.c sha_x86.c sha_armv8.c
 LOCAL_CFLAGS := -Wall -Werror
+LOCAL_CFLAGS_arm64 := -march=armv8-a+crypto
 include $(BUILD_SHARED_LIBRARY)
 
 include $(CLEAR_VARS)
 LOCAL_MODULE := libmincrypttwrp
 LOCAL_MODULE_TAGS := optional
 LOCAL_C_INCLUDES := $(commands_recovery_local_path)/libmincrypt/includes
-LOCAL_SRC_FILES := dsa_sig.c p256.c p256_ec.c p256_ecdsa.c rsa.c sha.c sha256.c
+LOCAL_SRC_FILES := dsa_sig.c p256.c p256_ec.c p256_ecdsa.c rsa.c sha.c sha256.c \
+    sha_impl.c sha_x86.c sha_armv8.c
 LOCAL_CFLAGS := -Wall -Werror
 include $(BUILD_HOST_STATIC_LIBRARY)
@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2016 TeamWin Recovery Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *	  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_CORE_INCLUDE_MINCRYPT_SHA_IMPL_H_
+#define SYSTEM_CORE_INCLUDE_MINCRYPT_SHA_IMPL_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+// Implementations of the SHA-1 and SHA-256 block functions behind
+// SHA_update() and SHA256_update().  The fastest one the CPU supports
+// is picked the first time a hash is initialized; callers only need
+// this header to compare or benchmark them.
+typedef enum {
+    SHA_IMPL_PORTABLE,
+    SHA_IMPL_SHA_NI,      // x86 SHA extensions
+    SHA_IMPL_ARMV8_CE,    // ARMv8 Crypto Extensions
+    SHA_IMPL_COUNT
+} SHA_IMPL;
+
+// Returns nonzero if the implementation is built in and the CPU runs it.
+int SHA_impl_supported(SHA_IMPL impl);
+
+// Switches SHA-1 and SHA-256 to the given implementation.  Returns 0, or
+// -1 if it isn't supported.  Contexts already in use keep working.
+int SHA_impl_set(SHA_IMPL impl);
+
+SHA_IMPL SHA_impl_get(void);
+
+const char* SHA_impl_name(SHA_IMPL impl);
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
+
+#endif  // SYSTEM_CORE_INCLUDE_MINCRYPT_SHA_IMPL_H_
@@ -28,6 +28,7 @@
 // Optimized for minimal code size.
 
 #include "mincrypt/sha.h"
+#include "sha_blocks.h"
 
 #include <stdio.h>
 #include <string.h>
@@ -35,10 +36,9 @@
 
 #define rol(bits, value) (((value) << (bits)) | ((value) >> (32 - (bits))))
 
-static void SHA1_Transform(SHA_CTX* ctx) {
+static void SHA1_Transform(uint32_t* state, const uint8_t* p) {
     uint32_t W[80];
     uint32_t A, B, C, D, E;
-    uint8_t* p = ctx->buf;
     int t;
 
     for(t = 0; t < 16; ++t) {
@@ -53,11 +53,11 @@ static void SHA1_Transform(SHA_CTX* ctx) {
         W[t] = rol(1,W[t-3] ^ W[t-8] ^ W[t-14] ^ W[t-16]);
     }
 
-    A = ctx->state[0];
-    B = ctx->state[1];
-    C = ctx->state[2];
-    D = ctx->state[3];
-    E = ctx->state[4];
+    A = state[0];
+    B = state[1];
+    C = state[2];
+    D = state[3];
+    E = state[4];
 
     for(t = 0; t < 80; t++) {
         uint32_t tmp = rol(5,A) + E + W[t];
@@ -78,11 +78,18 @@ static void SHA1_Transform(SHA_CTX* ctx) {
         A = tmp;
     }
 
-    ctx->state[0] += A;
-    ctx->state[1] += B;
-    ctx->state[2] += C;
-    ctx->state[3] += D;
-    ctx->state[4] += E;
+    state[0] += A;
+    state[1] += B;
+    state[2] += C;
+    state[3] += D;
+    state[4] += E;
+}
+
+void SHA1_blocks_portable(uint32_t* state, const uint8_t* data, size_t blocks) {
+    while (blocks--) {
+        SHA1_Transform(state, data);
+        data += 64;
+    }
 }
 
 static const HASH_VTAB SHA_VTAB = {
@@ -94,6 +101,7 @@ static const HASH_VTAB SHA_VTAB = {
 };
 
 void SHA_init(SHA_CTX* ctx) {
+    SHA_impl_init();
     ctx->f = &SHA_VTAB;
     ctx->state[0] = 0x67452301;
     ctx->state[1] = 0xEFCDAB89;
@@ -110,13 +118,24 @@ void SHA_update(SHA_CTX* ctx, const void* data, int len) {
 
     ctx->count += len;
 
-    while (len--) {
-        ctx->buf[i++] = *p++;
-        if (i == 64) {
-            SHA1_Transform(ctx);
-            i = 0;
-        }
+    // top up a partial block first, then hash whole blocks straight from
+    // the caller's buffer
+    if (i) {
+        int n = 64 - i;
+        if (n > len) n = len;
+        memcpy(ctx->buf + i, p, n);
+        i += n;
+        p += n;
+        len -= n;
+        if (i < 64) return;
+        SHA1_blocks(ctx->state, ctx->buf, 1);
+    }
+    if (len >= 64) {
+        SHA1_blocks(ctx->state, p, len / 64);
+        p += len & ~63;
+        len &= 63;
     }
+    memcpy(ctx->buf, p, len);
 }
 
 
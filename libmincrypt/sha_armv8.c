@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2016 TeamWin Recovery Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *	  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// SHA-1 and SHA-256 block functions using the ARMv8 Crypto Extensions.
+// Only called once sha_impl.c has checked the CPU supports them.
+
+#include "sha_blocks.h"
+
+#if defined(SHA_HAVE_ARMV8_CE)
+
+#include <arm_neon.h>
+
+void SHA1_blocks_armv8_ce(uint32_t* state, const uint8_t* data, size_t blocks) {
+    static const uint32_t K[4] = { 0x5A827999, 0x6ED9EBA1, 0x8F1BBCDC, 0xCA62C1D6 };
+    uint32x4_t abcd, abcd_save, tmp;
+    uint32x4_t W[20];
+    uint32_t e, e_next, e_save;
+    int i;
+
+    abcd = vld1q_u32(state);
+    e = state[4];
+
+    while (blocks--) {
+        abcd_save = abcd;
+        e_save = e;
+
+        for (i = 0; i < 4; ++i)
+            W[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 16 * i)));
+        for (; i < 20; ++i)
+            W[i] = vsha1su1q_u32(vsha1su0q_u32(W[i - 4], W[i - 3], W[i - 2]), W[i - 1]);
+
+        for (i = 0; i < 20; ++i) {
+            tmp = vaddq_u32(W[i], vdupq_n_u32(K[i / 5]));
+            e_next = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+            if (i < 5)
+                abcd = vsha1cq_u32(abcd, e, tmp);
+            else if (i >= 10 && i < 15)
+                abcd = vsha1mq_u32(abcd, e, tmp);
+            else
+                abcd = vsha1pq_u32(abcd, e, tmp);
+            e = e_next;
+        }
+
+        abcd = vaddq_u32(abcd, abcd_save);
+        e += e_save;
+        data += 64;
+    }
+
+    vst1q_u32(state, abcd);
+    state[4] = e;
+}
+
+void SHA256_blocks_armv8_ce(uint32_t* state, const uint8_t* data, size_t blocks) {
+    uint32x4_t state0, state1, abef_save, cdgh_save, msg, tmp;
+    uint32x4_t W[16];
+    int i;
+
+    state0 = vld1q_u32(&state[0]);
+    state1 = vld1q_u32(&state[4]);
+
+    while (blocks--) {
+        abef_save = state0;
+        cdgh_save = state1;
+
+        for (i = 0; i < 4; ++i)
+            W[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 16 * i)));
+        for (; i < 16; ++i)
+            W[i] = vsha256su1q_u32(vsha256su0q_u32(W[i - 4], W[i - 3]), W[i - 2], W[i - 1]);
+
+        for (i = 0; i < 16; ++i) {
+            msg = vaddq_u32(W[i], vld1q_u32(&SHA256_K[4 * i]));
+            tmp = state0;
+            state0 = vsha256hq_u32(state0, state1, msg);
+            state1 = vsha256h2q_u32(state1, tmp, msg);
+        }
+
+        state0 = vaddq_u32(state0, abef_save);
+        state1 = vaddq_u32(state1, cdgh_save);
+        data += 64;
+    }
+
+    vst1q_u32(&state[0], state0);
+    vst1q_u32(&state[4], state1);
+}
+
+#endif  // SHA_HAVE_ARMV8_CE
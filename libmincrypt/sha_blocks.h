@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2016 TeamWin Recovery Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *	  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBMINCRYPT_SHA_BLOCKS_H_
+#define LIBMINCRYPT_SHA_BLOCKS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Runs the compression function over 'blocks' consecutive 64 byte
+// blocks of 'data', updating the 5 (SHA-1) or 8 (SHA-256) word state.
+typedef void (*SHA_BLOCKS_FN)(uint32_t* state, const uint8_t* data, size_t blocks);
+
+// Picks the implementations on first use, see sha_impl.c.
+extern SHA_BLOCKS_FN SHA1_blocks;
+extern SHA_BLOCKS_FN SHA256_blocks;
+void SHA_impl_init(void);
+
+extern const uint32_t SHA256_K[64];
+
+void SHA1_blocks_portable(uint32_t* state, const uint8_t* data, size_t blocks);
+void SHA256_blocks_portable(uint32_t* state, const uint8_t* data, size_t blocks);
+
+// target("sha") needs GCC 4.9 or clang
+#if (defined(__i386__) || defined(__x86_64__)) && \
+    (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define SHA_HAVE_SHA_NI 1
+void SHA1_blocks_sha_ni(uint32_t* state, const uint8_t* data, size_t blocks);
+void SHA256_blocks_sha_ni(uint32_t* state, const uint8_t* data, size_t blocks);
+#endif
+
+// The intrinsics need the crypto extension enabled for the whole file,
+// see LOCAL_CFLAGS_arm64 in Android.mk.
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRYPTO)
+#define SHA_HAVE_ARMV8_CE 1
+void SHA1_blocks_armv8_ce(uint32_t* state, const uint8_t* data, size_t blocks);
+void SHA256_blocks_armv8_ce(uint32_t* state, const uint8_t* data, size_t blocks);
+#endif
+
+#endif  // LIBMINCRYPT_SHA_BLOCKS_H_
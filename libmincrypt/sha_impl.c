@@ -0,0 +1,131 @@
+/*
+ * Copyright (C) 2016 TeamWin Recovery Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *	  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Picks the SHA-1/SHA-256 block functions for the CPU at run time.
+
+#include "mincrypt/sha_impl.h"
+#include "sha_blocks.h"
+
+#include <pthread.h>
+
+#if defined(SHA_HAVE_SHA_NI)
+#include <cpuid.h>
+#endif
+
+#if defined(SHA_HAVE_ARMV8_CE)
+#include <sys/auxv.h>
+#ifndef HWCAP_SHA1
+#define HWCAP_SHA1 (1 << 5)
+#endif
+#ifndef HWCAP_SHA2
+#define HWCAP_SHA2 (1 << 6)
+#endif
+#endif
+
+SHA_BLOCKS_FN SHA1_blocks = SHA1_blocks_portable;
+SHA_BLOCKS_FN SHA256_blocks = SHA256_blocks_portable;
+
+static SHA_IMPL current_impl = SHA_IMPL_PORTABLE;
+static pthread_once_t impl_once = PTHREAD_ONCE_INIT;
+
+static const char* const impl_names[SHA_IMPL_COUNT] = {
+    "portable",
+    "sha-ni",
+    "armv8-ce",
+};
+
+int SHA_impl_supported(SHA_IMPL impl) {
+    switch (impl) {
+        case SHA_IMPL_PORTABLE:
+            return 1;
+#if defined(SHA_HAVE_SHA_NI)
+        case SHA_IMPL_SHA_NI: {
+            unsigned int eax, ebx, ecx, edx;
+            // SSSE3 and SSE4.1 are used to shuffle the state around
+            if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) ||
+                    !(ecx & bit_SSSE3) || !(ecx & bit_SSE4_1))
+                return 0;
+            if (__get_cpuid_max(0, NULL) < 7)
+                return 0;
+            __cpuid_count(7, 0, eax, ebx, ecx, edx);
+            return (ebx & (1 << 29)) != 0;
+        }
+#endif
+#if defined(SHA_HAVE_ARMV8_CE)
+        case SHA_IMPL_ARMV8_CE: {
+            unsigned long hwcap = getauxval(AT_HWCAP);
+            return (hwcap & HWCAP_SHA1) && (hwcap & HWCAP_SHA2);
+        }
+#endif
+        default:
+            return 0;
+    }
+}
+
+static void use_impl(SHA_IMPL impl) {
+    switch (impl) {
+#if defined(SHA_HAVE_SHA_NI)
+        case SHA_IMPL_SHA_NI:
+            SHA1_blocks = SHA1_blocks_sha_ni;
+            SHA256_blocks = SHA256_blocks_sha_ni;
+            break;
+#endif
+#if defined(SHA_HAVE_ARMV8_CE)
+        case SHA_IMPL_ARMV8_CE:
+            SHA1_blocks = SHA1_blocks_armv8_ce;
+            SHA256_blocks = SHA256_blocks_armv8_ce;
+            break;
+#endif
+        default:
+            SHA1_blocks = SHA1_blocks_portable;
+            SHA256_blocks = SHA256_blocks_portable;
+            break;
+    }
+    current_impl = impl;
+}
+
+static void pick_impl(void) {
+    int impl;
+    // the last supported one is the fastest
+    for (impl = SHA_IMPL_COUNT - 1; impl > SHA_IMPL_PORTABLE; --impl) {
+        if (SHA_impl_supported((SHA_IMPL) impl))
+            break;
+    }
+    use_impl((SHA_IMPL) impl);
+}
+
+void SHA_impl_init(void) {
+    pthread_once(&impl_once, pick_impl);
+}
+
+int SHA_impl_set(SHA_IMPL impl) {
+    if (!SHA_impl_supported(impl))
+        return -1;
+    SHA_impl_init();
+    use_impl(impl);
+    return 0;
+}
+
+SHA_IMPL SHA_impl_get(void) {
+    SHA_impl_init();
+    return current_impl;
+}
+
+const char* SHA_impl_name(SHA_IMPL impl) {
+    if ((unsigned) impl >= SHA_IMPL_COUNT)
+        return "unknown";
+    return impl_names[impl];
+}
@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2016 TeamWin Recovery Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *	  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// SHA-1 and SHA-256 block functions using the x86 SHA extensions.  Only
+// called once sha_impl.c has checked the CPU supports them.
+
+#include "sha_blocks.h"
+
+#if defined(SHA_HAVE_SHA_NI)
+
+#include <immintrin.h>
+
+#define SHA_NI_TARGET __attribute__((target("sha,sse4.1,ssse3")))
+
+#define SHA1_ROUNDS(first, last, func) \
+    for (i = first; i < last; ++i) { \
+        prev = abcd; \
+        abcd = _mm_sha1rnds4_epu32(abcd, e, func); \
+        if (i < 19) e = _mm_sha1nexte_epu32(prev, W[i + 1]); \
+    }
+
+SHA_NI_TARGET
+void SHA1_blocks_sha_ni(uint32_t* state, const uint8_t* data, size_t blocks) {
+    const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+    __m128i abcd, e0, abcd_save, e, prev;
+    __m128i W[20];
+    int i;
+
+    abcd = _mm_loadu_si128((const __m128i*) state);
+    abcd = _mm_shuffle_epi32(abcd, 0x1B);
+    e0 = _mm_set_epi32(state[4], 0, 0, 0);
+
+    while (blocks--) {
+        abcd_save = abcd;
+
+        for (i = 0; i < 4; ++i)
+            W[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (data + 16 * i)), mask);
+        for (; i < 20; ++i)
+            W[i] = _mm_sha1msg2_epu32(_mm_xor_si128(_mm_sha1msg1_epu32(W[i - 4], W[i - 3]),
+                    W[i - 2]), W[i - 1]);
+
+        e = _mm_add_epi32(e0, W[0]);
+        prev = abcd;
+        SHA1_ROUNDS(0, 5, 0);
+        SHA1_ROUNDS(5, 10, 1);
+        SHA1_ROUNDS(10, 15, 2);
+        SHA1_ROUNDS(15, 20, 3);
+
+        e0 = _mm_sha1nexte_epu32(prev, e0);
+        abcd = _mm_add_epi32(abcd, abcd_save);
+        data += 64;
+    }
+
+    abcd = _mm_shuffle_epi32(abcd, 0x1B);
+    _mm_storeu_si128((__m128i*) state, abcd);
+    state[4] = _mm_extract_epi32(e0, 3);
+}
+
+SHA_NI_TARGET
+void SHA256_blocks_sha_ni(uint32_t* state, const uint8_t* data, size_t blocks) {
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i state0, state1, abef_save, cdgh_save, msg, tmp;
+    __m128i W[16];
+    int i;
+
+    // the instructions want the state as ABEF and CDGH
+    tmp = _mm_loadu_si128((const __m128i*) &state[0]);
+    state1 = _mm_loadu_si128((const __m128i*) &state[4]);
+    tmp = _mm_shuffle_epi32(tmp, 0xB1);
+    state1 = _mm_shuffle_epi32(state1, 0x1B);
+    state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+    while (blocks--) {
+        abef_save = state0;
+        cdgh_save = state1;
+
+        for (i = 0; i < 4; ++i)
+            W[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (data + 16 * i)), mask);
+        for (; i < 16; ++i)
+            W[i] = _mm_sha256msg2_epu32(_mm_add_epi32(_mm_sha256msg1_epu32(W[i - 4], W[i - 3]),
+                    _mm_alignr_epi8(W[i - 1], W[i - 2], 4)), W[i - 1]);
+
+        for (i = 0; i < 16; ++i) {
+            msg = _mm_add_epi32(W[i], _mm_loadu_si128((const __m128i*) &SHA256_K[4 * i]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            msg = _mm_shuffle_epi32(msg, 0x0E);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+        }
+
+        state0 = _mm_add_epi32(state0, abef_save);
+        state1 = _mm_add_epi32(state1, cdgh_save);
+        data += 64;
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B);
+    state1 = _mm_shuffle_epi32(state1, 0xB1);
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+    state1 = _mm_alignr_epi8(state1, tmp, 8);
+    _mm_storeu_si128((__m128i*) &state[0], state0);
+    _mm_storeu_si128((__m128i*) &state[4], state1);
+}
+
+#endif  // SHA_HAVE_SHA_NI
@@ -98,6 +98,7 @@ struct ev {
 static struct pollfd ev_fds[MAX_DEVICES];
 static struct ev evs[MAX_DEVICES];
 static unsigned ev_count = 0;
+static unsigned ev_generation = 0;
 static struct timeval lastInputStat;
 static unsigned long lastInputMTime;
 static int has_mouse = 0;
@@ -310,6 +311,7 @@ int ev_init(void)
     int fd;
 
     has_mouse = 0;
+    ev_generation++;
 
 	dir = opendir("/dev/input");
     if(dir != 0) {
@@ -812,6 +814,18 @@ int ev_get(struct input_event *ev, int timeout_ms)
     return -2;
 }
 
+int ev_get_fd(unsigned index)
+{
+    if (index >= ev_count)
+        return -1;
+    return ev_fds[index].fd;
+}
+
+unsigned ev_get_generation(void)
+{
+    return ev_generation;
+}
+
 int ev_wait(int timeout)
 {
     return -1;
@@ -17,6 +17,8 @@
 #ifndef _MINUI_H_
 #define _MINUI_H_
 
+#include <stddef.h>
+
 typedef void* gr_surface;
 typedef unsigned short gr_pixel;
 
@@ -100,10 +102,19 @@ void ev_exit(void);
 int ev_get(struct input_event *ev, int timeout_ms);
 int ev_has_mouse(void);
 
+// Access to the opened input device fds so callers can wait on them with
+// their own poll/epoll set. The generation changes whenever the devices are
+// reopened, at which point previously returned fds are no longer valid.
+int ev_get_fd(unsigned index);
+unsigned ev_get_generation(void);
+
 // Resources
 
 // Returns 0 if no error, else negative.
 int res_create_surface(const char* name, gr_surface* pSurface);
+int res_create_surface_mem(const unsigned char* data, size_t length, gr_surface* pSurface);
+int res_write_surface(gr_surface surface, int fd);
+int res_read_surface(int fd, gr_surface* pSurface);
 void res_free_surface(gr_surface surface);
 int res_scale_surface(gr_surface source, gr_surface* destination, float scale_w, float scale_h);
 
@@ -14,7 +14,9 @@
  * limitations under the License.
  */
 
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <fcntl.h>
@@ -262,53 +264,26 @@ int res_create_surface_png(const char* name, gr_surface* pSurface) {
     return result;
 }
 
-int res_create_surface_jpg(const char* name, gr_surface* pSurface) {
+// Decode the image attached to 'cinfo' into a new RGBX surface.
+static int decode_jpg(j_decompress_ptr cinfo, gr_surface* pSurface) {
     GGLSurface* surface = NULL;
-    int result = 0;
-    struct jpeg_decompress_struct cinfo;
-    struct jpeg_error_mgr jerr;
-
-    FILE* fp = fopen(name, "rb");
-    if (fp == NULL) {
-        char resPath[256];
-#ifdef TW_HAS_LANDSCAPE
-        if(gr_get_rotation()%180 != 0)
-            snprintf(resPath, sizeof(resPath), TWRES "landscape/images/%s", name);
-        else
-#endif
-        {
-            snprintf(resPath, sizeof(resPath), TWRES "images/%s", name);
-        }
-
-        fp = fopen(resPath, "rb");
-        if (fp == NULL) {
-            result = -1;
-            goto exit;
-        }
-    }
-
-    cinfo.err = jpeg_std_error(&jerr);
-    jpeg_create_decompress(&cinfo);
-
-    /* Specify data source for decompression */
-    jpeg_stdio_src(&cinfo, fp);
 
     /* Read file header, set default decompression parameters */
-    if (jpeg_read_header(&cinfo, TRUE) != JPEG_HEADER_OK)
-        goto exit;
+    if (jpeg_read_header(cinfo, TRUE) != JPEG_HEADER_OK)
+        return -2;
 
     /* Start decompressor */
-    (void) jpeg_start_decompress(&cinfo);
+    (void) jpeg_start_decompress(cinfo);
 
-    size_t width = cinfo.image_width;
-    size_t height = cinfo.image_height;
+    size_t width = cinfo->image_width;
+    size_t height = cinfo->image_height;
     size_t stride = 4 * width;
     size_t pixelSize = stride * height;
 
     surface = malloc(sizeof(GGLSurface) + pixelSize);
     if (surface == NULL) {
-        result = -8;
-        goto exit;
+        jpeg_abort_decompress(cinfo);
+        return -8;
     }
 
     unsigned char* pData = (unsigned char*) (surface + 1);
@@ -322,7 +297,7 @@ int res_create_surface_jpg(const char* name, gr_surface* pSurface) {
     int y;
     for (y = 0; y < (int) height; ++y) {
         unsigned char* pRow = pData + y * stride;
-        jpeg_read_scanlines(&cinfo, &pRow, 1);
+        jpeg_read_scanlines(cinfo, &pRow, 1);
 
         int x;
         for(x = width - 1; x >= 0; x--) {
@@ -338,25 +313,205 @@ int res_create_surface_jpg(const char* name, gr_surface* pSurface) {
             pRow[dx + 3] = a;
         }
     }
+    (void) jpeg_finish_decompress(cinfo);
+
     *pSurface = (gr_surface) surface;
+    return 0;
+}
 
-exit:
-    if (fp != NULL)
-    {
-        if (surface)
+int res_create_surface_jpg(const char* name, gr_surface* pSurface) {
+    int result = 0;
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+
+    *pSurface = NULL;
+
+    FILE* fp = fopen(name, "rb");
+    if (fp == NULL) {
+        char resPath[256];
+#ifdef TW_HAS_LANDSCAPE
+        if(gr_get_rotation()%180 != 0)
+            snprintf(resPath, sizeof(resPath), TWRES "landscape/images/%s", name);
+        else
+#endif
         {
-            (void) jpeg_finish_decompress(&cinfo);
-            if (result < 0)
-            {
-                free(surface);
-            }
+            snprintf(resPath, sizeof(resPath), TWRES "images/%s", name);
         }
-        jpeg_destroy_decompress(&cinfo);
-        fclose(fp);
+
+        fp = fopen(resPath, "rb");
+        if (fp == NULL)
+            return -1;
     }
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_decompress(&cinfo);
+
+    /* Specify data source for decompression */
+    jpeg_stdio_src(&cinfo, fp);
+
+    result = decode_jpg(&cinfo, pSurface);
+
+    jpeg_destroy_decompress(&cinfo);
+    fclose(fp);
     return result;
 }
 
+// In-memory decoding, used for theme images that are read straight out
+// of a mapped zip or file instead of going through a temporary file.
+
+typedef struct {
+    const unsigned char* data;
+    size_t length;
+    size_t offset;
+} png_mem_source;
+
+static void png_read_mem(png_structp png_ptr, png_bytep out, png_size_t count) {
+    png_mem_source* src = (png_mem_source*) png_get_io_ptr(png_ptr);
+
+    if (count > src->length - src->offset)
+        png_error(png_ptr, "read past end of data");
+    memcpy(out, src->data + src->offset, count);
+    src->offset += count;
+}
+
+static int res_create_surface_png_mem(const unsigned char* data, size_t length, gr_surface* pSurface) {
+    GGLSurface* volatile surface = NULL;
+    unsigned char* volatile p_row = NULL;
+    int result = 0;
+    png_structp png_ptr = NULL;
+    png_infop info_ptr = NULL;
+    png_uint_32 width, height;
+    png_byte channels;
+    int color_type, bit_depth;
+    png_mem_source src;
+
+    if (length < 8 || png_sig_cmp((png_bytep) data, 0, 8))
+        return -3;
+
+    png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (!png_ptr)
+        return -4;
+
+    info_ptr = png_create_info_struct(png_ptr);
+    if (!info_ptr) {
+        result = -5;
+        goto exit;
+    }
+
+    if (setjmp(png_jmpbuf(png_ptr))) {
+        result = -6;
+        goto exit;
+    }
+
+    src.data = data;
+    src.length = length;
+    src.offset = 0;
+    png_set_read_fn(png_ptr, &src, png_read_mem);
+    png_read_info(png_ptr, info_ptr);
+
+    png_get_IHDR(png_ptr, info_ptr, &width, &height, &bit_depth,
+            &color_type, NULL, NULL, NULL);
+    if (color_type == PNG_COLOR_TYPE_PALETTE)
+        png_set_palette_to_rgb(png_ptr);
+    png_read_update_info(png_ptr, info_ptr);
+    channels = png_get_channels(png_ptr, info_ptr);
+
+    surface = init_display_surface(width, height);
+    p_row = malloc(width * 4);
+    if (surface == NULL || p_row == NULL) {
+        result = -8;
+        goto exit;
+    }
+
+    unsigned int y;
+    for (y = 0; y < height; ++y) {
+        png_read_row(png_ptr, p_row, NULL);
+        transform_rgb_to_draw(p_row, surface->data + y * width * 4, channels, width);
+    }
+
+    if (channels == 3)
+        surface->format = GGL_PIXEL_FORMAT_RGBX_8888;
+    else
+        surface->format = GGL_PIXEL_FORMAT_RGBA_8888;
+
+    *pSurface = (gr_surface) surface;
+
+  exit:
+    free(p_row);
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+    if (result < 0 && surface != NULL) free(surface);
+    return result;
+}
+
+static void jpg_mem_init_source(j_decompress_ptr cinfo) {
+}
+
+static boolean jpg_mem_fill_input_buffer(j_decompress_ptr cinfo) {
+    // Out of data; insert a fake EOI marker like the stdio source
+    // does for truncated files.
+    static const JOCTET eoi[2] = { (JOCTET) 0xFF, (JOCTET) JPEG_EOI };
+
+    cinfo->src->next_input_byte = eoi;
+    cinfo->src->bytes_in_buffer = sizeof(eoi);
+    return TRUE;
+}
+
+static void jpg_mem_skip_input_data(j_decompress_ptr cinfo, long num_bytes) {
+    struct jpeg_source_mgr* src = cinfo->src;
+
+    if (num_bytes <= 0)
+        return;
+    if ((size_t) num_bytes > src->bytes_in_buffer) {
+        jpg_mem_fill_input_buffer(cinfo);
+    } else {
+        src->next_input_byte += num_bytes;
+        src->bytes_in_buffer -= num_bytes;
+    }
+}
+
+static void jpg_mem_term_source(j_decompress_ptr cinfo) {
+}
+
+static int res_create_surface_jpg_mem(const unsigned char* data, size_t length, gr_surface* pSurface) {
+    int result;
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    struct jpeg_source_mgr src;
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_decompress(&cinfo);
+
+    src.next_input_byte = data;
+    src.bytes_in_buffer = length;
+    src.init_source = jpg_mem_init_source;
+    src.fill_input_buffer = jpg_mem_fill_input_buffer;
+    src.skip_input_data = jpg_mem_skip_input_data;
+    src.resync_to_restart = jpeg_resync_to_restart;
+    src.term_source = jpg_mem_term_source;
+    cinfo.src = &src;
+
+    result = decode_jpg(&cinfo, pSurface);
+
+    jpeg_destroy_decompress(&cinfo);
+    return result;
+}
+
+int res_create_surface_mem(const unsigned char* data, size_t length, gr_surface* pSurface) {
+    *pSurface = NULL;
+
+    if (!data || length < 8)
+        return -1;
+
+    if (!png_sig_cmp((png_bytep) data, 0, 8))
+        return res_create_surface_png_mem(data, length, pSurface);
+
+    // JPEG files start with an SOI marker
+    if (data[0] == 0xFF && data[1] == 0xD8)
+        return res_create_surface_jpg_mem(data, length, pSurface);
+
+    return -3;
+}
+
 int res_create_surface(const char* name, gr_surface* pSurface) {
     int ret;
 
@@ -379,6 +534,86 @@ void res_free_surface(gr_surface surface) {
     }
 }
 
+// Surfaces written by res_write_surface() start with this header,
+// followed by stride * height 32-bit pixels.
+#define SURFACE_FILE_MAGIC  0x31435354 /* "TSC1" */
+
+typedef struct {
+    uint32_t magic;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint32_t format;
+} surface_file_header;
+
+int res_write_surface(gr_surface surface, int fd) {
+    GGLSurface* pSurface = (GGLSurface*) surface;
+    surface_file_header header;
+
+    if (!pSurface)
+        return -1;
+
+    header.magic = SURFACE_FILE_MAGIC;
+    header.width = pSurface->width;
+    header.height = pSurface->height;
+    header.stride = pSurface->stride;
+    header.format = pSurface->format;
+
+    if (write(fd, &header, sizeof(header)) != (ssize_t) sizeof(header))
+        return -1;
+
+    const unsigned char* data = (const unsigned char*) pSurface->data;
+    size_t left = (size_t) header.stride * header.height * 4;
+    while (left > 0) {
+        ssize_t ret = write(fd, data, left);
+        if (ret <= 0)
+            return -1;
+        data += ret;
+        left -= ret;
+    }
+    return 0;
+}
+
+int res_read_surface(int fd, gr_surface* pSurface) {
+    surface_file_header header;
+    GGLSurface* surface;
+
+    *pSurface = NULL;
+
+    if (read(fd, &header, sizeof(header)) != (ssize_t) sizeof(header))
+        return -1;
+    if (header.magic != SURFACE_FILE_MAGIC || header.width == 0 || header.height == 0
+            || header.width > 16384 || header.height > 16384
+            || header.stride < header.width || header.stride > 16384)
+        return -2;
+
+    size_t size = (size_t) header.stride * header.height * 4;
+    surface = malloc_surface(size);
+    if (surface == NULL)
+        return -8;
+
+    surface->version = sizeof(GGLSurface);
+    surface->width = header.width;
+    surface->height = header.height;
+    surface->stride = header.stride;
+    surface->format = header.format;
+
+    unsigned char* data = (unsigned char*) surface->data;
+    size_t left = size;
+    while (left > 0) {
+        ssize_t ret = read(fd, data, left);
+        if (ret <= 0) {
+            free(surface);
+            return -1;
+        }
+        data += ret;
+        left -= ret;
+    }
+
+    *pSurface = (gr_surface) surface;
+    return 0;
+}
+
 // Scale image function
 int res_scale_surface(gr_surface source, gr_surface* destination, float scale_w, float scale_h) {
     GGLContext *gl = NULL;
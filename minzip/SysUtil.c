@@ -204,6 +204,12 @@ int sysMapFile(const char* fn, MemMapping* pMap)
     return 0;
 }
 
+int sysMapFd(int fd, MemMapping* pMap)
+{
+    memset(pMap, 0, sizeof(*pMap));
+    return sysMapFD(fd, pMap);
+}
+
 /*
  * Release a memory mapping.
  */
@@ -38,6 +38,14 @@ typedef struct MemMapping {
  */
 int sysMapFile(const char* fn, MemMapping* pMap);
 
+/*
+ * Map the regular file open on "fd" from its current offset to its end,
+ * like sysMapFile() does for a file name.  The caller keeps "fd".
+ *
+ * On success, "pMap" is filled in, and zero is returned.
+ */
+int sysMapFd(int fd, MemMapping* pMap);
+
 /*
  * Release the pages associated with a shared memory segment.
  *
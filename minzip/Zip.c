@@ -9,6 +9,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdint.h>     // for uintptr_t
 #include <stdlib.h>
 #include <sys/stat.h>   // for S_ISLNK()
@@ -471,6 +472,171 @@ void mzCloseZipArchive(ZipArchive* pArchive)
     pArchive->pEntries = NULL;
 }
 
+/*
+ * The central directory as mzWriteZipDirectory() hands it to another
+ * process: a header, then a record for every entry in the order of
+ * pEntries.  File names stay in the archive and are stored as offsets.
+ */
+#define ZIP_DIRECTORY_MAGIC 0x315a444d  // "MDZ1"
+
+typedef struct {
+    uint32_t magic;
+    uint32_t numEntries;
+    uint64_t length;        // of the archive
+} ZipDirectoryHeader;
+
+typedef struct {
+    uint32_t fileNameOffset;
+    uint32_t fileNameLen;
+    uint32_t offset;
+    uint32_t compLen;
+    uint32_t uncompLen;
+    uint32_t compression;
+    uint32_t modTime;
+    uint32_t crc32;
+    uint32_t versionMadeBy;
+    uint32_t externalFileAttributes;
+} ZipDirectoryRecord;
+
+static bool writeFully(int fd, const void *data, size_t len)
+{
+    const char *p = (const char *) data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool preadFully(int fd, void *data, size_t len, off_t offset)
+{
+    char *p = (char *) data;
+    while (len > 0) {
+        ssize_t n = pread(fd, p, len, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return true;
+}
+
+int mzWriteZipDirectory(const ZipArchive* pArchive, int fd)
+{
+    ZipDirectoryHeader header;
+    ZipDirectoryRecord *records;
+    unsigned int i;
+    int err = 0;
+
+    records = (ZipDirectoryRecord*) calloc(pArchive->numEntries,
+            sizeof(ZipDirectoryRecord));
+    if (records == NULL)
+        return ENOMEM;
+
+    header.magic = ZIP_DIRECTORY_MAGIC;
+    header.numEntries = pArchive->numEntries;
+    header.length = pArchive->length;
+    for (i = 0; i < pArchive->numEntries; i++) {
+        const ZipEntry *pEntry = &pArchive->pEntries[i];
+        ZipDirectoryRecord *r = &records[i];
+
+        r->fileNameOffset = (const unsigned char*) pEntry->fileName - pArchive->addr;
+        r->fileNameLen = pEntry->fileNameLen;
+        r->offset = pEntry->offset;
+        r->compLen = pEntry->compLen;
+        r->uncompLen = pEntry->uncompLen;
+        r->compression = pEntry->compression;
+        r->modTime = pEntry->modTime;
+        r->crc32 = pEntry->crc32;
+        r->versionMadeBy = pEntry->versionMadeBy;
+        r->externalFileAttributes = pEntry->externalFileAttributes;
+    }
+
+    errno = 0;
+    if (!writeFully(fd, &header, sizeof(header)) ||
+            !writeFully(fd, records, pArchive->numEntries * sizeof(ZipDirectoryRecord))) {
+        err = errno ? errno : EIO;
+        LOGW("Writing the Zip directory failed: %s\n", strerror(err));
+    }
+    free(records);
+    return err;
+}
+
+int mzOpenZipArchiveDirectory(unsigned char* addr, size_t length, int fd,
+        ZipArchive* pArchive)
+{
+    ZipDirectoryHeader header;
+    ZipDirectoryRecord *records = NULL;
+    unsigned int i;
+    int err = EINVAL;
+
+    memset(pArchive, 0, sizeof(*pArchive));
+    pArchive->addr = addr;
+    pArchive->length = length;
+
+    if (!preadFully(fd, &header, sizeof(header), 0)) {
+        LOGW("Reading the Zip directory failed\n");
+        goto bail;
+    }
+    // The entry count comes from a 16-bit field in the EOCD
+    if (header.magic != ZIP_DIRECTORY_MAGIC || header.length != length ||
+            header.numEntries == 0 || header.numEntries > 0xffff) {
+        LOGW("Zip directory does not match the archive\n");
+        goto bail;
+    }
+
+    records = (ZipDirectoryRecord*) malloc(header.numEntries * sizeof(ZipDirectoryRecord));
+    pArchive->numEntries = header.numEntries;
+    pArchive->pEntries = (ZipEntry*) calloc(header.numEntries, sizeof(ZipEntry));
+    pArchive->pHash = mzHashTableCreate(mzHashSize(header.numEntries), NULL);
+    if (records == NULL || pArchive->pEntries == NULL || pArchive->pHash == NULL) {
+        err = ENOMEM;
+        goto bail;
+    }
+    if (!preadFully(fd, records, header.numEntries * sizeof(ZipDirectoryRecord),
+            sizeof(header))) {
+        LOGW("Reading the Zip directory failed\n");
+        goto bail;
+    }
+
+    for (i = 0; i < header.numEntries; i++) {
+        const ZipDirectoryRecord *r = &records[i];
+        ZipEntry *pEntry = &pArchive->pEntries[i];
+
+        if ((uint64_t) r->fileNameOffset + r->fileNameLen > length ||
+                (uint64_t) r->offset + r->compLen > length) {
+            LOGW("Zip directory entry %d runs off the end\n", i);
+            goto bail;
+        }
+        pEntry->fileNameLen = r->fileNameLen;
+        pEntry->fileName = (const char*) addr + r->fileNameOffset;
+        pEntry->offset = r->offset;
+        pEntry->compLen = r->compLen;
+        pEntry->uncompLen = r->uncompLen;
+        pEntry->compression = r->compression;
+        pEntry->modTime = r->modTime;
+        pEntry->crc32 = r->crc32;
+        pEntry->versionMadeBy = r->versionMadeBy;
+        pEntry->externalFileAttributes = r->externalFileAttributes;
+        addEntryToHashTable(pArchive->pHash, pEntry);
+    }
+    err = 0;
+
+bail:
+    free(records);
+    if (err != 0)
+        mzCloseZipArchive(pArchive);
+    return err;
+}
+
 /*
  * Find a matching entry.
  *
@@ -505,13 +671,14 @@ static bool processStoredEntry(const ZipArchive *pArchive,
     return processFunction(pArchive->addr + pEntry->offset, pEntry->uncompLen, cookie);
 }
 
-static bool processDeflatedEntry(const ZipArchive *pArchive,
+/* Inflate a DEFLATED entry through processFunction, procBufLen bytes
+ * at a time.
+ */
+static bool processDeflatedEntryBuf(const ZipArchive *pArchive,
     const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
-    void *cookie)
+    void *cookie, unsigned char *procBuf, size_t procBufLen)
 {
     long result = -1;
-    unsigned char readBuf[32 * 1024];
-    unsigned char procBuf[32 * 1024];
     z_stream zstream;
     int zerr;
     long compRemaining;
@@ -528,7 +695,7 @@ static bool processDeflatedEntry(const ZipArchive *pArchive,
     zstream.next_in = pArchive->addr + pEntry->offset;
     zstream.avail_in = pEntry->compLen;
     zstream.next_out = (Bytef*) procBuf;
-    zstream.avail_out = sizeof(procBuf);
+    zstream.avail_out = procBufLen;
     zstream.data_type = Z_UNKNOWN;
 
     /*
@@ -559,7 +726,7 @@ static bool processDeflatedEntry(const ZipArchive *pArchive,
 
         /* write when we're full or when we're done */
         if (zstream.avail_out == 0 ||
-            (zerr == Z_STREAM_END && zstream.avail_out != sizeof(procBuf)))
+            (zerr == Z_STREAM_END && zstream.avail_out != procBufLen))
         {
             long procSize = zstream.next_out - procBuf;
             LOGVV("+++ processing %d bytes\n", (int) procSize);
@@ -570,7 +737,7 @@ static bool processDeflatedEntry(const ZipArchive *pArchive,
             }
 
             zstream.next_out = procBuf;
-            zstream.avail_out = sizeof(procBuf);
+            zstream.avail_out = procBufLen;
         }
     } while (zerr == Z_OK);
 
@@ -592,6 +759,15 @@ bail:
     return true;
 }
 
+static bool processDeflatedEntry(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
+    void *cookie)
+{
+    unsigned char procBuf[32 * 1024];
+    return processDeflatedEntryBuf(pArchive, pEntry, processFunction, cookie,
+            procBuf, sizeof(procBuf));
+}
+
 /*
  * Stream the uncompressed data through the supplied function,
  * passing cookie to it each time it gets called.  processFunction
@@ -851,6 +1027,195 @@ static const char *targetEntryPath(MzPathHelper *helper, ZipEntry *pEntry)
     return helper->buf;
 }
 
+#define UNZIP_DIRMODE 0755
+#define UNZIP_FILEMODE 0644
+
+/* Output buffer for inflating files in mzExtractRecursive(), big enough
+ * that most files are written with a single write().
+ */
+#define UNZIP_WRITE_BUFFER_SIZE (256 * 1024)
+
+/* At most this many threads inflate files at the same time.
+ */
+#define UNZIP_MAX_THREADS 4
+
+/* A regular file to extract, with the label it gets when
+ * mzExtractRecursive() was given a selabel handle.
+ */
+typedef struct {
+    const ZipEntry *pEntry;
+    char *path;
+    char *secontext;
+} MzExtractJob;
+
+/* Create and write one regular file.  The file is preallocated at its
+ * full size, then written from the mapped archive (STORED) or through
+ * buf (DEFLATED).  setfscreatecon() applies to the calling thread only,
+ * so this is safe to run on several threads at once.
+ */
+static bool extractFileJob(const ZipArchive *pArchive, const MzExtractJob *job,
+        const struct utimbuf *timestamp, unsigned char *buf, size_t bufLen)
+{
+    const ZipEntry *pEntry = job->pEntry;
+
+    if (job->secontext)
+        setfscreatecon(job->secontext);
+    int fd = creat(job->path, UNZIP_FILEMODE);
+    if (job->secontext)
+        setfscreatecon(NULL);
+    if (fd < 0) {
+        LOGE("Can't create target file \"%s\": %s\n",
+                job->path, strerror(errno));
+        return false;
+    }
+
+#if PLATFORM_SDK_VERSION >= 21
+    // fewer, larger extents; failure just means the filesystem can't do it
+    if (pEntry->uncompLen > 0)
+        fallocate(fd, 0, 0, pEntry->uncompLen);
+#endif
+
+    bool ok;
+    if (pEntry->compression == DEFLATED) {
+        ok = processDeflatedEntryBuf(pArchive, pEntry, writeProcessFunction,
+                (void*)(intptr_t)fd, buf, bufLen);
+    } else {
+        ok = mzProcessZipEntryContents(pArchive, pEntry, writeProcessFunction,
+                (void*)(intptr_t)fd);
+    }
+    close(fd);
+    if (!ok) {
+        LOGE("Error extracting \"%s\"\n", job->path);
+        return false;
+    }
+
+    if (timestamp != NULL && utime(job->path, timestamp)) {
+        LOGE("Error touching \"%s\"\n", job->path);
+        return false;
+    }
+
+    LOGV("Extracted file \"%s\"\n", job->path);
+    return true;
+}
+
+static void freeJobs(MzExtractJob *jobs, int jobCount)
+{
+    int i;
+    for (i = 0; i < jobCount; i++) {
+        free(jobs[i].path);
+        if (jobs[i].secontext) freecon(jobs[i].secontext);
+    }
+}
+
+/* The files of a parallel mzExtractRecursive(), handed out in archive
+ * order to the worker threads.
+ */
+typedef struct {
+    const ZipArchive *pArchive;
+    const struct utimbuf *timestamp;
+    MzExtractJob *jobs;
+    int jobCount;
+    int nextJob;
+    bool failed;
+    pthread_mutex_t lock;
+} MzExtractPool;
+
+static void *extractWorker(void *cookie)
+{
+    MzExtractPool *pool = (MzExtractPool *)cookie;
+    unsigned char *buf = malloc(UNZIP_WRITE_BUFFER_SIZE);
+    if (buf == NULL) {
+        LOGE("Can't allocate extraction buffer\n");
+        pthread_mutex_lock(&pool->lock);
+        pool->failed = true;
+        pthread_mutex_unlock(&pool->lock);
+        return NULL;
+    }
+
+    for (;;) {
+        const MzExtractJob *job = NULL;
+        pthread_mutex_lock(&pool->lock);
+        if (!pool->failed && pool->nextJob < pool->jobCount)
+            job = &pool->jobs[pool->nextJob++];
+        pthread_mutex_unlock(&pool->lock);
+        if (job == NULL)
+            break;
+
+        if (!extractFileJob(pool->pArchive, job, pool->timestamp,
+                buf, UNZIP_WRITE_BUFFER_SIZE)) {
+            pthread_mutex_lock(&pool->lock);
+            pool->failed = true;
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+    }
+
+    free(buf);
+    return NULL;
+}
+
+/* Extract the queued files on up to UNZIP_MAX_THREADS threads (the
+ * calling one included).  Every entry is an independent inflate, so the
+ * result is the same as extracting them one by one.  Stops handing out
+ * files after the first failure.
+ */
+static bool extractJobs(const ZipArchive *pArchive, MzExtractJob *jobs,
+        int jobCount, const struct utimbuf *timestamp)
+{
+    MzExtractPool pool;
+    pthread_t threads[UNZIP_MAX_THREADS - 1];
+    int threadCount = 0;
+    int i;
+
+    pool.pArchive = pArchive;
+    pool.timestamp = timestamp;
+    pool.jobs = jobs;
+    pool.jobCount = jobCount;
+    pool.nextJob = 0;
+    pool.failed = false;
+    pthread_mutex_init(&pool.lock, NULL);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int wanted = (cpus < 1 ? 1 : (cpus > UNZIP_MAX_THREADS ? UNZIP_MAX_THREADS : (int)cpus));
+    if (wanted > jobCount)
+        wanted = jobCount;
+    for (i = 1; i < wanted; i++) {
+        if (pthread_create(&threads[threadCount], NULL, extractWorker, &pool) != 0)
+            break;
+        threadCount++;
+    }
+    extractWorker(&pool);
+    for (i = 0; i < threadCount; i++)
+        pthread_join(threads[i], NULL);
+
+    pthread_mutex_destroy(&pool.lock);
+    LOGD("Extracted %d file(s) on %d thread(s)\n", pool.nextJob, threadCount + 1);
+    return !pool.failed;
+}
+
+/* Create the directory that will contain path, unless it was the one
+ * created last: entries are sorted, so a directory's files come
+ * together and only the first of them needs to walk the hierarchy.
+ * lastDir remembers that directory.
+ */
+static int createContainingDir(const char *path, char **lastDir,
+        const struct utimbuf *timestamp, struct selabel_handle *sehnd)
+{
+    const char *slash = strrchr(path, '/');
+    size_t len = (slash ? (size_t)(slash - path) : 0);
+    if (*lastDir != NULL && strlen(*lastDir) == len &&
+            strncmp(*lastDir, path, len) == 0) {
+        return 0;
+    }
+
+    int ret = dirCreateHierarchy(path, UNZIP_DIRMODE, timestamp, true, sehnd);
+    if (ret == 0) {
+        free(*lastDir);
+        *lastDir = strndup(path, len);
+    }
+    return ret;
+}
+
 /*
  * Inflate all entries under zipDir to the directory specified by
  * targetDir, which must exist and be a writable directory.
@@ -930,6 +1295,18 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
     bool seenMatch = false;
     int ok = true;
     int extractCount = 0;
+    char *lastDir = NULL;
+
+    /* Without a callback to call in order, regular files are only
+     * queued here and extracted in parallel once everything else is
+     * in place.
+     */
+    bool parallel = (callback == NULL && !(flags & MZ_EXTRACT_SERIAL));
+    MzExtractJob *jobs = NULL;
+    int jobCount = 0;
+    int jobAlloc = 0;
+    unsigned char *writeBuf = NULL;
+
     for (i = 0; i < pArchive->numEntries; i++) {
         ZipEntry *pEntry = pArchive->pEntries + i;
         if (pEntry->fileNameLen < zipDirLen) {
@@ -986,8 +1363,6 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
 
         /* Create the file or directory.
          */
-#define UNZIP_DIRMODE 0755
-#define UNZIP_FILEMODE 0644
         if (pEntry->fileName[pEntry->fileNameLen-1] == '/') {
             if (!(flags & MZ_EXTRACT_FILES_ONLY)) {
                 int ret = dirCreateHierarchy(
@@ -1004,8 +1379,7 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
             /* This is not a directory.  First, make sure that
              * the containing directory exists.
              */
-            int ret = dirCreateHierarchy(
-                    targetFile, UNZIP_DIRMODE, timestamp, true, sehnd);
+            int ret = createContainingDir(targetFile, &lastDir, timestamp, sehnd);
             if (ret != 0) {
                 LOGE("Can't create containing directory for \"%s\": %s\n",
                         targetFile, strerror(errno));
@@ -1021,6 +1395,18 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
                  * The relative target of the symlink is in the
                  * data section of this entry.
                  */
+                /* Files queued so far go first, so a link never ends up
+                 * in the way of (or under) a file that precedes it.
+                 */
+                if (jobCount > 0) {
+                    ok = extractJobs(pArchive, jobs, jobCount, timestamp);
+                    if (ok) extractCount += jobCount;
+                    freeJobs(jobs, jobCount);
+                    jobCount = 0;
+                    if (!ok) {
+                        break;
+                    }
+                }
                 if (pEntry->uncompLen == 0) {
                     LOGE("Symlink entry \"%s\" has no target\n",
                             targetFile);
@@ -1057,45 +1443,53 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
                 free(linkTarget);
             } else {
                 /* The entry is a regular file.
-                 * Open the target for writing.
                  */
-
-                char *secontext = NULL;
-
+                MzExtractJob job;
+                job.pEntry = pEntry;
+                job.path = (char *)targetFile;
+                job.secontext = NULL;
                 if (sehnd) {
-                    selabel_lookup(sehnd, &secontext, targetFile, UNZIP_FILEMODE);
-                    setfscreatecon(secontext);
+                    selabel_lookup(sehnd, &job.secontext, targetFile, UNZIP_FILEMODE);
                 }
 
-                int fd = creat(targetFile, UNZIP_FILEMODE);
-
-                if (secontext) {
-                    freecon(secontext);
-                    setfscreatecon(NULL);
+                if (parallel) {
+                    if (jobCount == jobAlloc) {
+                        int newAlloc = (jobAlloc ? jobAlloc * 2 : 256);
+                        MzExtractJob *newJobs = (MzExtractJob *)realloc(jobs,
+                                newAlloc * sizeof(MzExtractJob));
+                        if (newJobs == NULL) {
+                            if (job.secontext) freecon(job.secontext);
+                            ok = false;
+                            break;
+                        }
+                        jobs = newJobs;
+                        jobAlloc = newAlloc;
+                    }
+                    job.path = strdup(targetFile);
+                    if (job.path == NULL) {
+                        if (job.secontext) freecon(job.secontext);
+                        ok = false;
+                        break;
+                    }
+                    /* Duplicate names sort next to each other, and the
+                     * last one wins as it would serially.
+                     */
+                    if (jobCount > 0 && strcmp(jobs[jobCount-1].path, job.path) == 0) {
+                        freeJobs(&jobs[--jobCount], 1);
+                    }
+                    jobs[jobCount++] = job;
+                    continue;
                 }
 
-                if (fd < 0) {
-                    LOGE("Can't create target file \"%s\": %s\n",
-                            targetFile, strerror(errno));
-                    ok = false;
-                    break;
-                }
-
-                bool ok = mzExtractZipEntryToFile(pArchive, pEntry, fd);
-                close(fd);
+                if (writeBuf == NULL)
+                    writeBuf = malloc(UNZIP_WRITE_BUFFER_SIZE);
+                ok = writeBuf != NULL &&
+                        extractFileJob(pArchive, &job, timestamp,
+                                writeBuf, UNZIP_WRITE_BUFFER_SIZE);
+                if (job.secontext) freecon(job.secontext);
                 if (!ok) {
-                    LOGE("Error extracting \"%s\"\n", targetFile);
-                    ok = false;
                     break;
                 }
-
-                if (timestamp != NULL && utime(targetFile, timestamp)) {
-                    LOGE("Error touching \"%s\"\n", targetFile);
-                    ok = false;
-                    break;
-                }
-
-                LOGV("Extracted file \"%s\"\n", targetFile);
                 ++extractCount;
             }
         }
@@ -1103,6 +1497,15 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
         if (callback != NULL) callback(targetFile, cookie);
     }
 
+    if (ok && jobCount > 0) {
+        ok = extractJobs(pArchive, jobs, jobCount, timestamp);
+        if (ok) extractCount += jobCount;
+    }
+    freeJobs(jobs, jobCount);
+    free(jobs);
+    free(writeBuf);
+    free(lastDir);
+
     LOGD("Extracted %d file(s)\n", extractCount);
 
     free(helper.buf);
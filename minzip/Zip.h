@@ -78,6 +78,27 @@ int mzOpenZipArchive(unsigned char* addr, size_t length, ZipArchive* pArchive);
  */
 void mzCloseZipArchive(ZipArchive* pArchive);
 
+/*
+ * Write the parsed central directory of "pArchive" to "fd", so another
+ * process that maps the same archive can open it with
+ * mzOpenZipArchiveDirectory() instead of parsing the Zip again.
+ *
+ * Returns 0 on success, nonzero errno value on failure.
+ */
+int mzWriteZipDirectory(const ZipArchive* pArchive, int fd);
+
+/*
+ * Open a Zip archive mapped at "addr" from the directory that
+ * mzWriteZipDirectory() wrote to "fd".  Only the entries' offsets are
+ * checked against "length"; the directory must come from a process that
+ * parsed the same file.
+ *
+ * On success, returns 0 and populates "pArchive".  Returns nonzero errno
+ * value on failure.
+ */
+int mzOpenZipArchiveDirectory(unsigned char* addr, size_t length, int fd,
+        ZipArchive* pArchive);
+
 
 /*
  * Find an entry in the Zip archive, by name.
@@ -215,14 +236,18 @@ bool mzGetStoredEntry(const ZipArchive *pArchive,
  *
  *     MZ_EXTRACT_FILES_ONLY - only unpack files, not directories or symlinks
  *     MZ_EXTRACT_DRY_RUN - don't do anything, but do invoke the callback
+ *     MZ_EXTRACT_SERIAL - extract regular files one at a time
  *
  * If timestamp is non-NULL, file timestamps will be set accordingly.
  *
  * If callback is non-NULL, it will be invoked with each unpacked file.
+ * Without a callback, regular files are extracted on several threads
+ * once directories and symlinks are in place, unless MZ_EXTRACT_SERIAL
+ * is given.  The result is the same either way.
  *
  * Returns true on success, false on failure.
  */
-enum { MZ_EXTRACT_FILES_ONLY = 1, MZ_EXTRACT_DRY_RUN = 2 };
+enum { MZ_EXTRACT_FILES_ONLY = 1, MZ_EXTRACT_DRY_RUN = 2, MZ_EXTRACT_SERIAL = 4 };
 bool mzExtractRecursive(const ZipArchive *pArchive,
         const char *zipDir, const char *targetDir,
         int flags, const struct utimbuf *timestamp,
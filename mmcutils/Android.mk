@@ -4,8 +4,10 @@ LOCAL_PATH := $(call my-dir)
 include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES := \
-	mmcutils.c
+	mmcutils.c \
+	zero_range.c
 
+LOCAL_CFLAGS += -DPLATFORM_SDK_VERSION=$(PLATFORM_SDK_VERSION)
 LOCAL_MODULE := libmmcutils
 LOCAL_MODULE_TAGS := eng
 
@@ -18,8 +20,10 @@ LOCAL_CFLAGS += -DBOARD_HAS_LARGE_FILESYSTEM
 endif
 
 LOCAL_SRC_FILES := \
-mmcutils.c
+mmcutils.c \
+zero_range.c
 
+LOCAL_CFLAGS += -DPLATFORM_SDK_VERSION=$(PLATFORM_SDK_VERSION)
 LOCAL_MODULE := libmmcutils
 LOCAL_MODULE_TAGS := eng
 
@@ -0,0 +1,212 @@
+/*
+ * Copyright (C) 2016 TeamWin Recovery Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *	  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "zero_range.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <linux/fs.h>
+
+#ifndef BLKDISCARD
+#define BLKDISCARD _IO(0x12,119)
+#endif
+#ifndef BLKZEROOUT
+#define BLKZEROOUT _IO(0x12,127)
+#endif
+#ifndef PLATFORM_SDK_VERSION
+#define PLATFORM_SDK_VERSION 0
+#endif
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE 0x01
+#endif
+#ifndef FALLOC_FL_PUNCH_HOLE
+#define FALLOC_FL_PUNCH_HOLE 0x02
+#endif
+
+/* The block layer works in 512 byte sectors */
+#define SECTOR_SIZE 512
+
+/* Writes go out in chunks of this size, aligned to it on the device */
+#define ZERO_CHUNK_SIZE (1024 * 1024)
+
+int zero_range_write(int fd, uint64_t offset, uint64_t len)
+{
+    size_t bufsize = len < ZERO_CHUNK_SIZE ? (size_t)len : ZERO_CHUNK_SIZE;
+    char *zeroes;
+
+    if (len == 0)
+        return 0;
+    zeroes = calloc(1, bufsize);
+    if (zeroes == NULL)
+        return -1;
+
+    while (len > 0) {
+        /* Up to the next chunk boundary, so the rest are aligned */
+        size_t count = ZERO_CHUNK_SIZE - (size_t)(offset % ZERO_CHUNK_SIZE);
+        if (count > bufsize)
+            count = bufsize;
+        if (count > len)
+            count = (size_t)len;
+
+        ssize_t written = pwrite64(fd, zeroes, count, offset);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            free(zeroes);
+            return -1;
+        } else if (written == 0) {
+            free(zeroes);
+            errno = ENOSPC;
+            return -1;
+        }
+        offset += written;
+        len -= written;
+    }
+
+    free(zeroes);
+    return 0;
+}
+
+/*
+ * Zero the aligned middle of a block device range with BLKZEROOUT, and
+ * write the rest.  BLKDISCARD is not used even where the device claims
+ * discarded blocks read as zeroes, as not all of them keep to that.
+ * Writes through fd sit in the page cache, so they are flushed first
+ * (or they would land on top of the zeroes later), and the cached pages
+ * of the range are dropped afterwards so reads see the zeroes.  *dirty
+ * says whether there are writes to flush, and is set again when the
+ * range needed writes of its own.
+ */
+static int blk_zero_range(int fd, uint64_t offset, uint64_t len, int *dirty)
+{
+    uint64_t start, count;
+    uint64_t range[2];
+
+    start = (offset + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+    count = (offset + len) / SECTOR_SIZE * SECTOR_SIZE;
+    if (count > start) {
+        count -= start;
+        if (*dirty) {
+            if (fdatasync(fd) < 0)
+                return -1;
+            *dirty = 0;
+        }
+        range[0] = start;
+        range[1] = count;
+        if (ioctl(fd, BLKZEROOUT, &range) == 0) {
+#if PLATFORM_SDK_VERSION >= 21
+            posix_fadvise64(fd, start, count, POSIX_FADV_DONTNEED);
+#endif
+            /* The unaligned ends, if any, are written */
+            if (start == offset && count == len)
+                return 0;
+            *dirty = 1;
+            if (zero_range_write(fd, offset, start - offset) < 0)
+                return -1;
+            return zero_range_write(fd, start + count, offset + len - (start + count));
+        }
+    }
+    /* Nothing aligned, or a kernel without BLKZEROOUT */
+    *dirty = 1;
+    return zero_range_write(fd, offset, len);
+}
+
+static int file_zero_range(int fd, const struct stat *st, uint64_t offset, uint64_t len)
+{
+#if PLATFORM_SDK_VERSION >= 21
+    uint64_t size = st->st_size;
+    uint64_t inside = 0;
+
+    /* Holes read back as zeroes, and so does the file grown by ftruncate */
+    if (offset < size) {
+        inside = offset + len > size ? size - offset : len;
+        if (fallocate64(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, inside) < 0)
+            return -1;
+    }
+    if (offset + len > size && ftruncate64(fd, offset + len) < 0)
+        return -1;
+    return 0;
+#else
+    /* No fallocate64() in this libc */
+    errno = EOPNOTSUPP;
+    return -1;
+#endif
+}
+
+int zero_ranges(int fd, const uint64_t *ranges, int count)
+{
+    struct stat st;
+    /* What the caller wrote is flushed once, before the first range */
+    int dirty = 1;
+    int i;
+
+    if (fstat(fd, &st) < 0)
+        memset(&st, 0, sizeof(st));
+
+    for (i = 0; i < count; i++) {
+        uint64_t offset = ranges[i * 2], len = ranges[i * 2 + 1];
+        int ret;
+
+        if (len == 0)
+            continue;
+        if (S_ISBLK(st.st_mode)) {
+            ret = blk_zero_range(fd, offset, len, &dirty);
+        } else {
+            ret = -1;
+            if (S_ISREG(st.st_mode))
+                ret = file_zero_range(fd, &st, offset, len);
+            /* File systems without hole punching, and others */
+            if (ret < 0)
+                ret = zero_range_write(fd, offset, len);
+            /* Either may have grown the file */
+            if (ret == 0 && offset + len > (uint64_t)st.st_size)
+                st.st_size = offset + len;
+        }
+        if (ret < 0)
+            return -1;
+    }
+    return 0;
+}
+
+int zero_range(int fd, uint64_t offset, uint64_t len)
+{
+    uint64_t range[2];
+
+    range[0] = offset;
+    range[1] = len;
+    return zero_ranges(fd, range, 1);
+}
+
+int discard_range(int fd, uint64_t offset, uint64_t len)
+{
+    uint64_t range[2];
+
+    range[0] = offset;
+    range[1] = len;
+    if (fdatasync(fd) < 0)
+        return -1;
+    if (ioctl(fd, BLKDISCARD, &range) < 0)
+        return -1;
+#if PLATFORM_SDK_VERSION >= 21
+    posix_fadvise64(fd, offset, len, POSIX_FADV_DONTNEED);
+#endif
+    return 0;
+}
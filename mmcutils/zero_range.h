@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2016 TeamWin Recovery Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *	  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MMCUTILS_ZERO_RANGE_H_
+#define MMCUTILS_ZERO_RANGE_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Zero or discard a byte range of a block device or a regular file.
+ * None of these move the file position, and all return 0 on success
+ * or -1 with errno set.
+ */
+
+/*
+ * Make len bytes at offset read back as zeroes, leaving the kernel to
+ * do it where it can.  Block devices get BLKZEROOUT; regular files get
+ * a hole punched (and grow if the range ends past the end).  Whatever
+ * is left is written with zero_range_write().
+ */
+int zero_range(int fd, uint64_t offset, uint64_t len);
+
+/*
+ * zero_range() for count ranges, given as pairs of offset and length.
+ * A block device is flushed once for all of them rather than per range.
+ */
+int zero_ranges(int fd, const uint64_t *ranges, int count);
+
+/* Zero a range with plain writes of a large zeroed buffer. */
+int zero_range_write(int fd, uint64_t offset, uint64_t len);
+
+/*
+ * BLKDISCARD a range of a block device.  The contents of the range are
+ * undefined afterwards unless the device zeroes discarded blocks.
+ */
+int discard_range(int fd, uint64_t offset, uint64_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // MMCUTILS_ZERO_RANGE_H_
@@ -12,9 +12,11 @@ LOCAL_SRC_FILES = \
     btree.cpp \
     MtpDataPacket.cpp \
     MtpDebug.cpp \
+    MtpDeleteWorker.cpp \
     MtpDevice.cpp \
     MtpDeviceInfo.cpp \
     MtpEventPacket.cpp \
+    MtpFileTransfer.cpp \
     MtpObjectInfo.cpp \
     MtpPacket.cpp \
     MtpProperty.cpp \
@@ -49,9 +51,11 @@ LOCAL_SRC_FILES = \
     btree.cpp \
     MtpDataPacket.cpp \
     MtpDebug.cpp \
+    MtpDeleteWorker.cpp \
     MtpDevice.cpp \
     MtpDeviceInfo.cpp \
     MtpEventPacket.cpp \
+    MtpFileTransfer.cpp \
     MtpObjectInfo.cpp \
     MtpPacket.cpp \
     MtpProperty.cpp \
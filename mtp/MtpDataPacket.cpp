@@ -17,6 +17,7 @@
  *
  */
 
+#include <errno.h>
 #include <stdio.h>
 #include <sys/types.h>
 #include <fcntl.h>
@@ -153,82 +154,56 @@ UInt64List* MtpDataPacket::getAUInt64() {
 	return result;
 }
 
+void MtpDataPacket::reserve(size_t length) {
+	allocate(mOffset + length);
+}
+
 void MtpDataPacket::putInt8(int8_t value) {
 	allocate(mOffset + 1);
-	mBuffer[mOffset++] = (uint8_t)value;
-	if (mPacketSize < mOffset)
-		mPacketSize = mOffset;
+	storeUInt8(value);
+	endPut();
 }
 
 void MtpDataPacket::putUInt8(uint8_t value) {
 	allocate(mOffset + 1);
-	mBuffer[mOffset++] = (uint8_t)value;
-	if (mPacketSize < mOffset)
-		mPacketSize = mOffset;
+	storeUInt8(value);
+	endPut();
 }
 
 void MtpDataPacket::putInt16(int16_t value) {
 	allocate(mOffset + 2);
-	mBuffer[mOffset++] = (uint8_t)(value & 0xFF);
-	mBuffer[mOffset++] = (uint8_t)((value >> 8) & 0xFF);
-	if (mPacketSize < mOffset)
-		mPacketSize = mOffset;
+	storeUInt16(value);
+	endPut();
 }
 
 void MtpDataPacket::putUInt16(uint16_t value) {
 	allocate(mOffset + 2);
-	mBuffer[mOffset++] = (uint8_t)(value & 0xFF);
-	mBuffer[mOffset++] = (uint8_t)((value >> 8) & 0xFF);
-	if (mPacketSize < mOffset)
-		mPacketSize = mOffset;
+	storeUInt16(value);
+	endPut();
 }
 
 void MtpDataPacket::putInt32(int32_t value) {
 	allocate(mOffset + 4);
-	mBuffer[mOffset++] = (uint8_t)(value & 0xFF);
-	mBuffer[mOffset++] = (uint8_t)((value >> 8) & 0xFF);
-	mBuffer[mOffset++] = (uint8_t)((value >> 16) & 0xFF);
-	mBuffer[mOffset++] = (uint8_t)((value >> 24) & 0xFF);
-	if (mPacketSize < mOffset)
-		mPacketSize = mOffset;
+	storeUInt32(value);
+	endPut();
 }
 
 void MtpDataPacket::putUInt32(uint32_t value) {
 	allocate(mOffset + 4);
-	mBuffer[mOffset++] = (uint8_t)(value & 0xFF);
-	mBuffer[mOffset++] = (uint8_t)((value >> 8) & 0xFF);
-	mBuffer[mOffset++] = (uint8_t)((value >> 16) & 0xFF);
-	mBuffer[mOffset++] = (uint8_t)((value >> 24) & 0xFF);
-	if (mPacketSize < mOffset)
-		mPacketSize = mOffset;
+	storeUInt32(value);
+	endPut();
 }
 
 void MtpDataPacket::putInt64(int64_t value) {
 	allocate(mOffset + 8);
-	mBuffer[mOffset++] = (uint8_t)(value & 0xFF);
-	mBuffer[mOffset++] = (uint8_t)((value >> 8) & 0xFF);
-	mBuffer[mOffset++] = (uint8_t)((value >> 16) & 0xFF);
-	mBuffer[mOffset++] = (uint8_t)((value >> 24) & 0xFF);
-	mBuffer[mOffset++] = (uint8_t)((value >> 32) & 0xFF);
-	mBuffer[mOffset++] = (uint8_t)((value >> 40) & 0xFF);
-	mBuffer[mOffset++] = (uint8_t)((value >> 48) & 0xFF);
-	mBuffer[mOffset++] = (uint8_t)((value >> 56) & 0xFF);
-	if (mPacketSize < mOffset)
-		mPacketSize = mOffset;
+	storeUInt64(value);
+	endPut();
 }
 
 void MtpDataPacket::putUInt64(uint64_t value) {
 	allocate(mOffset + 8);
-	mBuffer[mOffset++] = (uint8_t)(value & 0xFF);
-	mBuffer[mOffset++] = (uint8_t)((value >> 8) & 0xFF);
-	mBuffer[mOffset++] = (uint8_t)((value >> 16) & 0xFF);
-	mBuffer[mOffset++] = (uint8_t)((value >> 24) & 0xFF);
-	mBuffer[mOffset++] = (uint8_t)((value >> 32) & 0xFF);
-	mBuffer[mOffset++] = (uint8_t)((value >> 40) & 0xFF);
-	mBuffer[mOffset++] = (uint8_t)((value >> 48) & 0xFF);
-	mBuffer[mOffset++] = (uint8_t)((value >> 56) & 0xFF);
-	if (mPacketSize < mOffset)
-		mPacketSize = mOffset;
+	storeUInt64(value);
+	endPut();
 }
 
 void MtpDataPacket::putInt128(const int128_t& value) {
@@ -256,46 +231,60 @@ void MtpDataPacket::putUInt128(uint64_t value) {
 }
 
 void MtpDataPacket::putAInt8(const int8_t* values, int count) {
-	putUInt32(count);
+	reserve(4 + count);
+	storeUInt32(count);
 	for (int i = 0; i < count; i++)
-		putInt8(*values++);
+		storeUInt8(*values++);
+	endPut();
 }
 
 void MtpDataPacket::putAUInt8(const uint8_t* values, int count) {
-	putUInt32(count);
+	reserve(4 + count);
+	storeUInt32(count);
 	for (int i = 0; i < count; i++)
-		putUInt8(*values++);
+		storeUInt8(*values++);
+	endPut();
 }
 
 void MtpDataPacket::putAInt16(const int16_t* values, int count) {
-	putUInt32(count);
+	reserve(4 + count * 2);
+	storeUInt32(count);
 	for (int i = 0; i < count; i++)
-		putInt16(*values++);
+		storeUInt16(*values++);
+	endPut();
 }
 
 void MtpDataPacket::putAUInt16(const uint16_t* values, int count) {
-	putUInt32(count);
+	reserve(4 + count * 2);
+	storeUInt32(count);
 	for (int i = 0; i < count; i++)
-		putUInt16(*values++);
+		storeUInt16(*values++);
+	endPut();
 }
 
 void MtpDataPacket::putAUInt16(const UInt16List* values) {
 	size_t count = (values ? values->size() : 0);
-	putUInt32(count);
+	reserve(4 + count * 2);
+	storeUInt32(count);
 	for (size_t i = 0; i < count; i++)
-		putUInt16((*values)[i]);
+		storeUInt16((*values)[i]);
+	endPut();
 }
 
 void MtpDataPacket::putAInt32(const int32_t* values, int count) {
-	putUInt32(count);
+	reserve(4 + count * 4);
+	storeUInt32(count);
 	for (int i = 0; i < count; i++)
-		putInt32(*values++);
+		storeUInt32(*values++);
+	endPut();
 }
 
 void MtpDataPacket::putAUInt32(const uint32_t* values, int count) {
-	putUInt32(count);
+	reserve(4 + count * 4);
+	storeUInt32(count);
 	for (int i = 0; i < count; i++)
-		putUInt32(*values++);
+		storeUInt32(*values++);
+	endPut();
 }
 
 void MtpDataPacket::putAUInt32(const UInt32List* list) {
@@ -303,22 +292,28 @@ void MtpDataPacket::putAUInt32(const UInt32List* list) {
 		putEmptyArray();
 	} else {
 		size_t size = list->size();
-		putUInt32(size);
+		reserve(4 + size * 4);
+		storeUInt32(size);
 		for (size_t i = 0; i < size; i++)
-			putUInt32((*list)[i]);
+			storeUInt32((*list)[i]);
+		endPut();
 	}
 }
 
 void MtpDataPacket::putAInt64(const int64_t* values, int count) {
-	putUInt32(count);
+	reserve(4 + count * 8);
+	storeUInt32(count);
 	for (int i = 0; i < count; i++)
-		putInt64(*values++);
+		storeUInt64(*values++);
+	endPut();
 }
 
 void MtpDataPacket::putAUInt64(const uint64_t* values, int count) {
-	putUInt32(count);
+	reserve(4 + count * 8);
+	storeUInt32(count);
 	for (int i = 0; i < count; i++)
-		putUInt64(*values++);
+		storeUInt64(*values++);
+	endPut();
 }
 
 void MtpDataPacket::putString(const MtpStringBuffer& string) {
@@ -338,12 +333,14 @@ void MtpDataPacket::putString(const uint16_t* string) {
 		else
 			break;
 	}
-	putUInt8(count > 0 ? count + 1 : 0);
+	reserve(1 + (count > 0 ? (count + 1) * 2 : 0));
+	storeUInt8(count > 0 ? count + 1 : 0);
 	for (int i = 0; i < count; i++)
-		putUInt16(string[i]);
+		storeUInt16(string[i]);
 	// only terminate with zero if string is not empty
 	if (count > 0)
-		putUInt16(0);
+		storeUInt16(0);
+	endPut();
 }
 
 #ifdef MTP_DEVICE 
@@ -356,21 +353,35 @@ int MtpDataPacket::read(int fd) {
 	return ret;
 }
 
+// The whole container goes out in one write, f_mtp ends the transfer
+// after each write. Only a write cut short by a signal, or on a socket
+// in tests, needs more than one.
+static int writeFully(int fd, const uint8_t* data, uint32_t length) {
+	while (length > 0) {
+		int ret = ::write(fd, data, length);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		data += ret;
+		length -= ret;
+	}
+	return 0;
+}
+
 int MtpDataPacket::write(int fd) {
 	MtpPacket::putUInt32(MTP_CONTAINER_LENGTH_OFFSET, mPacketSize);
 	MtpPacket::putUInt16(MTP_CONTAINER_TYPE_OFFSET, MTP_CONTAINER_TYPE_DATA);
-	int ret = ::write(fd, mBuffer, mPacketSize);
-	return (ret < 0 ? ret : 0);
+	return writeFully(fd, mBuffer, mPacketSize);
 }
 
 int MtpDataPacket::writeData(int fd, void* data, uint32_t length) {
-	allocate(length);
+	allocate(length + MTP_CONTAINER_HEADER_SIZE);
 	memcpy(mBuffer + MTP_CONTAINER_HEADER_SIZE, data, length);
 	length += MTP_CONTAINER_HEADER_SIZE;
 	MtpPacket::putUInt32(MTP_CONTAINER_LENGTH_OFFSET, length);
 	MtpPacket::putUInt16(MTP_CONTAINER_TYPE_OFFSET, MTP_CONTAINER_TYPE_DATA);
-	int ret = ::write(fd, mBuffer, length);
-	return (ret < 0 ? ret : 0);
+	return writeFully(fd, mBuffer, length);
 }
 
 #endif // MTP_DEVICE
@@ -34,6 +34,26 @@ private:
     // current offset for get/put methods
     uint64_t            mOffset;
 
+    // store at mOffset without checking the buffer size, for arrays and
+    // strings that reserve() their whole size first. endPut() then moves
+    // the packet size up to the offset once for the whole item.
+    inline void         storeUInt8(uint8_t value) { mBuffer[mOffset++] = value; }
+    inline void         storeUInt16(uint16_t value) {
+                            mBuffer[mOffset++] = (uint8_t)(value & 0xFF);
+                            mBuffer[mOffset++] = (uint8_t)((value >> 8) & 0xFF);
+                        }
+    inline void         storeUInt32(uint32_t value) {
+                            storeUInt16((uint16_t)(value & 0xFFFF));
+                            storeUInt16((uint16_t)(value >> 16));
+                        }
+    inline void         storeUInt64(uint64_t value) {
+                            storeUInt32((uint32_t)(value & 0xFFFFFFFF));
+                            storeUInt32((uint32_t)(value >> 32));
+                        }
+    inline void         endPut() { if (mPacketSize < mOffset) mPacketSize = mOffset; }
+
+    friend class MtpStringBuffer;
+
 public:
                         MtpDataPacket();
     virtual             ~MtpDataPacket();
@@ -65,6 +85,12 @@ public:
     Int64List*          getAInt64();
     UInt64List*         getAUInt64();
 
+    // makes room for length more bytes up front, so a large response is
+    // not copied as it grows. The array and string puts store without
+    // checking the size, so they call this with their whole size first;
+    // anything else stored unchecked must be covered by it the same way.
+    void                reserve(size_t length);
+
     void                putInt8(int8_t value);
     void                putUInt8(uint8_t value);
     void                putInt16(int16_t value);
@@ -422,3 +422,7 @@ void MtpDebug::enableDebug(void) {
 	debug_enabled = 1;
 	MTPD("MTP debug logging enabled\n");
 }
+
+bool MtpDebug::isDebugEnabled(void) {
+	return debug_enabled != 0;
+}
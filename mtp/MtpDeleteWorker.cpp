@@ -0,0 +1,213 @@
+/*
+ * Copyright (C) 2016 TeamWin Recovery Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *	  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "MtpDebug.h"
+#include "MtpDeleteWorker.h"
+
+#define DELETE_CHUNK_SIZE ( 32 * 1024 )
+
+MtpDeleteWorker::MtpDeleteWorker(int threadCount)
+	:	mThreadCount(threadCount < 1 ? 1 : threadCount),
+		mActive(0),
+		mExit(false)
+{
+	pthread_mutex_init(&mMutex, NULL);
+	pthread_cond_init(&mWorkCond, NULL);
+	pthread_cond_init(&mIdleCond, NULL);
+}
+
+MtpDeleteWorker::~MtpDeleteWorker() {
+	wait();
+	pthread_mutex_lock(&mMutex);
+	mExit = true;
+	pthread_cond_broadcast(&mWorkCond);
+	pthread_mutex_unlock(&mMutex);
+	for (size_t i = 0; i < mThreads.size(); i++)
+		pthread_join(mThreads[i], NULL);
+	pthread_cond_destroy(&mIdleCond);
+	pthread_cond_destroy(&mWorkCond);
+	pthread_mutex_destroy(&mMutex);
+}
+
+bool MtpDeleteWorker::isDeletePath(const char* name) {
+	size_t prefix = strlen(MTP_DELETE_PREFIX);
+	if (strncmp(name, MTP_DELETE_PREFIX, prefix) != 0)
+		return false;
+	// the handle, as doDeleteObject writes it
+	const char* p = name + prefix;
+	if (!*p)
+		return false;
+	for (; *p; p++) {
+		if (*p < '0' || *p > '9')
+			return false;
+	}
+	return true;
+}
+
+// threads are started on the first deletion and kept for the life of the server
+void MtpDeleteWorker::start() {
+	while ((int)mThreads.size() < mThreadCount) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, workerThread, this)) {
+			MTPE("MtpDeleteWorker: can't start thread: %s\n", strerror(errno));
+			break;
+		}
+		mThreads.push_back(thread);
+	}
+}
+
+void MtpDeleteWorker::deletePath(const std::string& path) {
+	pthread_mutex_lock(&mMutex);
+	if (!mPaths.insert(path).second) {
+		// a leftover found again while it is still being deleted
+		pthread_mutex_unlock(&mMutex);
+		return;
+	}
+	MTPD("MtpDeleteWorker: queueing %s\n", path.c_str());
+	start();
+	bool threads = !mThreads.empty();
+	pthread_mutex_unlock(&mMutex);
+	addJob(path, NULL);
+	if (!threads) {
+		// no thread to do it, delete it here
+		Job* job;
+		while ((job = nextJob()) != NULL)
+			scan(job);
+	}
+}
+
+void MtpDeleteWorker::wait() {
+	pthread_mutex_lock(&mMutex);
+	while (mActive > 0)
+		pthread_cond_wait(&mIdleCond, &mMutex);
+	pthread_mutex_unlock(&mMutex);
+}
+
+void MtpDeleteWorker::addJob(const std::string& path, Job* parent) {
+	Job* job = new Job;
+	job->path = path;
+	job->parent = parent;
+	job->pending = 1;
+	job->isDir = false;
+	pthread_mutex_lock(&mMutex);
+	if (parent)
+		parent->pending++;
+	mActive++;
+	mQueue.push_back(job);
+	pthread_cond_signal(&mWorkCond);
+	pthread_mutex_unlock(&mMutex);
+}
+
+MtpDeleteWorker::Job* MtpDeleteWorker::nextJob() {
+	Job* job = NULL;
+	pthread_mutex_lock(&mMutex);
+	if (!mQueue.empty()) {
+		job = mQueue.back();
+		mQueue.pop_back();
+	}
+	pthread_mutex_unlock(&mMutex);
+	return job;
+}
+
+void* MtpDeleteWorker::workerThread(void* cookie) {
+	MtpDeleteWorker* worker = (MtpDeleteWorker*)cookie;
+	for (;;) {
+		pthread_mutex_lock(&worker->mMutex);
+		while (!worker->mExit && worker->mQueue.empty())
+			pthread_cond_wait(&worker->mWorkCond, &worker->mMutex);
+		bool exit = worker->mQueue.empty();
+		pthread_mutex_unlock(&worker->mMutex);
+		if (exit)
+			break;
+		Job* job = worker->nextJob();
+		if (job)
+			worker->scan(job);
+	}
+	return NULL;
+}
+
+// Removes the files of a directory and queues its subdirectories
+void MtpDeleteWorker::scan(Job* job) {
+	int fd = open(job->path.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0) {
+		if (errno == ENOTDIR || errno == ELOOP) {
+			if (unlink(job->path.c_str()))
+				MTPE("MtpDeleteWorker: unlink '%s' failed: %s\n", job->path.c_str(), strerror(errno));
+		} else if (errno != ENOENT) {
+			MTPE("MtpDeleteWorker: opening '%s' failed: %s\n", job->path.c_str(), strerror(errno));
+		}
+		finish(job);
+		return;
+	}
+	job->isDir = true;
+	char* buf = (char*)malloc(DELETE_CHUNK_SIZE);
+	int len = -1;
+	while (buf && (len = syscall(SYS_getdents64, fd, buf, DELETE_CHUNK_SIZE)) > 0) {
+		for (int pos = 0; pos < len; ) {
+			struct dirent64* de = (struct dirent64*)(buf + pos);
+			pos += de->d_reclen;
+			const char* name = de->d_name;
+			if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0)))
+				continue;
+			bool isDir = (de->d_type == DT_DIR);
+			if (de->d_type == DT_UNKNOWN) {
+				struct stat st;
+				isDir = (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode));
+			}
+			if (isDir)
+				addJob(job->path + "/" + name, job);
+			else if (unlinkat(fd, name, 0) && errno != ENOENT)
+				MTPE("MtpDeleteWorker: unlink '%s/%s' failed: %s\n", job->path.c_str(), name, strerror(errno));
+		}
+	}
+	if (len < 0)
+		MTPE("MtpDeleteWorker: reading '%s' failed: %s\n", job->path.c_str(), strerror(errno));
+	free(buf);
+	close(fd);
+	finish(job);
+}
+
+// Drops one reference from the job. The last one removes the directory,
+// which may in turn finish its parent.
+void MtpDeleteWorker::finish(Job* job) {
+	while (job) {
+		pthread_mutex_lock(&mMutex);
+		bool done = (--job->pending == 0);
+		pthread_mutex_unlock(&mMutex);
+		if (!done)
+			return;
+		if (job->isDir && rmdir(job->path.c_str()) && errno != ENOENT)
+			MTPE("MtpDeleteWorker: rmdir '%s' failed: %s\n", job->path.c_str(), strerror(errno));
+		Job* parent = job->parent;
+		pthread_mutex_lock(&mMutex);
+		if (!parent)
+			mPaths.erase(job->path);
+		delete job;
+		if (--mActive == 0)
+			pthread_cond_broadcast(&mIdleCond);
+		pthread_mutex_unlock(&mMutex);
+		job = parent;
+	}
+}
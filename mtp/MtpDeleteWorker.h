@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2016 TeamWin Recovery Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *	  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MTP_DELETE_WORKER_H
+#define _MTP_DELETE_WORKER_H
+
+#include <pthread.h>
+#include <set>
+#include <string>
+#include <vector>
+
+// Directories being deleted in the background are first renamed to this
+// prefix followed by their handle, which frees their name right away.
+// Storages hide such entries and hand leftovers back for deletion; only
+// names of exactly that form count, so nothing else is ever deleted.
+#define MTP_DELETE_PREFIX ".twmtp_delete."
+
+// Deletes directory trees in the background, so DeleteObject can answer
+// the host as soon as the objects are gone from the database. Each
+// directory is a job: its files are removed with unlinkat relative to the
+// open directory, its subdirectories become jobs of their own so several
+// threads can work on one tree, and it is removed once they are all gone.
+class MtpDeleteWorker {
+public:
+	MtpDeleteWorker(int threadCount = kDefaultThreadCount);
+	// waits for queued deletions to finish
+	~MtpDeleteWorker();
+
+	// queues a file or a directory tree for deletion, unless it is
+	// already queued
+	void deletePath(const std::string& path);
+	// blocks until everything queued so far is deleted
+	void wait();
+
+	static bool isDeletePath(const char* name);
+
+	static const int kDefaultThreadCount = 3;
+
+private:
+	struct Job {
+		std::string path;
+		Job* parent;
+		int pending; // own scan plus subdirectories not removed yet
+		bool isDir; // set once opened as a directory
+	};
+
+	void start();
+	void addJob(const std::string& path, Job* parent);
+	Job* nextJob();
+	void scan(Job* job);
+	void finish(Job* job);
+	static void* workerThread(void* cookie);
+
+	int mThreadCount;
+	std::vector<pthread_t> mThreads;
+	// jobs not scanned yet, taken from the back so the tree is walked
+	// depth first and only a few directories are open at a time
+	std::vector<Job*> mQueue;
+	int mActive; // jobs not finished yet
+	std::set<std::string> mPaths; // paths queued by deletePath, until deleted
+	bool mExit;
+	pthread_mutex_t mMutex;
+	pthread_cond_t mWorkCond;
+	pthread_cond_t mIdleCond;
+};
+
+#endif // _MTP_DELETE_WORKER_H
@@ -0,0 +1,370 @@
+/*
+ * Copyright (C) 2016 TeamWin Recovery Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *	  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/usb/functionfs.h>
+
+#include "MtpDebug.h"
+#include "MtpFileTransfer.h"
+#include "mtp.h"
+
+// keep buffers page aligned so the USB controller can DMA straight from them
+#define TRANSFER_BUFFER_ALIGN 4096
+
+static void putUInt16(char* dst, uint16_t value) {
+	dst[0] = (char)(value & 0xFF);
+	dst[1] = (char)(value >> 8);
+}
+
+static void putUInt32(char* dst, uint32_t value) {
+	putUInt16(dst, (uint16_t)(value & 0xFFFF));
+	putUInt16(dst + 2, (uint16_t)(value >> 16));
+}
+
+// Reads until count bytes are read or end of file, returns the bytes read
+// or -1 on error
+static ssize_t readFully(int fd, char* data, size_t count, off64_t offset, bool positional) {
+	size_t done = 0;
+	while (done < count) {
+		ssize_t ret;
+		if (positional)
+			ret = pread64(fd, data + done, count - done, offset + done);
+		else
+			ret = read(fd, data + done, count - done);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (ret == 0)
+			break;
+		done += ret;
+	}
+	return done;
+}
+
+static int writeFully(int fd, const char* data, size_t count, off64_t offset, bool positional) {
+	size_t done = 0;
+	while (done < count) {
+		ssize_t ret;
+		if (positional)
+			ret = pwrite64(fd, data + done, count - done, offset + done);
+		else
+			ret = write(fd, data + done, count - done);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		done += ret;
+	}
+	return 0;
+}
+
+// The host only sees the end of a data phase that fills its last packet
+// if it is followed by a zero length packet. FunctionFS does not add one
+// on its own, so find out the packet size of the endpoint. Anything that
+// is not a FunctionFS endpoint (f_mtp, a socket in tests) returns 0.
+size_t MtpFileTransfer::endpointPacketSize(int fd) {
+#ifdef FUNCTIONFS_ENDPOINT_DESC
+	struct usb_endpoint_descriptor desc;
+	if (ioctl(fd, FUNCTIONFS_ENDPOINT_DESC, &desc) == 0)
+		return desc.wMaxPacketSize;
+#endif
+	return 0;
+}
+
+MtpFileTransfer::MtpFileTransfer(size_t bufferSize, int bufferCount)
+	:	mBufferSize(bufferSize),
+		mProgress(NULL),
+		mPacketSize(0),
+		mRequestSize(0),
+		mHead(0),
+		mTail(0),
+		mLast(false),
+		mError(0),
+		mFileFD(-1),
+		mOffset(0),
+		mLength(0)
+{
+	if (bufferCount < 2)
+		bufferCount = 2;
+	if (mBufferSize < TRANSFER_BUFFER_ALIGN)
+		mBufferSize = TRANSFER_BUFFER_ALIGN;
+	Buffer empty = { NULL, 0 };
+	mBuffers.resize(bufferCount, empty);
+	pthread_mutex_init(&mMutex, NULL);
+	pthread_cond_init(&mCond, NULL);
+}
+
+MtpFileTransfer::~MtpFileTransfer() {
+	for (size_t i = 0; i < mBuffers.size(); i++)
+		free(mBuffers[i].data);
+	pthread_cond_destroy(&mCond);
+	pthread_mutex_destroy(&mMutex);
+}
+
+int MtpFileTransfer::allocate(int usbFd) {
+	size_t packetSize = mPacketSize ? mPacketSize : endpointPacketSize(usbFd);
+	if (!packetSize) {
+		MTPE("MtpFileTransfer: fd %d is not a FunctionFS endpoint\n", usbFd);
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+	// reads ask for whole packets, so one that comes back short is the
+	// end of the transfer
+	mRequestSize = mBufferSize - mBufferSize % packetSize;
+	if (!mRequestSize) {
+		MTPE("MtpFileTransfer: %zu byte packets don't fit the buffers\n", packetSize);
+		errno = EINVAL;
+		return -1;
+	}
+
+	// buffers are kept for the life of the server once allocated
+	for (size_t i = 0; i < mBuffers.size(); i++) {
+		if (mBuffers[i].data)
+			continue;
+		void* data;
+		int ret = posix_memalign(&data, TRANSFER_BUFFER_ALIGN, mBufferSize);
+		if (ret) {
+			MTPE("MtpFileTransfer: failed to allocate %zu byte buffer\n", mBufferSize);
+			errno = ret;
+			return -1;
+		}
+		mBuffers[i].data = (char*)data;
+	}
+	return 0;
+}
+
+void MtpFileTransfer::start(void* (*func)(void*)) {
+	mHead = 0;
+	mTail = 0;
+	mLast = false;
+	mError = 0;
+	if (mProgress) {
+		mtp_progress_set(&mProgress->transferred, 0);
+		mtp_progress_set(&mProgress->total, mLength == 0xFFFFFFFF ? 0 : mLength);
+	}
+	pthread_create(&mThread, NULL, func, this);
+}
+
+int MtpFileTransfer::finish() {
+	pthread_join(mThread, NULL);
+	if (mError) {
+		errno = mError;
+		return -1;
+	}
+	return 0;
+}
+
+MtpFileTransfer::Buffer* MtpFileTransfer::getEmpty() {
+	Buffer* buffer = NULL;
+	pthread_mutex_lock(&mMutex);
+	while (!mError && mHead - mTail == mBuffers.size())
+		pthread_cond_wait(&mCond, &mMutex);
+	if (!mError)
+		buffer = &mBuffers[mHead % mBuffers.size()];
+	pthread_mutex_unlock(&mMutex);
+	return buffer;
+}
+
+void MtpFileTransfer::putFull(bool last) {
+	pthread_mutex_lock(&mMutex);
+	mHead++;
+	if (last)
+		mLast = true;
+	pthread_cond_broadcast(&mCond);
+	pthread_mutex_unlock(&mMutex);
+}
+
+MtpFileTransfer::Buffer* MtpFileTransfer::getFull() {
+	Buffer* buffer = NULL;
+	pthread_mutex_lock(&mMutex);
+	while (!mError && !mLast && mHead == mTail)
+		pthread_cond_wait(&mCond, &mMutex);
+	if (!mError && mHead != mTail)
+		buffer = &mBuffers[mTail % mBuffers.size()];
+	pthread_mutex_unlock(&mMutex);
+	return buffer;
+}
+
+void MtpFileTransfer::putEmpty() {
+	pthread_mutex_lock(&mMutex);
+	mTail++;
+	pthread_cond_broadcast(&mCond);
+	pthread_mutex_unlock(&mMutex);
+}
+
+void MtpFileTransfer::fail(int error) {
+	pthread_mutex_lock(&mMutex);
+	if (!mError)
+		mError = (error ? error : EIO);
+	pthread_cond_broadcast(&mCond);
+	pthread_mutex_unlock(&mMutex);
+}
+
+void MtpFileTransfer::addProgress(size_t length) {
+	if (mProgress)
+		mtp_progress_add(&mProgress->transferred, length);
+}
+
+int MtpFileTransfer::sendFile(int usbFd, int fd, uint64_t offset, uint64_t length,
+		MtpOperationCode command, MtpTransactionID transactionID) {
+	if (allocate(usbFd))
+		return -1;
+
+	// the container length field saturates for objects of 4GB and more
+	uint64_t total = length + MTP_CONTAINER_HEADER_SIZE;
+	putUInt32(mHeader, total > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)total);
+	putUInt16(mHeader + 4, MTP_CONTAINER_TYPE_DATA);
+	putUInt16(mHeader + 6, command);
+	putUInt32(mHeader + 8, transactionID);
+
+	mFileFD = fd;
+	mOffset = offset;
+	mLength = length;
+	start(diskReadThread);
+
+	bool first = true;
+	Buffer* buffer;
+	while ((buffer = getFull()) != NULL) {
+		if (writeFully(usbFd, buffer->data, buffer->length, 0, false)) {
+			MTPE("MtpFileTransfer: USB write failed: %s\n", strerror(errno));
+			fail(errno);
+			break;
+		}
+		addProgress(buffer->length - (first ? MTP_CONTAINER_HEADER_SIZE : 0));
+		first = false;
+		putEmpty();
+	}
+	if (finish())
+		return -1;
+
+	size_t packetSize = mPacketSize ? mPacketSize : endpointPacketSize(usbFd);
+	if (total % packetSize == 0)
+		write(usbFd, mHeader, 0);
+	return 0;
+}
+
+void* MtpFileTransfer::diskReadThread(void* cookie) {
+	MtpFileTransfer* transfer = (MtpFileTransfer*)cookie;
+	uint64_t offset = transfer->mOffset;
+	uint64_t remaining = transfer->mLength;
+	size_t header = MTP_CONTAINER_HEADER_SIZE;
+
+	do {
+		Buffer* buffer = transfer->getEmpty();
+		if (!buffer)
+			break;
+		// the header goes out with the first chunk of data
+		memcpy(buffer->data, transfer->mHeader, header);
+		size_t count = transfer->mBufferSize - header;
+		if (count > remaining)
+			count = remaining;
+		ssize_t ret = readFully(transfer->mFileFD, buffer->data + header, count, offset, true);
+		if (ret != (ssize_t)count) {
+			// a short read means the file shrank under us
+			MTPE("MtpFileTransfer: file read failed at %llu: %s\n", (unsigned long long)offset,
+					ret < 0 ? strerror(errno) : "unexpected end of file");
+			transfer->fail(ret < 0 ? errno : EIO);
+			break;
+		}
+		buffer->length = header + count;
+		offset += count;
+		remaining -= count;
+		header = 0;
+		transfer->putFull(remaining == 0);
+	} while (remaining > 0);
+	return NULL;
+}
+
+int MtpFileTransfer::receiveFile(int usbFd, int fd, uint64_t offset, uint64_t length) {
+	if (allocate(usbFd))
+		return -1;
+
+	bool untilShort = (length == 0xFFFFFFFF);
+	mFileFD = fd;
+	mOffset = offset;
+	mLength = length;
+	start(diskWriteThread);
+
+	uint64_t remaining = length;
+	for (;;) {
+		Buffer* buffer = getEmpty();
+		if (!buffer)
+			break;
+		size_t count = mRequestSize;
+		if (!untilShort && count > remaining)
+			count = remaining;
+		ssize_t ret;
+		if (untilShort) {
+			// one request per buffer: it comes back short only at the
+			// end of the transfer, and another read would block on the
+			// next one
+			do {
+				ret = read(usbFd, buffer->data, count);
+			} while (ret < 0 && errno == EINTR);
+		} else {
+			ret = readFully(usbFd, buffer->data, count, 0, false);
+			if (ret >= 0 && ret != (ssize_t)count) {
+				MTPE("MtpFileTransfer: data phase ended %llu bytes early\n",
+						(unsigned long long)(remaining - ret));
+				errno = EIO;
+				ret = -1;
+			}
+		}
+		if (ret < 0) {
+			MTPE("MtpFileTransfer: USB read failed: %s\n", strerror(errno));
+			fail(errno);
+			break;
+		}
+		buffer->length = ret;
+		bool last;
+		if (untilShort) {
+			last = ((size_t)ret < count);
+		} else {
+			remaining -= ret;
+			last = (remaining == 0);
+		}
+		putFull(last);
+		if (last)
+			break;
+	}
+	return finish();
+}
+
+void* MtpFileTransfer::diskWriteThread(void* cookie) {
+	MtpFileTransfer* transfer = (MtpFileTransfer*)cookie;
+	uint64_t offset = transfer->mOffset;
+
+	Buffer* buffer;
+	while ((buffer = transfer->getFull()) != NULL) {
+		if (writeFully(transfer->mFileFD, buffer->data, buffer->length, offset, true)) {
+			MTPE("MtpFileTransfer: file write failed at %llu: %s\n", (unsigned long long)offset,
+					strerror(errno));
+			transfer->fail(errno);
+			break;
+		}
+		offset += buffer->length;
+		transfer->addProgress(buffer->length);
+		transfer->putEmpty();
+	}
+	return NULL;
+}
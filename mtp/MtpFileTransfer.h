@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2016 TeamWin Recovery Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *	  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MTP_FILE_TRANSFER_H
+#define _MTP_FILE_TRANSFER_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <vector>
+
+#include "MtpTypes.h"
+#include "MtpMessage.hpp"
+
+// Moves file data between a FunctionFS bulk endpoint and the disk in
+// user space, as the f_mtp MTP_SEND_FILE_WITH_HEADER and MTP_RECEIVE_FILE
+// ioctls do in the kernel. A helper thread does the disk side while the
+// calling thread does the USB side, handing a ring of aligned buffers
+// back and forth so both stay busy.
+//
+// It relies on FunctionFS semantics: each write() queues one request
+// and only a short or zero length packet ends the transfer, and a
+// read() completes when its request is full or the transfer ends. f_mtp
+// ends the transfer at the end of every write() and rejects reads
+// larger than its receive request, so its endpoint is refused.
+class MtpFileTransfer {
+public:
+	MtpFileTransfer(size_t bufferSize = kDefaultBufferSize, int bufferCount = kDefaultBufferCount);
+	~MtpFileTransfer();
+
+	// progress is updated after each buffer, may be NULL
+	void setProgress(mtp_transfer_progress* progress) { mProgress = progress; }
+	// Packet size to use for an fd that behaves like a FunctionFS
+	// endpoint but can't report one (the sockets in the tests). 0 asks
+	// the endpoint.
+	void setPacketSize(size_t packetSize) { mPacketSize = packetSize; }
+
+	// The max packet size of a FunctionFS endpoint, 0 for anything else
+	static size_t endpointPacketSize(int fd);
+
+	// Sends a complete data phase to usbFd: the container header followed
+	// by length bytes of fd starting at offset.
+	// Returns 0 or -1 with errno set, EOPNOTSUPP if usbFd isn't a
+	// FunctionFS endpoint.
+	int sendFile(int usbFd, int fd, uint64_t offset, uint64_t length,
+			MtpOperationCode command, MtpTransactionID transactionID);
+	// Receives length bytes of a data phase from usbFd and writes them to fd
+	// at offset. A length of 0xFFFFFFFF reads until a short read, which is
+	// how the host ends transfers of 4GB and more.
+	// Returns 0 or -1 with errno set, EOPNOTSUPP if usbFd isn't a
+	// FunctionFS endpoint.
+	int receiveFile(int usbFd, int fd, uint64_t offset, uint64_t length);
+
+	static const size_t kDefaultBufferSize = 256 * 1024;
+	static const int kDefaultBufferCount = 4;
+
+private:
+	struct Buffer {
+		char* data;
+		size_t length;
+	};
+
+	int allocate(int usbFd);
+	void start(void* (*func)(void*));
+	int finish();
+
+	// ring handling, shared by both directions
+	Buffer* getEmpty();
+	void putFull(bool last);
+	Buffer* getFull();
+	void putEmpty();
+	void fail(int error);
+	void addProgress(size_t length);
+
+	static void* diskReadThread(void* cookie);
+	static void* diskWriteThread(void* cookie);
+
+	std::vector<Buffer> mBuffers;
+	size_t mBufferSize;
+	mtp_transfer_progress* mProgress;
+	size_t mPacketSize; // set by setPacketSize(), 0 to ask the endpoint
+	size_t mRequestSize; // bytes per USB read, whole packets
+
+	pthread_mutex_t mMutex;
+	pthread_cond_t mCond;
+	pthread_t mThread;
+	unsigned int mHead; // next buffer to fill
+	unsigned int mTail; // next buffer to drain
+	bool mLast; // no more buffers will be filled
+	int mError; // errno of the side that failed, 0 if none
+
+	// the disk side of the current transfer
+	int mFileFD;
+	uint64_t mOffset;
+	uint64_t mLength;
+	char mHeader[12];
+};
+
+#endif // _MTP_FILE_TRANSFER_H
@@ -30,4 +30,25 @@ struct mtpmsg {
 	uint64_t maxFileSize;
 };
 
+// Progress of the current file transfer. The recovery maps this shared
+// before forking the MTP process so the GUI can show it. The counters are
+// written by the transfer threads while the GUI reads them, so access them
+// through the helpers below.
+struct mtp_transfer_progress {
+	uint64_t transferred;
+	uint64_t total;
+};
+
+static inline uint64_t mtp_progress_get(const uint64_t* value) {
+	return __atomic_load_n(value, __ATOMIC_RELAXED);
+}
+
+static inline void mtp_progress_set(uint64_t* value, uint64_t n) {
+	__atomic_store_n(value, n, __ATOMIC_RELAXED);
+}
+
+static inline void mtp_progress_add(uint64_t* value, uint64_t n) {
+	__atomic_fetch_add(value, n, __ATOMIC_RELAXED);
+}
+
 #endif //_MTPMESSAGE_HPP
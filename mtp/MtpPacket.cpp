@@ -48,12 +48,18 @@ MtpPacket::~MtpPacket() {
 void MtpPacket::reset() {
 	allocate(MTP_CONTAINER_HEADER_SIZE);
 	mPacketSize = MTP_CONTAINER_HEADER_SIZE;
-	memset(mBuffer, 0, mBufferSize);
+	// the buffer is kept at whatever size the largest packet of the
+	// session needed, only clear as much as a normal packet uses
+	memset(mBuffer, 0, mBufferSize < mAllocationIncrement ? mBufferSize : mAllocationIncrement);
 }
 
 void MtpPacket::allocate(int length) {
 	if (length > mBufferSize) {
+		// at least double, so building a large packet only copies it a
+		// few times
 		int newLength = length + mAllocationIncrement;
+		if (newLength < mBufferSize * 2)
+			newLength = mBufferSize * 2;
 		mBuffer = (uint8_t *)realloc(mBuffer, newLength);
 		if (!mBuffer) {
 			MTPE("out of memory!");
@@ -63,11 +69,27 @@ void MtpPacket::allocate(int length) {
 	}
 }
 
+void MtpPacket::trim() {
+	if (mBufferSize > mAllocationIncrement) {
+		uint8_t* buffer = (uint8_t *)realloc(mBuffer, mAllocationIncrement);
+		if (buffer) {
+			mBuffer = buffer;
+			mBufferSize = mAllocationIncrement;
+			if (mPacketSize > (unsigned)mBufferSize)
+				mPacketSize = mBufferSize;
+		}
+	}
+}
+
 void MtpPacket::dump() {
 #define DUMP_BYTES_PER_ROW  16
 	char buffer[500];
 	char* bufptr = buffer;
 
+	// formatting every byte of a large packet takes longer than sending it
+	if (!MtpDebug::isDebugEnabled())
+		return;
+
 	for (size_t i = 0; i < mPacketSize; i++) {
 		sprintf(bufptr, "%02X ", mBuffer[i]);
 		bufptr += strlen(bufptr);
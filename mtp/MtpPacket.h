@@ -43,6 +43,9 @@ public:
     virtual void        reset();
 
     void                allocate(int length);
+    // gives back the memory of packets larger than the initial size,
+    // which is otherwise kept for the next packet
+    void                trim();
     void                dump();
     void                copyFrom(const MtpPacket& src);
 
@@ -32,6 +32,8 @@
 #include "MtpTypes.h"
 #include "MtpDebug.h"
 #include "MtpDatabase.h"
+#include "MtpDeleteWorker.h"
+#include "MtpFileTransfer.h"
 #include "MtpObjectInfo.h"
 #include "MtpProperty.h"
 #include "MtpServer.h"
@@ -107,12 +109,24 @@ MtpServer::MtpServer(MtpDatabase* database, bool ptp,
 		mSessionOpen(false),
 		mSendObjectHandle(kInvalidObjectHandle),
 		mSendObjectFormat(0),
-		mSendObjectFileSize(0)
+		mSendObjectFileSize(0),
+		mTransfer(NULL),
+		mTransferPacketSize(0),
+		mProgress(NULL),
+		mDeleter(new MtpDeleteWorker())
 {
 	mFD = -1;
 }
 
 MtpServer::~MtpServer() {
+	delete mTransfer;
+	delete mDeleter;
+}
+
+void MtpServer::setTransferProgress(mtp_transfer_progress* progress) {
+	mProgress = progress;
+	if (mTransfer)
+		mTransfer->setProgress(progress);
 }
 
 void MtpServer::addStorage(MtpStorage* storage) {
@@ -189,10 +203,20 @@ void MtpServer::run(int fd) {
 
 	mFD = fd;
 	MTPI("MtpServer::run fd: %d\n", fd);
+	// f_mtp has no use for the user space engine, its ioctls do the job
+	size_t packetSize = MtpFileTransfer::endpointPacketSize(fd);
+	if (packetSize)
+		setUserSpaceTransfer(packetSize);
 
 	while (1) {
 		MTPD("About to read device...\n");
 		int ret = mRequest.read(fd);
+		if (ret == 0) {
+			// the USB driver never returns an empty command, but a
+			// socket (see tests/mtp_loopback_test.cpp) ends this way
+			MTPI("end of stream, exiting MtpServer::run loop\n");
+			break;
+		}
 		if (ret < 0) {
 			if (errno == ECANCELED) {
 				// return to top of loop and wait for next command
@@ -278,6 +302,7 @@ void MtpServer::run(int fd) {
 
 	if (mSessionOpen)
 		mDatabase->sessionEnded(); // This doesn't actually do anything but was carry over from AOSP
+	mData.trim();
 	close(fd);
 	mFD = -1;
 }
@@ -297,6 +322,14 @@ void MtpServer::sendObjectUpdated(MtpObjectHandle handle) {
 	sendEvent(MTP_EVENT_OBJECT_PROP_CHANGED, handle);
 }
 
+// For more changes than are worth sending one by one: hosts drop what they
+// know about a storage when it goes away, and read it again when it is back
+void MtpServer::sendStoreChanged(MtpStorageID id) {
+	MTPD("sendStoreChanged %08X\n", id);
+	sendEvent(MTP_EVENT_STORE_REMOVED, id);
+	sendEvent(MTP_EVENT_STORE_ADDED, id);
+}
+
 void MtpServer::sendStoreAdded(MtpStorageID id) {
 	MTPD("sendStoreAdded %08X\n", id);
 	sendEvent(MTP_EVENT_STORE_ADDED, id);
@@ -571,6 +604,8 @@ MtpResponseCode MtpServer::doCloseSession() {
 	mSessionID = 0;
 	mSessionOpen = false;
 	mDatabase->sessionEnded();
+	// the data packet keeps its largest size for the whole session
+	mData.trim();
 	return MTP_RESPONSE_OK;
 }
 
@@ -858,8 +893,7 @@ MtpResponseCode MtpServer::doGetObject() {
 	mfr.transaction_id = mRequest.getTransactionID();
 
 	// then transfer the file
-	int ret = ioctl(mFD, MTP_SEND_FILE_WITH_HEADER, (unsigned long)&mfr);
-	MTPD("MTP_SEND_FILE_WITH_HEADER returned %d\n", ret);
+	int ret = sendFile(mfr);
 	close(mfr.fd);
 	if (ret < 0) {
 		if (errno == ECANCELED)
@@ -930,8 +964,7 @@ MtpResponseCode MtpServer::doGetPartialObject(MtpOperationCode operation) {
 	mResponse.setParameter(1, length);
 
 	// transfer the file
-	int ret = ioctl(mFD, MTP_SEND_FILE_WITH_HEADER, (unsigned long)&mfr);
-	MTPD("MTP_SEND_FILE_WITH_HEADER returned %d\n", ret);
+	int ret = sendFile(mfr);
 	close(mfr.fd);
 	if (ret < 0) {
 		if (errno == ECANCELED)
@@ -1104,7 +1137,7 @@ MtpResponseCode MtpServer::doSendObject() {
 
 		MTPD("receiving %s\n", (const char *)mSendObjectFilePath);
 		// transfer the file
-		ret = ioctl(mFD, MTP_RECEIVE_FILE, (unsigned long)&mfr);
+		ret = receiveFile(mfr);
 	}
 	close(mfr.fd);
 	tw_set_default_metadata((const char *)mSendObjectFilePath);
@@ -1121,7 +1154,7 @@ MtpResponseCode MtpServer::doSendObject() {
 
 done:
 	// reset so we don't attempt to send the data back
-	MTPD("MTP_RECEIVE_FILE returned %d\n", ret);
+	MTPD("receiveFile returned %d\n", ret);
 	mData.reset();
 	mDatabase->lockMutex();
 	mDatabase->endSendObject(mSendObjectFilePath, mSendObjectHandle, mSendObjectFormat,
@@ -1133,69 +1166,44 @@ done:
 	return result;
 }
 
-static void deleteRecursive(const char* path) {
-	char pathbuf[PATH_MAX];
-	size_t pathLength = strlen(path);
-	if (pathLength >= sizeof(pathbuf) - 1) {
-		MTPE("path too long: %s\n", path);
-	}
-	strcpy(pathbuf, path);
-	if (pathbuf[pathLength - 1] != '/') {
-		pathbuf[pathLength++] = '/';
-	}
-	char* fileSpot = pathbuf + pathLength;
-	int pathRemaining = sizeof(pathbuf) - pathLength - 1;
+void MtpServer::deleteInBackground(const std::string& path) {
+	mDeleter->deletePath(path);
+}
 
-	DIR* dir = opendir(path);
-	if (!dir) {
-		MTPE("opendir %s failed: %s", path, strerror(errno));
-		return;
+MtpFileTransfer* MtpServer::getTransfer() {
+	if (!mTransfer) {
+		mTransfer = new MtpFileTransfer();
+		mTransfer->setProgress(mProgress);
 	}
+	mTransfer->setPacketSize(mTransferPacketSize);
+	return mTransfer;
+}
 
-	struct dirent* entry;
-	while ((entry = readdir(dir))) {
-		const char* name = entry->d_name;
-
-		// ignore "." and ".."
-		if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0))) {
-			continue;
-		}
-
-		int nameLength = strlen(name);
-		if (nameLength > pathRemaining) {
-			MTPE("path %s/%s too long\n", path, name);
-			continue;
-		}
-		strcpy(fileSpot, name);
-
-		int type = entry->d_type;
-		struct stat st;
-		if (lstat(pathbuf, &st)) {
-			MTPE("Failed to lstat '%s'\n", pathbuf);
-			continue;
-		}
-		if (st.st_mode & S_IFDIR) {
-			deleteRecursive(pathbuf);
-			rmdir(pathbuf);
-		} else {
-			unlink(pathbuf);
+int MtpServer::sendFile(mtp_file_range& mfr) {
+	if (!mTransferPacketSize) {
+		int ret = ioctl(mFD, MTP_SEND_FILE_WITH_HEADER, (unsigned long)&mfr);
+		MTPD("MTP_SEND_FILE_WITH_HEADER returned %d\n", ret);
+		if (ret >= 0 && mProgress) {
+			mtp_progress_set(&mProgress->total, mfr.length);
+			mtp_progress_set(&mProgress->transferred, mfr.length);
 		}
+		return ret;
 	}
-	closedir(dir);
+	return getTransfer()->sendFile(mFD, mfr.fd, mfr.offset, mfr.length,
+			mfr.command, mfr.transaction_id);
 }
 
-static void deletePath(const char* path) {
-	struct stat statbuf;
-	if (stat(path, &statbuf) == 0) {
-		if (S_ISDIR(statbuf.st_mode)) {
-			deleteRecursive(path);
-			rmdir(path);
-		} else {
-			unlink(path);
+int MtpServer::receiveFile(mtp_file_range& mfr) {
+	if (!mTransferPacketSize) {
+		int ret = ioctl(mFD, MTP_RECEIVE_FILE, (unsigned long)&mfr);
+		MTPD("MTP_RECEIVE_FILE returned %d\n", ret);
+		if (ret >= 0 && mProgress && mfr.length != 0xFFFFFFFF) {
+			mtp_progress_set(&mProgress->total, mfr.length);
+			mtp_progress_set(&mProgress->transferred, mfr.length);
 		}
-	} else {
-		MTPE("deletePath stat failed for %s: %s", path, strerror(errno));
+		return ret;
 	}
+	return getTransfer()->receiveFile(mFD, mfr.fd, mfr.offset, mfr.length);
 }
 
 MtpResponseCode MtpServer::doDeleteObject() {
@@ -1213,10 +1221,31 @@ MtpResponseCode MtpServer::doDeleteObject() {
 	int result = mDatabase->getObjectFilePath(handle, filePath, fileLength, format);
 	if (result == MTP_RESPONSE_OK) {
 		MTPD("deleting %s", (const char *)filePath);
+		// this also drops the inotify watches of everything below, so
+		// deleting the files does not send events back at us
 		result = mDatabase->deleteFile(handle);
 		// Don't delete the actual files unless the database deletion is allowed
 		if (result == MTP_RESPONSE_OK) {
-			deletePath((const char *)filePath);
+			if (format != MTP_FORMAT_ASSOCIATION) {
+				if (unlink((const char *)filePath))
+					MTPE("unlink '%s' failed: %s\n", (const char *)filePath, strerror(errno));
+			} else {
+				// move the folder out of the way so its name is free
+				// again right away, and delete it in the background
+				std::string path((const char *)filePath);
+				char name[32];
+				snprintf(name, sizeof(name), MTP_DELETE_PREFIX "%u", handle);
+				std::string hidden = path.substr(0, path.rfind('/') + 1) + name;
+				if (rename(path.c_str(), hidden.c_str()) == 0) {
+					deleteInBackground(hidden);
+				} else {
+					// the folder keeps its name, so it has to be gone
+					// before the host can make a new one with it
+					MTPE("rename '%s' failed: %s, deleting it now\n", path.c_str(), strerror(errno));
+					MtpDeleteWorker deleter;
+					deleter.deletePath(path);
+				}
+			}
 		}
 	}
 	mDatabase->unlockMutex();
@@ -1298,8 +1327,8 @@ MtpResponseCode MtpServer::doSendPartialObject() {
 		mfr.length = length;
 
 		// transfer the file
-		ret = ioctl(mFD, MTP_RECEIVE_FILE, (unsigned long)&mfr);
-		MTPD("MTP_RECEIVE_FILE returned %d", ret);
+		ret = receiveFile(mfr);
+		MTPD("receiveFile returned %d", ret);
 	}
 	if (ret < 0) {
 		mResponse.setParameter(1, 0);
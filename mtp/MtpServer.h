@@ -19,6 +19,7 @@
 #ifndef _MTP_SERVER_H
 #define _MTP_SERVER_H
 
+#include <string>
 #include <utils/threads.h>
 #include <utils/Vector.h>
 #include "MtpRequestPacket.h"
@@ -28,9 +29,13 @@
 #include "MtpEventPacket.h"
 #include "mtp.h"
 #include "MtpUtils.h"
+#include "MtpMessage.hpp"
 
+struct mtp_file_range;
 
 class MtpDatabase;
+class MtpDeleteWorker;
+class MtpFileTransfer;
 class MtpStorage;
 
 class MtpServer {
@@ -70,6 +75,16 @@ private:
 
 	pthread_mutex_t mtpMutex;
 
+    // user space file transfers, used instead of the f_mtp file ioctls
+    // on a FunctionFS endpoint
+    MtpFileTransfer*    mTransfer;
+    // packet size of the endpoint for mTransfer, 0 to use the ioctls
+    size_t              mTransferPacketSize;
+    // progress of the current transfer, shared with the GUI, may be NULL
+    mtp_transfer_progress* mProgress;
+    // removes deleted folders in the background
+    MtpDeleteWorker*    mDeleter;
+
     // represents an MTP object that is being edited using the android extensions
     // for direct editing (BeginEditObject, SendPartialObject, TruncateObject and EndEditObject)
     class ObjectEdit {
@@ -103,10 +118,19 @@ public:
     void                removeStorage(MtpStorage* storage);
 
     void                run(int fd);
+    void                setTransferProgress(mtp_transfer_progress* progress);
+    // move file data with reads and writes instead of the f_mtp file
+    // ioctls, for an fd that ends transfers like a FunctionFS endpoint
+    // with this packet size. run() turns it on for FunctionFS; 0 goes
+    // back to the ioctls.
+    void                setUserSpaceTransfer(size_t packetSize) { mTransferPacketSize = packetSize; }
 
     void                sendObjectAdded(MtpObjectHandle handle);
     void                sendObjectRemoved(MtpObjectHandle handle);
     void                sendObjectUpdated(MtpObjectHandle handle);
+    void                sendStoreChanged(MtpStorageID id);
+    // deletes a file or folder that is no longer in any storage
+    void                deleteInBackground(const std::string& path);
 
 private:
     void                sendStoreAdded(MtpStorageID id);
@@ -121,6 +145,10 @@ private:
 
     bool                handleRequest();
 
+    MtpFileTransfer*    getTransfer();
+    int                 sendFile(mtp_file_range& mfr);
+    int                 receiveFile(mtp_file_range& mfr);
+
     MtpResponseCode     doGetDeviceInfo();
     MtpResponseCode     doOpenSession();
     MtpResponseCode     doCloseSession();
@@ -22,6 +22,7 @@
 #include "MtpServer.h"
 #include "MtpEventPacket.h"
 #include "MtpDatabase.h"
+#include "MtpDeleteWorker.h"
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -31,14 +32,94 @@
 #include <errno.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <limits.h>
 #include <pthread.h>
 #include <signal.h>
 #include <sys/inotify.h>
+#include <sys/syscall.h>
 #include <fcntl.h>
+#include <time.h>
+#include <algorithm>
 #include "../tw_atomic.hpp"
 
-#define WATCH_FLAGS ( IN_CREATE | IN_DELETE | IN_MOVE | IN_MODIFY )
+#define WATCH_FLAGS ( IN_CREATE | IN_DELETE | IN_MOVE | IN_MODIFY | IN_CLOSE_WRITE )
+// a file being written is checked for changes at most this often
+#define INOTIFY_MODIFY_WINDOW_MS 500
+// host notifications go out in batches of at most
+// INOTIFY_EVENTS_PER_FLUSH every INOTIFY_EVENT_INTERVAL_MS, and with more
+// than INOTIFY_EVENT_BURST queued the host is told to rescan instead
+#define INOTIFY_EVENT_INTERVAL_MS 50
+#define INOTIFY_EVENTS_PER_FLUSH 64
+#define INOTIFY_EVENT_BURST 1024
+
+// The object database of each storage is kept here, named after the
+// filesystem and the storage root
+#define MTP_DB_DIR "/tmp/mtp"
+#define MTP_DB_MAGIC "TWMTPDB1"
+#define MTP_DB_DIR_FLAG 1	// record is a directory
+#define MTP_DB_READ_FLAG 2	// its entries follow
+// saved once nothing changed for this long
+#define MTP_DB_SAVE_DELAY_MS 3000
+// a directory changed this recently is saved as not read: with a 1s
+// mtime resolution, a change right after saving might not show up
+#define MTP_DB_RACY_SECONDS 2
+// handles in a database stay below this: they are handed out in order,
+// with room for other storages and for objects deleted while MTP ran
+#define MTP_DB_MAX_HANDLE(records) ((uint64_t)(records) * 16 + 1024 * 1024)
+
+static std::string dbDir = MTP_DB_DIR;
+
+// Object handles are unique across all storages. Handles restored from
+// the database are claimed back, new ones keep counting up so a handle
+// is not reused for a different object while MTP is running.
+static pthread_mutex_t handleMutex = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<bool> handlesInUse;
+static MtpObjectHandle nextHandle = 1;
+
+static MtpObjectHandle allocateHandle() {
+	pthread_mutex_lock(&handleMutex);
+	while (nextHandle < handlesInUse.size() && handlesInUse[nextHandle])
+		++nextHandle;
+	MtpObjectHandle handle = nextHandle++;
+	if (handle >= handlesInUse.size())
+		handlesInUse.resize(handle + 1024, false);
+	handlesInUse[handle] = true;
+	pthread_mutex_unlock(&handleMutex);
+	return handle;
+}
+
+static bool claimHandle(MtpObjectHandle handle) {
+	if (handle == 0 || handle >= 0x80000000)
+		return false;
+	pthread_mutex_lock(&handleMutex);
+	bool claimed = false;
+	if (handle >= handlesInUse.size())
+		handlesInUse.resize(handle + 1024, false);
+	if (!handlesInUse[handle]) {
+		handlesInUse[handle] = true;
+		claimed = true;
+	}
+	pthread_mutex_unlock(&handleMutex);
+	return claimed;
+}
+
+// new handles start above those in a database, so objects restored later
+// don't find their handle taken
+static void skipHandles(MtpObjectHandle last) {
+	pthread_mutex_lock(&handleMutex);
+	if (nextHandle <= last)
+		nextHandle = last + 1;
+	pthread_mutex_unlock(&handleMutex);
+}
+
+static void releaseHandle(MtpObjectHandle handle) {
+	pthread_mutex_lock(&handleMutex);
+	if (handle < handlesInUse.size())
+		handlesInUse[handle] = false;
+	pthread_mutex_unlock(&handleMutex);
+}
+#define READDIR_CHUNK_SIZE ( 32 * 1024 )
 
 MtpStorage::MtpStorage(MtpStorageID id, const char* filePath,
 		const char* description, uint64_t reserveSpace,
@@ -50,7 +131,13 @@ MtpStorage::MtpStorage(MtpStorageID id, const char* filePath,
 		mMaxFileSize(maxFileSize),
 		mReserveSpace(reserveSpace),
 		mRemovable(removable),
-		mServer(refserver)
+		mServer(refserver),
+		mtproot(NULL),
+		volumeID(0),
+		rootDev(0),
+		rootIno(0),
+		dbDirty(false),
+		lastChange(0)
 {
 	MTPI("MtpStorage id: %d path: %s\n", id, filePath);
 	inotify_thread = 0;
@@ -59,6 +146,8 @@ MtpStorage::MtpStorage(MtpStorageID id, const char* filePath,
 	inotify_thread_kill.set_value(0);
 	sendEvents = false;
 	handleCurrentlySending = 0;
+	pendingStoreChanged = false;
+	nextEventFlush = 0;
 	use_mutex = true;
 	if (pthread_mutex_init(&mtpMutex, NULL) != 0) {
 		MTPE("Failed to init mtpMutex\n");
@@ -83,11 +172,20 @@ MtpStorage::~MtpStorage() {
 		}
 		close(inotify_fd);
 		inotifymap.clear();
+		inotifywds.clear();
+	}
+	if (dbDirty)
+		saveDB();
+	// the handles can be claimed again when the storage comes back
+	for (size_t i = 0; i < nodeindex.size(); i++) {
+		if (nodeindex[i])
+			releaseHandle(i);
 	}
 	// Deleting the root tree causes a cascade in btree.cpp that ends up
 	// deleting all of the trees and nodes.
-	delete mtpmap[0];
-	mtpmap.clear();
+	delete mtproot;
+	mtproot = NULL;
+	nodeindex.clear();
 	if (use_mutex) {
 		use_mutex = false;
 		MTPD("~MtpStorage destroying mutexes\n");
@@ -134,7 +232,7 @@ int MtpStorage::createDB() {
 	std::string mtpParent = "";
 	mtpstorageparent = getPath();
 	// root directory is special: handle 0, parent 0, and empty path
-	mtpmap[0] = new Tree(0, 0, "");
+	mtproot = new Tree(0, 0, "");
 	MTPD("MtpStorage::createDB DONE\n");
 	if (use_mutex) {
 		sendEvents = true;
@@ -149,9 +247,31 @@ int MtpStorage::createDB() {
 	} else {
 		MTPD("NOT starting inotify thread\n");
 	}
-	// for debugging and caching purposes, read the root dir already now
-	readDir(mtpstorageparent, mtpmap[0]);
-	// all other dirs are read on demand
+
+	// the database is keyed by the filesystem (statfs has an id derived
+	// from the volume UUID on ext4 and f2fs) and the storage root
+	struct statfs sfs;
+	struct stat st;
+	if (statfs(getPath(), &sfs) == 0 && lstat(getPath(), &st) == 0) {
+		uint64_t fsid = 0;
+		memcpy(&fsid, &sfs.f_fsid, sizeof(fsid) < sizeof(sfs.f_fsid) ? sizeof(fsid) : sizeof(sfs.f_fsid));
+		volumeID = (uint32_t)(fsid ^ (fsid >> 32));
+		rootDev = st.st_dev;
+		rootIno = st.st_ino;
+		char name[64];
+		snprintf(name, sizeof(name), "/%016llx-%llx.db", (unsigned long long)fsid, (unsigned long long)st.st_ino);
+		dbPath = dbDir + name;
+	}
+	if (volumeID == 0)
+		volumeID = mStorageID;
+
+	lockMutex(0);
+	if (loadDB() != 0) {
+		// for debugging and caching purposes, read the root dir already now
+		readDir(mtpstorageparent, mtproot);
+		// all other dirs are read on demand
+	}
+	unlockMutex(0);
 	return 0;
 }
 
@@ -164,12 +284,12 @@ MtpObjectHandleList* MtpStorage::getObjectList(MtpStorageID storageID, MtpObject
 		parent = 0;
 	}
 
-	if (mtpmap.find(parent) == mtpmap.end()) {
+	Tree* tree = findTree(parent);
+	if (!tree) {
 		MTPE("parent handle not found, returning empty list\n");
 		return list;
 	}
 
-	Tree* tree = mtpmap[parent];
 	if (!tree->wasAlreadyRead())
 	{
 		std::string path = getNodePath(tree);
@@ -177,7 +297,7 @@ MtpObjectHandleList* MtpStorage::getObjectList(MtpStorageID storageID, MtpObject
 		readDir(path, tree);
 	}
 
-	mtpmap[parent]->getmtpids(list);
+	tree->getmtpids(list);
 	MTPD("returning %u objects in %s.\n", list->size(), tree->getName().c_str());
 	return list;
 }
@@ -219,12 +339,11 @@ MtpObjectHandle MtpStorage::beginSendObject(const char* path,
 											uint64_t size,
 											time_t modified) {
 	MTPD("MtpStorage::beginSendObject(), path: '%s', parent: %u, format: %04x\n", path, parent, format);
-	iter it = mtpmap.find(parent);
-	if (it == mtpmap.end()) {
+	Tree* tree = findTree(parent);
+	if (!tree) {
 		MTPE("parent node not found, returning error\n");
 		return kInvalidObjectHandle;
 	}
-	Tree* tree = it->second;
 
 	std::string pathstr(path);
 	size_t slashpos = pathstr.find_last_of('/');
@@ -254,7 +373,7 @@ void MtpStorage::endSendObject(const char* path, MtpObjectHandle handle, MtpObje
 	if (!node)
 		return;	// just ignore if this is for another storage
 
-	node->addProperties(path, mStorageID);
+	node->readProperties(path);
 	handleCurrentlySending = 0;
 	// TODO: are we supposed to send an event about an upload by the initiator?
 	if (sendEvents)
@@ -283,41 +402,80 @@ int MtpStorage::getObjectFilePath(MtpObjectHandle handle, MtpString& outFilePath
 
 int MtpStorage::readDir(const std::string& path, Tree* tree)
 {
-	struct dirent *de;
-	int storageID = getStorageID();
+	return readDir(path, tree, NULL, NULL);
+}
+
+// With saved entries from the database, entries that are still the same
+// file keep their handle, and saved subdirectories are restored too
+int MtpStorage::readDir(const std::string& path, Tree* tree, const DBEntries* saved, const DBDirs* dirs)
+{
 	MtpObjectHandle parent = tree->Mtpid();
+	std::vector<std::pair<Tree*, const DBRecord*> > restore;
 
-	DIR *d = opendir(path.c_str());
+	int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
 	MTPD("reading dir '%s', parent handle %u\n", path.c_str(), parent);
-	if (d == NULL) {
+	if (fd < 0) {
 		MTPE("error opening '%s' -- error: %s\n", path.c_str(), strerror(errno));
 		return -1;
 	}
+	char* buf = (char*)malloc(READDIR_CHUNK_SIZE);
+	if (!buf) {
+		close(fd);
+		return -1;
+	}
+	// start watching first, so nothing created while reading is missed
+	addInotify(tree);
+
 	// TODO: for refreshing dirs: capture old entries here
-	while ((de = readdir(d)) != NULL) {
-		// Because exfat-fuse causes issues with dirent, we will use stat
-		// for some things that dirent should be able to do
-		std::string item = path + "/" + de->d_name;
-		struct stat st;
-		if (lstat(item.c_str(), &st)) {
-			MTPE("Error running lstat on '%s'\n", item.c_str());
-			return -1;
+	// read the directory a chunk of entries at a time, and stat each entry
+	// relative to the directory instead of looking up its full path again
+	int len;
+	while ((len = syscall(SYS_getdents64, fd, buf, READDIR_CHUNK_SIZE)) > 0) {
+		for (int pos = 0; pos < len; ) {
+			// getdents64 fills the buffer with 64-bit entries, which
+			// struct dirent does not match on every libc
+			struct dirent64* de = (struct dirent64*)(buf + pos);
+			pos += de->d_reclen;
+			if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+				continue;
+			if (MtpDeleteWorker::isDeletePath(de->d_name)) {
+				// left over when MTP was stopped while deleting it
+				if (mServer)
+					mServer->deleteInBackground(path + "/" + de->d_name);
+				continue;
+			}
+			// Because exfat-fuse causes issues with dirent, we will use stat
+			// for some things that dirent should be able to do
+			struct stat st;
+			if (fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW)) {
+				MTPE("Error running lstat on '%s/%s': %s\n", path.c_str(), de->d_name, strerror(errno));
+				continue;
+			}
+			// TODO: if we want to use this for refreshing dirs too, first find existing name and overwrite
+			const DBRecord* record = NULL;
+			if (saved) {
+				DBEntries::const_iterator it = saved->find(de->d_name);
+				if (it != saved->end() && it->second->inode == (uint64_t)st.st_ino &&
+						((it->second->flags & MTP_DB_DIR_FLAG) != 0) == S_ISDIR(st.st_mode))
+					record = it->second;
+			}
+			Node* node = addNewNode(S_ISDIR(st.st_mode), tree, de->d_name, record ? record->handle : 0);
+			node->setProperties(st);
+			if (record && node->isDir())
+				restore.push_back(std::make_pair(static_cast<Tree*>(node), record));
+			//if (sendEvents)
+			//	mServer->sendObjectAdded(node->Mtpid());
+			//	sending events here makes simple-mtpfs very slow, and it is probably the wrong thing to do anyway
 		}
-		// TODO: if we want to use this for refreshing dirs too, first find existing name and overwrite
-		if (strcmp(de->d_name, ".") == 0)
-			continue;
-		if (strcmp(de->d_name, "..") == 0)
-			continue;
-		Node* node = addNewNode(st.st_mode & S_IFDIR, tree, de->d_name);
-		node->addProperties(item, storageID);
-		//if (sendEvents)
-		//	mServer->sendObjectAdded(node->Mtpid());
-		//	sending events here makes simple-mtpfs very slow, and it is probably the wrong thing to do anyway
 	}
-	closedir(d);
+	if (len < 0)
+		MTPE("error reading '%s' -- error: %s\n", path.c_str(), strerror(errno));
+	free(buf);
+	close(fd);
 	// TODO: for refreshing dirs: remove entries that no longer exist (with their nodes)
 	tree->setAlreadyRead(true);
-	addInotify(tree);
+	for (size_t i = 0; i < restore.size(); i++)
+		restoreTree(restore[i].first, *restore[i].second, path + "/" + restore[i].first->getName(), *dirs);
 	return 0;
 }
 
@@ -328,16 +486,14 @@ int MtpStorage::deleteFile(MtpObjectHandle handle) {
 		// Item is not on this storage device
 		return -1;
 	}
-	MtpObjectHandle parent = node->getMtpParentId();
-	Tree* tree = mtpmap[parent];
+	Tree* tree = node->getParentTree();
 	if (!tree) {
-		MTPE("parent tree for handle %u not found\n", parent);
+		MTPE("parent tree for handle %u not found\n", node->getMtpParentId());
 		return -1;
 	}
-	if (node->isDir()) {
-		MTPD("deleting tree from mtpmap: %u\n", handle);
-		mtpmap.erase(handle);
-	}
+	// drop the node and everything below it from the index before the
+	// tree deletes them
+	unindexNode(node);
 
 	MTPD("deleting handle: %u\n", handle);
 	tree->deleteNode(handle);
@@ -345,183 +501,233 @@ int MtpStorage::deleteFile(MtpObjectHandle handle) {
 	return 0;
 }
 
-void MtpStorage::queryNodeProperties(std::vector<MtpStorage::PropEntry>& results, Node* node, uint32_t property, int groupCode, MtpStorageID storageID)
+// Properties reported for every object, in the order they are listed when
+// all properties are requested
+static const MtpObjectProperty kNodeProperties[] = {
+	MTP_PROPERTY_STORAGE_ID,
+	MTP_PROPERTY_OBJECT_FORMAT,
+	MTP_PROPERTY_PROTECTION_STATUS,
+	MTP_PROPERTY_OBJECT_SIZE,
+	MTP_PROPERTY_OBJECT_FILE_NAME,
+	MTP_PROPERTY_DATE_MODIFIED,
+	MTP_PROPERTY_PARENT_OBJECT,
+	MTP_PROPERTY_PERSISTENT_UID,
+	MTP_PROPERTY_NAME,
+	MTP_PROPERTY_DISPLAY_NAME,
+	MTP_PROPERTY_DATE_ADDED,
+	MTP_PROPERTY_DESCRIPTION,
+	MTP_PROPERTY_ARTIST,
+	MTP_PROPERTY_ALBUM_NAME,
+	MTP_PROPERTY_ALBUM_ARTIST,
+	MTP_PROPERTY_TRACK,
+	MTP_PROPERTY_ORIGINAL_RELEASE_DATE,
+	MTP_PROPERTY_DURATION,
+	MTP_PROPERTY_GENRE,
+	MTP_PROPERTY_COMPOSER
+};
+
+bool MtpStorage::getNodeProperty(Node* node, MtpObjectProperty property, PropEntry& pe)
 {
-	MTPD("queryNodeProperties handle %u, path: %s\n", node->Mtpid(), getNodePath(node).c_str());
-	PropEntry pe;
 	pe.handle = node->Mtpid();
 	pe.property = property;
+	pe.intvalue = 0;
+	pe.strvalue.clear();
 
-	if (property == 0xffffffff)
-	{
-		// add all properties
-		MTPD("MtpStorage::queryNodeProperties for all properties\n");
-		std::vector<Node::mtpProperty> mtpprop = node->getMtpProps();
-		for (size_t i = 0; i < mtpprop.size(); ++i) {
-			pe.property = mtpprop[i].property;
-			pe.datatype = mtpprop[i].dataType;
-			pe.intvalue = mtpprop[i].valueInt;
-			pe.strvalue = mtpprop[i].valueStr;
-			results.push_back(pe);
-		}
-		return;
-	}
-	else if (property == 0)
-	{
-		// TODO: use groupCode
-	}
+	if (node->isStale() && (property == MTP_PROPERTY_OBJECT_SIZE ||
+			property == MTP_PROPERTY_DATE_MODIFIED || property == MTP_PROPERTY_DATE_ADDED))
+		refreshNode(node);
 
-	// single property
-	// TODO: this should probably be moved to the Node class and/or merged with getObjectPropertyValue
 	switch (property) {
-//		case MTP_PROPERTY_OBJECT_FORMAT:
-//			pe.datatype = MTP_TYPE_UINT16;
-//			pe.intvalue = node->getIntProperty(MTP_PROPERTY_OBJECT_FORMAT);
-//			break;
-
 		case MTP_PROPERTY_STORAGE_ID:
 			pe.datatype = MTP_TYPE_UINT32;
-			pe.intvalue = storageID;
+			pe.intvalue = mStorageID;
+			break;
+		case MTP_PROPERTY_OBJECT_FORMAT:
+			pe.datatype = MTP_TYPE_UINT16;
+			pe.intvalue = node->getFormat();
 			break;
-
 		case MTP_PROPERTY_PROTECTION_STATUS:
+		case MTP_PROPERTY_TRACK:
 			pe.datatype = MTP_TYPE_UINT16;
-			pe.intvalue = 0;
 			break;
-
 		case MTP_PROPERTY_OBJECT_SIZE:
-		{
 			pe.datatype = MTP_TYPE_UINT64;
-			struct stat st;
-			pe.intvalue = 0;
-			if (lstat(getNodePath(node).c_str(), &st) == 0)
-				pe.intvalue = st.st_size;
+			pe.intvalue = node->getSize();
+			break;
+		case MTP_PROPERTY_OBJECT_FILE_NAME:
+		case MTP_PROPERTY_NAME:
+		case MTP_PROPERTY_DISPLAY_NAME:
+			pe.datatype = MTP_TYPE_STR;
+			pe.strvalue = node->getName();
+			break;
+		case MTP_PROPERTY_DATE_MODIFIED:
+		case MTP_PROPERTY_DATE_ADDED:
+			pe.datatype = MTP_TYPE_UINT64;
+			pe.intvalue = node->getModified();
+			break;
+		case MTP_PROPERTY_PARENT_OBJECT:
+			pe.datatype = MTP_TYPE_UINT32;
+			pe.intvalue = node->getMtpParentId();
+			break;
+		case MTP_PROPERTY_PERSISTENT_UID:
+			// volume + inode number, so it stays the same whether or not the
+			// database could be used. Filesystems without native inode
+			// numbers (fat, exfat-fuse) only keep it for as long as they
+			// stay mounted.
+			pe.datatype = MTP_TYPE_UINT128;
+			pe.intvalue = ((uint64_t)volumeID << 32) + (node->getInode() ? (uint32_t)node->getInode() : node->Mtpid());
+			break;
+		case MTP_PROPERTY_ORIGINAL_RELEASE_DATE:
+			pe.datatype = MTP_TYPE_UINT64;
+			pe.intvalue = 2014;	// TODO: extract year from st.st_mtime?
+			break;
+		case MTP_PROPERTY_DURATION:
+			pe.datatype = MTP_TYPE_UINT32;
+			break;
+		case MTP_PROPERTY_DESCRIPTION:
+		case MTP_PROPERTY_ARTIST:
+		case MTP_PROPERTY_ALBUM_NAME:
+		case MTP_PROPERTY_ALBUM_ARTIST:
+		case MTP_PROPERTY_GENRE:
+		case MTP_PROPERTY_COMPOSER:
+			pe.datatype = MTP_TYPE_STR;
 			break;
-		}
-
 		default:
-		{
-			const Node::mtpProperty& prop = node->getProperty(property);
-			if (prop.property != property)
-			{
-				MTPD("queryNodeProperties: unknown property %x\n", property);
-				return;
-			}
-			pe.datatype = prop.dataType;
-			pe.intvalue = prop.valueInt;
-			pe.strvalue = prop.valueStr;
-			// TODO: all the special case stuff in MyMtpDatabase::getObjectPropertyValue is missing here
-		}
-
+			return false;
 	}
-	results.push_back(pe);
+	return true;
 }
 
-int MtpStorage::getObjectPropertyList(MtpObjectHandle handle, uint32_t format, uint32_t property, int groupCode, int depth, MtpDataPacket& packet) {
-	MTPD("MtpStorage::getObjectPropertyList handle: %u, format: %x, property: %x\n", handle, format, property);
-	if (groupCode != 0)
-	{
-		MTPE("getObjectPropertyList: groupCode unsupported\n");
-		return -1; // TODO: RESPONSE_SPECIFICATION_BY_GROUP_UNSUPPORTED
+bool MtpStorage::hasNodeProperty(uint32_t property)
+{
+	for (size_t i = 0; i < sizeof(kNodeProperties) / sizeof(kNodeProperties[0]); ++i) {
+		if (kNodeProperties[i] == property)
+			return true;
 	}
-	// TODO: support all the special stuff, like:
-	// handle == 0 -> all objects at the root level
-	// handle == 0xffffffff -> all objects (on all storages? how could we support that?)
-	// format == 0 -> all formats, otherwise filter by ObjectFormatCode
-	// property == 0xffffffff -> all properties except those with group code 0xffffffff
-	// if property == 0 then use groupCode
-	//   groupCode == 0 -> return Specification_By_Group_Unsupported
-	// depth == 0xffffffff -> all objects incl. and below handle
+	return false;
+}
 
-	std::vector<PropEntry> results;
+uint32_t MtpStorage::getPropertyListCount(size_t nodeCount, uint32_t property)
+{
+	if (property == 0xffffffff)
+		return nodeCount * (sizeof(kNodeProperties) / sizeof(kNodeProperties[0]));
+	return nodeCount;
+}
 
+int MtpStorage::collectObjects(MtpObjectHandle handle, uint32_t format, uint32_t depth, std::vector<Node*>& nodes)
+{
+	MTPD("MtpStorage::collectObjects handle: %u, format: %x, depth: %u\n", handle, format, depth);
 	if (handle == 0xffffffff) {
-		// TODO: all object on all storages (needs a different design, result packet needs to be built by server instead of storage)
-	} else if (handle == 0)	{
-		// all objects at the root level
-		Tree* root = mtpmap[0];
-		MtpObjectHandleList list;
-		root->getmtpids(&list);
-		for (MtpObjectHandleList::iterator it = list.begin(); it != list.end(); ++it) {
-			Node* node = root->findNode(*it);
-			if (!node) {
-				MTPE("BUG: node not found for root entry with handle %u\n", *it);
-				break;
+		// all objects on the storage
+		collectChildren(mtproot, format, 0xffffffff, nodes);
+		return 0;
+	}
+	if (handle == 0) {
+		// objects at the root level, and below it for depth > 1
+		collectChildren(mtproot, format, depth > 1 ? depth : 1, nodes);
+		return 0;
+	}
+
+	Node* node = findNode(handle);
+	if (!node) {
+		// Item is not on this storage device
+		return -1;
+	}
+	// depth 0 is the object itself, otherwise that many levels below it
+	if (depth == 0) {
+		if (format == 0 || node->getFormat() == format)
+			nodes.push_back(node);
+	} else if (node->isDir()) {
+		collectChildren(static_cast<Tree*>(node), format, depth, nodes);
+	}
+	return 0;
+}
+
+void MtpStorage::collectChildren(Tree* tree, uint32_t format, uint32_t depth, std::vector<Node*>& nodes)
+{
+	if (!tree->wasAlreadyRead())
+		readDir(getNodePath(tree), tree);
+
+	uint32_t childDepth = (depth == 0xffffffff) ? depth : depth - 1;
+	for (Tree::const_iterator it = tree->begin(); it != tree->end(); ++it) {
+		Node* node = it->second;
+		if (format == 0 || node->getFormat() == format)
+			nodes.push_back(node);
+		if (childDepth > 0 && node->isDir())
+			collectChildren(static_cast<Tree*>(node), format, childDepth, nodes);
+	}
+}
+
+static void putPropEntry(const MtpStorage::PropEntry& p, MtpDataPacket& packet)
+{
+	packet.putUInt32(p.handle);
+	packet.putUInt16(p.property);
+	packet.putUInt16(p.datatype);
+	switch (p.datatype) {
+		case MTP_TYPE_INT8:
+			packet.putInt8(p.intvalue);
+			break;
+		case MTP_TYPE_UINT8:
+			packet.putUInt8(p.intvalue);
+			break;
+		case MTP_TYPE_INT16:
+			packet.putInt16(p.intvalue);
+			break;
+		case MTP_TYPE_UINT16:
+			packet.putUInt16(p.intvalue);
+			break;
+		case MTP_TYPE_INT32:
+			packet.putInt32(p.intvalue);
+			break;
+		case MTP_TYPE_UINT32:
+			packet.putUInt32(p.intvalue);
+			break;
+		case MTP_TYPE_INT64:
+			packet.putInt64(p.intvalue);
+			break;
+		case MTP_TYPE_UINT64:
+			packet.putUInt64(p.intvalue);
+			break;
+		case MTP_TYPE_INT128:
+			packet.putInt128(p.intvalue);
+			break;
+		case MTP_TYPE_UINT128:
+			packet.putUInt128(p.intvalue);
+			break;
+		case MTP_TYPE_STR:
+			packet.putString(p.strvalue.c_str());
+			break;
+		default:
+			MTPE("bad or unsupported data type: %x in MtpStorage::putObjectPropertyList", p.datatype);
+			break;
+	}
+}
+
+void MtpStorage::putObjectPropertyList(const std::vector<Node*>& nodes, uint32_t property, MtpDataPacket& packet)
+{
+	MTPD("MtpStorage::putObjectPropertyList %u objects, property: %x\n", nodes.size(), property);
+	// size the packet once: handle, code and type, a value of up to 16
+	// bytes, plus the UTF-16 names (file name, name and display name)
+	size_t size = getPropertyListCount(nodes.size(), property) * 24;
+	if (property == 0xffffffff || property == MTP_PROPERTY_OBJECT_FILE_NAME
+			|| property == MTP_PROPERTY_NAME || property == MTP_PROPERTY_DISPLAY_NAME) {
+		size_t names = (property == 0xffffffff) ? 3 : 1;
+		for (std::vector<Node*>::const_iterator it = nodes.begin(); it != nodes.end(); ++it)
+			size += names * ((*it)->getName().size() * 2 + 3);
+	}
+	packet.reserve(size);
+
+	PropEntry pe;
+	for (std::vector<Node*>::const_iterator it = nodes.begin(); it != nodes.end(); ++it) {
+		if (property == 0xffffffff) {
+			for (size_t i = 0; i < sizeof(kNodeProperties) / sizeof(kNodeProperties[0]); ++i) {
+				getNodeProperty(*it, kNodeProperties[i], pe);
+				putPropEntry(pe, packet);
 			}
-			queryNodeProperties(results, node, property, groupCode, mStorageID);
-		}
-	} else {
-		// single object
-		Node* node = findNode(handle);
-		if (!node) {
-			// Item is not on this storage device
-			return -1;
-		}
-		queryNodeProperties(results, node, property, groupCode, mStorageID);
-	}
-
-	MTPD("count: %u\n", results.size());
-	packet.putUInt32(results.size());
-
-	for (size_t i = 0; i < results.size(); ++i) {
-		PropEntry& p = results[i];
-		MTPD("handle: %u, propertyCode: %x = %s, datatype: %x, value: %llu\n",
-				p.handle, p.property, MtpDebug::getObjectPropCodeName(p.property),
-				p.datatype, p.intvalue);
-		packet.putUInt32(p.handle);
-		packet.putUInt16(p.property);
-		packet.putUInt16(p.datatype);
-		switch (p.datatype) {
-			case MTP_TYPE_INT8:
-				MTPD("MTP_TYPE_INT8\n");
-				packet.putInt8(p.intvalue);
-				break;
-			case MTP_TYPE_UINT8:
-				MTPD("MTP_TYPE_UINT8\n");
-				packet.putUInt8(p.intvalue);
-				break;
-			case MTP_TYPE_INT16:
-				MTPD("MTP_TYPE_INT16\n");
-				packet.putInt16(p.intvalue);
-				break;
-			case MTP_TYPE_UINT16:
-				MTPD("MTP_TYPE_UINT16\n");
-				packet.putUInt16(p.intvalue);
-				break;
-			case MTP_TYPE_INT32:
-				MTPD("MTP_TYPE_INT32\n");
-				packet.putInt32(p.intvalue);
-				break;
-			case MTP_TYPE_UINT32:
-				MTPD("MTP_TYPE_UINT32\n");
-				packet.putUInt32(p.intvalue);
-				break;
-			case MTP_TYPE_INT64:
-				MTPD("MTP_TYPE_INT64\n");
-				packet.putInt64(p.intvalue);
-				break;
-			case MTP_TYPE_UINT64:
-				MTPD("MTP_TYPE_UINT64\n");
-				packet.putUInt64(p.intvalue);
-				break;
-			case MTP_TYPE_INT128:
-				MTPD("MTP_TYPE_INT128\n");
-				packet.putInt128(p.intvalue);
-				break;
-			case MTP_TYPE_UINT128:
-				MTPD("MTP_TYPE_UINT128\n");
-				packet.putUInt128(p.intvalue);
-				break;
-			case MTP_TYPE_STR:
-				MTPD("MTP_TYPE_STR: %s\n", p.strvalue.c_str());
-				packet.putString(p.strvalue.c_str());
-				break;
-			default:
-				MTPE("bad or unsupported data type: %x in MyMtpDatabase::getObjectPropertyList", p.datatype);
-				break;
+		} else if (getNodeProperty(*it, property, pe)) {
+			putPropEntry(pe, packet);
 		}
 	}
-	return 0;
 }
 
 int MtpStorage::renameObject(MtpObjectHandle handle, std::string newName) {
@@ -530,20 +736,19 @@ int MtpStorage::renameObject(MtpObjectHandle handle, std::string newName) {
 		MTPE("parent == MTP_PARENT_ROOT, cannot rename root\n");
 		return -1;
 	} else {
-		for (iter i = mtpmap.begin(); i != mtpmap.end(); i++) {
-			Node* node = i->second->findNode(handle);
-			if (node != NULL) {
-				std::string oldName = getNodePath(node);
-				std::string parentdir = oldName.substr(0, oldName.find_last_of('/'));
-				std::string newFullName = parentdir + "/" + newName;
-				MTPD("old: '%s', new: '%s'\n", oldName.c_str(), newFullName.c_str());
-				if (rename(oldName.c_str(), newFullName.c_str()) == 0) {
-					node->rename(newName);
-					return 0;
-				} else {
-					MTPE("MtpStorage::renameObject failed, handle: %u, new name: '%s'\n", handle, newName.c_str());
-					return -1;
-				}
+		Node* node = findNode(handle);
+		if (node != NULL) {
+			std::string oldName = getNodePath(node);
+			std::string parentdir = oldName.substr(0, oldName.find_last_of('/'));
+			std::string newFullName = parentdir + "/" + newName;
+			MTPD("old: '%s', new: '%s'\n", oldName.c_str(), newFullName.c_str());
+			if (rename(oldName.c_str(), newFullName.c_str()) == 0) {
+				node->rename(newName);
+				markDirty();
+				return 0;
+			} else {
+				MTPE("MtpStorage::renameObject failed, handle: %u, new name: '%s'\n", handle, newName.c_str());
+				return -1;
 			}
 		}
 	}
@@ -552,22 +757,13 @@ int MtpStorage::renameObject(MtpObjectHandle handle, std::string newName) {
 }
 
 int MtpStorage::getObjectPropertyValue(MtpObjectHandle handle, MtpObjectProperty property, MtpStorage::PropEntry& pe) {
-	Node *node;
-	for (iter i = mtpmap.begin(); i != mtpmap.end(); i++) {
-		node = i->second->findNode(handle);
-		if (node != NULL) {
-			const Node::mtpProperty& prop = node->getProperty(property);
-			if (prop.property != property) {
-				MTPD("getObjectPropertyValue: unknown property %x for handle %u\n", property, handle);
-				return -1;
-			}
-			pe.datatype = prop.dataType;
-			pe.intvalue = prop.valueInt;
-			pe.strvalue = prop.valueStr;
-			pe.handle = handle;
-			pe.property = property;
-			return 0;
+	Node *node = findNode(handle);
+	if (node != NULL) {
+		if (!getNodeProperty(node, property, pe)) {
+			MTPD("getObjectPropertyValue: unknown property %x for handle %u\n", property, handle);
+			return -1;
 		}
+		return 0;
 	}
 	// handle not found on this storage
 	return -1;
@@ -607,90 +803,448 @@ int MtpStorage::addInotify(Tree* tree) {
 		return -1;
 	}
 	inotifymap[wd] = tree;
+	inotifywds[tree] = wd;
 	return 0;
 }
 
-void MtpStorage::handleInotifyEvent(struct inotify_event* event)
+void MtpStorage::removeInotify(Tree* tree) {
+	std::map<Tree*, int>::iterator it = inotifywds.find(tree);
+	if (it == inotifywds.end())
+		return;
+	MTPD("removing inotify watch %i\n", it->second);
+	// fails harmlessly if the kernel already dropped the watch because the
+	// directory is gone
+	inotify_rm_watch(inotify_fd, it->second);
+	inotifymap.erase(it->second);
+	inotifywds.erase(it);
+}
+
+static uint64_t now_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void MtpStorage::handleInotifyEvents(const char* buf, int len)
 {
-	std::map<int, Tree*>::iterator it = inotifymap.find(event->wd);
+	// Merge everything one read() returned per name first. Extracting a
+	// zip or restoring a backup creates, writes and closes each file in
+	// quick succession, which ends up as a single change here.
+	std::vector<InotifyChange> changes;
+	std::map<std::pair<int, std::string>, size_t> changeIndex;
+	std::vector<int> ignored;
+	bool overflow = false;
+
+	for (int i = 0; i < len; ) {
+		const struct inotify_event* event = (const struct inotify_event*)&buf[i];
+		i += sizeof(struct inotify_event) + event->len;
+		if (event->mask & IN_Q_OVERFLOW) {
+			overflow = true;
+			continue;
+		}
+		if (event->mask & IN_IGNORED) {
+			// the watched directory is gone
+			ignored.push_back(event->wd);
+			continue;
+		}
+		if (!event->len)
+			continue;
+		MTPD("inotify event: wd: %i, mask: %x, name: %s\n", event->wd, event->mask, event->name);
+		std::pair<int, std::string> key(event->wd, event->name);
+		std::map<std::pair<int, std::string>, size_t>::iterator it = changeIndex.find(key);
+		if (it == changeIndex.end()) {
+			InotifyChange change;
+			change.wd = event->wd;
+			change.name = event->name;
+			change.mask = 0;
+			change.exists = true;
+			it = changeIndex.insert(std::make_pair(key, changes.size())).first;
+			changes.push_back(change);
+		}
+		InotifyChange& change = changes[it->second];
+		change.mask |= event->mask;
+		if (event->mask & (IN_CREATE | IN_MOVED_TO))
+			change.exists = true;
+		else if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+			change.exists = false;
+	}
+
+	if (!changes.empty() || !ignored.empty()) {
+		lockMutex(1);
+		// parent paths are only built once per directory per batch
+		std::map<Tree*, std::string> paths;
+		for (size_t i = 0; i < changes.size() && inotify_thread_kill.get_value() == 0; i++)
+			applyInotifyChange(changes[i], paths);
+		for (size_t i = 0; i < ignored.size(); i++) {
+			std::map<int, Tree*>::iterator it = inotifymap.find(ignored[i]);
+			if (it != inotifymap.end()) {
+				inotifywds.erase(it->second);
+				inotifymap.erase(it);
+			}
+		}
+		unlockMutex(1);
+	}
+	if (overflow) {
+		MTPE("inotify queue overflowed, asking the host to rescan storage %u\n", mStorageID);
+		pendingStoreChanged = true;
+	}
+}
+
+void MtpStorage::applyInotifyChange(const InotifyChange& change, std::map<Tree*, std::string>& paths)
+{
+	std::map<int, Tree*>::iterator it = inotifymap.find(change.wd);
 	if (it == inotifymap.end()) {
-		MTPE("Unable to locate inotify_wd: %i\n", event->wd);
+		MTPD("Unable to locate inotify_wd: %i\n", change.wd);
 		return;
 	}
+	if (MtpDeleteWorker::isDeletePath(change.name.c_str()))
+		return;	// our own background delete
 	Tree* tree = it->second;
-	MTPD("inotify_t tree: %x '%s'\n", tree, tree->getName().c_str());
-	Node* node = tree->findEntryByName(basename(event->name));
+	Node* node = tree->findEntryByName(change.name);
 	if (node && node->Mtpid() == handleCurrentlySending) {
 		MTPD("ignoring inotify event for currently uploading file, handle: %u\n", node->Mtpid());
 		return;
 	}
-	if (event->mask & IN_CREATE || event->mask & IN_MOVED_TO) {
-		if (event->mask & IN_ISDIR) {
-			MTPD("inotify_t create is dir\n");
-		} else {
-			MTPD("inotify_t create is file\n");
+	bool created = change.mask & (IN_CREATE | IN_MOVED_TO);
+	bool deleted = change.mask & (IN_DELETE | IN_MOVED_FROM);
+
+	// gone, or replaced by a new item with the same name
+	if (node && (!change.exists || (created && deleted))) {
+		MTPD("inotify_t %s deleted\n", change.name.c_str());
+		MtpObjectHandle handle = node->Mtpid();
+		// also drops the watches of everything below a directory
+		deleteFile(handle);
+		pendingModified.erase(handle);
+		queueEvent(MTP_EVENT_OBJECT_REMOVED, handle);
+		node = NULL;
+	}
+	if (!change.exists)
+		return;
+
+	if (created && node == NULL) {
+		std::map<Tree*, std::string>::iterator path = paths.find(tree);
+		if (path == paths.end())
+			path = paths.insert(std::make_pair(tree, getNodePath(tree))).first;
+		node = addNewNode(change.mask & IN_ISDIR, tree, change.name);
+		node->readProperties(path->second + "/" + change.name);
+		MTPD("inotify_t %s created\n", change.name.c_str());
+		queueEvent(MTP_EVENT_OBJECT_ADDED, node->Mtpid());
+	} else if (node && (change.mask & (IN_MODIFY | IN_CLOSE_WRITE))) {
+		// look at the size once the writer is done or the window is over
+		uint64_t due = now_ms() + INOTIFY_MODIFY_WINDOW_MS;
+		if (change.mask & IN_CLOSE_WRITE)
+			due = 0;
+		std::map<MtpObjectHandle, uint64_t>::iterator pending = pendingModified.find(node->Mtpid());
+		if (pending == pendingModified.end())
+			pendingModified[node->Mtpid()] = due;
+		else if (due < pending->second)
+			pending->second = due;
+	} else if (!node) {
+		MTPD("inotify_t item %s not found\n", change.name.c_str());
+	}
+}
+
+void MtpStorage::flushModified(uint64_t now)
+{
+	if (pendingModified.empty())
+		return;
+	bool locked = false;
+	std::map<MtpObjectHandle, uint64_t>::iterator it = pendingModified.begin();
+	while (it != pendingModified.end()) {
+		if (it->second > now) {
+			++it;
+			continue;
 		}
-		if (node == NULL) {
-			node = addNewNode(event->mask & IN_ISDIR, tree, event->name);
-			std::string item = getNodePath(tree) + "/" + event->name;
-			node->addProperties(item, getStorageID());
-			mServer->sendObjectAdded(node->Mtpid());
-		} else {
-			MTPD("inotify_t item already exists.\n");
+		if (!locked) {
+			lockMutex(1);
+			locked = true;
 		}
-		if (event->mask & IN_ISDIR) {
-			// TODO: do we need to do anything here? probably not until someone reads from the dir...
+		Node* node = findNode(it->first);
+		struct stat st;
+		if (node && node->Mtpid() != handleCurrentlySending && lstat(getNodePath(node).c_str(), &st) == 0 &&
+				((uint64_t)st.st_size != node->getSize() || st.st_mtime != node->getModified())) {
+			MTPD("size changed from %llu to %llu on mtpid: %u\n", node->getSize(), (uint64_t)st.st_size, node->Mtpid());
+			node->setProperties(st);
+			markDirty();
+			queueEvent(MTP_EVENT_OBJECT_PROP_CHANGED, node->Mtpid());
 		}
-	} else if (event->mask & IN_DELETE || event->mask & IN_MOVED_FROM) {
-		if (event->mask & IN_ISDIR) {
-			MTPD("inotify_t Directory %s deleted\n", event->name);
-		} else {
-			MTPD("inotify_t File %s deleted\n", event->name);
+		pendingModified.erase(it++);
+	}
+	if (locked)
+		unlockMutex(1);
+}
+
+void MtpStorage::queueEvent(MtpEventCode code, MtpObjectHandle handle)
+{
+	std::map<MtpObjectHandle, MtpEventCode>::iterator it = pendingEvents.find(handle);
+	if (it == pendingEvents.end()) {
+		pendingEvents[handle] = code;
+	} else if (code == MTP_EVENT_OBJECT_REMOVED) {
+		// the host never has to know about an object that came and went
+		if (it->second == MTP_EVENT_OBJECT_ADDED)
+			pendingEvents.erase(it);
+		else
+			it->second = code;
+	}
+	// an update is implied by a pending add
+}
+
+void MtpStorage::flushEvents(uint64_t now)
+{
+	if (!mServer) {
+		pendingEvents.clear();
+		pendingStoreChanged = false;
+		return;
+	}
+	if (pendingEvents.size() > INOTIFY_EVENT_BURST)
+		pendingStoreChanged = true;
+	if (pendingStoreChanged) {
+		MTPD("%zu changes on storage %u, asking the host to rescan\n", pendingEvents.size(), mStorageID);
+		pendingEvents.clear();
+		pendingStoreChanged = false;
+		mServer->sendStoreChanged(mStorageID);
+		nextEventFlush = now + INOTIFY_EVENT_INTERVAL_MS;
+		return;
+	}
+	if (pendingEvents.empty() || now < nextEventFlush)
+		return;
+	// handles are handed out in order, so parents are announced before
+	// what was created inside them
+	int count = 0;
+	std::map<MtpObjectHandle, MtpEventCode>::iterator it = pendingEvents.begin();
+	while (it != pendingEvents.end() && count++ < INOTIFY_EVENTS_PER_FLUSH) {
+		if (it->second == MTP_EVENT_OBJECT_ADDED)
+			mServer->sendObjectAdded(it->first);
+		else if (it->second == MTP_EVENT_OBJECT_REMOVED)
+			mServer->sendObjectRemoved(it->first);
+		else
+			mServer->sendObjectUpdated(it->first);
+		pendingEvents.erase(it++);
+	}
+	nextEventFlush = now + INOTIFY_EVENT_INTERVAL_MS;
+}
+
+void MtpStorage::markDirty()
+{
+	dbDirty = true;
+	lastChange = now_ms();
+}
+
+void MtpStorage::setDBDir(const std::string& dir)
+{
+	dbDir = dir;
+}
+
+static void putDB(std::string& out, uint64_t value, int bytes)
+{
+	for (int i = 0; i < bytes; i++)
+		out += (char)(value >> (i * 8));
+}
+
+static bool getDB(const std::vector<char>& in, size_t& pos, uint64_t& value, int bytes)
+{
+	if (pos + bytes > in.size())
+		return false;
+	value = 0;
+	for (int i = 0; i < bytes; i++)
+		value |= (uint64_t)(unsigned char)in[pos + i] << (i * 8);
+	pos += bytes;
+	return true;
+}
+
+// Records are written parents first. Only directories that were read,
+// and that have not changed too recently, are saved with their entries.
+void MtpStorage::writeDBRecord(Node* node, const std::string& path, time_t racy, std::string& out, uint32_t& count)
+{
+	uint8_t flags = 0;
+	uint64_t inode = node->getInode();
+	int64_t modified = node->getModified();
+	Tree* tree = NULL;
+	if (node->isDir()) {
+		flags |= MTP_DB_DIR_FLAG;
+		tree = static_cast<Tree*>(node);
+		struct stat st;
+		if (tree->wasAlreadyRead() && lstat(path.c_str(), &st) == 0 && st.st_mtime < racy) {
+			flags |= MTP_DB_READ_FLAG;
+			inode = st.st_ino;
+			modified = st.st_mtime;
 		}
-		if (node)
-		{
-			if (event->mask & IN_ISDIR) {
-				for (std::map<int, Tree*>::iterator it = inotifymap.begin(); it != inotifymap.end(); ++it) {
-					if (it->second == node) {
-						inotify_rm_watch(inotify_fd, it->first);
-						MTPD("inotify_t removing watch on '%s'\n", getNodePath(it->second).c_str());
-						inotifymap.erase(it->first);
-						break;
-					}
-
-				}
-			}
-			MtpObjectHandle handle = node->Mtpid();
-			deleteFile(handle);
-			mServer->sendObjectRemoved(handle);
-		} else {
-			MTPD("inotify_t already removed.\n");
+	}
+	putDB(out, node->Mtpid(), 4);
+	putDB(out, node->getMtpParentId(), 4);
+	putDB(out, flags, 1);
+	putDB(out, inode, 8);
+	putDB(out, node->getSize(), 8);
+	putDB(out, modified, 8);
+	putDB(out, node->getName().size(), 2);
+	out += node->getName();
+	count++;
+	if (flags & MTP_DB_READ_FLAG) {
+		for (Tree::const_iterator it = tree->begin(); it != tree->end(); ++it)
+			writeDBRecord(it->second, path + "/" + it->second->getName(), racy, out, count);
+	}
+}
+
+int MtpStorage::saveDB()
+{
+	if (dbPath.empty() || !mtproot)
+		return -1;
+	// don't save a tree that belongs to whatever is mounted there now
+	struct stat st;
+	if (lstat(mtpstorageparent.c_str(), &st) || st.st_dev != rootDev || st.st_ino != rootIno) {
+		MTPE("MtpStorage::saveDB: storage root '%s' changed, not saving\n", mtpstorageparent.c_str());
+		lastChange = now_ms();
+		return -1;
+	}
+	uint64_t start = now_ms();
+	std::string records;
+	uint32_t count = 0;
+	writeDBRecord(mtproot, mtpstorageparent, time(NULL) - MTP_DB_RACY_SECONDS, records, count);
+
+	std::string header = MTP_DB_MAGIC;
+	putDB(header, rootDev, 8);
+	putDB(header, rootIno, 8);
+	putDB(header, count, 4);
+
+	mkdir(dbDir.c_str(), 0700);
+	std::string tmpPath = dbPath + ".tmp";
+	int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		MTPE("MtpStorage::saveDB: can't create '%s': %s\n", tmpPath.c_str(), strerror(errno));
+		lastChange = now_ms();
+		return -1;
+	}
+	bool ok = write(fd, header.data(), header.size()) == (ssize_t)header.size() &&
+			write(fd, records.data(), records.size()) == (ssize_t)records.size();
+	if (close(fd) || !ok || rename(tmpPath.c_str(), dbPath.c_str())) {
+		MTPE("MtpStorage::saveDB: can't write '%s': %s\n", dbPath.c_str(), strerror(errno));
+		unlink(tmpPath.c_str());
+		lastChange = now_ms();
+		return -1;
+	}
+	dbDirty = false;
+	MTPD("MtpStorage::saveDB: saved %u objects to %s in %llu ms\n", count, dbPath.c_str(),
+			(unsigned long long)(now_ms() - start));
+	return 0;
+}
+
+int MtpStorage::loadDB()
+{
+	if (dbPath.empty())
+		return -1;
+	int fd = open(dbPath.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	uint64_t start = now_ms();
+	struct stat st;
+	std::vector<char> data;
+	if (fstat(fd, &st) == 0 && st.st_size > 0) {
+		data.resize(st.st_size);
+		if (read(fd, &data[0], data.size()) != (ssize_t)data.size())
+			data.clear();
+	}
+	close(fd);
+
+	size_t pos = strlen(MTP_DB_MAGIC);
+	uint64_t dev, ino, count;
+	if (data.size() < pos || memcmp(&data[0], MTP_DB_MAGIC, pos) ||
+			!getDB(data, pos, dev, 8) || !getDB(data, pos, ino, 8) || !getDB(data, pos, count, 4) ||
+			dev != (uint64_t)rootDev || ino != (uint64_t)rootIno || count == 0) {
+		MTPI("MtpStorage::loadDB: no usable database in %s\n", dbPath.c_str());
+		return -1;
+	}
+	// don't trust the count for the allocation, a record is at least 35 bytes
+	std::vector<DBRecord> records;
+	records.reserve(std::min<uint64_t>(count, data.size() / 35));
+	for (uint64_t i = 0; i < count; i++) {
+		DBRecord record;
+		uint64_t handle, parent, flags, size, modified, namelen;
+		if (!getDB(data, pos, handle, 4) || !getDB(data, pos, parent, 4) || !getDB(data, pos, flags, 1) ||
+				!getDB(data, pos, record.inode, 8) || !getDB(data, pos, size, 8) ||
+				!getDB(data, pos, modified, 8) || !getDB(data, pos, namelen, 2) ||
+				pos + namelen > data.size()) {
+			MTPE("MtpStorage::loadDB: %s is truncated\n", dbPath.c_str());
+			return -1;
 		}
-	} else if (event->mask & IN_MODIFY) {
-		MTPD("inotify_t item %s modified.\n", event->name);
-		if (node != NULL) {
-			uint64_t orig_size = node->getProperty(MTP_PROPERTY_OBJECT_SIZE).valueInt;
-			struct stat st;
-			uint64_t new_size = 0;
-			if (lstat(getNodePath(node).c_str(), &st) == 0)
-				new_size = (uint64_t)st.st_size;
-			if (orig_size != new_size) {
-				MTPD("size changed from %llu to %llu on mtpid: %u\n", orig_size, new_size, node->Mtpid());
-				node->updateProperty(MTP_PROPERTY_OBJECT_SIZE, new_size, "", MTP_TYPE_UINT64);
-				mServer->sendObjectUpdated(node->Mtpid());
-			}
-		} else {
-			MTPE("inotify_t modified item not found\n");
+		record.handle = handle;
+		record.parent = parent;
+		record.flags = flags;
+		record.size = size;
+		record.modified = modified;
+		record.name.assign(&data[pos], namelen);
+		pos += namelen;
+		records.push_back(record);
+	}
+	if (records[0].handle != 0 || !(records[0].flags & MTP_DB_READ_FLAG))
+		return -1;
+
+	// claimHandle() and the node index allocate for every handle up to
+	// the highest one, so a handle far beyond the others is corruption
+	// that would cost gigabytes, not an object to restore
+	uint64_t maxHandle = MTP_DB_MAX_HANDLE(records.size());
+	DBDirs dirs;
+	MtpObjectHandle last = 0;
+	for (size_t i = 1; i < records.size(); i++) {
+		if (records[i].handle > maxHandle || records[i].parent > maxHandle) {
+			MTPE("MtpStorage::loadDB: %s has a bad handle %u, discarding it\n", dbPath.c_str(),
+					records[i].handle > maxHandle ? records[i].handle : records[i].parent);
+			return -1;
 		}
-	} else if (event->mask & IN_DELETE_SELF || event->mask & IN_MOVE_SELF) {
-		// TODO: is this always already handled by IN_DELETE for the parent dir?
+		dirs[records[i].parent][records[i].name] = &records[i];
+		if (records[i].handle > last)
+			last = records[i].handle;
+	}
+	skipHandles(last);
+	bool changed = restoreTree(mtproot, records[0], mtpstorageparent, dirs);
+	// nothing to save if everything came back as it was
+	dbDirty = changed;
+	MTPI("MtpStorage::loadDB: restored %u objects from %s in %llu ms\n", (unsigned)(records.size() - 1),
+			dbPath.c_str(), (unsigned long long)(now_ms() - start));
+	return 0;
+}
+
+// Returns true if the tree had to be read again, or handles changed
+bool MtpStorage::restoreTree(Tree* tree, const DBRecord& record, const std::string& path, const DBDirs& dirs)
+{
+	if (!(record.flags & MTP_DB_READ_FLAG))
+		return false;	// read on demand as usual
+	static const DBEntries none;
+	DBDirs::const_iterator entries = dirs.find(record.handle);
+	const DBEntries& saved = (entries != dirs.end() ? entries->second : none);
+
+	// watch first: whatever changes after the check below is caught by inotify
+	addInotify(tree);
+	struct stat st;
+	if (lstat(path.c_str(), &st) || (uint64_t)st.st_ino != record.inode || st.st_mtime != record.modified) {
+		MTPD("restoreTree: '%s' changed, reading it again\n", path.c_str());
+		readDir(path, tree, &saved, &dirs);
+		return true;
+	}
+	bool changed = false;
+	for (DBEntries::const_iterator it = saved.begin(); it != saved.end(); ++it) {
+		const DBRecord& r = *it->second;
+		Node* node = addNewNode((r.flags & MTP_DB_DIR_FLAG) != 0, tree, r.name, r.handle);
+		node->setProperties(r.inode, r.size, r.modified);
+		if (node->Mtpid() != r.handle)
+			changed = true;
+		if (node->isDir() && restoreTree(static_cast<Tree*>(node), r, path + "/" + r.name, dirs))
+			changed = true;
 	}
+	tree->setAlreadyRead(true);
+	return changed;
+}
+
+// Files restored from the database may have been written since
+void MtpStorage::refreshNode(Node* node)
+{
+	MTPD("refreshing properties of handle %u\n", node->Mtpid());
+	node->readProperties(getNodePath(node));
 }
 
 int MtpStorage::inotify_t(void) {
 	#define EVENT_SIZE ( sizeof(struct inotify_event) )
 	#define EVENT_BUF_LEN ( 1024 * ( EVENT_SIZE + 16) )
-	char buf[EVENT_BUF_LEN];
+	char buf[EVENT_BUF_LEN] __attribute__((aligned(__alignof__(struct inotify_event))));
 	fd_set fdset;
 	struct timeval seltmout;
 	int sel_ret;
@@ -703,26 +1257,24 @@ int MtpStorage::inotify_t(void) {
 		seltmout.tv_sec = 0;
 		seltmout.tv_usec = 25000;
 		sel_ret = select(inotify_fd + 1, &fdset, NULL, NULL, &seltmout);
-		if (sel_ret == 0)
-			continue;
-		int i = 0;
-		int len = read(inotify_fd, buf, EVENT_BUF_LEN);
-
-		if (len < 0) {
-			if (errno == EINTR)
-				continue;
-			MTPE("inotify_t Can't read inotify events\n");
-		}
-
-		while (i < len && inotify_thread_kill.get_value() == 0) {
-			struct inotify_event *event = (struct inotify_event *) &buf[i];
-			if (event->len) {
-				MTPD("inotify event: wd: %i, mask: %x, name: %s\n", event->wd, event->mask, event->name);
-				lockMutex(1);
-				handleInotifyEvent(event);
-				unlockMutex(1);
+		if (sel_ret > 0) {
+			int len = read(inotify_fd, buf, EVENT_BUF_LEN);
+			if (len < 0) {
+				if (errno == EINTR)
+					continue;
+				MTPE("inotify_t Can't read inotify events\n");
+			} else {
+				handleInotifyEvents(buf, len);
 			}
-			i += EVENT_SIZE + event->len;
+		}
+		uint64_t now = now_ms();
+		flushModified(now);
+		flushEvents(now);
+		if (dbDirty && now >= lastChange + MTP_DB_SAVE_DELAY_MS) {
+			lockMutex(1);
+			if (dbDirty)
+				saveDB();
+			unlockMutex(1);
 		}
 	}
 	MTPD("inotify_thread_kill received!\n");
@@ -745,7 +1297,7 @@ Node* MtpStorage::findNodeByPath(const std::string& path) {
 
 	// TODO: fix and test this
 	std::string p = path.substr(mtpstorageparent.size()+1);	// cut off "/" after storage root too
-	Tree* tree = mtpmap[0]; // start at storage root
+	Tree* tree = mtproot; // start at storage root
 
 	Node* node = NULL;
 	while (!p.empty()) {
@@ -775,53 +1327,84 @@ Node* MtpStorage::findNodeByPath(const std::string& path) {
 	return node;
 }
 
-Node* MtpStorage::addNewNode(bool isDir, Tree* tree, const std::string& name)
+Node* MtpStorage::addNewNode(bool isDir, Tree* tree, const std::string& name, MtpObjectHandle handle)
 {
-	// global counter for new object handles
-	static MtpObjectHandle mtpid = 0;
-
-	++mtpid;
+	// keep the handle from the database unless something else has it now
+	MtpObjectHandle mtpid = (handle && claimHandle(handle)) ? handle : allocateHandle();
 	MTPD("adding new %s node for %s, new handle: %u\n", isDir ? "dir" : "file", name.c_str(), mtpid);
 	MtpObjectHandle parent = tree->Mtpid();
 	MTPD("parent tree: %x, handle: %u, name: %s\n", tree, parent, tree->getName().c_str());
 	Node* node;
 	if (isDir)
-		node = mtpmap[mtpid] = new Tree(mtpid, parent, name);
+		node = new Tree(mtpid, parent, name);
 	else
 		node = new Node(mtpid, parent, name);
 	tree->addEntry(node);
+	indexNode(node);
 	return node;
 }
 
+void MtpStorage::indexNode(Node* node) {
+	MtpObjectHandle handle = node->Mtpid();
+	if (handle >= nodeindex.size())
+		nodeindex.resize(handle + 1, NULL);
+	nodeindex[handle] = node;
+	markDirty();
+}
+
+void MtpStorage::unindexNode(Node* node) {
+	if (node->isDir()) {
+		Tree* tree = static_cast<Tree*>(node);
+		for (Tree::const_iterator it = tree->begin(); it != tree->end(); ++it)
+			unindexNode(it->second);
+		removeInotify(tree);
+	}
+	if (node->Mtpid() < nodeindex.size())
+		nodeindex[node->Mtpid()] = NULL;
+	releaseHandle(node->Mtpid());
+	markDirty();
+}
+
 Node* MtpStorage::findNode(MtpObjectHandle handle) {
-	for (iter i = mtpmap.begin(); i != mtpmap.end(); i++) {
-		Node* node = i->second->findNode(handle);
-		if (node != NULL) {
-			MTPD("findNode: found node %p for handle %u, name: %s\n", node, handle, node->getName().c_str());
-			if (node->Mtpid() != handle)
-			{
-				MTPE("BUG: entry for handle %u points to node with handle %u\n", handle, node->Mtpid());
-			}
-			return node;
-		}
+	if (handle != 0 && handle < nodeindex.size() && nodeindex[handle] != NULL) {
+		Node* node = nodeindex[handle];
+		MTPD("findNode: found node %p for handle %u, name: %s\n", node, handle, node->getName().c_str());
+		return node;
 	}
 	// Item is not on this storage device
-	MTPD("MtpStorage::findNode: no node found for handle %u on storage %u, searched %u trees\n", handle, mStorageID, mtpmap.size());
+	MTPD("MtpStorage::findNode: no node found for handle %u on storage %u\n", handle, mStorageID);
+	return NULL;
+}
+
+Tree* MtpStorage::findTree(MtpObjectHandle handle) {
+	if (handle == 0)
+		return mtproot;
+	Node* node = findNode(handle);
+	if (node && node->isDir())
+		return static_cast<Tree*>(node);
 	return NULL;
 }
 
 std::string MtpStorage::getNodePath(Node* node) {
-	std::string path;
 	MTPD("getNodePath: node %p, handle %u\n", node, node->Mtpid());
+	// collect the names up to the root, then build the path in one go
+	std::vector<const std::string*> names;
+	size_t length = mtpstorageparent.size();
 	while (node)
 	{
-		path = "/" + node->getName() + path;
-		MtpObjectHandle parent = node->getMtpParentId();
-		if (parent == 0)	// root
+		names.push_back(&node->getName());
+		length += node->getName().size() + 1;
+		if (node->getMtpParentId() == 0)	// root
 			break;
-		node = findNode(parent);
+		node = node->getParentTree();
+	}
+	std::string path;
+	path.reserve(length);
+	path = mtpstorageparent;
+	for (std::vector<const std::string*>::reverse_iterator it = names.rbegin(); it != names.rend(); ++it) {
+		path += '/';
+		path += **it;
 	}
-	path = mtpstorageparent + path;
 	MTPD("getNodePath: path %s\n", path.c_str());
 	return path;
 }
@@ -24,6 +24,7 @@
 #include <string>
 #include <deque>
 #include <map>
+#include <vector>
 #include <libgen.h>
 #include <pthread.h>
 #include "btree.hpp"
@@ -31,7 +32,6 @@
 #include "../tw_atomic.hpp"
 
 class MtpDatabase;
-struct inotify_event;
 
 class MtpStorage {
 
@@ -45,9 +45,10 @@ private:
     uint64_t                mReserveSpace;
     bool                    mRemovable;
 	MtpServer*				mServer;
-    typedef std::map<int, Tree*> maptree;
-    typedef maptree::iterator iter;
-    maptree mtpmap;
+	Tree* mtproot;
+	// handle -> node for every object on this storage. Handles are handed
+	// out sequentially, so indexing a vector by handle is a perfect hash.
+	std::vector<Node*> nodeindex;
 	std::string mtpstorageparent;
 	android::Mutex           mMutex;
 
@@ -82,13 +83,21 @@ public:
 	int getObjectInfo(MtpObjectHandle handle, MtpObjectInfo& info);
 	MtpObjectHandle beginSendObject(const char* path, MtpObjectFormat format, MtpObjectHandle parent, uint64_t size, time_t modified);
 	void endSendObject(const char* path, MtpObjectHandle handle, MtpObjectFormat format, bool succeeded);
-	int getObjectPropertyList(MtpObjectHandle handle, uint32_t format, uint32_t property, int groupCode, int depth, MtpDataPacket& packet);
+	// GetObjectPropList: collect the objects first, then write their properties
+	int collectObjects(MtpObjectHandle handle, uint32_t format, uint32_t depth, std::vector<Node*>& nodes);
+	void putObjectPropertyList(const std::vector<Node*>& nodes, uint32_t property, MtpDataPacket& packet);
+	static bool hasNodeProperty(uint32_t property);
+	static uint32_t getPropertyListCount(size_t nodeCount, uint32_t property);
 	int getObjectFilePath(MtpObjectHandle handle, MtpString& outFilePath, int64_t& outFileLength, MtpObjectFormat& outFormat);
 	int deleteFile(MtpObjectHandle handle);
 	int renameObject(MtpObjectHandle handle, std::string newName);
 	int getObjectPropertyValue(MtpObjectHandle handle, MtpObjectProperty property, PropEntry& prop);
 	void lockMutex(int thread_type);
 	void unlockMutex(int thread_type);
+	// object database, so handles survive restarting MTP or re-adding
+	// the storage; saved by the inotify thread when idle
+	int saveDB();
+	static void setDBDir(const std::string& dir);
 
 private:
 	pthread_t inotify();
@@ -96,20 +105,71 @@ private:
 	typedef int (MtpStorage::*ThreadPtr)(void);
 	typedef void* (*PThreadPtr)(void *);
 	std::map<int, Tree*> inotifymap;	// inotify wd -> tree
+	std::map<Tree*, int> inotifywds;	// tree -> inotify wd
 	pthread_t inotify_thread;
 	int inotify_fd;
 	int addInotify(Tree* tree);
-	void handleInotifyEvent(struct inotify_event* event);
+	void removeInotify(Tree* tree);
+
+	// All events for one name in one read() of the inotify fd, merged
+	struct InotifyChange {
+		int wd;
+		std::string name;
+		uint32_t mask;	// every event seen
+		bool exists;	// after the last create or delete event
+	};
+	void handleInotifyEvents(const char* buf, int len);
+	void applyInotifyChange(const InotifyChange& change, std::map<Tree*, std::string>& paths);
+	void flushModified(uint64_t now);
+	void queueEvent(MtpEventCode code, MtpObjectHandle handle);
+	void flushEvents(uint64_t now);
+	// handle -> time to check it again, so a file being written is
+	// looked at a few times a second instead of for every write
+	std::map<MtpObjectHandle, uint64_t> pendingModified;
+	// handle -> event to send to the host, sent a few at a time
+	std::map<MtpObjectHandle, MtpEventCode> pendingEvents;
+	// too much changed to send events one by one
+	bool pendingStoreChanged;
+	uint64_t nextEventFlush;
 
 	bool sendEvents;
 	MtpObjectHandle handleCurrentlySending;
 
-	Node* addNewNode(bool isDir, Tree* tree, const std::string& name);
+	// one object in the database file, parents come before children
+	struct DBRecord {
+		MtpObjectHandle handle;
+		MtpObjectHandle parent;
+		uint8_t flags;
+		uint64_t inode;
+		uint64_t size;
+		int64_t modified;
+		std::string name;
+	};
+	typedef std::map<std::string, const DBRecord*> DBEntries;	// name -> record
+	typedef std::map<MtpObjectHandle, DBEntries> DBDirs;	// handle -> saved entries
+	uint64_t volumeID;	// identifies the filesystem, from statfs
+	dev_t rootDev;
+	ino_t rootIno;
+	std::string dbPath;
+	bool dbDirty;
+	uint64_t lastChange;
+	void markDirty();
+	int loadDB();
+	bool restoreTree(Tree* tree, const DBRecord& record, const std::string& path, const DBDirs& dirs);
+	void writeDBRecord(Node* node, const std::string& path, time_t racy, std::string& out, uint32_t& count);
+	int readDir(const std::string& path, Tree* tree, const DBEntries* saved, const DBDirs* dirs);
+	void refreshNode(Node* node);
+
+	Node* addNewNode(bool isDir, Tree* tree, const std::string& name, MtpObjectHandle handle = 0);
 	Node* findNode(MtpObjectHandle handle);
+	Tree* findTree(MtpObjectHandle handle);
 	Node* findNodeByPath(const std::string& path);
+	void indexNode(Node* node);
+	void unindexNode(Node* node);
 	std::string getNodePath(Node* node);
 
-	void queryNodeProperties(std::vector<PropEntry>& results, Node* node, uint32_t property, int groupCode, MtpStorageID storageID);
+	bool getNodeProperty(Node* node, MtpObjectProperty property, PropEntry& pe);
+	void collectChildren(Tree* tree, uint32_t format, uint32_t depth, std::vector<Node*>& nodes);
 
 	bool use_mutex;
 	pthread_mutex_t inMutex; // inotify mutex
@@ -139,7 +139,9 @@ void MtpStringBuffer::readFromPacket(MtpDataPacket* packet) {
 void MtpStringBuffer::writeToPacket(MtpDataPacket* packet) const {
 	int count = mCharCount;
 	const uint8_t* src = mBuffer;
-	packet->putUInt8(count > 0 ? count + 1 : 0);
+	// one size check for the whole string instead of one per character
+	packet->reserve(1 + (count > 0 ? (count + 1) * 2 : 0));
+	packet->storeUInt8(count > 0 ? count + 1 : 0);
 
 	// expand utf8 to 16 bit chars
 	for (int i = 0; i < count; i++) {
@@ -158,10 +160,11 @@ void MtpStringBuffer::writeToPacket(MtpDataPacket* packet) const {
 			uint16_t ch3 = *src++;
 			ch = ((ch1 & 0x0F) << 12) | ((ch2 & 0x3F) << 6) | (ch3 & 0x3F);
 		}
-		packet->putUInt16(ch);
+		packet->storeUInt16(ch);
 	}
 	// only terminate with zero if string is not empty
 	if (count > 0)
-		packet->putUInt16(0);
+		packet->storeUInt16(0);
+	packet->endPut();
 }
 
@@ -46,6 +46,7 @@ void Tree::addEntry(Node* node) {
 		return;
 	}
 	entries[node->Mtpid()] = node;
+	node->setParentTree(this);
 }
 
 Node* Tree::findEntryByName(std::string name) {
@@ -20,13 +20,25 @@
 #include <vector>
 #include <string>
 #include <map>
+#include <sys/stat.h>
+#include <time.h>
 #include "MtpTypes.h"
 
+class Tree;
+
 // A directory entry
 class Node {
 	MtpObjectHandle handle;
 	MtpObjectHandle parent;
+	Tree* parentTree;	// set by Tree::addEntry, saves looking up the parent handle
 	std::string name;	// name only without path
+	// everything else MTP reports about an object is constant or derived
+	// from these, see MtpStorage::getNodeProperty
+	uint64_t inode;
+	uint64_t size;
+	time_t modified;
+	MtpObjectFormat format;
+	bool stale;	// restored from the database, size and date not checked yet
 
 public:
 	Node();
@@ -38,22 +50,19 @@ public:
 	void rename(const std::string& newName);
 	MtpObjectHandle Mtpid() const;
 	MtpObjectHandle getMtpParentId() const;
+	Tree* getParentTree() const { return parentTree; }
+	void setParentTree(Tree* tree) { parentTree = tree; }
 	const std::string& getName() const;
 
-	void addProperty(MtpPropertyCode property, uint64_t valueInt, std::string valueStr, MtpDataType dataType);
-	void updateProperty(MtpPropertyCode property, uint64_t valueInt, std::string valueStr, MtpDataType dataType);
-	void addProperties(const std::string& path, int storageID);
-	uint64_t getIntProperty(MtpPropertyCode property);
-	struct mtpProperty {
-		MtpPropertyCode property;
-		MtpDataType dataType;
-		uint64_t valueInt;
-		std::string valueStr;
-		mtpProperty() : property(0), dataType(0), valueInt(0) {}
-	};
-	std::vector<mtpProperty>& getMtpProps();
-	std::vector<mtpProperty> mtpProp;
-	const mtpProperty& getProperty(MtpPropertyCode property);
+	void setProperties(const struct stat& st);
+	void setProperties(uint64_t newInode, uint64_t newSize, time_t newModified);
+	void readProperties(const std::string& path);
+	uint64_t getInode() const { return inode; }
+	bool isStale() const { return stale; }
+	uint64_t getSize() const { return size; }
+	void setSize(uint64_t newSize) { size = newSize; }
+	time_t getModified() const { return modified; }
+	MtpObjectFormat getFormat() const { return format; }
 };
 
 // A directory
@@ -66,6 +75,10 @@ public:
 
 	virtual bool isDir() const { return true; }
 
+	typedef std::map<MtpObjectHandle, Node*>::const_iterator const_iterator;
+	const_iterator begin() const { return entries.begin(); }
+	const_iterator end() const { return entries.end(); }
+
 	void addEntry(Node* node);
 	Node* findNode(MtpObjectHandle handle);
 	void getmtpids(MtpObjectHandleList* mtpids);
@@ -637,16 +637,42 @@ MtpResponseCode MyMtpDatabase::resetDeviceProperty(MtpDeviceProperty property) {
 MtpResponseCode MyMtpDatabase::getObjectPropertyList(MtpObjectHandle handle, uint32_t format, uint32_t property, int groupCode, int depth, MtpDataPacket& packet) {
 	MTPD("getObjectPropertyList()\n");
 	MTPD("property: %x\n", property);
+	if (property == 0) {
+		// property groups are not supported, see getObjectPropertyDesc
+		MTPE("MyMtpDatabase::getObjectPropertyList group code %x unsupported\n", groupCode);
+		return MTP_RESPONSE_SPECIFICATION_BY_GROUP_UNSUPPORTED;
+	}
+	if (property != 0xffffffff && !MtpStorage::hasNodeProperty(property)) {
+		MTPE("MyMtpDatabase::getObjectPropertyList property %x unsupported\n", property);
+		return MTP_RESPONSE_OBJECT_PROP_NOT_SUPPORTED;
+	}
+
+	// gather the objects from every storage that has them first, as the
+	// count goes in front of the list. 0 and 0xffffffff cover all storages.
+	bool allStorages = (handle == 0 || handle == 0xffffffff);
+	std::vector<std::pair<MtpStorage*, std::vector<Node*> > > lists;
+	size_t count = 0;
 	std::map<int, MtpStorage*>::iterator storit;
 	for (storit = storagemap.begin(); storit != storagemap.end(); storit++) {
-		MTPD("MyMtpDatabase::getObjectPropertyList calling getObjectPropertyList\n");
-		if (storit->second->getObjectPropertyList(handle, format, property, groupCode, depth, packet) == 0) {
-			MTPD("MTP_RESPONSE_OK\n");
-   			return MTP_RESPONSE_OK;
+		lists.push_back(std::make_pair(storit->second, std::vector<Node*>()));
+		if (storit->second->collectObjects(handle, format, depth, lists.back().second) != 0) {
+			lists.pop_back();
+			continue;
 		}
+		count += MtpStorage::getPropertyListCount(lists.back().second.size(), property);
+		if (!allStorages)
+			break;
 	}
-	MTPE("MyMtpDatabase::getObjectPropertyList MTP_RESPOSNE_INVALID_OBJECT_HANDLE %i\n", handle);
-	return MTP_RESPONSE_INVALID_OBJECT_HANDLE;
+	if (lists.empty()) {
+		MTPE("MyMtpDatabase::getObjectPropertyList MTP_RESPOSNE_INVALID_OBJECT_HANDLE %i\n", handle);
+		return MTP_RESPONSE_INVALID_OBJECT_HANDLE;
+	}
+
+	MTPD("count: %u\n", count);
+	packet.putUInt32(count);
+	for (size_t i = 0; i < lists.size(); i++)
+		lists[i].first->putObjectPropertyList(lists[i].second, property, packet);
+	return MTP_RESPONSE_OK;
 }
 
 MtpResponseCode MyMtpDatabase::getObjectInfo(MtpObjectHandle handle, MtpObjectInfo& info) {
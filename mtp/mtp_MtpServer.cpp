@@ -35,6 +35,15 @@
 
 #include <string>
 
+twmtp_MtpServer::twmtp_MtpServer()
+	:	stores(NULL),
+		server(NULL),
+		refserver(NULL),
+		mtp_read_pipe(-1),
+		mtp_progress(NULL)
+{
+}
+
 void twmtp_MtpServer::start()
 {
 	usePtp =  false;
@@ -59,6 +68,7 @@ void twmtp_MtpServer::start()
 	}
 	MTPD("fd: %d\n", fd);
 	server = new MtpServer(mtpdb, usePtp, 0, 0664, 0775);
+	server->setTransferProgress(mtp_progress);
 	refserver = server;
 	MTPI("created new mtpserver object\n");
 	add_storage();
@@ -197,3 +207,8 @@ void twmtp_MtpServer::set_read_pipe(int pipe)
 {
 	mtp_read_pipe = pipe;
 }
+
+void twmtp_MtpServer::set_progress(struct mtp_transfer_progress* progress)
+{
+	mtp_progress = progress;
+}
@@ -43,6 +43,7 @@ typedef std::vector<storage*> storages;
 
 class twmtp_MtpServer {
 	public:
+		twmtp_MtpServer();
 		void start();
 		void cleanup();
 		void send_object_added(int handle);
@@ -51,6 +52,7 @@ class twmtp_MtpServer {
 		void remove_storage(int storageId);
 		void set_storages(storages* mtpstorages);
 		void set_read_pipe(int pipe);
+		void set_progress(struct mtp_transfer_progress* progress);
 		storages *stores;
 	private:
 		typedef int (twmtp_MtpServer::*ThreadPtr)(void);
@@ -60,6 +62,7 @@ class twmtp_MtpServer {
 		MtpServer* server;
 		MtpServer* refserver;
 		int mtp_read_pipe;
+		struct mtp_transfer_progress* mtp_progress;
 
 };
 #endif
@@ -73,6 +73,7 @@ twrpMtp::twrpMtp(int debug_enabled = 0) {
 		MtpDebug::enableDebug();
 	mtpstorages = new storages;
 	mtp_read_pipe = -1;
+	mtp_progress = NULL;
 }
 
 int twrpMtp::start(void) {
@@ -80,6 +81,7 @@ int twrpMtp::start(void) {
 	twmtp_MtpServer *mtp = new twmtp_MtpServer();
 	mtp->set_storages(mtpstorages);
 	mtp->set_read_pipe(mtp_read_pipe);
+	mtp->set_progress(mtp_progress);
 	mtp->start();
 	return 0;
 }
@@ -112,6 +114,10 @@ pid_t twrpMtp::forkserver(int mtppipe[2]) {
 	return 0;
 }
 
+void twrpMtp::set_progress(struct mtp_transfer_progress* progress) {
+	mtp_progress = progress;
+}
+
 void twrpMtp::addStorage(std::string display, std::string path, int mtpid, uint64_t maxFileSize) {
 	s = new storage;
 	s->display = display;
@@ -37,6 +37,7 @@ class twrpMtp {
 		pthread_t threadserver(void);
 		pid_t forkserver(int mtppipe[2]);
 		void addStorage(std::string display, std::string path, int mtpid, uint64_t maxFileSize);
+		void set_progress(struct mtp_transfer_progress* progress);
 	private:
 		int start(void);
 		typedef int (twrpMtp::*ThreadPtr)(void);
@@ -44,5 +45,6 @@ class twrpMtp {
 		storages *mtpstorages;
 		storage *s;
 		int mtp_read_pipe;
+		struct mtp_transfer_progress* mtp_progress;
 };
 #endif
@@ -30,6 +30,7 @@
 #include <iostream>
 #include <iomanip>
 #include <sys/wait.h>
+#include <sys/mman.h>
 #include "variables.h"
 #include "twcommon.h"
 #include "partitions.hpp"
@@ -60,6 +61,7 @@ extern bool datamedia;
 TWPartitionManager::TWPartitionManager(void) {
 	mtp_was_enabled = false;
 	mtp_write_fd = -1;
+	mtp_progress = NULL;
 	stop_backup.set_value(0);
 	tar_fork_pid = 0;
 }
@@ -2023,6 +2025,17 @@ bool TWPartitionManager::Enable_MTP(void) {
 	 * twrp set tw_mtp_debug 1
 	 */
 	twrpMtp *mtp = new twrpMtp(DataManager::GetIntValue("tw_mtp_debug"));
+	// the MTP process reports transfer progress through a shared page
+	if (!mtp_progress) {
+		void* map = mmap(NULL, sizeof(struct mtp_transfer_progress), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (map != MAP_FAILED)
+			mtp_progress = (struct mtp_transfer_progress*)map;
+	}
+	if (mtp_progress) {
+		mtp_progress_set(&mtp_progress->transferred, 0);
+		mtp_progress_set(&mtp_progress->total, 0);
+	}
+	mtp->set_progress(mtp_progress);
 	mtppid = mtp->forkserver(mtppipe);
 	if (mtppid) {
 		close(mtppipe[0]); // Host closes read side
@@ -2094,6 +2107,18 @@ bool TWPartitionManager::Disable_MTP(void) {
 	return false;
 }
 
+bool TWPartitionManager::Get_MTP_Transfer_Progress(uint64_t& transferred, uint64_t& total) {
+#ifdef TW_HAS_MTP
+	if (!mtppid || !mtp_progress)
+		return false;
+	transferred = mtp_progress_get(&mtp_progress->transferred);
+	total = mtp_progress_get(&mtp_progress->total);
+	return true;
+#else
+	return false;
+#endif
+}
+
 TWPartition* TWPartitionManager::Find_Partition_By_MTP_Storage_ID(unsigned int Storage_ID) {
 	std::vector<TWPartition*>::iterator iter;
 
@@ -84,6 +84,7 @@ public:
 	unsigned long long GetSizeBackup() { return Backup_Size; }
 	unsigned long long GetSizeTotal() { return Size; }
 	unsigned long long GetSizeRaw() { return Size_Raw; }
+	bool IsRemovable() { return Removable; }
 
 public:
 	string Current_File_System;                                               // Current file system
@@ -244,6 +245,7 @@ public:
 	bool Enable_MTP();                                                        // Enables MTP
 	void Add_All_MTP_Storage();                                               // Adds all storage objects for MTP
 	bool Disable_MTP();                                                       // Disables MTP
+	bool Get_MTP_Transfer_Progress(uint64_t& transferred, uint64_t& total);   // Returns false if MTP is not running
 	bool Add_MTP_Storage(string Mount_Point);                                 // Adds or removes an MTP Storage partition
 	bool Add_MTP_Storage(unsigned int Storage_ID);                            // Adds or removes an MTP Storage partition
 	bool Remove_MTP_Storage(string Mount_Point);                              // Adds or removes an MTP Storage partition
@@ -273,6 +275,7 @@ private:
 	pid_t mtppid;
 	bool mtp_was_enabled;
 	int mtp_write_fd;
+	struct mtp_transfer_progress* mtp_progress;                               // Shared with the MTP process
 	pid_t tar_fork_pid;
 
 private:
@@ -5,6 +5,7 @@ include $(CLEAR_VARS)
 LOCAL_C_INCLUDES += $(commands_recovery_local_path)
 LOCAL_SRC_FILES := simg2img.c sparse_crc32.c
 LOCAL_SHARED_LIBRARIES += libz libc
+LOCAL_STATIC_LIBRARIES += libmmcutils
 
 LOCAL_MODULE := simg2img_twrp
 LOCAL_MODULE_TAGS := eng
@@ -17,6 +17,7 @@
 #include "ext4_utils.h"
 #include "sparse_format.h"
 #include "sparse_crc32.h"
+#include "mmcutils/zero_range.h"
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -128,6 +129,20 @@ int process_fill_chunk(int in, int out, u32 blocks, u32 blk_sz, u32 *crc32)
 		fillbuf[i] = fill_val;
 	}
 
+	/* Zero fills are left to the kernel when the output can seek */
+	if (fill_val == 0) {
+		off64_t pos = lseek64(out, 0, SEEK_CUR);
+		if (pos >= 0 && zero_range(out, pos, len) == 0) {
+			lseek64(out, len, SEEK_CUR);
+			while (len) {
+				chunk = (len > COPY_BUF_SIZE) ? COPY_BUF_SIZE : len;
+				*crc32 = sparse_crc32(*crc32, copybuf, chunk);
+				len -= chunk;
+			}
+			return blocks;
+		}
+	}
+
 	while (len) {
 		chunk = (len > COPY_BUF_SIZE) ? COPY_BUF_SIZE : len;
 		*crc32 = sparse_crc32(*crc32, copybuf, chunk);
@@ -25,3 +25,97 @@ $(foreach file,$(test_src_files), \
     $(eval LOCAL_MODULE_TAGS := optional) \
     $(eval include $(BUILD_NATIVE_TEST)) \
 )
+
+# MTP tests: storage, including a handle lookup benchmark on a synthetic
+# tree of ~100k objects, the user space file transfer engine over a
+# socketpair standing in for the USB endpoint, background deletes, and
+# the whole server driven over a socketpair by a scripted host, which
+# benchmarks enumeration and transfers (MTP_LOOPBACK_OBJECTS sets the
+# number of objects).
+mtp_test_src_files := \
+    mtp_delete_test.cpp \
+    mtp_loopback_test.cpp \
+    mtp_storage_test.cpp \
+    mtp_transfer_test.cpp
+
+$(foreach file,$(mtp_test_src_files), \
+    $(eval include $(CLEAR_VARS)) \
+    $(eval LOCAL_MODULE := $(notdir $(file:%.cpp=%))) \
+    $(eval LOCAL_MODULE_TAGS := optional) \
+    $(eval LOCAL_SRC_FILES := $(file)) \
+    $(eval LOCAL_CFLAGS := -D_FILE_OFFSET_BITS=64 -DMTP_DEVICE -DMTP_HOST) \
+    $(eval LOCAL_C_INCLUDES := $(LOCAL_PATH)/.. $(LOCAL_PATH)/../mtp bionic external/stlport/stlport frameworks/base/include system/core/include) \
+    $(eval LOCAL_SHARED_LIBRARIES := libtwrpmtp libstlport libutils libcutils liblog) \
+    $(eval LOCAL_STATIC_LIBRARIES := libgtest libgtest_main) \
+    $(eval include $(BUILD_NATIVE_TEST)) \
+)
+
+# minzip: parallel extraction compared byte for byte with the serial
+# path on a synthetic ROM zip (MINZIP_TEST_FILES sets the number of files),
+# and the central directory handed over by mzWriteZipDirectory().
+include $(CLEAR_VARS)
+LOCAL_MODULE := minzip_extract_test
+LOCAL_MODULE_TAGS := optional
+LOCAL_SRC_FILES := minzip_extract_test.cpp
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/.. external/zlib external/libselinux/include
+LOCAL_STATIC_LIBRARIES := libminzip libz libselinux libgtest libgtest_main
+include $(BUILD_NATIVE_TEST)
+
+# SHA-1/SHA-256 known answers for every implementation the CPU supports,
+# and their throughput. Also built for the host so the benchmark runs on
+# any Linux machine.
+include $(CLEAR_VARS)
+LOCAL_MODULE := sha_test
+LOCAL_MODULE_TAGS := optional
+LOCAL_SRC_FILES := sha_test.cpp
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/.. $(LOCAL_PATH)/../libmincrypt/includes
+LOCAL_STATIC_LIBRARIES := libmincrypttwrp libgtest libgtest_main
+include $(BUILD_NATIVE_TEST)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := sha_test
+LOCAL_MODULE_TAGS := optional
+LOCAL_SRC_FILES := sha_test.cpp
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/.. $(LOCAL_PATH)/../libmincrypt/includes
+LOCAL_STATIC_LIBRARIES := libmincrypttwrp libgtest_host libgtest_main_host
+LOCAL_LDLIBS := -lpthread
+include $(BUILD_HOST_NATIVE_TEST)
+
+# Zeroing byte ranges of plain files and, when run as root, of a loop
+# device, through the kernel and through plain writes.
+include $(CLEAR_VARS)
+LOCAL_MODULE := zero_range_test
+LOCAL_MODULE_TAGS := optional
+LOCAL_SRC_FILES := zero_range_test.cpp
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/..
+LOCAL_STATIC_LIBRARIES := libmmcutils libgtest libgtest_main
+include $(BUILD_NATIVE_TEST)
+
+# applypatch: image patches built from applypatch/testdata, applied
+# serially and with the chunks patched in parallel (run from the top of
+# the recovery tree or set IMGPATCH_TESTDATA).
+include $(CLEAR_VARS)
+LOCAL_MODULE := imgpatch_test
+LOCAL_MODULE_TAGS := optional
+LOCAL_SRC_FILES := imgpatch_test.cpp
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/.. $(LOCAL_PATH)/../libmincrypt/includes external/zlib
+LOCAL_STATIC_LIBRARIES := libapplypatch libmincrypttwrp libbz libz libgtest libgtest_main
+include $(BUILD_NATIVE_TEST)
+
+# block_image_update(): killed at every write in turn and run again,
+# which has to pick up from its checkpoint and leave the same image as
+# an uninterrupted update, range_sha1() while an update is partway
+# done, and another package refusing to take over.  Links updater's
+# blockimg.c and wraps write() so the update can die in the middle of
+# one.
+include $(CLEAR_VARS)
+LOCAL_MODULE := blockimg_resume_test
+LOCAL_MODULE_TAGS := optional
+LOCAL_SRC_FILES := blockimg_resume_test.cpp ../updater/blockimg.c
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/.. $(LOCAL_PATH)/../libmincrypt/includes \
+    external/bzip2 external/zlib external/libselinux/include
+LOCAL_LDFLAGS := -Wl,--wrap=write
+LOCAL_STATIC_LIBRARIES := libapplypatch libedify libmtdutils libbmlutils libmmcutils \
+    libminzip libmincrypttwrp libselinux libbz libz libgtest libgtest_main
+LOCAL_SHARED_LIBRARIES := libcutils liblog
+include $(BUILD_NATIVE_TEST)
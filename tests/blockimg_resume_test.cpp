@@ -0,0 +1,769 @@
+/*
+ * Copyright (C) 2016 TeamWin Recovery Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+#include <bzlib.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include "edify/expr.h"
+#include "mincrypt/sha.h"
+#include "minzip/SysUtil.h"
+#include "minzip/Zip.h"
+#include "updater/updater.h"
+
+Value* BlockImageUpdateFn(const char* name, State* state, int argc, Expr* argv[]);
+Value* RangeSha1Fn(const char* name, State* state, int argc, Expr* argv[]);
+}
+
+// Runs block_image_update() on a synthetic image and transfer list
+// (moves, stashes, bsdiff patches, zeroes, new data and erases, with
+// targets overlapping their own sources), killing it at every write in
+// turn, then runs the script again and compares the result with an
+// uninterrupted update.  Every attempt first checks the source with
+// range_sha1(), as an OTA script does.  The updater runs in a child
+// process; the test binary is linked with --wrap=write so the child
+// can die in the middle of any write.  BLOCKIMG_TEST_SEED picks the
+// update (default 1).
+
+#define BLOCKSIZE 4096
+#define IMAGE_BLOCKS 1024
+#define STASH_SLOTS 8
+
+// exit codes of the child
+#define RESULT_DONE 0
+#define RESULT_FAILED 1
+#define RESULT_SOURCE_MISMATCH 5
+#define RESULT_CRASHED 9
+
+static long crash_at = -1;
+static long writes = 0;
+
+extern "C" ssize_t __real_write(int fd, const void* buf, size_t count);
+
+extern "C" ssize_t __wrap_write(int fd, const void* buf, size_t count) {
+    if (crash_at >= 0 && fd > 2 && ++writes >= crash_at) {
+        // half of it makes it out
+        if (count > 1) {
+            __real_write(fd, buf, count / 2);
+        }
+        _exit(RESULT_CRASHED);
+    }
+    return __real_write(fd, buf, count);
+}
+
+// What the updater's install.c provides.
+extern "C" char* PrintSha1(const uint8_t* digest) {
+    char* buffer = (char*)malloc(SHA_DIGEST_SIZE * 2 + 1);
+    for (int i = 0; i < SHA_DIGEST_SIZE; i++) {
+        sprintf(buffer + i * 2, "%02x", digest[i]);
+    }
+    return buffer;
+}
+
+static std::string temp_path(const char* name) {
+    const char* dir = getenv("TMPDIR");
+    return std::string(dir ? dir : "/data/local/tmp") + "/" + name;
+}
+
+static std::string sha1_hex(const std::string& data) {
+    uint8_t digest[SHA_DIGEST_SIZE];
+    SHA_hash(data.data(), data.size(), digest);
+    char* hex = PrintSha1(digest);
+    std::string out = hex;
+    free(hex);
+    return out;
+}
+
+static bool read_file(const std::string& path, std::string* out) {
+    FILE* f = fopen(path.c_str(), "rb");
+    if (f == NULL) {
+        return false;
+    }
+    char buf[65536];
+    size_t n;
+    out->clear();
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+        out->append(buf, n);
+    }
+    fclose(f);
+    return true;
+}
+
+static bool write_file(const std::string& path, const std::string& data) {
+    FILE* f = fopen(path.c_str(), "wb");
+    if (f == NULL) {
+        return false;
+    }
+    bool ok = fwrite(data.data(), 1, data.size(), f) == data.size();
+    return fclose(f) == 0 && ok;
+}
+
+static bool exists(const std::string& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0;
+}
+
+// Where block_image_update() keeps its checkpoint for blockdev (see
+// CheckpointDir() in updater/blockimg.c), or "" if there is none.
+static std::string checkpoint_dir(const std::string& blockdev) {
+    static const char* bases[] = { "/cache/recovery", "/tmp" };
+    std::string id = sha1_hex(blockdev);
+    for (size_t i = 0; i < sizeof(bases) / sizeof(bases[0]); i++) {
+        std::string path = std::string(bases[i]) + "/blockimg-" + id;
+        struct stat st;
+        if (stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+            return path;
+        }
+    }
+    return "";
+}
+
+static void remove_checkpoint(const std::string& blockdev) {
+    std::string dir = checkpoint_dir(blockdev);
+    if (dir.empty()) {
+        return;
+    }
+    DIR* d = opendir(dir.c_str());
+    if (d != NULL) {
+        struct dirent* de;
+        while ((de = readdir(d)) != NULL) {
+            if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0) {
+                unlink((dir + "/" + de->d_name).c_str());
+            }
+        }
+        closedir(d);
+    }
+    rmdir(dir.c_str());
+}
+
+static void put16(std::string* out, unsigned value) {
+    out->push_back(value & 0xFF);
+    out->push_back((value >> 8) & 0xFF);
+}
+
+static void put32(std::string* out, unsigned long value) {
+    put16(out, value & 0xFFFF);
+    put16(out, (value >> 16) & 0xFFFF);
+}
+
+static void put64(std::string* out, unsigned long long value) {
+    put32(out, value & 0xFFFFFFFFUL);
+    put32(out, value >> 32);
+}
+
+// Just enough of a zip writer for the package: no data descriptors,
+// no extra fields.
+class ZipWriter {
+public:
+    void add(const std::string& name, const std::string& data, bool compress) {
+        std::string comp = data;
+        if (compress) {
+            z_stream zs;
+            memset(&zs, 0, sizeof(zs));
+            deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+            comp.resize(deflateBound(&zs, data.size()));
+            zs.next_in = (Bytef*)data.data();
+            zs.avail_in = data.size();
+            zs.next_out = (Bytef*)&comp[0];
+            zs.avail_out = comp.size();
+            deflate(&zs, Z_FINISH);
+            comp.resize(zs.total_out);
+            deflateEnd(&zs);
+        }
+        unsigned long crc = crc32(0, (const Bytef*)data.data(), data.size());
+        unsigned method = compress ? 8 : 0;
+        size_t offset = mData.size();
+
+        put32(&mData, 0x04034b50);
+        put16(&mData, 20);
+        put16(&mData, 0);
+        put16(&mData, method);
+        put32(&mData, 0);
+        put32(&mData, crc);
+        put32(&mData, comp.size());
+        put32(&mData, data.size());
+        put16(&mData, name.size());
+        put16(&mData, 0);
+        mData += name;
+        mData += comp;
+
+        put32(&mCentral, 0x02014b50);
+        put16(&mCentral, 3 << 8 | 20);
+        put16(&mCentral, 20);
+        put16(&mCentral, 0);
+        put16(&mCentral, method);
+        put32(&mCentral, 0);
+        put32(&mCentral, crc);
+        put32(&mCentral, comp.size());
+        put32(&mCentral, data.size());
+        put16(&mCentral, name.size());
+        put32(&mCentral, 0);
+        put32(&mCentral, 0);
+        put32(&mCentral, 0100644UL << 16);
+        put32(&mCentral, offset);
+        mCentral += name;
+        mCount++;
+    }
+
+    bool write(const std::string& path) {
+        std::string out = mData + mCentral;
+        put32(&out, 0x06054b50);
+        put32(&out, 0);
+        put16(&out, mCount);
+        put16(&out, mCount);
+        put32(&out, mCentral.size());
+        put32(&out, mData.size());
+        put16(&out, 0);
+        return write_file(path, out);
+    }
+
+private:
+    std::string mData;
+    std::string mCentral;
+    unsigned mCount = 0;
+};
+
+static std::string bzip2(const std::string& data) {
+    unsigned int len = data.size() + data.size() / 100 + 600;
+    std::string out(len, '\0');
+    BZ2_bzBuffToBuffCompress(&out[0], &len, (char*)data.data(), data.size(), 9, 0, 0);
+    out.resize(len);
+    return out;
+}
+
+// A bsdiff patch that adds the difference to the old data all in one
+// go, which is all bspatch needs to see.
+static std::string make_bsdiff(const std::string& old_data, const std::string& new_data) {
+    std::string ctrl;
+    put64(&ctrl, new_data.size());
+    put64(&ctrl, 0);
+    put64(&ctrl, 0);
+    std::string diff = new_data;
+    for (size_t i = 0; i < diff.size() && i < old_data.size(); i++) {
+        diff[i] = new_data[i] - old_data[i];
+    }
+    std::string ctrl_bz = bzip2(ctrl);
+    std::string diff_bz = bzip2(diff);
+
+    std::string patch = "BSDIFF40";
+    put64(&patch, ctrl_bz.size());
+    put64(&patch, diff_bz.size());
+    put64(&patch, new_data.size());
+    return patch + ctrl_bz + diff_bz + bzip2("");
+}
+
+typedef std::vector<std::pair<int, int> > Ranges;
+
+static Ranges ranges_of(std::vector<int> blocks) {
+    std::sort(blocks.begin(), blocks.end());
+    Ranges out;
+    for (size_t i = 0; i < blocks.size(); i++) {
+        if (!out.empty() && out.back().second == blocks[i]) {
+            out.back().second++;
+        } else {
+            out.push_back(std::make_pair(blocks[i], blocks[i] + 1));
+        }
+    }
+    return out;
+}
+
+static int block_count(const Ranges& r) {
+    int n = 0;
+    for (size_t i = 0; i < r.size(); i++) {
+        n += r[i].second - r[i].first;
+    }
+    return n;
+}
+
+static std::string format_ranges(const Ranges& r) {
+    std::string out = std::to_string(r.size() * 2);
+    for (size_t i = 0; i < r.size(); i++) {
+        out += "," + std::to_string(r[i].first) + "," + std::to_string(r[i].second);
+    }
+    return out;
+}
+
+// Makes up an image and a version 2 transfer list for it, and works
+// out what running the list should leave behind.
+class UpdateBuilder {
+public:
+    explicit UpdateBuilder(unsigned seed) : mRandom(seed) {
+        mSource.resize(IMAGE_BLOCKS * BLOCKSIZE);
+        for (size_t i = 0; i < mSource.size(); i++) {
+            mSource[i] = mRandom() & 0xFF;
+        }
+        mTarget = mSource;
+        mWritten.assign(IMAGE_BLOCKS, false);
+        mRead.assign(IMAGE_BLOCKS, false);
+    }
+
+    void build(int steps) {
+        static const char* kinds[] = {
+            "move", "bsdiff", "stash", "zero", "new", "erase", "move", "bsdiff"
+        };
+        std::map<int, std::string> stashes;
+        std::vector<std::string> commands;
+        int total = 0;
+        int stashed_blocks = 0;
+
+        for (int step = 0; step < steps; step++) {
+            std::string kind = kinds[rnd(8)];
+            if (kind == "stash") {
+                int id = rnd(STASH_SLOTS);
+                if (stashes.count(id)) {
+                    continue;
+                }
+                Ranges src = ranges_of(pick(1 + rnd(16), false));
+                stashes[id] = read(src);
+                stashed_blocks += block_count(src);
+                commands.push_back("stash " + std::to_string(id) + " " + format_ranges(src));
+                continue;
+            }
+            if (kind == "zero" || kind == "new" || kind == "erase") {
+                Ranges tgt = ranges_of(pick(1 + rnd(64), true));
+                int n = block_count(tgt);
+                if (kind == "zero") {
+                    write(tgt, std::string(n * BLOCKSIZE, '\0'));
+                    total += n;
+                } else if (kind == "new") {
+                    std::string data = random_data(n * BLOCKSIZE);
+                    mNewData += data;
+                    write(tgt, data);
+                    total += n;
+                } else {
+                    // left as it is in a file; not to be read again
+                    write(tgt, read_target(tgt));
+                }
+                commands.push_back(kind + " " + format_ranges(tgt));
+                continue;
+            }
+
+            // move or bsdiff, from source blocks and maybe stashes
+            std::vector<int> src_blocks = pick(1 + rnd(48), false);
+            Ranges src = ranges_of(src_blocks);
+            std::string src_data = read(src);
+            std::vector<int> used;
+            for (std::map<int, std::string>::iterator it = stashes.begin();
+                 it != stashes.end(); ++it) {
+                if (rnd(2)) {
+                    used.push_back(it->first);
+                }
+            }
+            std::string buffer;
+            std::string src_part;
+            if (!used.empty() || rnd(10) < 3) {
+                int src_total = src_blocks.size();
+                for (size_t i = 0; i < used.size(); i++) {
+                    src_total += stashes[used[i]].size() / BLOCKSIZE;
+                }
+                std::vector<int> order;
+                for (int i = 0; i < src_total; i++) {
+                    order.push_back(i);
+                }
+                std::shuffle(order.begin(), order.end(), mRandom);
+                buffer.resize(src_total * BLOCKSIZE);
+                std::vector<int> mine(order.begin(), order.begin() + src_blocks.size());
+                Ranges locs = ranges_of(mine);
+                place(&buffer, locs, src_data);
+                src_part = format_ranges(src) + " " + format_ranges(locs);
+
+                size_t next = src_blocks.size();
+                for (size_t i = 0; i < used.size(); i++) {
+                    const std::string& stash = stashes[used[i]];
+                    size_t n = stash.size() / BLOCKSIZE;
+                    std::vector<int> theirs(order.begin() + next, order.begin() + next + n);
+                    next += n;
+                    Ranges stash_locs = ranges_of(theirs);
+                    place(&buffer, stash_locs, stash);
+                    src_part += " " + std::to_string(used[i]) + ":" + format_ranges(stash_locs);
+                    stashed_blocks -= n;
+                    stashes.erase(used[i]);
+                }
+            } else {
+                buffer = src_data;
+                src_part = format_ranges(src);
+            }
+
+            int src_total = buffer.size() / BLOCKSIZE;
+            std::string out;
+            std::string patch_part;
+            if (kind == "move") {
+                out = buffer;
+            } else {
+                int tgt_blocks = std::max(1, src_total + rnd(9) - 4);
+                out = (buffer + buffer).substr(0, tgt_blocks * BLOCKSIZE);
+                for (int i = 0; i < 20; i++) {
+                    out[rnd(out.size())] = mRandom() & 0xFF;
+                }
+                std::string patch = make_bsdiff(buffer, out);
+                patch_part = std::to_string(mPatchData.size()) + " " +
+                        std::to_string(patch.size()) + " ";
+                mPatchData += patch;
+            }
+            // anywhere, so the target often overlaps the source
+            Ranges tgt = ranges_of(pick(out.size() / BLOCKSIZE, true));
+            write(tgt, out);
+            total += block_count(tgt);
+            commands.push_back(kind + " " + patch_part + format_ranges(tgt) + " " +
+                               std::to_string(src_total) + " " + src_part);
+            mMaxStashed = std::max(mMaxStashed, stashed_blocks);
+        }
+
+        mList = "2\n" + std::to_string(total) + "\n" + std::to_string(STASH_SLOTS) + "\n" +
+                std::to_string(mMaxStashed) + "\n";
+        for (size_t i = 0; i < commands.size(); i++) {
+            mList += commands[i] + "\n";
+        }
+
+        std::vector<int> read_blocks;
+        for (int b = 0; b < IMAGE_BLOCKS; b++) {
+            if (mRead[b]) {
+                read_blocks.push_back(b);
+            }
+        }
+        mReadRanges = ranges_of(read_blocks);
+        mSourceRanges = format_ranges(mReadRanges);
+        mSourceSha1 = source_sha1(mSource);
+    }
+
+    // The SHA-1 of the blocks the list reads, in image.
+    std::string source_sha1(const std::string& image) {
+        std::string data;
+        for (size_t i = 0; i < mReadRanges.size(); i++) {
+            data += image.substr((size_t)mReadRanges[i].first * BLOCKSIZE,
+                                 (size_t)(mReadRanges[i].second - mReadRanges[i].first) * BLOCKSIZE);
+        }
+        return sha1_hex(data);
+    }
+
+    std::string mSource;
+    std::string mTarget;
+    std::string mList;
+    std::string mNewData;
+    std::string mPatchData;
+    std::string mSourceRanges;  // every block the list reads
+    std::string mSourceSha1;
+
+private:
+    int rnd(int n) {
+        return std::uniform_int_distribution<int>(0, n - 1)(mRandom);
+    }
+
+    std::string random_data(size_t size) {
+        std::string data(size, '\0');
+        for (size_t i = 0; i < size; i++) {
+            data[i] = mRandom() & 0xFF;
+        }
+        return data;
+    }
+
+    // Up to n distinct blocks; only ones not yet written unless any is
+    // true, since the list must never read what it has written.
+    std::vector<int> pick(int n, bool any) {
+        std::vector<int> pool;
+        for (int b = 0; b < IMAGE_BLOCKS; b++) {
+            if (any || !mWritten[b]) {
+                pool.push_back(b);
+            }
+        }
+        std::shuffle(pool.begin(), pool.end(), mRandom);
+        pool.resize(std::min((int)pool.size(), n));
+        return pool;
+    }
+
+    std::string read_target(const Ranges& r) {
+        std::string out;
+        for (size_t i = 0; i < r.size(); i++) {
+            out += mTarget.substr((size_t)r[i].first * BLOCKSIZE,
+                                  (size_t)(r[i].second - r[i].first) * BLOCKSIZE);
+        }
+        return out;
+    }
+
+    std::string read(const Ranges& r) {
+        for (size_t i = 0; i < r.size(); i++) {
+            for (int b = r[i].first; b < r[i].second; b++) {
+                mRead[b] = true;
+            }
+        }
+        return read_target(r);
+    }
+
+    void write(const Ranges& r, const std::string& data) {
+        size_t p = 0;
+        for (size_t i = 0; i < r.size(); i++) {
+            size_t n = (size_t)(r[i].second - r[i].first) * BLOCKSIZE;
+            mTarget.replace((size_t)r[i].first * BLOCKSIZE, n, data, p, n);
+            p += n;
+            for (int b = r[i].first; b < r[i].second; b++) {
+                mWritten[b] = true;
+            }
+        }
+    }
+
+    static void place(std::string* buffer, const Ranges& locs, const std::string& data) {
+        size_t p = 0;
+        for (size_t i = 0; i < locs.size(); i++) {
+            size_t n = (size_t)(locs[i].second - locs[i].first) * BLOCKSIZE;
+            buffer->replace((size_t)locs[i].first * BLOCKSIZE, n, data, p, n);
+            p += n;
+        }
+    }
+
+    std::mt19937 mRandom;
+    Ranges mReadRanges;
+    std::vector<bool> mWritten;
+    std::vector<bool> mRead;
+    int mMaxStashed = 0;
+};
+
+static Value* BlobLiteral(const char* name, State* state, int argc, Expr* argv[]) {
+    Value* v = (Value*)malloc(sizeof(Value));
+    v->type = VAL_BLOB;
+    v->size = strlen(name);
+    v->data = strdup(name);
+    return v;
+}
+
+static Expr* Arg(Function fn, const std::string& value) {
+    Expr* e = (Expr*)calloc(1, sizeof(Expr));
+    e->fn = fn;
+    e->name = strdup(value.c_str());
+    return e;
+}
+
+static std::string CallRangeSha1(const std::string& blockdev, const std::string& ranges) {
+    State state;
+    memset(&state, 0, sizeof(state));
+    Expr* argv[] = { Arg(Literal, blockdev), Arg(Literal, ranges) };
+    Value* v = RangeSha1Fn("range_sha1", &state, 2, argv);
+    return v != NULL && v->type == VAL_STRING ? v->data : "";
+}
+
+class BlockImageResumeTest : public ::testing::Test {
+protected:
+    virtual void SetUp() {
+        const char* seed = getenv("BLOCKIMG_TEST_SEED");
+        mUpdate = new UpdateBuilder(seed ? atoi(seed) : 1);
+        mUpdate->build(40);
+
+        mImage = temp_path("blockimg_test.img");
+        mPackage = temp_path("blockimg_test.zip");
+        ZipWriter zip;
+        zip.add("new.dat", mUpdate->mNewData, true);
+        zip.add("patch.dat", mUpdate->mPatchData, false);
+        ASSERT_TRUE(zip.write(mPackage));
+        ASSERT_EQ(0, sysMapFile(mPackage.c_str(), &mMap));
+        ASSERT_EQ(0, mzOpenZipArchive(mMap.addr, mMap.length, &mZip));
+        remove_checkpoint(mImage);
+    }
+
+    virtual void TearDown() {
+        mzCloseZipArchive(&mZip);
+        sysReleaseMap(&mMap);
+        remove_checkpoint(mImage);
+        unlink(mImage.c_str());
+        unlink(mPackage.c_str());
+        delete mUpdate;
+    }
+
+    // Runs the script for the update in a child, dying at its
+    // crash_at'th write if crash_at isn't negative: range_sha1() of
+    // the source, abort unless it's as expected, block_image_update().
+    int RunScript(const std::string& list, long crash_at_write) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            freopen("/dev/null", "w", stdout);
+            freopen("/dev/null", "w", stderr);
+            crash_at = crash_at_write;
+            if (CallRangeSha1(mImage, mUpdate->mSourceRanges) != mUpdate->mSourceSha1) {
+                _exit(RESULT_SOURCE_MISMATCH);
+            }
+
+            UpdaterInfo ui;
+            ui.cmd_pipe = fopen("/dev/null", "w");
+            ui.package_zip = &mZip;
+            ui.version = 3;
+            ui.package_zip_addr = mMap.addr;
+            ui.package_zip_len = mMap.length;
+            State state;
+            memset(&state, 0, sizeof(state));
+            state.cookie = &ui;
+            Expr* argv[] = {
+                Arg(Literal, mImage), Arg(BlobLiteral, list),
+                Arg(Literal, "new.dat"), Arg(Literal, "patch.dat")
+            };
+            Value* v = BlockImageUpdateFn("block_image_update", &state, 4, argv);
+            if (v != NULL && strcmp(v->data, "t") == 0) {
+                _exit(RESULT_DONE);
+            }
+            _exit(RESULT_FAILED);
+        }
+        int status;
+        if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status)) {
+            return -1;
+        }
+        return WEXITSTATUS(status);
+    }
+
+    // What range_sha1() says, asked by a child as a script would.
+    std::string RangeSha1(const std::string& ranges) {
+        int fds[2];
+        if (pipe(fds) != 0) {
+            return "";
+        }
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(fds[0]);
+            freopen("/dev/null", "w", stdout);
+            std::string sha1 = CallRangeSha1(mImage, ranges);
+            __real_write(fds[1], sha1.data(), sha1.size());
+            _exit(0);
+        }
+        close(fds[1]);
+        std::string out;
+        char buf[64];
+        ssize_t n;
+        while ((n = read(fds[0], buf, sizeof(buf))) > 0) {
+            out.append(buf, n);
+        }
+        close(fds[0]);
+        waitpid(pid, NULL, 0);
+        return out;
+    }
+
+    // Interrupts a fresh update at its crash_at'th write.  Returns
+    // false if it finished first.
+    bool Interrupt(long crash_at_write) {
+        remove_checkpoint(mImage);
+        EXPECT_TRUE(write_file(mImage, mUpdate->mSource));
+        int result = RunScript(mUpdate->mList, crash_at_write);
+        EXPECT_TRUE(result == RESULT_CRASHED || result == RESULT_DONE) << result;
+        return result == RESULT_CRASHED;
+    }
+
+    bool HasProgress() {
+        std::string dir = checkpoint_dir(mImage);
+        return !dir.empty() && exists(dir + "/progress");
+    }
+
+    UpdateBuilder* mUpdate;
+    std::string mImage;
+    std::string mPackage;
+    MemMapping mMap;
+    ZipArchive mZip;
+};
+
+TEST_F(BlockImageResumeTest, UninterruptedMatchesExpected) {
+    ASSERT_TRUE(write_file(mImage, mUpdate->mSource));
+    ASSERT_EQ(RESULT_DONE, RunScript(mUpdate->mList, -1));
+    std::string image;
+    ASSERT_TRUE(read_file(mImage, &image));
+    EXPECT_TRUE(image == mUpdate->mTarget);
+    EXPECT_EQ("", checkpoint_dir(mImage));
+}
+
+TEST_F(BlockImageResumeTest, ResumesAfterInterruptionAtEveryWrite) {
+    ASSERT_TRUE(write_file(mImage, mUpdate->mSource));
+    ASSERT_EQ(RESULT_DONE, RunScript(mUpdate->mList, -1));
+    std::string reference;
+    ASSERT_TRUE(read_file(mImage, &reference));
+
+    int crashes = 0, resumed = 0, source_changed = 0;
+    for (long k = 1; Interrupt(k); k++) {
+        crashes++;
+        std::string image;
+        ASSERT_TRUE(read_file(mImage, &image));
+        if (HasProgress()) {
+            resumed++;
+            // Even once the source is overwritten, range_sha1() answers
+            // with what it held before the update.
+            if (mUpdate->source_sha1(image) != mUpdate->mSourceSha1) {
+                source_changed++;
+            }
+            ASSERT_EQ(mUpdate->mSourceSha1, RangeSha1(mUpdate->mSourceRanges)) << "write " << k;
+        }
+
+        ASSERT_EQ(RESULT_DONE, RunScript(mUpdate->mList, -1)) << "write " << k;
+        ASSERT_TRUE(read_file(mImage, &image));
+        ASSERT_TRUE(image == reference) << "write " << k;
+        ASSERT_EQ("", checkpoint_dir(mImage)) << "write " << k;
+    }
+    printf("%d crash points, %d resumed from a checkpoint (%d with the source changed)\n",
+           crashes, resumed, source_changed);
+    EXPECT_GT(crashes, 0);
+    EXPECT_GT(resumed, 0);
+    EXPECT_GT(source_changed, 0);
+}
+
+TEST_F(BlockImageResumeTest, RangeSha1LeavesNoState) {
+    ASSERT_TRUE(write_file(mImage, mUpdate->mSource));
+    EXPECT_EQ(mUpdate->mSourceSha1, RangeSha1(mUpdate->mSourceRanges));
+    EXPECT_EQ("", checkpoint_dir(mImage));
+
+    // An update interrupted before it saved any progress leaves a
+    // directory whose records answer for nothing; it's removed.
+    long k = 1;
+    while (Interrupt(k) && checkpoint_dir(mImage).empty()) {
+        k++;
+    }
+    ASSERT_FALSE(HasProgress());
+    std::string dir = checkpoint_dir(mImage);
+    ASSERT_NE("", dir);
+    std::string record = dir + "/sha1-" + sha1_hex(mUpdate->mSourceRanges);
+    ASSERT_TRUE(write_file(record, sha1_hex("stale")));
+    EXPECT_EQ(mUpdate->mSourceSha1, RangeSha1(mUpdate->mSourceRanges));
+    EXPECT_EQ("", checkpoint_dir(mImage));
+}
+
+TEST_F(BlockImageResumeTest, DifferentPackageStartsOver) {
+    // Stop partway, once there's progress but the source is still
+    // intact, so another package for the same source can apply.
+    std::string image;
+    bool found = false;
+    for (long k = 1; !found && Interrupt(k); k++) {
+        ASSERT_TRUE(read_file(mImage, &image));
+        found = HasProgress() && mUpdate->source_sha1(image) == mUpdate->mSourceSha1;
+    }
+    ASSERT_TRUE(found);
+
+    // Same commands, but not the same list: another block total.  Its
+    // checkpoints are thrown away and it runs from the first transfer.
+    const std::string& list = mUpdate->mList;
+    std::string other = "2\n" + std::to_string(atoi(list.c_str() + 2) + 1) +
+            list.substr(list.find('\n', 2));
+    ASSERT_EQ(RESULT_DONE, RunScript(other, -1));
+    std::string after;
+    ASSERT_TRUE(read_file(mImage, &after));
+    EXPECT_TRUE(after == mUpdate->mTarget);
+    EXPECT_EQ("", checkpoint_dir(mImage));
+}
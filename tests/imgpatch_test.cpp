@@ -0,0 +1,292 @@
+/*
+ * Copyright (C) 2016 TeamWin Recovery Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <string>
+#include <vector>
+
+extern "C" {
+#include "applypatch/applypatch.h"
+#include "applypatch/imgdiff.h"
+}
+
+// Builds an image patch out of applypatch/testdata: normal, raw and
+// deflate chunks (one of them with bonus data) that all reuse
+// patch.bsdiff, which turns old.file into new.file.  Applies it serially
+// and in parallel and compares the output with the expected image.
+// IMGPATCH_TESTDATA sets the testdata directory (default
+// applypatch/testdata, so run from the top of the recovery tree).
+
+static long long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static bool read_file(const std::string& path, std::string* out) {
+    FILE* f = fopen(path.c_str(), "rb");
+    if (f == NULL) {
+        return false;
+    }
+    char buf[65536];
+    size_t n;
+    out->clear();
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+        out->append(buf, n);
+    }
+    fclose(f);
+    return true;
+}
+
+static void put32(std::string* out, long long value) {
+    for (int i = 0; i < 4; i++) {
+        out->push_back((value >> (i * 8)) & 0xFF);
+    }
+}
+
+static void put64(std::string* out, long long value) {
+    for (int i = 0; i < 8; i++) {
+        out->push_back((value >> (i * 8)) & 0xFF);
+    }
+}
+
+static std::string deflate_data(const std::string& data, int level) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    deflateInit2(&zs, level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+    std::string out(deflateBound(&zs, data.size()), '\0');
+    zs.next_in = (Bytef*)data.data();
+    zs.avail_in = data.size();
+    zs.next_out = (Bytef*)&out[0];
+    zs.avail_out = out.size();
+    deflate(&zs, Z_FINISH);
+    out.resize(zs.total_out);
+    deflateEnd(&zs);
+    return out;
+}
+
+struct Output {
+    std::string data;
+    pthread_t caller;
+    bool other_thread;
+    long long first_write_delay_ms = 0;
+};
+
+static ssize_t output_sink(const unsigned char* data, ssize_t len, void* token) {
+    Output* out = (Output*)token;
+    if (out->data.empty() && out->first_write_delay_ms > 0) {
+        // let the workers get ahead of the sink
+        usleep(out->first_write_delay_ms * 1000);
+    }
+    if (!pthread_equal(pthread_self(), out->caller)) {
+        out->other_thread = true;
+    }
+    out->data.append((const char*)data, len);
+    return len;
+}
+
+class ImgpatchTest : public ::testing::Test {
+protected:
+    virtual void SetUp() {
+        const char* dir = getenv("IMGPATCH_TESTDATA");
+        std::string base = dir ? dir : "applypatch/testdata";
+        ASSERT_TRUE(read_file(base + "/old.file", &mOld)) << base;
+        ASSERT_TRUE(read_file(base + "/new.file", &mNew)) << base;
+        ASSERT_TRUE(read_file(base + "/patch.bsdiff", &mBsdiff)) << base;
+    }
+
+    // Lay out 'chunks' chunks: a raw chunk first, then normal and
+    // deflate chunks at three compression levels.  Chunk 1 is deflate
+    // and leaves the last bonus_size bytes of its source to the bonus
+    // data.
+    void Build(int chunks, size_t bonus_size) {
+        std::string headers;
+        std::string raw = "raw chunk\n";
+        mSource.clear();
+        mExpected.clear();
+        mBonus = mOld.substr(mOld.size() - bonus_size);
+
+        // The bsdiff patch goes after the headers; every chunk uses it.
+        size_t header_size = 12;
+        for (int i = 0; i < chunks; i++) {
+            header_size += (i == 0 ? 8 + raw.size() : (i % 4 == 2 ? 28 : 64));
+        }
+
+        mChunkOffsets.clear();
+        for (int i = 0; i < chunks; i++) {
+            mChunkOffsets.push_back(12 + headers.size());
+            if (i == 0) {
+                put32(&headers, CHUNK_RAW);
+                put32(&headers, raw.size());
+                headers += raw;
+                mExpected += raw;
+            } else if (i % 4 == 2) {
+                put32(&headers, CHUNK_NORMAL);
+                put64(&headers, mSource.size());
+                put64(&headers, mOld.size());
+                put64(&headers, header_size);
+                mSource += mOld;
+                mExpected += mNew;
+            } else {
+                int level = (i % 4 == 1 ? 6 : (i % 4 == 3 ? 9 : 1));
+                std::string src = deflate_data(
+                        i == 1 ? mOld.substr(0, mOld.size() - bonus_size) : mOld, level);
+                std::string tgt = deflate_data(mNew, level);
+                put32(&headers, CHUNK_DEFLATE);
+                put64(&headers, mSource.size());
+                put64(&headers, src.size());
+                put64(&headers, header_size);
+                put64(&headers, mOld.size());
+                put64(&headers, tgt.size());
+                put32(&headers, level);
+                put32(&headers, Z_DEFLATED);
+                put32(&headers, -MAX_WBITS);
+                put32(&headers, 8);
+                put32(&headers, Z_DEFAULT_STRATEGY);
+                mSource += src;
+                mExpected += tgt;
+            }
+        }
+
+        mPatch = "IMGDIFF2";
+        put32(&mPatch, chunks);
+        mPatch += headers;
+        ASSERT_EQ(header_size, mPatch.size());
+        mPatch += mBsdiff;
+    }
+
+    int Apply(int threads, Output* out, uint8_t* digest) {
+        Value patch = { VAL_BLOB, (ssize_t)mPatch.size(), &mPatch[0] };
+        Value bonus = { VAL_BLOB, (ssize_t)mBonus.size(), &mBonus[0] };
+        SHA_CTX ctx;
+        SHA_init(&ctx);
+        out->data.clear();
+        out->caller = pthread_self();
+        out->other_thread = false;
+        int result = ApplyImagePatchThreads(
+                (const unsigned char*)mSource.data(), mSource.size(), &patch,
+                output_sink, out, &ctx, mBonus.empty() ? NULL : &bonus, threads);
+        memcpy(digest, SHA_final(&ctx), SHA_DIGEST_SIZE);
+        return result;
+    }
+
+    std::string mOld;
+    std::string mNew;
+    std::string mBsdiff;
+    std::string mSource;
+    std::string mExpected;
+    std::string mPatch;
+    std::string mBonus;
+    std::vector<size_t> mChunkOffsets;
+};
+
+TEST_F(ImgpatchTest, SerialMatchesExpected) {
+    Build(6, 4096);
+    Output out;
+    uint8_t digest[SHA_DIGEST_SIZE];
+    ASSERT_EQ(0, Apply(1, &out, digest));
+    ASSERT_TRUE(out.data == mExpected);
+    uint8_t expected[SHA_DIGEST_SIZE];
+    EXPECT_EQ(0, memcmp(digest, SHA_hash(mExpected.data(), mExpected.size(), expected),
+                        SHA_DIGEST_SIZE));
+}
+
+TEST_F(ImgpatchTest, ParallelMatchesSerial) {
+    Build(10, 4096);
+    Output serial;
+    uint8_t serial_digest[SHA_DIGEST_SIZE];
+    long long start = now_ms();
+    ASSERT_EQ(0, Apply(1, &serial, serial_digest));
+    long long serial_ms = now_ms() - start;
+    ASSERT_TRUE(serial.data == mExpected);
+
+    int threads[] = { 2, 4, 0 };
+    for (size_t i = 0; i < sizeof(threads) / sizeof(threads[0]); i++) {
+        Output parallel;
+        uint8_t digest[SHA_DIGEST_SIZE];
+        start = now_ms();
+        ASSERT_EQ(0, Apply(threads[i], &parallel, digest)) << threads[i];
+        long long parallel_ms = now_ms() - start;
+        ASSERT_TRUE(parallel.data == serial.data) << threads[i];
+        EXPECT_EQ(0, memcmp(digest, serial_digest, SHA_DIGEST_SIZE)) << threads[i];
+        EXPECT_FALSE(parallel.other_thread) << threads[i];
+        printf("%zu bytes in %d chunks: serial %lld ms, %d thread(s) %lld ms\n",
+               mExpected.size(), 10, serial_ms, threads[i], parallel_ms);
+    }
+}
+
+TEST_F(ImgpatchTest, CorruptChunkFails) {
+    Build(10, 0);
+    // Point normal chunk 6 at the patch header instead of the bsdiff
+    // patch.  The chunks before it still come out.
+    std::string offset;
+    put64(&offset, 0);
+    mPatch.replace(mChunkOffsets[6] + 4 + 16, 8, offset);
+
+    int threads[] = { 1, 4 };
+    for (size_t i = 0; i < sizeof(threads) / sizeof(threads[0]); i++) {
+        Output out;
+        uint8_t digest[SHA_DIGEST_SIZE];
+        EXPECT_NE(0, Apply(threads[i], &out, digest)) << threads[i];
+        EXPECT_TRUE(out.data.size() < mExpected.size()) << threads[i];
+        EXPECT_TRUE(out.data == mExpected.substr(0, out.data.size())) << threads[i];
+    }
+}
+
+TEST_F(ImgpatchTest, LateBsdiffFailureFails) {
+    Build(7, 0);
+    // Give the last chunk, normal chunk 6, a copy of the bsdiff patch
+    // that claims more output than its control stream covers: it fails
+    // only once the control stream runs out, with its output buffer
+    // already sized.  Holding up the sink on the raw chunk 0 lets every
+    // chunk finish, so the chunks before it go out before the failure
+    // is seen.
+    std::string bumped = mBsdiff;
+    long long new_size = 0;
+    for (int i = 7; i >= 0; i--) {
+        new_size = new_size << 8 | (unsigned char)bumped[24 + i];
+    }
+    std::string size;
+    put64(&size, new_size + 1024 * 1024);
+    bumped.replace(24, 8, size);
+    std::string offset;
+    put64(&offset, mPatch.size());
+    mPatch.replace(mChunkOffsets[6] + 4 + 16, 8, offset);
+    mPatch += bumped;
+
+    Output serial;
+    uint8_t digest[SHA_DIGEST_SIZE];
+    long long start = now_ms();
+    EXPECT_NE(0, Apply(1, &serial, digest));
+    long long serial_ms = now_ms() - start;
+
+    int threads[] = { 1, 2, 4 };
+    for (size_t i = 0; i < sizeof(threads) / sizeof(threads[0]); i++) {
+        Output out;
+        out.first_write_delay_ms = 2 * serial_ms + 100;
+        EXPECT_NE(0, Apply(threads[i], &out, digest)) << threads[i];
+        EXPECT_TRUE(out.data.size() < mExpected.size()) << threads[i];
+        EXPECT_TRUE(out.data == mExpected.substr(0, out.data.size())) << threads[i];
+    }
+}
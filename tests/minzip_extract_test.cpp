@@ -0,0 +1,331 @@
+/*
+ * Copyright (C) 2016 TeamWin Recovery Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "minzip/SysUtil.h"
+#include "minzip/Zip.h"
+#include "minzip/DirUtil.h"
+
+// Builds a zip shaped like a ROM with system/ shipped as files, extracts
+// it serially and in parallel and compares the trees byte for byte.
+// MINZIP_TEST_FILES sets the number of files (default 2000).
+
+static long long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static void put16(std::string* out, unsigned value) {
+    out->push_back(value & 0xFF);
+    out->push_back((value >> 8) & 0xFF);
+}
+
+static void put32(std::string* out, unsigned long value) {
+    put16(out, value & 0xFFFF);
+    put16(out, (value >> 16) & 0xFFFF);
+}
+
+// Just enough of a zip writer for the test: no data descriptors, no
+// extra fields, unix mode in the external attributes.
+class ZipWriter {
+public:
+    void add(const std::string& name, const std::string& data, bool compress) {
+        std::string comp = data;
+        if (compress) {
+            z_stream zs;
+            memset(&zs, 0, sizeof(zs));
+            deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+            comp.resize(deflateBound(&zs, data.size()));
+            zs.next_in = (Bytef*)data.data();
+            zs.avail_in = data.size();
+            zs.next_out = (Bytef*)&comp[0];
+            zs.avail_out = comp.size();
+            deflate(&zs, Z_FINISH);
+            comp.resize(zs.total_out);
+            deflateEnd(&zs);
+        }
+        unsigned long crc = crc32(0, (const Bytef*)data.data(), data.size());
+        unsigned method = compress ? 8 : 0;
+        size_t offset = mData.size();
+
+        put32(&mData, 0x04034b50);
+        put16(&mData, 20);
+        put16(&mData, 0);
+        put16(&mData, method);
+        put32(&mData, 0);
+        put32(&mData, crc);
+        put32(&mData, comp.size());
+        put32(&mData, data.size());
+        put16(&mData, name.size());
+        put16(&mData, 0);
+        mData += name;
+        mData += comp;
+
+        put32(&mCentral, 0x02014b50);
+        put16(&mCentral, 3 << 8 | 20);
+        put16(&mCentral, 20);
+        put16(&mCentral, 0);
+        put16(&mCentral, method);
+        put32(&mCentral, 0);
+        put32(&mCentral, crc);
+        put32(&mCentral, comp.size());
+        put32(&mCentral, data.size());
+        put16(&mCentral, name.size());
+        put32(&mCentral, 0);
+        put32(&mCentral, 0);
+        put32(&mCentral, 0100644UL << 16);
+        put32(&mCentral, offset);
+        mCentral += name;
+        mCount++;
+    }
+
+    bool write(const std::string& path) {
+        std::string out = mData + mCentral;
+        put32(&out, 0x06054b50);
+        put32(&out, 0);
+        put16(&out, mCount);
+        put16(&out, mCount);
+        put32(&out, mCentral.size());
+        put32(&out, mData.size());
+        put16(&out, 0);
+        FILE* f = fopen(path.c_str(), "wb");
+        if (!f)
+            return false;
+        bool ok = fwrite(out.data(), 1, out.size(), f) == out.size();
+        return fclose(f) == 0 && ok;
+    }
+
+private:
+    std::string mData;
+    std::string mCentral;
+    unsigned mCount = 0;
+};
+
+static void readTree(const std::string& root, const std::string& rel,
+        std::map<std::string, std::string>* out) {
+    DIR* d = opendir((root + rel).c_str());
+    ASSERT_TRUE(d != NULL) << root + rel;
+    struct dirent* de;
+    while ((de = readdir(d)) != NULL) {
+        std::string name = de->d_name;
+        if (name == "." || name == "..")
+            continue;
+        std::string path = rel + "/" + name;
+        struct stat st;
+        ASSERT_EQ(0, lstat((root + path).c_str(), &st));
+        if (S_ISDIR(st.st_mode)) {
+            (*out)[path + "/"] = "";
+            readTree(root, path, out);
+        } else {
+            std::string data;
+            FILE* f = fopen((root + path).c_str(), "rb");
+            ASSERT_TRUE(f != NULL);
+            char buf[65536];
+            size_t n;
+            while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+                data.append(buf, n);
+            fclose(f);
+            char mode[32];
+            snprintf(mode, sizeof(mode), "%o %ld ", st.st_mode, (long)st.st_mtime);
+            (*out)[path] = mode + data;
+        }
+    }
+    closedir(d);
+}
+
+class MinzipExtractTest : public ::testing::Test {
+protected:
+    virtual void SetUp() {
+        char tmpl[] = "/data/local/tmp/minzip_test.XXXXXX";
+        ASSERT_TRUE(mkdtemp(tmpl) != NULL);
+        mRoot = tmpl;
+        const char* env = getenv("MINZIP_TEST_FILES");
+        mFiles = env ? atoi(env) : 2000;
+    }
+
+    virtual void TearDown() {
+        dirUnlinkHierarchy(mRoot.c_str());
+    }
+
+    bool extract(const std::string& zipPath, const std::string& dest, int flags,
+            long long* ms) {
+        MemMapping map;
+        ZipArchive zip;
+        if (sysMapFile(zipPath.c_str(), &map) != 0)
+            return false;
+        if (mzOpenZipArchive(map.addr, map.length, &zip) != 0) {
+            sysReleaseMap(&map);
+            return false;
+        }
+        mkdir(dest.c_str(), 0755);
+        struct utimbuf timestamp = { 1217592000, 1217592000 };
+        long long start = now_ms();
+        bool ok = mzExtractRecursive(&zip, "system", dest.c_str(),
+                MZ_EXTRACT_FILES_ONLY | flags, &timestamp, NULL, NULL, NULL);
+        if (ms)
+            *ms = now_ms() - start;
+        mzCloseZipArchive(&zip);
+        sysReleaseMap(&map);
+        return ok;
+    }
+
+    std::string mRoot;
+    int mFiles;
+};
+
+TEST_F(MinzipExtractTest, ParallelMatchesSerial) {
+    ZipWriter zip;
+    srand(7);
+    for (int i = 0; i < mFiles; i++) {
+        char name[128];
+        snprintf(name, sizeof(name), "system/dir%02d/sub%d/file%05d", i % 37, i % 3, i);
+        // mostly small files, a few large ones, some empty
+        size_t size = (i % 101 == 0) ? 1024 * 1024 + i : (i % 13 == 0 ? 0 : rand() % 20000);
+        std::string data(size, 0);
+        for (size_t j = 0; j < size; j++)
+            data[j] = (j % 64 < 32) ? 'a' + (j % 7) : rand();
+        zip.add(name, data, i % 4 != 0);
+    }
+    // duplicate names, whichever copy sorts last wins either way
+    zip.add("system/dir00/sub0/file00000", "first", true);
+    zip.add("system/dir00/sub0/file00000", "second", false);
+    // outside the extracted directory
+    zip.add("META-INF/com/google/android/updater-script", "ui_print(\"x\");", true);
+    std::string zipPath = mRoot + "/test.zip";
+    ASSERT_TRUE(zip.write(zipPath));
+
+    long long serialMs, parallelMs;
+    ASSERT_TRUE(extract(zipPath, mRoot + "/serial", MZ_EXTRACT_SERIAL, &serialMs));
+    ASSERT_TRUE(extract(zipPath, mRoot + "/parallel", 0, &parallelMs));
+    printf("%d files: serial %lld ms, parallel %lld ms\n", mFiles, serialMs, parallelMs);
+
+    std::map<std::string, std::string> serial, parallel;
+    readTree(mRoot + "/serial", "", &serial);
+    readTree(mRoot + "/parallel", "", &parallel);
+    ASSERT_EQ(serial.size(), parallel.size());
+    EXPECT_TRUE(serial == parallel);
+    EXPECT_EQ(0u, parallel.count("/updater-script"));
+}
+
+TEST_F(MinzipExtractTest, FailsOnCorruptEntry) {
+    ZipWriter zip;
+    std::string data(100000, 'x');
+    zip.add("system/good", data, true);
+    zip.add("system/bad", data, true);
+    std::string zipPath = mRoot + "/bad.zip";
+    ASSERT_TRUE(zip.write(zipPath));
+
+    // flip bytes in the middle of the second entry's deflate stream
+    FILE* f = fopen(zipPath.c_str(), "r+b");
+    ASSERT_TRUE(f != NULL);
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    std::string buf(size, 0);
+    fseek(f, 0, SEEK_SET);
+    ASSERT_EQ((size_t)size, fread(&buf[0], 1, size, f));
+    // the first copy of the name is in the local header, the data follows
+    size_t bad = buf.find("system/bad");
+    ASSERT_NE(std::string::npos, bad);
+    for (int i = 0; i < 8; i++)
+        buf[bad + strlen("system/bad") + 2 + i] ^= 0x55;
+    fseek(f, 0, SEEK_SET);
+    fwrite(buf.data(), 1, size, f);
+    fclose(f);
+
+    EXPECT_FALSE(extract(zipPath, mRoot + "/serial", MZ_EXTRACT_SERIAL, NULL));
+    EXPECT_FALSE(extract(zipPath, mRoot + "/parallel", 0, NULL));
+}
+
+TEST_F(MinzipExtractTest, DirectoryHandoff) {
+    ZipWriter zip;
+    for (int i = 0; i < mFiles; i++) {
+        char name[128];
+        snprintf(name, sizeof(name), "system/dir%02d/file%05d", i % 37, i);
+        zip.add(name, std::string(i % 5000, 'a' + i % 26), i % 2 == 0);
+    }
+    std::string zipPath = mRoot + "/dir.zip";
+    ASSERT_TRUE(zip.write(zipPath));
+
+    // The writer and the reader each map the zip, as the recovery and the
+    // updater do, so the names end up at different addresses
+    MemMapping map, map2;
+    ZipArchive parsed, handed;
+    ASSERT_EQ(0, sysMapFile(zipPath.c_str(), &map));
+    long long start = now_ms();
+    ASSERT_EQ(0, mzOpenZipArchive(map.addr, map.length, &parsed));
+    long long parseMs = now_ms() - start;
+
+    char tmpl[128];
+    snprintf(tmpl, sizeof(tmpl), "%s/directory.XXXXXX", mRoot.c_str());
+    int fd = mkstemp(tmpl);
+    ASSERT_GE(fd, 0);
+    unlink(tmpl);
+    ASSERT_EQ(0, mzWriteZipDirectory(&parsed, fd));
+
+    int zipFd = open(zipPath.c_str(), O_RDONLY);
+    ASSERT_GE(zipFd, 0);
+    ASSERT_EQ(0, sysMapFd(zipFd, &map2));
+    close(zipFd);
+    start = now_ms();
+    ASSERT_EQ(0, mzOpenZipArchiveDirectory(map2.addr, map2.length, fd, &handed));
+    long long handoffMs = now_ms() - start;
+    printf("%d entries: parsed in %lld ms, handed over in %lld ms\n",
+            mFiles, parseMs, handoffMs);
+
+    ASSERT_EQ(parsed.numEntries, handed.numEntries);
+    for (unsigned i = 0; i < parsed.numEntries; i++) {
+        const ZipEntry* a = &parsed.pEntries[i];
+        const ZipEntry* b = &handed.pEntries[i];
+        ASSERT_EQ(std::string(a->fileName, a->fileNameLen),
+                std::string(b->fileName, b->fileNameLen));
+        EXPECT_EQ((const unsigned char*)a->fileName - map.addr,
+                (const unsigned char*)b->fileName - map2.addr);
+        EXPECT_EQ(a->offset, b->offset);
+        EXPECT_EQ(a->compLen, b->compLen);
+        EXPECT_EQ(a->uncompLen, b->uncompLen);
+        EXPECT_EQ(a->compression, b->compression);
+        EXPECT_EQ(a->crc32, b->crc32);
+        EXPECT_EQ(a->externalFileAttributes, b->externalFileAttributes);
+        std::string name(a->fileName, a->fileNameLen);
+        EXPECT_EQ(b, mzFindZipEntry(&handed, name.c_str()));
+        EXPECT_TRUE(mzIsZipEntryIntact(&handed, b));
+    }
+
+    // A directory of some other archive is refused
+    ZipArchive other;
+    EXPECT_NE(0, mzOpenZipArchiveDirectory(map2.addr, map2.length - 1, fd, &other));
+
+    close(fd);
+    mzCloseZipArchive(&handed);
+    mzCloseZipArchive(&parsed);
+    sysReleaseMap(&map2);
+    sysReleaseMap(&map);
+}
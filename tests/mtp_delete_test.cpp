@@ -0,0 +1,143 @@
+/*
+ * Copyright (C) 2016 TeamWin Recovery Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "mtp/MtpDeleteWorker.h"
+
+static long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static bool exists(const std::string& path) {
+    struct stat st;
+    return lstat(path.c_str(), &st) == 0;
+}
+
+static void createFile(const std::string& path) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT, 0644);
+    ASSERT_GE(fd, 0);
+    close(fd);
+}
+
+// depth levels of width folders, each with files files
+static int createTree(const std::string& dir, int depth, int width, int files) {
+    int count = 0;
+    for (int f = 0; f < files; f++) {
+        char name[32];
+        snprintf(name, sizeof(name), "/file%04d", f);
+        createFile(dir + name);
+        count++;
+    }
+    if (depth == 0)
+        return count;
+    for (int d = 0; d < width; d++) {
+        char name[32];
+        snprintf(name, sizeof(name), "/dir%02d", d);
+        std::string sub = dir + name;
+        if (mkdir(sub.c_str(), 0755))
+            return -1;
+        count += 1 + createTree(sub, depth - 1, width, files);
+    }
+    return count;
+}
+
+class MtpDeleteTest : public testing::Test {
+  protected:
+    virtual void SetUp() {
+        char tmpl[] = "/data/local/tmp/mtp_delete_test.XXXXXX";
+        ASSERT_TRUE(mkdtemp(tmpl) != NULL);
+        root = tmpl;
+    }
+
+    virtual void TearDown() {
+        std::string cmd = "rm -rf " + root;
+        system(cmd.c_str());
+    }
+
+    std::string root;
+};
+
+TEST_F(MtpDeleteTest, DeletesTree) {
+    std::string dir = root + "/" MTP_DELETE_PREFIX "1";
+    ASSERT_EQ(0, mkdir(dir.c_str(), 0755));
+    int count = createTree(dir, 3, 8, 64);
+    ASSERT_GT(count, 0);
+    symlink("dir00", (dir + "/link").c_str());
+    createFile(root + "/keep");
+
+    MtpDeleteWorker worker;
+    long long start = now_ns();
+    worker.deletePath(dir);
+    long long queued = now_ns() - start;
+    worker.wait();
+    long long elapsed = now_ns() - start;
+
+    EXPECT_FALSE(exists(dir));
+    EXPECT_TRUE(exists(root + "/keep"));
+    printf("queued in %lld us, deleted %d objects in %lld ms\n", queued / 1000, count,
+           elapsed / 1000000);
+}
+
+TEST_F(MtpDeleteTest, DeletesFilesAndMissingPaths) {
+    createFile(root + "/file");
+    MtpDeleteWorker worker(1);
+    worker.deletePath(root + "/file");
+    worker.deletePath(root + "/missing");
+    worker.wait();
+    EXPECT_FALSE(exists(root + "/file"));
+}
+
+TEST_F(MtpDeleteTest, QueuesPathOnce) {
+    std::string dir = root + "/" MTP_DELETE_PREFIX "2";
+    ASSERT_EQ(0, mkdir(dir.c_str(), 0755));
+    ASSERT_GT(createTree(dir, 2, 8, 64), 0);
+
+    MtpDeleteWorker worker(1);
+    // a storage rescan finds the folder again while it is being deleted
+    worker.deletePath(dir);
+    worker.deletePath(dir);
+    worker.wait();
+    EXPECT_FALSE(exists(dir));
+
+    // once deleted, the same name can be queued again
+    ASSERT_EQ(0, mkdir(dir.c_str(), 0755));
+    createFile(dir + "/file");
+    worker.deletePath(dir);
+    worker.wait();
+    EXPECT_FALSE(exists(dir));
+}
+
+TEST_F(MtpDeleteTest, IsDeletePath) {
+    EXPECT_TRUE(MtpDeleteWorker::isDeletePath(MTP_DELETE_PREFIX "42"));
+    EXPECT_FALSE(MtpDeleteWorker::isDeletePath("DCIM"));
+    EXPECT_FALSE(MtpDeleteWorker::isDeletePath(".twmtp"));
+    // only names the server makes, never a user's own files
+    EXPECT_FALSE(MtpDeleteWorker::isDeletePath(MTP_DELETE_PREFIX));
+    EXPECT_FALSE(MtpDeleteWorker::isDeletePath(MTP_DELETE_PREFIX "backup"));
+    EXPECT_FALSE(MtpDeleteWorker::isDeletePath(MTP_DELETE_PREFIX "42.jpg"));
+}
@@ -0,0 +1,416 @@
+/*
+ * Copyright (C) 2016 TeamWin Recovery Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/sockios.h>
+
+#include <string>
+#include <vector>
+
+#include "mtp/mtp.h"
+#include "mtp/MtpServer.h"
+#include "mtp/MtpStorage.h"
+#include "mtp/mtp_MtpDatabase.hpp"
+
+// Runs the whole MTP server over a socketpair, with a scripted host on
+// the other end. The socket stands in for the f_mtp endpoint: files go
+// through the user space transfer engine instead of the f_mtp ioctls,
+// and events are dropped.
+//
+// The storage is a temp dir of MTP_LOOPBACK_OBJECTS empty files (1000
+// by default) in folders of 1000, set it to 1000000 for the big numbers.
+
+static const MtpStorageID kStorageID = 0x10001;
+static const int kFilesPerDir = 1000;
+
+static long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void put16(std::vector<char>& out, uint16_t value) {
+    out.push_back((char)(value & 0xFF));
+    out.push_back((char)(value >> 8));
+}
+
+static void put32(std::vector<char>& out, uint32_t value) {
+    put16(out, (uint16_t)(value & 0xFFFF));
+    put16(out, (uint16_t)(value >> 16));
+}
+
+static void putString(std::vector<char>& out, const char* str) {
+    size_t length = strlen(str);
+    if (length == 0) {
+        out.push_back(0);
+        return;
+    }
+    out.push_back((char)(length + 1));
+    for (size_t i = 0; i <= length; i++)
+        put16(out, (unsigned char)str[i]);
+}
+
+static uint32_t get32(const std::vector<char>& in, size_t offset) {
+    const unsigned char* u = (const unsigned char*)&in[offset];
+    return u[0] | (u[1] << 8) | (u[2] << 16) | ((uint32_t)u[3] << 24);
+}
+
+// The host side: one transaction at a time, like a real initiator
+class MtpLoopbackClient {
+  public:
+    explicit MtpLoopbackClient(int fd) : mFD(fd), mTransactionID(0) {}
+
+    // Sends a command with an optional data phase, and collects the data
+    // phase coming back. Returns the response code, or 0 if the stream
+    // broke.
+    uint16_t transact(uint16_t operation, const std::vector<uint32_t>& params,
+                      const std::vector<char>* dataOut = NULL, std::vector<char>* dataIn = NULL,
+                      std::vector<uint32_t>* responseParams = NULL) {
+        uint32_t transaction = ++mTransactionID;
+        std::vector<char> command;
+        putHeader(command, MTP_CONTAINER_HEADER_SIZE + params.size() * 4,
+                  MTP_CONTAINER_TYPE_COMMAND, operation, transaction);
+        for (size_t i = 0; i < params.size(); i++)
+            put32(command, params[i]);
+        if (!writeFully(&command[0], command.size()))
+            return 0;
+        if (dataOut) {
+            // USB keeps the command and the data phase apart, a stream
+            // socket would let the server read them as one
+            if (!waitConsumed())
+                return 0;
+            // header and payload in one go, so the server's first read
+            // sees them together like a USB transfer would
+            std::vector<char> header;
+            putHeader(header, MTP_CONTAINER_HEADER_SIZE + dataOut->size(),
+                      MTP_CONTAINER_TYPE_DATA, operation, transaction);
+            struct iovec iov[2];
+            iov[0].iov_base = &header[0];
+            iov[0].iov_len = header.size();
+            iov[1].iov_base = dataOut->empty() ? NULL : (void*)&(*dataOut)[0];
+            iov[1].iov_len = dataOut->size();
+            if (!writevFully(iov, 2))
+                return 0;
+        }
+        for (;;) {
+            std::vector<char> container;
+            if (!readContainer(container))
+                return 0;
+            uint16_t type = container[4] | (container[5] << 8);
+            uint16_t code = (unsigned char)container[6] | ((unsigned char)container[7] << 8);
+            if (type == MTP_CONTAINER_TYPE_DATA) {
+                if (dataIn)
+                    dataIn->assign(container.begin() + MTP_CONTAINER_HEADER_SIZE, container.end());
+                continue;
+            }
+            if (type != MTP_CONTAINER_TYPE_RESPONSE || get32(container, 8) != transaction)
+                return 0;
+            if (responseParams) {
+                responseParams->clear();
+                for (size_t offset = MTP_CONTAINER_HEADER_SIZE; offset + 4 <= container.size(); offset += 4)
+                    responseParams->push_back(get32(container, offset));
+            }
+            return code;
+        }
+    }
+
+  private:
+    static void putHeader(std::vector<char>& out, uint32_t length, uint16_t type,
+                          uint16_t code, uint32_t transaction) {
+        put32(out, length);
+        put16(out, type);
+        put16(out, code);
+        put32(out, transaction);
+    }
+
+    // waits until the server has read everything written so far
+    bool waitConsumed() {
+        for (;;) {
+            int queued;
+            if (ioctl(mFD, SIOCOUTQ, &queued))
+                return false;
+            if (queued == 0)
+                return true;
+            usleep(50);
+        }
+    }
+
+    bool writeFully(const char* data, size_t length) {
+        while (length > 0) {
+            ssize_t ret = write(mFD, data, length);
+            if (ret < 0 && errno == EINTR)
+                continue;
+            if (ret <= 0)
+                return false;
+            data += ret;
+            length -= ret;
+        }
+        return true;
+    }
+
+    bool writevFully(struct iovec* iov, int count) {
+        while (count > 0) {
+            ssize_t ret = writev(mFD, iov, count);
+            if (ret < 0 && errno == EINTR)
+                continue;
+            if (ret <= 0)
+                return false;
+            while (count > 0 && (size_t)ret >= iov->iov_len) {
+                ret -= iov->iov_len;
+                iov++;
+                count--;
+            }
+            if (count > 0) {
+                iov->iov_base = (char*)iov->iov_base + ret;
+                iov->iov_len -= ret;
+            }
+        }
+        return true;
+    }
+
+    bool readFully(char* data, size_t length) {
+        while (length > 0) {
+            ssize_t ret = read(mFD, data, length);
+            if (ret < 0 && errno == EINTR)
+                continue;
+            if (ret <= 0)
+                return false;
+            data += ret;
+            length -= ret;
+        }
+        return true;
+    }
+
+    bool readContainer(std::vector<char>& container) {
+        container.resize(MTP_CONTAINER_HEADER_SIZE);
+        if (!readFully(&container[0], MTP_CONTAINER_HEADER_SIZE))
+            return false;
+        uint32_t length = get32(container, 0);
+        if (length < MTP_CONTAINER_HEADER_SIZE)
+            return false;
+        container.resize(length);
+        return readFully(&container[MTP_CONTAINER_HEADER_SIZE], length - MTP_CONTAINER_HEADER_SIZE);
+    }
+
+    int mFD;
+    uint32_t mTransactionID;
+};
+
+static void* runServer(void* cookie) {
+    std::pair<MtpServer*, int>* args = (std::pair<MtpServer*, int>*)cookie;
+    args->first->run(args->second);
+    return NULL;
+}
+
+class MtpLoopbackTest : public testing::Test {
+  protected:
+    virtual void SetUp() {
+        const char* env = getenv("MTP_LOOPBACK_OBJECTS");
+        objects = env ? atoi(env) : 1000;
+        char tmpl[] = "/data/local/tmp/mtp_loopback_test.XXXXXX";
+        ASSERT_TRUE(mkdtemp(tmpl) != NULL);
+        root = tmpl;
+        MtpStorage::setDBDir(root + ".db");
+        dirs = (objects + kFilesPerDir - 1) / kFilesPerDir;
+        for (int d = 0, left = objects; d < dirs; d++) {
+            char dir[PATH_MAX];
+            snprintf(dir, sizeof(dir), "%s/dir%04d", root.c_str(), d);
+            ASSERT_EQ(0, mkdir(dir, 0755));
+            for (int f = 0; f < kFilesPerDir && left > 0; f++, left--) {
+                char file[PATH_MAX];
+                snprintf(file, sizeof(file), "%s/file%04d.jpg", dir, f);
+                int fd = open(file, O_WRONLY | O_CREAT, 0644);
+                ASSERT_GE(fd, 0);
+                close(fd);
+            }
+        }
+
+        int fds[2];
+        ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+        database = new MyMtpDatabase();
+        server = new MtpServer(database, false, 0, 0664, 0775);
+        server->setUserSpaceTransfer(512);
+        long long start = now_ns();
+        server->addStorage(new MtpStorage(kStorageID, root.c_str(), "loopback", 0, false, 0, server));
+        addStorageNs = now_ns() - start;
+        args = std::make_pair(server, fds[0]);
+        ASSERT_EQ(0, pthread_create(&thread, NULL, runServer, &args));
+        client = new MtpLoopbackClient(fds[1]);
+        clientFD = fds[1];
+
+        std::vector<uint32_t> params(1, 1);
+        ASSERT_EQ(MTP_RESPONSE_OK, client->transact(MTP_OPERATION_OPEN_SESSION, params));
+    }
+
+    virtual void TearDown() {
+        // the server sees the end of the stream and returns from run()
+        shutdown(clientFD, SHUT_RDWR);
+        pthread_join(thread, NULL);
+        close(clientFD);
+        delete client;
+        delete database;
+        delete server;
+        std::string cmd = "rm -rf " + root + " " + root + ".db";
+        system(cmd.c_str());
+    }
+
+    // GetObjectHandles for one folder, returns the handles
+    std::vector<uint32_t> getHandles(uint32_t parent) {
+        std::vector<uint32_t> params;
+        params.push_back(kStorageID);
+        params.push_back(0);
+        params.push_back(parent);
+        std::vector<char> data;
+        std::vector<uint32_t> handles;
+        EXPECT_EQ(MTP_RESPONSE_OK, client->transact(MTP_OPERATION_GET_OBJECT_HANDLES, params, NULL, &data));
+        if (data.size() < 4)
+            return handles;
+        uint32_t count = get32(data, 0);
+        EXPECT_EQ(data.size(), 4 + count * 4);
+        for (uint32_t i = 0; i < count && 4 + i * 4 + 4 <= data.size(); i++)
+            handles.push_back(get32(data, 4 + i * 4));
+        return handles;
+    }
+
+    uint32_t sendObject(const char* name, const std::vector<char>& content) {
+        std::vector<char> info;
+        put32(info, kStorageID);
+        put16(info, MTP_FORMAT_UNDEFINED);
+        put16(info, 0);                 // protection status
+        put32(info, content.size());
+        put16(info, 0);                 // thumb format
+        for (int i = 0; i < 6; i++)
+            put32(info, 0);             // thumb and image sizes, bit depth
+        put32(info, MTP_PARENT_ROOT);
+        put16(info, 0);                 // association type
+        put32(info, 0);                 // association desc
+        put32(info, 0);                 // sequence number
+        putString(info, name);
+        putString(info, "");            // date created
+        putString(info, "20161001T120000");
+        putString(info, "");            // keywords
+        std::vector<uint32_t> params, response;
+        params.push_back(kStorageID);
+        params.push_back(MTP_PARENT_ROOT);
+        EXPECT_EQ(MTP_RESPONSE_OK, client->transact(MTP_OPERATION_SEND_OBJECT_INFO, params, &info,
+                                                    NULL, &response));
+        EXPECT_EQ(3U, response.size());
+        if (response.size() < 3)
+            return 0;
+        EXPECT_EQ(MTP_RESPONSE_OK, client->transact(MTP_OPERATION_SEND_OBJECT,
+                                                    std::vector<uint32_t>(), &content));
+        return response[2];
+    }
+
+    int objects;
+    int dirs;
+    std::string root;
+    MyMtpDatabase* database;
+    MtpServer* server;
+    std::pair<MtpServer*, int> args;
+    pthread_t thread;
+    MtpLoopbackClient* client;
+    int clientFD;
+    long long addStorageNs;
+};
+
+TEST_F(MtpLoopbackTest, DeviceInfoAndStorage) {
+    std::vector<char> data;
+    EXPECT_EQ(MTP_RESPONSE_OK, client->transact(MTP_OPERATION_GET_DEVICE_INFO,
+                                                std::vector<uint32_t>(), NULL, &data));
+    EXPECT_FALSE(data.empty());
+    EXPECT_EQ(MTP_RESPONSE_OK, client->transact(MTP_OPERATION_GET_STORAGE_IDS,
+                                                std::vector<uint32_t>(), NULL, &data));
+    ASSERT_EQ(8U, data.size());
+    EXPECT_EQ(1U, get32(data, 0));
+    EXPECT_EQ(kStorageID, get32(data, 4));
+}
+
+TEST_F(MtpLoopbackTest, EnumerationBenchmark) {
+    long long start = now_ns();
+    std::vector<uint32_t> top = getHandles(MTP_PARENT_ROOT);
+    ASSERT_EQ((size_t)dirs, top.size());
+    size_t count = top.size();
+    for (size_t i = 0; i < top.size(); i++)
+        count += getHandles(top[i]).size();
+    long long elapsed = now_ns() - start;
+    EXPECT_EQ((size_t)(dirs + objects), count);
+
+    // everything in one GetObjectPropList, as Windows does it
+    std::vector<uint32_t> params;
+    params.push_back(0xFFFFFFFF);   // all objects
+    params.push_back(0);            // any format
+    params.push_back(0xFFFFFFFF);   // all properties
+    params.push_back(0);
+    params.push_back(0xFFFFFFFF);   // all levels
+    std::vector<char> data;
+    start = now_ns();
+    ASSERT_EQ(MTP_RESPONSE_OK, client->transact(MTP_OPERATION_GET_OBJECT_PROP_LIST, params, NULL, &data));
+    long long propList = now_ns() - start;
+    ASSERT_GE(data.size(), 4U);
+    EXPECT_EQ(0U, get32(data, 0) % (dirs + objects));
+
+    printf("%d objects: storage added in %lld ms, enumerated in %lld ms, "
+           "property list (%zu bytes) in %lld ms\n", dirs + objects, addStorageNs / 1000000,
+           elapsed / 1000000, data.size(), propList / 1000000);
+}
+
+TEST_F(MtpLoopbackTest, SendAndGetObjectThroughput) {
+    std::vector<char> content(64 * 1024 * 1024 + 17);
+    for (size_t i = 0; i < content.size(); i++)
+        content[i] = (char)(i * 7 + (i >> 12));
+
+    long long start = now_ns();
+    uint32_t handle = sendObject("big.bin", content);
+    long long sendNs = now_ns() - start;
+    ASSERT_NE(0U, handle);
+    struct stat st;
+    ASSERT_EQ(0, stat((root + "/big.bin").c_str(), &st));
+    EXPECT_EQ((off_t)content.size(), st.st_size);
+
+    std::vector<char> data;
+    std::vector<uint32_t> params(1, handle);
+    start = now_ns();
+    ASSERT_EQ(MTP_RESPONSE_OK, client->transact(MTP_OPERATION_GET_OBJECT, params, NULL, &data));
+    long long getNs = now_ns() - start;
+    EXPECT_TRUE(data == content);
+
+    printf("SendObject %zu bytes at %lld MB/s, GetObject at %lld MB/s\n", content.size(),
+           (long long)content.size() * 1000 / (sendNs ? sendNs : 1),
+           (long long)content.size() * 1000 / (getNs ? getNs : 1));
+}
+
+TEST_F(MtpLoopbackTest, DeleteObject) {
+    std::vector<uint32_t> top = getHandles(MTP_PARENT_ROOT);
+    ASSERT_FALSE(top.empty());
+    std::vector<uint32_t> params(1, top[0]);
+    EXPECT_EQ(MTP_RESPONSE_OK, client->transact(MTP_OPERATION_DELETE_OBJECT, params));
+    EXPECT_EQ(top.size() - 1, getHandles(MTP_PARENT_ROOT).size());
+    EXPECT_NE(MTP_RESPONSE_OK, client->transact(MTP_OPERATION_GET_OBJECT_INFO, params));
+}
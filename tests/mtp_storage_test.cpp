@@ -0,0 +1,414 @@
+/*
+ * Copyright (C) 2016 TeamWin Recovery Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "mtp/MtpDataPacket.h"
+#include "mtp/MtpStorage.h"
+
+// Synthetic tree used by the benchmark: kDirs folders of kFilesPerDir
+// empty files, a bit over 100k objects in total.
+static const int kDirs = 100;
+static const int kFilesPerDir = 1024;
+static const MtpStorageID kStorageID = 0x10001;
+
+static long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+class MtpStorageTest : public testing::Test {
+  protected:
+    virtual void SetUp() {
+        char tmpl[] = "/data/local/tmp/mtp_storage_test.XXXXXX";
+        ASSERT_TRUE(mkdtemp(tmpl) != NULL);
+        root = tmpl;
+        MtpStorage::setDBDir(root + ".db");
+        for (int d = 0; d < kDirs; d++) {
+            char dir[PATH_MAX];
+            snprintf(dir, sizeof(dir), "%s/dir%03d", root.c_str(), d);
+            ASSERT_EQ(0, mkdir(dir, 0755));
+            for (int f = 0; f < kFilesPerDir; f++) {
+                char file[PATH_MAX];
+                snprintf(file, sizeof(file), "%s/file%04d.jpg", dir, f);
+                int fd = open(file, O_WRONLY | O_CREAT, 0644);
+                ASSERT_GE(fd, 0);
+                close(fd);
+            }
+        }
+    }
+
+    virtual void TearDown() {
+        std::string cmd = "rm -rf " + root + " " + root + ".db";
+        system(cmd.c_str());
+    }
+
+    // Reads every directory and returns the handles of all files
+    void readAll(MtpStorage& storage, std::vector<MtpObjectHandle>& dirs,
+                 std::vector<MtpObjectHandle>& files) {
+        MtpObjectHandleList* top = storage.getObjectList(kStorageID, MTP_PARENT_ROOT);
+        for (size_t i = 0; i < top->size(); i++) {
+            dirs.push_back((*top)[i]);
+            MtpObjectHandleList* list = storage.getObjectList(kStorageID, (*top)[i]);
+            for (size_t j = 0; j < list->size(); j++)
+                files.push_back((*list)[j]);
+            delete list;
+        }
+        delete top;
+    }
+
+    std::string root;
+};
+
+TEST_F(MtpStorageTest, HandleLookupBenchmark) {
+    MtpStorage storage(kStorageID, root.c_str(), "test", 0, false, 0, NULL);
+    storage.createDB();
+
+    std::vector<MtpObjectHandle> dirs, files;
+    long long start = now_ns();
+    readAll(storage, dirs, files);
+    long long read_ns = now_ns() - start;
+    ASSERT_EQ((size_t)kDirs, dirs.size());
+    ASSERT_EQ((size_t)(kDirs * kFilesPerDir), files.size());
+
+    // getObjectFilePath does a handle lookup plus a walk up to the root
+    start = now_ns();
+    for (size_t i = 0; i < files.size(); i++) {
+        MtpString path;
+        int64_t length;
+        MtpObjectFormat format;
+        ASSERT_EQ(0, storage.getObjectFilePath(files[i], path, length, format));
+        ASSERT_EQ(0, strncmp(path.string(), root.c_str(), root.size()));
+    }
+    long long lookup_ns = now_ns() - start;
+
+    printf("read %zu objects in %lld ms, %zu path lookups in %lld ms (%lld ns each)\n",
+           dirs.size() + files.size(), read_ns / 1000000, files.size(),
+           lookup_ns / 1000000, lookup_ns / (long long)files.size());
+}
+
+TEST_F(MtpStorageTest, DeleteDropsSubtree) {
+    MtpStorage storage(kStorageID, root.c_str(), "test", 0, false, 0, NULL);
+    storage.createDB();
+
+    std::vector<MtpObjectHandle> dirs, files;
+    readAll(storage, dirs, files);
+    ASSERT_FALSE(dirs.empty());
+
+    // deleting the first folder must make all of its files unreachable;
+    // it drops inotify watches, so hold the lock like the server does
+    storage.lockMutex(0);
+    ASSERT_EQ(0, storage.deleteFile(dirs[0]));
+    storage.unlockMutex(0);
+    MtpObjectInfo info(dirs[0]);
+    EXPECT_EQ(-1, storage.getObjectInfo(dirs[0], info));
+    for (int f = 0; f < kFilesPerDir; f++) {
+        MtpString path;
+        int64_t length;
+        MtpObjectFormat format;
+        EXPECT_EQ(-1, storage.getObjectFilePath(files[f], path, length, format));
+    }
+    // the rest of the tree is untouched
+    MtpString path;
+    int64_t length;
+    MtpObjectFormat format;
+    EXPECT_EQ(0, storage.getObjectFilePath(files[kFilesPerDir], path, length, format));
+}
+
+TEST_F(MtpStorageTest, SynthesizedProperties) {
+    MtpStorage storage(kStorageID, root.c_str(), "test", 0, false, 0, NULL);
+    storage.createDB();
+
+    std::vector<MtpObjectHandle> dirs, files;
+    readAll(storage, dirs, files);
+    ASSERT_FALSE(files.empty());
+
+    MtpString path;
+    int64_t length;
+    MtpObjectFormat format;
+    ASSERT_EQ(0, storage.getObjectFilePath(files[0], path, length, format));
+    std::string name(path.string());
+    name = name.substr(name.rfind('/') + 1);
+
+    MtpStorage::PropEntry pe;
+    ASSERT_EQ(0, storage.getObjectPropertyValue(files[0], MTP_PROPERTY_OBJECT_FILE_NAME, pe));
+    EXPECT_EQ(MTP_TYPE_STR, pe.datatype);
+    EXPECT_EQ(name, pe.strvalue);
+    ASSERT_EQ(0, storage.getObjectPropertyValue(files[0], MTP_PROPERTY_PARENT_OBJECT, pe));
+    EXPECT_EQ(dirs[0], pe.intvalue);
+    ASSERT_EQ(0, storage.getObjectPropertyValue(files[0], MTP_PROPERTY_OBJECT_FORMAT, pe));
+    EXPECT_EQ(MTP_FORMAT_UNDEFINED, pe.intvalue);
+    ASSERT_EQ(0, storage.getObjectPropertyValue(dirs[0], MTP_PROPERTY_OBJECT_FORMAT, pe));
+    EXPECT_EQ(MTP_FORMAT_ASSOCIATION, pe.intvalue);
+    ASSERT_EQ(0, storage.getObjectPropertyValue(files[0], MTP_PROPERTY_STORAGE_ID, pe));
+    EXPECT_EQ(kStorageID, pe.intvalue);
+    ASSERT_EQ(0, storage.getObjectPropertyValue(files[0], MTP_PROPERTY_ARTIST, pe));
+    EXPECT_EQ(MTP_TYPE_STR, pe.datatype);
+    EXPECT_TRUE(pe.strvalue.empty());
+}
+
+TEST_F(MtpStorageTest, CollectObjectsByDepth) {
+    MtpStorage storage(kStorageID, root.c_str(), "test", 0, false, 0, NULL);
+    storage.createDB();
+
+    // the whole storage in one go, reading folders as needed
+    std::vector<Node*> nodes;
+    long long start = now_ns();
+    ASSERT_EQ(0, storage.collectObjects(0xffffffff, 0, 0, nodes));
+    EXPECT_EQ((size_t)(kDirs + kDirs * kFilesPerDir), nodes.size());
+    MtpDataPacket packet;
+    packet.putUInt32(MtpStorage::getPropertyListCount(nodes.size(), 0xffffffff));
+    storage.putObjectPropertyList(nodes, 0xffffffff, packet);
+    printf("listed all properties of %zu objects in %lld ms\n", nodes.size(),
+           (now_ns() - start) / 1000000);
+
+    nodes.clear();
+    ASSERT_EQ(0, storage.collectObjects(0, 0, 0, nodes));
+    ASSERT_EQ((size_t)kDirs, nodes.size());
+    MtpObjectHandle dir = nodes[0]->Mtpid();
+
+    nodes.clear();
+    ASSERT_EQ(0, storage.collectObjects(0xffffffff, MTP_FORMAT_ASSOCIATION, 0, nodes));
+    EXPECT_EQ((size_t)kDirs, nodes.size());
+
+    nodes.clear();
+    ASSERT_EQ(0, storage.collectObjects(dir, 0, 0, nodes));
+    ASSERT_EQ(1U, nodes.size());
+    EXPECT_EQ(dir, nodes[0]->Mtpid());
+
+    nodes.clear();
+    ASSERT_EQ(0, storage.collectObjects(dir, 0, 1, nodes));
+    EXPECT_EQ((size_t)kFilesPerDir, nodes.size());
+
+    nodes.clear();
+    EXPECT_EQ(-1, storage.collectObjects(0x7ffffff0, 0, 0, nodes));
+}
+
+// Waits for the inotify thread to catch up with changes made on disk
+static bool waitForCount(MtpStorage& storage, MtpObjectHandle parent, size_t count) {
+    for (int i = 0; i < 400; i++) {
+        storage.lockMutex(0);
+        MtpObjectHandleList* list = storage.getObjectList(kStorageID, parent);
+        size_t size = list ? list->size() : 0;
+        delete list;
+        storage.unlockMutex(0);
+        if (size == count)
+            return true;
+        usleep(25000);
+    }
+    return false;
+}
+
+TEST_F(MtpStorageTest, InotifyTracksChanges) {
+    MtpStorage storage(kStorageID, root.c_str(), "test", 0, false, 0, NULL);
+    storage.createDB();
+
+    std::vector<MtpObjectHandle> dirs, files;
+    storage.lockMutex(0);
+    readAll(storage, dirs, files);
+    MtpString path;
+    int64_t length;
+    MtpObjectFormat format;
+    ASSERT_EQ(0, storage.getObjectFilePath(dirs[0], path, length, format));
+    storage.unlockMutex(0);
+    std::string dir(path.string());
+
+    // a burst of new files, each created, written and closed, while some
+    // of the old ones go away
+    const int kNew = 500, kRemoved = 100;
+    for (int f = 0; f < kNew; f++) {
+        char file[PATH_MAX];
+        snprintf(file, sizeof(file), "%s/new%04d.jpg", dir.c_str(), f);
+        int fd = open(file, O_WRONLY | O_CREAT, 0644);
+        ASSERT_GE(fd, 0);
+        ASSERT_EQ(10, write(fd, "0123456789", 10));
+        close(fd);
+    }
+    for (int f = 0; f < kRemoved; f++) {
+        char file[PATH_MAX];
+        snprintf(file, sizeof(file), "%s/file%04d.jpg", dir.c_str(), f);
+        ASSERT_EQ(0, unlink(file));
+    }
+    ASSERT_TRUE(waitForCount(storage, dirs[0], kFilesPerDir + kNew - kRemoved));
+
+    // the new files have their final size
+    storage.lockMutex(0);
+    MtpObjectHandleList* list = storage.getObjectList(kStorageID, dirs[0]);
+    int checked = 0;
+    for (size_t i = 0; i < list->size(); i++) {
+        MtpStorage::PropEntry pe;
+        ASSERT_EQ(0, storage.getObjectPropertyValue((*list)[i], MTP_PROPERTY_OBJECT_FILE_NAME, pe));
+        if (pe.strvalue.compare(0, 3, "new") != 0)
+            continue;
+        ASSERT_EQ(0, storage.getObjectPropertyValue((*list)[i], MTP_PROPERTY_OBJECT_SIZE, pe));
+        EXPECT_EQ(10U, pe.intvalue);
+        checked++;
+    }
+    delete list;
+    storage.unlockMutex(0);
+    EXPECT_EQ(kNew, checked);
+
+    // removing a whole folder drops it and everything in it
+    ASSERT_EQ(0, storage.getObjectFilePath(dirs[1], path, length, format));
+    std::string cmd = std::string("rm -rf ") + path.string();
+    system(cmd.c_str());
+    ASSERT_TRUE(waitForCount(storage, MTP_PARENT_ROOT, kDirs - 1));
+    storage.lockMutex(0);
+    EXPECT_EQ(-1, storage.getObjectFilePath(files[kFilesPerDir], path, length, format));
+    storage.unlockMutex(0);
+}
+
+TEST_F(MtpStorageTest, DatabaseKeepsHandles) {
+    // directories changed in the last seconds are not saved
+    sleep(3);
+
+    std::map<MtpObjectHandle, std::string> paths;
+    std::map<MtpObjectHandle, uint64_t> puids;
+    long long scan_ns, load_ns;
+    MtpString path;
+    int64_t length;
+    MtpObjectFormat format;
+    MtpStorage::PropEntry pe;
+    {
+        long long start = now_ns();
+        MtpStorage storage(kStorageID, root.c_str(), "test", 0, false, 0, NULL);
+        storage.createDB();
+        std::vector<MtpObjectHandle> dirs, files;
+        storage.lockMutex(0);
+        readAll(storage, dirs, files);
+        scan_ns = now_ns() - start;
+        files.insert(files.end(), dirs.begin(), dirs.end());
+        for (size_t i = 0; i < files.size(); i++) {
+            ASSERT_EQ(0, storage.getObjectFilePath(files[i], path, length, format));
+            paths[files[i]] = path.string();
+            ASSERT_EQ(0, storage.getObjectPropertyValue(files[i], MTP_PROPERTY_PERSISTENT_UID, pe));
+            puids[files[i]] = pe.intvalue;
+        }
+        EXPECT_EQ(0, storage.saveDB());
+        storage.unlockMutex(0);
+    }
+
+    // one folder changes while MTP is off
+    std::string dir = root + "/dir000";
+    ASSERT_EQ(0, unlink((dir + "/file0000.jpg").c_str()));
+    int fd = open((dir + "/added.jpg").c_str(), O_WRONLY | O_CREAT, 0644);
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(3, write(fd, "abc", 3));
+    close(fd);
+    // and a file in an unchanged folder is written
+    fd = open((root + "/dir001/file0001.jpg").c_str(), O_WRONLY);
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(5, write(fd, "hello", 5));
+    close(fd);
+
+    long long start = now_ns();
+    MtpStorage storage(kStorageID, root.c_str(), "test", 0, false, 0, NULL);
+    storage.createDB();
+    std::vector<MtpObjectHandle> dirs, files;
+    storage.lockMutex(0);
+    readAll(storage, dirs, files);
+    load_ns = now_ns() - start;
+    ASSERT_EQ((size_t)kDirs, dirs.size());
+    ASSERT_EQ((size_t)(kDirs * kFilesPerDir), files.size());
+    files.insert(files.end(), dirs.begin(), dirs.end());
+
+    int kept = 0;
+    for (size_t i = 0; i < files.size(); i++) {
+        ASSERT_EQ(0, storage.getObjectFilePath(files[i], path, length, format));
+        std::string p = path.string();
+        if (p == dir + "/added.jpg") {
+            EXPECT_TRUE(paths.find(files[i]) == paths.end());
+            continue;
+        }
+        // same object, same handle and persistent UID
+        ASSERT_TRUE(paths.find(files[i]) != paths.end()) << p;
+        EXPECT_EQ(paths[files[i]], p);
+        ASSERT_EQ(0, storage.getObjectPropertyValue(files[i], MTP_PROPERTY_PERSISTENT_UID, pe));
+        EXPECT_EQ(puids[files[i]], pe.intvalue);
+        if (p == root + "/dir001/file0001.jpg") {
+            ASSERT_EQ(0, storage.getObjectPropertyValue(files[i], MTP_PROPERTY_OBJECT_SIZE, pe));
+            EXPECT_EQ(5U, pe.intvalue);
+        }
+        kept++;
+    }
+    storage.unlockMutex(0);
+    EXPECT_EQ(kDirs * (kFilesPerDir + 1) - 1, kept);
+
+    printf("listed %d objects in %lld ms after a scan, %lld ms from the database\n",
+           kDirs * (kFilesPerDir + 1), scan_ns / 1000000, load_ns / 1000000);
+}
+
+TEST_F(MtpStorageTest, DatabaseWithBadHandleIsDiscarded) {
+    sleep(3);
+    {
+        MtpStorage storage(kStorageID, root.c_str(), "test", 0, false, 0, NULL);
+        storage.createDB();
+        storage.lockMutex(0);
+        EXPECT_EQ(0, storage.saveDB());
+        storage.unlockMutex(0);
+    }
+
+    // give one folder a handle near the top of the range
+    std::string dbDir = root + ".db";
+    DIR* d = opendir(dbDir.c_str());
+    ASSERT_TRUE(d != NULL);
+    std::string db;
+    struct dirent* de;
+    while ((de = readdir(d)) != NULL) {
+        if (strstr(de->d_name, ".db") != NULL)
+            db = dbDir + "/" + de->d_name;
+    }
+    closedir(d);
+    ASSERT_NE("", db);
+    int fd = open(db.c_str(), O_RDWR);
+    ASSERT_GE(fd, 0);
+    struct stat st;
+    ASSERT_EQ(0, fstat(fd, &st));
+    std::vector<char> data(st.st_size);
+    ASSERT_EQ((ssize_t)data.size(), pread(fd, &data[0], data.size(), 0));
+    std::string contents(data.begin(), data.end());
+    size_t name = contents.find("dir050");
+    ASSERT_NE(std::string::npos, name);
+    // handle, parent, flags, inode, size, modified and name length come first
+    const unsigned char handle[4] = { 0xf0, 0xff, 0xff, 0x7f };
+    ASSERT_EQ(4, pwrite(fd, handle, 4, name - 35));
+    close(fd);
+
+    MtpStorage storage(kStorageID, root.c_str(), "test", 0, false, 0, NULL);
+    storage.createDB();
+    std::vector<MtpObjectHandle> dirs, files;
+    storage.lockMutex(0);
+    readAll(storage, dirs, files);
+    storage.unlockMutex(0);
+    ASSERT_EQ((size_t)kDirs, dirs.size());
+    ASSERT_EQ((size_t)(kDirs * kFilesPerDir), files.size());
+    files.insert(files.end(), dirs.begin(), dirs.end());
+    for (size_t i = 0; i < files.size(); i++)
+        ASSERT_LT(files[i], 0x10000000U);
+}
@@ -0,0 +1,329 @@
+/*
+ * Copyright (C) 2016 TeamWin Recovery Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "mtp/mtp.h"
+#include "mtp/MtpFileTransfer.h"
+
+// A socketpair stands in for the USB endpoint: the engine works on one
+// end, a helper thread plays the host on the other. A stream socket is a
+// FunctionFS endpoint that never ends a transfer early, so the engine is
+// told its packet size.
+
+static const size_t kPacketSize = 512;
+
+static long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+struct HostIO {
+    int fd;
+    std::vector<char> data;
+    size_t length;  // bytes to read, or to write before closing
+};
+
+static void* hostRead(void* cookie) {
+    HostIO* io = (HostIO*)cookie;
+    io->data.resize(io->length);
+    size_t done = 0;
+    while (done < io->length) {
+        ssize_t ret = read(io->fd, &io->data[done], io->length - done);
+        if (ret <= 0)
+            break;
+        done += ret;
+    }
+    io->data.resize(done);
+    return NULL;
+}
+
+static void* hostWrite(void* cookie) {
+    HostIO* io = (HostIO*)cookie;
+    size_t done = 0;
+    while (done < io->length) {
+        ssize_t ret = write(io->fd, &io->data[done], io->length - done);
+        if (ret <= 0)
+            break;
+        done += ret;
+    }
+    shutdown(io->fd, SHUT_WR);
+    return NULL;
+}
+
+static uint32_t getUInt32(const char* p) {
+    const unsigned char* u = (const unsigned char*)p;
+    return u[0] | (u[1] << 8) | (u[2] << 16) | ((uint32_t)u[3] << 24);
+}
+
+class MtpTransferTest : public testing::Test {
+  protected:
+    virtual void SetUp() {
+        ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, usb));
+        char tmpl[] = "/data/local/tmp/mtp_transfer_test.XXXXXX";
+        fd = mkstemp(tmpl);
+        ASSERT_GE(fd, 0);
+        path = tmpl;
+        memset(&progress, 0, sizeof(progress));
+    }
+
+    virtual void TearDown() {
+        close(usb[0]);
+        close(usb[1]);
+        close(fd);
+        unlink(path.c_str());
+    }
+
+    void fillFile(size_t length) {
+        content.resize(length);
+        srand(length);
+        for (size_t i = 0; i < length; i++)
+            content[i] = (char)rand();
+        ASSERT_EQ((ssize_t)length, pwrite(fd, &content[0], length, 0));
+    }
+
+    std::vector<char> readFile() {
+        struct stat st;
+        fstat(fd, &st);
+        std::vector<char> data(st.st_size);
+        if (st.st_size)
+            pread(fd, &data[0], st.st_size, 0);
+        return data;
+    }
+
+    void checkSend(MtpFileTransfer& transfer, uint64_t offset, uint64_t length) {
+        HostIO host;
+        host.fd = usb[1];
+        host.length = length + MTP_CONTAINER_HEADER_SIZE;
+        pthread_t thread;
+        pthread_create(&thread, NULL, hostRead, &host);
+        transfer.setProgress(&progress);
+        long long start = now_ns();
+        ASSERT_EQ(0, transfer.sendFile(usb[0], fd, offset, length,
+                MTP_OPERATION_GET_PARTIAL_OBJECT, 0x1234));
+        long long elapsed = now_ns() - start;
+        pthread_join(thread, NULL);
+
+        ASSERT_EQ(length + MTP_CONTAINER_HEADER_SIZE, host.data.size());
+        EXPECT_EQ(length + MTP_CONTAINER_HEADER_SIZE, getUInt32(&host.data[0]));
+        EXPECT_EQ((uint32_t)(MTP_CONTAINER_TYPE_DATA | (MTP_OPERATION_GET_PARTIAL_OBJECT << 16)),
+                getUInt32(&host.data[4]));
+        EXPECT_EQ(0x1234U, getUInt32(&host.data[8]));
+        EXPECT_TRUE(std::equal(host.data.begin() + MTP_CONTAINER_HEADER_SIZE, host.data.end(),
+                content.begin() + offset));
+        EXPECT_EQ(length, progress.total);
+        EXPECT_EQ(length, progress.transferred);
+        if (elapsed)
+            printf("sent %llu bytes at %lld MB/s\n", (unsigned long long)length,
+                   (long long)length * 1000 / elapsed);
+    }
+
+    int usb[2];
+    int fd;
+    std::string path;
+    std::vector<char> content;
+    mtp_transfer_progress progress;
+};
+
+TEST_F(MtpTransferTest, SendFile) {
+    fillFile(64 * 1024 * 1024 + 123);
+    MtpFileTransfer transfer;
+    transfer.setPacketSize(kPacketSize);
+    checkSend(transfer, 0, content.size());
+}
+
+TEST_F(MtpTransferTest, SendPartialFileWithSmallBuffers) {
+    fillFile(1024 * 1024);
+    // small buffers so the ring wraps many times
+    MtpFileTransfer transfer(4096, 2);
+    transfer.setPacketSize(kPacketSize);
+    checkSend(transfer, 1000, 70000);
+    checkSend(transfer, 0, 0);
+}
+
+TEST_F(MtpTransferTest, SendFailsWhenFileShrinks) {
+    fillFile(1000);
+    MtpFileTransfer transfer(4096, 2);
+    transfer.setPacketSize(kPacketSize);
+    HostIO host;
+    host.fd = usb[1];
+    host.length = 10000;
+    pthread_t thread;
+    pthread_create(&thread, NULL, hostRead, &host);
+    EXPECT_EQ(-1, transfer.sendFile(usb[0], fd, 0, 10000, MTP_OPERATION_GET_OBJECT, 1));
+    EXPECT_EQ(EIO, errno);
+    shutdown(usb[0], SHUT_WR);
+    pthread_join(thread, NULL);
+}
+
+TEST_F(MtpTransferTest, ReceiveFile) {
+    HostIO host;
+    host.fd = usb[1];
+    host.length = 8 * 1024 * 1024 + 7;
+    host.data.resize(host.length);
+    for (size_t i = 0; i < host.length; i++)
+        host.data[i] = (char)(i * 31);
+    pthread_t thread;
+    pthread_create(&thread, NULL, hostWrite, &host);
+
+    MtpFileTransfer transfer(64 * 1024, 3);
+    transfer.setPacketSize(kPacketSize);
+    transfer.setProgress(&progress);
+    ASSERT_EQ(0, transfer.receiveFile(usb[0], fd, 0, host.length));
+    pthread_join(thread, NULL);
+    EXPECT_TRUE(readFile() == host.data);
+    EXPECT_EQ(host.length, progress.transferred);
+}
+
+TEST_F(MtpTransferTest, ReceiveUntilShortRead) {
+    // the host sends everything and ends the transfer with a short packet
+    HostIO host;
+    host.fd = usb[1];
+    host.length = 32 * 1024;
+    host.data.assign(host.length, 'x');
+    hostWrite(&host);
+
+    MtpFileTransfer transfer;
+    transfer.setPacketSize(kPacketSize);
+    ASSERT_EQ(0, transfer.receiveFile(usb[0], fd, 0, 0xFFFFFFFF));
+    EXPECT_TRUE(readFile() == host.data);
+}
+
+TEST_F(MtpTransferTest, ReceiveFailsOnEarlyEnd) {
+    HostIO host;
+    host.fd = usb[1];
+    host.length = 5000;
+    host.data.assign(host.length, 'y');
+    hostWrite(&host);
+
+    MtpFileTransfer transfer(4096, 2);
+    transfer.setPacketSize(kPacketSize);
+    EXPECT_EQ(-1, transfer.receiveFile(usb[0], fd, 0, 10000));
+    EXPECT_EQ(EIO, errno);
+}
+
+// A seqpacket socket keeps the boundaries of the engine's writes, so the
+// host can see where each USB transfer ends: on f_mtp at every write, on
+// FunctionFS at a short or zero length packet.
+
+static const char kEndOfTest[] = "end";
+
+struct HostTransfers {
+    int fd;
+    size_t packetSize;  // 0 for f_mtp
+    std::vector<std::string> transfers;
+    bool open;  // the last transfer has not ended
+};
+
+static void* hostReadTransfers(void* cookie) {
+    HostTransfers* io = (HostTransfers*)cookie;
+    std::vector<char> buffer(1024 * 1024);
+    io->open = false;
+    for (;;) {
+        ssize_t ret = recv(io->fd, &buffer[0], buffer.size(), 0);
+        if (ret < 0)
+            break;
+        // the test sends this once the engine is done
+        if (ret == sizeof(kEndOfTest) && memcmp(&buffer[0], kEndOfTest, ret) == 0)
+            break;
+        if (!io->open)
+            io->transfers.push_back(std::string());
+        io->transfers.back().append(&buffer[0], ret);
+        io->open = io->packetSize && ret && ret % io->packetSize == 0;
+    }
+    return NULL;
+}
+
+class MtpTransferEndpointTest : public MtpTransferTest {
+  protected:
+    virtual void SetUp() {
+        MtpTransferTest::SetUp();
+        close(usb[0]);
+        close(usb[1]);
+        ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_SEQPACKET, 0, usb));
+    }
+
+    // sends [offset, offset + length) and returns what the host saw
+    HostTransfers send(MtpFileTransfer& transfer, size_t packetSize, uint64_t offset,
+            uint64_t length, int* ret) {
+        HostTransfers host;
+        host.fd = usb[1];
+        host.packetSize = packetSize;
+        pthread_t thread;
+        pthread_create(&thread, NULL, hostReadTransfers, &host);
+        *ret = transfer.sendFile(usb[0], fd, offset, length, MTP_OPERATION_GET_OBJECT, 7);
+        int error = errno;
+        write(usb[0], kEndOfTest, sizeof(kEndOfTest));
+        pthread_join(thread, NULL);
+        errno = error;
+        return host;
+    }
+};
+
+TEST_F(MtpTransferEndpointTest, RefusesEndpointThatEndsEveryWrite) {
+    // f_mtp ends the transfer at the end of every write, so a container
+    // sent as several buffers would reach the host as several transfers
+    fillFile(100000);
+    MtpFileTransfer transfer(16384, 3);
+    int ret;
+    HostTransfers host = send(transfer, 0, 0, content.size(), &ret);
+    EXPECT_EQ(-1, ret);
+    EXPECT_EQ(EOPNOTSUPP, errno);
+    EXPECT_EQ(0U, host.transfers.size());
+
+    // nor does it read from it
+    ASSERT_EQ((ssize_t)sizeof(kEndOfTest), write(usb[1], kEndOfTest, sizeof(kEndOfTest)));
+    EXPECT_EQ(-1, transfer.receiveFile(usb[0], fd, 0, 0xFFFFFFFF));
+    EXPECT_EQ(EOPNOTSUPP, errno);
+    char buffer[16];
+    EXPECT_EQ((ssize_t)sizeof(kEndOfTest), recv(usb[0], buffer, sizeof(buffer), MSG_DONTWAIT));
+}
+
+TEST_F(MtpTransferEndpointTest, SendIsOneTransfer) {
+    fillFile(100000);
+    MtpFileTransfer transfer(16384, 3);
+    transfer.setPacketSize(kPacketSize);
+    // a container that fills its last packet is ended by a zero length
+    // packet, one that does not by its last write
+    uint64_t lengths[] = { 3 * 16384 - MTP_CONTAINER_HEADER_SIZE, 70000, 0,
+            kPacketSize - MTP_CONTAINER_HEADER_SIZE };
+    for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+        int ret;
+        HostTransfers host = send(transfer, kPacketSize, 1000, lengths[i], &ret);
+        ASSERT_EQ(0, ret) << lengths[i];
+        ASSERT_EQ(1U, host.transfers.size()) << lengths[i];
+        EXPECT_FALSE(host.open) << lengths[i];
+        const std::string& data = host.transfers[0];
+        ASSERT_EQ(lengths[i] + MTP_CONTAINER_HEADER_SIZE, data.size());
+        EXPECT_EQ(data.size(), getUInt32(data.data()));
+        EXPECT_TRUE(std::equal(data.begin() + MTP_CONTAINER_HEADER_SIZE, data.end(),
+                content.begin() + 1000));
+    }
+}
@@ -0,0 +1,161 @@
+/*
+ * Copyright (C) 2016 TeamWin Recovery Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <string>
+#include <vector>
+
+#include "mincrypt/sha.h"
+#include "mincrypt/sha256.h"
+#include "mincrypt/sha_impl.h"
+
+// Every implementation the CPU supports is checked against the FIPS 180
+// test vectors and against the portable one on odd lengths and splits.
+// The benchmark prints the throughput of each one.
+
+static long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static std::string hex(const uint8_t* digest, int len) {
+    std::string out;
+    char buf[3];
+    for (int i = 0; i < len; i++) {
+        snprintf(buf, sizeof(buf), "%02x", digest[i]);
+        out += buf;
+    }
+    return out;
+}
+
+static std::string sha1(const void* data, int len) {
+    uint8_t digest[SHA_DIGEST_SIZE];
+    return hex(SHA_hash(data, len, digest), SHA_DIGEST_SIZE);
+}
+
+static std::string sha256(const void* data, int len) {
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    return hex(SHA256_hash(data, len, digest), SHA256_DIGEST_SIZE);
+}
+
+class ShaTest : public ::testing::Test {
+protected:
+    virtual void SetUp() {
+        saved = SHA_impl_get();
+        for (int i = 0; i < SHA_IMPL_COUNT; i++) {
+            if (SHA_impl_supported((SHA_IMPL) i))
+                impls.push_back((SHA_IMPL) i);
+        }
+    }
+
+    virtual void TearDown() {
+        SHA_impl_set(saved);
+    }
+
+    SHA_IMPL saved;
+    std::vector<SHA_IMPL> impls;
+};
+
+TEST_F(ShaTest, PortableIsAlwaysSupported) {
+    ASSERT_TRUE(SHA_impl_supported(SHA_IMPL_PORTABLE));
+    ASSERT_EQ(-1, SHA_impl_set(SHA_IMPL_COUNT));
+    printf("using %s\n", SHA_impl_name(saved));
+}
+
+TEST_F(ShaTest, KnownAnswers) {
+    const char* abc = "abc";
+    const char* two_blocks = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+    std::string million(1000000, 'a');
+
+    for (size_t i = 0; i < impls.size(); i++) {
+        SCOPED_TRACE(SHA_impl_name(impls[i]));
+        ASSERT_EQ(0, SHA_impl_set(impls[i]));
+
+        EXPECT_EQ("da39a3ee5e6b4b0d3255bfef95601890afd80709", sha1("", 0));
+        EXPECT_EQ("a9993e364706816aba3e25717850c26c9cd0d89d", sha1(abc, 3));
+        EXPECT_EQ("84983e441c3bd26ebaae4aa1f95129e5e54670f1",
+                sha1(two_blocks, strlen(two_blocks)));
+        EXPECT_EQ("34aa973cd4c4daa4f61eeb2bdbad27316534016f",
+                sha1(million.data(), million.size()));
+
+        EXPECT_EQ("e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855",
+                sha256("", 0));
+        EXPECT_EQ("ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad",
+                sha256(abc, 3));
+        EXPECT_EQ("248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1",
+                sha256(two_blocks, strlen(two_blocks)));
+        EXPECT_EQ("cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0",
+                sha256(million.data(), million.size()));
+    }
+}
+
+TEST_F(ShaTest, MatchesPortableOnAnySplit) {
+    std::vector<uint8_t> data(4096 + 63);
+    srand(42);
+    for (size_t i = 0; i < data.size(); i++)
+        data[i] = rand();
+
+    for (size_t i = 0; i < impls.size(); i++) {
+        SCOPED_TRACE(SHA_impl_name(impls[i]));
+        for (int len = 0; len < (int) data.size(); len += 61) {
+            // unaligned starts and updates that straddle block boundaries
+            const uint8_t* p = &data[len % 7];
+            int n = len - len % 7;
+
+            ASSERT_EQ(0, SHA_impl_set(SHA_IMPL_PORTABLE));
+            std::string want1 = sha1(p, n);
+            std::string want256 = sha256(p, n);
+
+            ASSERT_EQ(0, SHA_impl_set(impls[i]));
+            SHA_CTX ctx1;
+            SHA256_CTX ctx256;
+            SHA_init(&ctx1);
+            SHA256_init(&ctx256);
+            for (int pos = 0, step = 1; pos < n; pos += step, step = step * 3 + 1) {
+                int count = (n - pos < step ? n - pos : step);
+                SHA_update(&ctx1, p + pos, count);
+                SHA256_update(&ctx256, p + pos, count);
+            }
+            ASSERT_EQ(want1, hex(SHA_final(&ctx1), SHA_DIGEST_SIZE)) << "length " << n;
+            ASSERT_EQ(want256, hex(SHA256_final(&ctx256), SHA256_DIGEST_SIZE)) << "length " << n;
+        }
+    }
+}
+
+TEST_F(ShaTest, Throughput) {
+    const int size = 64 * 1024 * 1024;
+    std::vector<uint8_t> data(size, 0x5a);
+    uint8_t digest[SHA256_DIGEST_SIZE];
+
+    for (size_t i = 0; i < impls.size(); i++) {
+        ASSERT_EQ(0, SHA_impl_set(impls[i]));
+        long long start = now_ns();
+        SHA_hash(&data[0], size, digest);
+        long long sha1_ns = now_ns() - start;
+        start = now_ns();
+        SHA256_hash(&data[0], size, digest);
+        long long sha256_ns = now_ns() - start;
+        printf("%-10s SHA-1 %5lld MB/s, SHA-256 %5lld MB/s\n", SHA_impl_name(impls[i]),
+                (long long) size * 1000 / (sha1_ns ? sha1_ns : 1),
+                (long long) size * 1000 / (sha256_ns ? sha256_ns : 1));
+    }
+}
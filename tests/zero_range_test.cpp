@@ -0,0 +1,213 @@
+/*
+ * Copyright (C) 2016 TeamWin Recovery Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <linux/loop.h>
+
+#include <string>
+#include <vector>
+
+#include "mmcutils/zero_range.h"
+
+// Zeroes ranges of plain files and, when the test runs as root with loop
+// devices available, of a loop device, and checks the result against the
+// same ranges zeroed in memory.
+
+#define IMAGE_SIZE (4 * 1024 * 1024)
+
+struct Range {
+    uint64_t offset;
+    uint64_t len;
+};
+
+// Aligned, unaligned at either end, inside one sector, and crossing
+// several write chunks
+static const Range ranges[] = {
+    { 0, 4096 },
+    { 8192 + 100, 3 * 4096 },
+    { 65536 + 7, 300 },
+    { 1024 * 1024 - 512, 2 * 1024 * 1024 + 1000 },
+    { IMAGE_SIZE - 4096, 4096 },
+};
+
+static std::string temp_path(const char* name) {
+    const char* dir = getenv("TMPDIR");
+    return std::string(dir ? dir : "/data/local/tmp") + "/" + name;
+}
+
+static std::string random_image(size_t size) {
+    std::string data(size, '\0');
+    srand(1234);
+    for (size_t i = 0; i < size; i++)
+        data[i] = rand() & 0xFF;
+    return data;
+}
+
+static bool write_file(const std::string& path, const std::string& data) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+        return false;
+    bool ok = write(fd, data.data(), data.size()) == (ssize_t)data.size();
+    close(fd);
+    return ok;
+}
+
+static std::string read_fd(int fd, size_t size) {
+    std::string data(size, '\0');
+    size_t pos = 0;
+    while (pos < size) {
+        ssize_t r = pread(fd, &data[pos], size - pos, pos);
+        if (r <= 0)
+            break;
+        pos += r;
+    }
+    data.resize(pos);
+    return data;
+}
+
+static void zero_expected(std::string* data, const Range& r) {
+    if (r.offset + r.len > data->size())
+        data->resize(r.offset + r.len, '\0');
+    memset(&(*data)[r.offset], 0, r.len);
+}
+
+static void check_ranges(int fd, int (*zero)(int, uint64_t, uint64_t), std::string expected) {
+    off_t pos = lseek(fd, 12345, SEEK_SET);
+    for (size_t i = 0; i < sizeof(ranges) / sizeof(ranges[0]); i++) {
+        ASSERT_EQ(0, zero(fd, ranges[i].offset, ranges[i].len)) << strerror(errno);
+        zero_expected(&expected, ranges[i]);
+    }
+    EXPECT_EQ(pos, lseek(fd, 0, SEEK_CUR));
+    EXPECT_TRUE(read_fd(fd, expected.size()) == expected);
+}
+
+// The same ranges in one zero_ranges() call
+static void check_ranges_at_once(int fd, std::string expected) {
+    std::vector<uint64_t> pairs;
+    for (size_t i = 0; i < sizeof(ranges) / sizeof(ranges[0]); i++) {
+        pairs.push_back(ranges[i].offset);
+        pairs.push_back(ranges[i].len);
+        zero_expected(&expected, ranges[i]);
+    }
+    ASSERT_EQ(0, zero_ranges(fd, &pairs[0], pairs.size() / 2)) << strerror(errno);
+    EXPECT_TRUE(read_fd(fd, expected.size()) == expected);
+}
+
+TEST(ZeroRange, PlainFile) {
+    std::string path = temp_path("zero_range_test.img");
+    std::string image = random_image(IMAGE_SIZE);
+    ASSERT_TRUE(write_file(path, image));
+
+    int fd = open(path.c_str(), O_RDWR);
+    ASSERT_GE(fd, 0);
+    check_ranges(fd, zero_range, image);
+    close(fd);
+    unlink(path.c_str());
+}
+
+TEST(ZeroRange, PlainFileWrites) {
+    std::string path = temp_path("zero_range_test.img");
+    std::string image = random_image(IMAGE_SIZE);
+    ASSERT_TRUE(write_file(path, image));
+
+    int fd = open(path.c_str(), O_RDWR);
+    ASSERT_GE(fd, 0);
+    check_ranges(fd, zero_range_write, image);
+    close(fd);
+    unlink(path.c_str());
+}
+
+TEST(ZeroRange, PlainFileAtOnce) {
+    std::string path = temp_path("zero_range_test.img");
+    std::string image = random_image(IMAGE_SIZE);
+    ASSERT_TRUE(write_file(path, image));
+
+    int fd = open(path.c_str(), O_RDWR);
+    ASSERT_GE(fd, 0);
+    check_ranges_at_once(fd, image);
+    close(fd);
+    unlink(path.c_str());
+}
+
+// Zeroing past the end grows the file like writing zeroes would
+TEST(ZeroRange, GrowsFile) {
+    std::string path = temp_path("zero_range_test.img");
+    std::string image = random_image(8192);
+    ASSERT_TRUE(write_file(path, image));
+
+    int fd = open(path.c_str(), O_RDWR);
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(0, zero_range(fd, 4096, 3 * 1024 * 1024));
+    struct stat st;
+    ASSERT_EQ(0, fstat(fd, &st));
+    EXPECT_EQ(4096 + 3 * 1024 * 1024, st.st_size);
+    image.resize(4096);
+    image.resize(st.st_size, '\0');
+    EXPECT_TRUE(read_fd(fd, st.st_size) == image);
+    close(fd);
+    unlink(path.c_str());
+}
+
+TEST(ZeroRange, LoopDevice) {
+    std::string path = temp_path("zero_range_loop.img");
+    std::string image = random_image(IMAGE_SIZE);
+    ASSERT_TRUE(write_file(path, image));
+
+    int control = open("/dev/loop-control", O_RDWR);
+    if (control < 0) {
+        printf("no loop devices (%s), skipping\n", strerror(errno));
+        unlink(path.c_str());
+        return;
+    }
+    int num = ioctl(control, LOOP_CTL_GET_FREE);
+    close(control);
+    ASSERT_GE(num, 0);
+
+    char loop_path[64];
+    snprintf(loop_path, sizeof(loop_path), "/dev/block/loop%d", num);
+    if (access(loop_path, F_OK) != 0)
+        snprintf(loop_path, sizeof(loop_path), "/dev/loop%d", num);
+    int loop_fd = open(loop_path, O_RDWR);
+    int backing_fd = open(path.c_str(), O_RDWR);
+    ASSERT_GE(loop_fd, 0);
+    ASSERT_GE(backing_fd, 0);
+    if (ioctl(loop_fd, LOOP_SET_FD, backing_fd) < 0) {
+        printf("can't set up %s (%s), skipping\n", loop_path, strerror(errno));
+    } else {
+        check_ranges(loop_fd, zero_range, image);
+        // once more on fresh data, all ranges in one call
+        std::string fresh = random_image(IMAGE_SIZE);
+        ASSERT_EQ(IMAGE_SIZE, pwrite(loop_fd, fresh.data(), fresh.size(), 0));
+        check_ranges_at_once(loop_fd, fresh);
+        // and the zeroes made it to the backing file
+        ASSERT_EQ(0, fsync(loop_fd));
+        for (size_t i = 0; i < sizeof(ranges) / sizeof(ranges[0]); i++)
+            zero_expected(&image, ranges[i]);
+        EXPECT_TRUE(read_fd(backing_fd, IMAGE_SIZE) == image);
+        ioctl(loop_fd, LOOP_CLR_FD, 0);
+    }
+    close(backing_fd);
+    close(loop_fd);
+    unlink(path.c_str());
+}
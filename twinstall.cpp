@@ -20,7 +20,9 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
@@ -41,6 +43,8 @@
 #include "partitions.hpp"
 #include "twrpDigest.hpp"
 #include "twrp-functions.hpp"
+#include "tw_atomic.hpp"
+#include "twinstall.h"
 extern "C" {
 	#include "gui/gui.h"
 	#include "legacy_property_service.h"
@@ -92,18 +96,38 @@ static int switch_to_new_properties()
 	return 0;
 }
 
-static int Run_Update_Binary(const char *path, ZipArchive *Zip, int* wipe_cache) {
+// Where the install queue look-ahead extracts the update-binary of the
+// next zip, while the current one runs from /tmp/updater
+#define LOOKAHEAD_BINARY "/tmp/updater_next"
+
+// What the look-ahead found out about a queued zip. The install only trusts
+// it if the zip is still the same file, unchanged (see Same_Stat).
+struct TWInstallPrep {
+	TWInstallPrep(const string& zip_path)
+		: path(zip_path), zip_verify(1), has_md5(false), begin_ret(VERIFY_FAILURE),
+		  end_ret(VERIFY_FAILURE), binary_ready(false), done(false) {}
+
+	string path;
+	struct stat st;      // of the file that was hashed
+	int zip_verify;      // TW_SIGNED_ZIP_VERIFY_VAR when the look-ahead started
+	bool has_md5;        // md5sum holds the digest of the whole zip
+	twrpDigest md5sum;
+	int begin_ret;       // verify_begin() result
+	int end_ret;         // verify_end() result
+	bool binary_ready;   // update-binary extracted to LOOKAHEAD_BINARY
+	bool done;           // finished without being cancelled
+	TWAtomicInt cancel;
+};
+
+// Extracts the update-binary of Zip to Temp_Binary. On failure the reason,
+// if there is one worth showing, is left in error.
+static int Extract_Update_Binary(ZipArchive *Zip, const string& Temp_Binary, string& error) {
 	const ZipEntry* binary_location = mzFindZipEntry(Zip, ASSUMED_UPDATE_BINARY_NAME);
-	string Temp_Binary = "/tmp/updater";
-	int binary_fd, ret_val, pipe_fd[2], status, zip_verify;
-	char buffer[1024];
-	const char** args = (const char**)malloc(sizeof(char*) * 5);
-	FILE* child_data;
+	int binary_fd;
+	bool extracted;
 
-	if (binary_location == NULL) {
-		mzCloseZipArchive(Zip);
+	if (binary_location == NULL)
 		return INSTALL_CORRUPT;
-	}
 
 	// Delete any existing updater
 	if (TWFunc::Path_Exists(Temp_Binary) && unlink(Temp_Binary.c_str()) != 0) {
@@ -112,19 +136,173 @@ static int Run_Update_Binary(const char *path, ZipArchive *Zip, int* wipe_cache)
 
 	binary_fd = creat(Temp_Binary.c_str(), 0755);
 	if (binary_fd < 0) {
-		mzCloseZipArchive(Zip);
-		LOGERR("Could not create file for updater extract in '%s'\n", Temp_Binary.c_str());
+		error = "Could not create file for updater extract in '" + Temp_Binary + "'";
 		return INSTALL_ERROR;
 	}
 
-	ret_val = mzExtractZipEntryToFile(Zip, binary_location, binary_fd);
+	extracted = mzExtractZipEntryToFile(Zip, binary_location, binary_fd);
 	close(binary_fd);
 
-	if (!ret_val) {
-		mzCloseZipArchive(Zip);
-		LOGERR("Could not extract '%s'\n", ASSUMED_UPDATE_BINARY_NAME);
+	if (!extracted) {
+		error = "Could not extract '" ASSUMED_UPDATE_BINARY_NAME "'";
 		return INSTALL_ERROR;
 	}
+	return INSTALL_SUCCESS;
+}
+
+// Tell an updater built from this tree where to find the package, still
+// open, and the central directory already parsed here (see OpenPackage()
+// in updater/updater.c). Other update-binaries just inherit two more fds.
+#define PACKAGE_FD_ENV "UPDATER_PACKAGE_FD"
+#define PACKAGE_DIRECTORY_FD_ENV "UPDATER_PACKAGE_DIRECTORY_FD"
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+
+// Writes the parsed central directory of Zip to an unnamed file for the
+// updater, in memory where the kernel has memfd_create. Returns its fd,
+// or -1 if the updater has to parse the zip itself.
+static int Write_Zip_Directory(ZipArchive *Zip) {
+	int fd = -1;
+
+#ifdef __NR_memfd_create
+	fd = syscall(__NR_memfd_create, "zip-directory", MFD_CLOEXEC);
+#endif
+	if (fd < 0) {
+		char name[] = "/tmp/zip-directory.XXXXXX";
+		fd = mkstemp(name);
+		if (fd < 0)
+			return -1;
+		unlink(name);
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+	}
+	if (mzWriteZipDirectory(Zip, fd) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// What the updater has told us so far. set_progress is applied once for
+// every read from the pipe, as each one redraws the progress bar and the
+// updater may send a lot of them.
+struct Updater_Output {
+	int* wipe_cache;
+	int zip_verify;
+	bool progress_pending;
+	float progress;
+};
+
+static void Flush_Progress(Updater_Output* out) {
+	if (out->progress_pending) {
+		DataManager::SetProgress(out->progress);
+		out->progress_pending = false;
+	}
+}
+
+static void Handle_Updater_Command(char* line, Updater_Output* out) {
+	char* save;
+	char* command = strtok_r(line, " \n", &save);
+	if (command == NULL) {
+		return;
+	} else if (strcmp(command, "progress") == 0) {
+		char* fraction_char = strtok_r(NULL, " \n", &save);
+		char* seconds_char = strtok_r(NULL, " \n", &save);
+
+		float fraction_float = strtof(fraction_char, NULL);
+		int seconds_float = strtol(seconds_char, NULL, 10);
+
+		// set_progress is relative to the section that this starts
+		Flush_Progress(out);
+		if (out->zip_verify)
+			DataManager::ShowProgress(fraction_float * (1 - VERIFICATION_PROGRESS_FRACTION), seconds_float);
+		else
+			DataManager::ShowProgress(fraction_float, seconds_float);
+	} else if (strcmp(command, "set_progress") == 0) {
+		char* fraction_char = strtok_r(NULL, " \n", &save);
+		out->progress = strtof(fraction_char, NULL);
+		out->progress_pending = true;
+	} else if (strcmp(command, "ui_print") == 0) {
+		char* display_value = strtok_r(NULL, "\n", &save);
+		if (display_value) {
+			gui_print("%s", display_value);
+		} else {
+			gui_print("\n");
+		}
+	} else if (strcmp(command, "wipe_cache") == 0) {
+		*out->wipe_cache = 1;
+	} else if (strcmp(command, "clear_display") == 0) {
+		// Do nothing, not supported by TWRP
+	} else {
+		LOGERR("unknown command [%s]\n", command);
+	}
+}
+
+// Handles the updater's commands until it closes the pipe
+static void Read_Updater_Output(int fd, Updater_Output* out) {
+	char buffer[4096];
+	size_t used = 0;
+
+	for (;;) {
+		ssize_t len = read(fd, buffer + used, sizeof(buffer) - 1 - used);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len <= 0)
+			break;
+		used += len;
+
+		char* line = buffer;
+		char* end;
+		while ((end = (char*)memchr(line, '\n', buffer + used - line)) != NULL) {
+			*end = '\0';
+			Handle_Updater_Command(line, out);
+			line = end + 1;
+		}
+		used -= line - buffer;
+		if (used == sizeof(buffer) - 1) {
+			// No end of line in sight; take what there is as a line
+			buffer[used] = '\0';
+			Handle_Updater_Command(buffer, out);
+			used = 0;
+		} else {
+			memmove(buffer, line, used);
+		}
+		Flush_Progress(out);
+	}
+	if (used > 0) {
+		buffer[used] = '\0';
+		Handle_Updater_Command(buffer, out);
+	}
+	Flush_Progress(out);
+}
+
+static int Run_Update_Binary(const char *path, ZipArchive *Zip, int package_fd, int* wipe_cache, TWInstallPrep* prep, TWInstallQueue* queue) {
+	string Temp_Binary = "/tmp/updater";
+	int ret_val, pipe_fd[2], status, zip_verify, directory_fd;
+	const char** args = (const char**)malloc(sizeof(char*) * 5);
+	bool have_binary = false;
+
+	if (prep != NULL && prep->binary_ready) {
+		// Already extracted by the look-ahead, while the previous zip installed
+		prep->binary_ready = false;
+		if (rename(LOOKAHEAD_BINARY, Temp_Binary.c_str()) == 0)
+			have_binary = true;
+		else
+			unlink(LOOKAHEAD_BINARY);
+	}
+	if (!have_binary) {
+		string error;
+		ret_val = Extract_Update_Binary(Zip, Temp_Binary, error);
+		if (ret_val != INSTALL_SUCCESS) {
+			mzCloseZipArchive(Zip);
+			if (!error.empty())
+				LOGERR("%s\n", error.c_str());
+			return ret_val;
+		}
+	}
+
+	directory_fd = Write_Zip_Directory(Zip);
 
 	// If exists, extract file_contexts from the zip file
 	const ZipEntry* selinx_contexts = mzFindZipEntry(Zip, "file_contexts");
@@ -142,6 +320,8 @@ static int Run_Update_Binary(const char *path, ZipArchive *Zip, int* wipe_cache)
 		int file_contexts_fd = creat(output_filename.c_str(), 0644);
 		if (file_contexts_fd < 0) {
 			mzCloseZipArchive(Zip);
+			if (directory_fd >= 0)
+				close(directory_fd);
 			LOGERR("Could not extract file_contexts to '%s'\n", output_filename.c_str());
 			return INSTALL_ERROR;
 		}
@@ -151,6 +331,8 @@ static int Run_Update_Binary(const char *path, ZipArchive *Zip, int* wipe_cache)
 
 		if (!ret_val) {
 			mzCloseZipArchive(Zip);
+			if (directory_fd >= 0)
+				close(directory_fd);
 			LOGERR("Could not extract '%s'\n", ASSUMED_UPDATE_BINARY_NAME);
 			return INSTALL_ERROR;
 		}
@@ -176,54 +358,51 @@ static int Run_Update_Binary(const char *path, ZipArchive *Zip, int* wipe_cache)
 	args[3] = (char*)path;
 	args[4] = NULL;
 
+	// The environment is put together before the fork; the child only
+	// makes the two fds inheritable
+	vector<string> handoff;
+	if (directory_fd >= 0) {
+		if (package_fd >= 0)
+			handoff.push_back(PACKAGE_FD_ENV "=" + TWFunc::to_string(package_fd));
+		handoff.push_back(PACKAGE_DIRECTORY_FD_ENV "=" + TWFunc::to_string(directory_fd));
+	}
+	vector<char*> envp;
+	for (char** env = environ; *env != NULL; env++)
+		envp.push_back(*env);
+	for (size_t i = 0; i < handoff.size(); i++)
+		envp.push_back((char*)handoff[i].c_str());
+	envp.push_back(NULL);
+
 	pid_t pid = fork();
 	if (pid == 0) {
 		close(pipe_fd[0]);
-		execve(Temp_Binary.c_str(), (char* const*)args, environ);
+		if (directory_fd >= 0) {
+			if (package_fd >= 0)
+				fcntl(package_fd, F_SETFD, 0);
+			fcntl(directory_fd, F_SETFD, 0);
+		}
+		execve(Temp_Binary.c_str(), (char* const*)args, &envp[0]);
 		printf("E:Can't execute '%s'\n", Temp_Binary.c_str());
 		_exit(-1);
 	}
 	close(pipe_fd[1]);
+	if (directory_fd >= 0)
+		close(directory_fd);
+
+	// The updater may run for minutes; get the next queued zip ready meanwhile
+	if (queue != NULL)
+		queue->Start_Lookahead();
 
 	*wipe_cache = 0;
 
 	DataManager::GetValue(TW_SIGNED_ZIP_VERIFY_VAR, zip_verify);
-	child_data = fdopen(pipe_fd[0], "r");
-	while (fgets(buffer, sizeof(buffer), child_data) != NULL) {
-		char* command = strtok(buffer, " \n");
-		if (command == NULL) {
-			continue;
-		} else if (strcmp(command, "progress") == 0) {
-			char* fraction_char = strtok(NULL, " \n");
-			char* seconds_char = strtok(NULL, " \n");
-
-			float fraction_float = strtof(fraction_char, NULL);
-			int seconds_float = strtol(seconds_char, NULL, 10);
-
-			if (zip_verify)
-				DataManager::ShowProgress(fraction_float * (1 - VERIFICATION_PROGRESS_FRACTION), seconds_float);
-			else
-				DataManager::ShowProgress(fraction_float, seconds_float);
-		} else if (strcmp(command, "set_progress") == 0) {
-			char* fraction_char = strtok(NULL, " \n");
-			float fraction_float = strtof(fraction_char, NULL);
-			DataManager::SetProgress(fraction_float);
-		} else if (strcmp(command, "ui_print") == 0) {
-			char* display_value = strtok(NULL, "\n");
-			if (display_value) {
-				gui_print("%s", display_value);
-			} else {
-				gui_print("\n");
-			}
-		} else if (strcmp(command, "wipe_cache") == 0) {
-			*wipe_cache = 1;
-		} else if (strcmp(command, "clear_display") == 0) {
-			// Do nothing, not supported by TWRP
-		} else {
-			LOGERR("unknown command [%s]\n", command);
-		}
-	}
-	fclose(child_data);
+	Updater_Output output;
+	output.wipe_cache = wipe_cache;
+	output.zip_verify = zip_verify;
+	output.progress_pending = false;
+	output.progress = 0;
+	Read_Updater_Output(pipe_fd[0], &output);
+	close(pipe_fd[0]);
 
 	waitpid(pid, &status, 0);
 
@@ -246,45 +425,227 @@ static int Run_Update_Binary(const char *path, ZipArchive *Zip, int* wipe_cache)
 	return INSTALL_SUCCESS;
 }
 
-extern "C" int TWinstall_zip(const char* path, int* wipe_cache) {
-	int ret_val, zip_verify = 1, md5_return, key_count;
-	twrpDigest md5sum;
+// The package is hashed in steps of INGEST_CHUNK_SIZE, with the kernel
+// asked to read INGEST_READAHEAD ahead of the hashing
+#define INGEST_CHUNK_SIZE (1024 * 1024)
+#define INGEST_READAHEAD (8 * 1024 * 1024)
+
+// Reads the mapped package once from start to end and feeds every check
+// that needs the whole of it (the MD5 and the signature hashes) from the
+// same pass, instead of reading a multi GB zip once per check. The
+// mapping stays warm for minzip afterwards. Returns false if cancel was set
+// before the end was reached.
+static bool Ingest_Package(MemMapping* map, twrpDigest* md5sum, VerifyContext* verify, bool show_progress, TWAtomicInt* cancel) {
+	unsigned char* addr = map->addr;
+	size_t length = map->length;
+	size_t advised = 0;
+	float frac = 0;
+
+	madvise(addr, length, MADV_SEQUENTIAL);
+	if (md5sum)
+		md5sum->startMD5();
+	for (size_t pos = 0; pos < length; ) {
+		if (cancel != NULL && cancel->get_value()) {
+			madvise(addr, length, MADV_NORMAL);
+			return false;
+		}
+		while (advised < length && advised < pos + INGEST_READAHEAD) {
+			size_t count = length - advised;
+			if (count > INGEST_READAHEAD)
+				count = INGEST_READAHEAD;
+			madvise(addr + advised, count, MADV_WILLNEED);
+			advised += count;
+		}
+		size_t count = length - pos;
+		if (count > INGEST_CHUNK_SIZE)
+			count = INGEST_CHUNK_SIZE;
+		if (md5sum)
+			md5sum->updateMD5(addr + pos, count);
+		if (verify)
+			verify_update(verify, addr + pos, count);
+		pos += count;
+		if (show_progress && verify && (float)pos / length > frac + 0.02) {
+			frac = (float)pos / length;
+			DataManager::SetProgress(frac * VERIFICATION_PROGRESS_FRACTION);
+		}
+	}
+	if (md5sum)
+		md5sum->finishMD5();
+	// minzip jumps around the central directory and the entries from here on
+	madvise(addr, length, MADV_NORMAL);
+	return true;
+}
+
+static bool Has_MD5_File(const string& path) {
+	return TWFunc::Path_Exists(path + ".md5") || TWFunc::Path_Exists(path + ".md5sum");
+}
+
+// Any write to the zip after the look-ahead moves its ctime on, which can't
+// be set back from user space, and replacing it changes the inode
+static bool Same_Stat(const struct stat& st, const struct stat& prev) {
+	return st.st_dev == prev.st_dev && st.st_ino == prev.st_ino &&
+		st.st_size == prev.st_size &&
+		st.st_mtim.tv_sec == prev.st_mtim.tv_sec && st.st_mtim.tv_nsec == prev.st_mtim.tv_nsec &&
+		st.st_ctim.tv_sec == prev.st_ctim.tv_sec && st.st_ctim.tv_nsec == prev.st_ctim.tv_nsec;
+}
+
+static bool Same_File(const TWInstallPrep* prep) {
+	struct stat st;
+
+	return stat(prep->path.c_str(), &st) == 0 && Same_Stat(st, prep->st);
+}
+
+// The slow part of installing a zip, done ahead of time for a queued zip:
+// hash it for the MD5 and signature checks and extract its update-binary.
+// Runs next to a running updater, so it leaves the screen and the progress
+// bar alone, and it does not keep the zip open once done so it does not get
+// in the way of the updater unmounting things.
+static void Prepare_Package(TWInstallPrep* prep) {
+	const char* path = prep->path.c_str();
+	MemMapping map;
+	VerifyContext verify;
+	ZipArchive Zip;
+	twrpDigest* md5sum = NULL;
+
+	// stat what gets mapped, so the install can tell it is the same file
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &prep->st) != 0 || sysMapFd(fd, &map) != 0) {
+		LOGINFO("Install look-ahead could not open '%s'\n", path);
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+	close(fd);
+	if (prep->zip_verify) {
+		prep->begin_ret = verify_begin(&verify, map.addr, map.length);
+		if (prep->begin_ret != VERIFY_SUCCESS) {
+			// The install stops at this point too, nothing else is needed
+			sysReleaseMap(&map);
+			prep->done = true;
+			return;
+		}
+	}
+	if (Has_MD5_File(prep->path))
+		md5sum = &prep->md5sum;
+	if (!Ingest_Package(&map, md5sum, prep->zip_verify ? &verify : NULL, false, &prep->cancel)) {
+		if (prep->zip_verify)
+			verify_end(&verify, map.addr, map.length);
+		sysReleaseMap(&map);
+		return;
+	}
+	prep->has_md5 = md5sum != NULL;
+	if (prep->zip_verify)
+		prep->end_ret = verify_end(&verify, map.addr, map.length);
+
+	if ((!prep->zip_verify || prep->end_ret == VERIFY_SUCCESS) && !prep->cancel.get_value()) {
+		if (mzOpenZipArchive(map.addr, map.length, &Zip) == 0) {
+			string error;
+			prep->binary_ready = Extract_Update_Binary(&Zip, LOOKAHEAD_BINARY, error) == INSTALL_SUCCESS;
+			mzCloseZipArchive(&Zip);
+		}
+	}
+	sysReleaseMap(&map);
+	prep->done = !prep->cancel.get_value();
+}
+
+static void Release_Package(MemMapping* map, int package_fd) {
+	sysReleaseMap(map);
+	if (package_fd >= 0)
+		close(package_fd);
+}
+
+// Installs path, using what the look-ahead prepared for it if prep is set.
+// queue, if set, gets to look ahead at its next zip once the updater runs.
+static int Install_Package(const char* path, int* wipe_cache, TWInstallPrep* prep, TWInstallQueue* queue) {
+	int ret_val, zip_verify = 1, md5_return = -1;
+	twrpDigest local_md5sum;
+	twrpDigest* md5sum = &local_md5sum;
 	string strpath = path;
 	ZipArchive Zip;
+	VerifyContext verify;
+	bool prepared = false;
 
 	if (strcmp(path, "error") == 0) {
 		LOGERR("Failed to get adb sideload file: '%s'\n", path);
 		return INSTALL_CORRUPT;
 	}
 
+#ifndef TW_OEM_BUILD
+	DataManager::GetValue(TW_SIGNED_ZIP_VERIFY_VAR, zip_verify);
+#endif
+	if (prep != NULL && prep->done && prep->zip_verify == zip_verify && Same_File(prep)) {
+		prepared = true;
+		md5sum = &prep->md5sum;
+	}
+
 	gui_print("Installing '%s'...\n", path);
 	if (strlen(path) < 9 || strncmp(path, "/sideload", 9) != 0) {
 		gui_print("Checking for MD5 file...\n");
-		md5sum.setfn(strpath);
-		md5_return = md5sum.verify_md5digest();
-		if (md5_return == -2) { // md5 did not match
-			LOGERR("Aborting zip install\n");
-			return INSTALL_CORRUPT;
-		}
+		md5sum->setfn(strpath);
+		md5_return = md5sum->read_md5digest();
 	}
+	// An MD5 file that showed up after the look-ahead still needs hashing
+	if (prepared && md5_return == 0 && !prep->has_md5 &&
+			(!zip_verify || prep->begin_ret == VERIFY_SUCCESS))
+		prepared = false;
 
-#ifndef TW_OEM_BUILD
-	DataManager::GetValue(TW_SIGNED_ZIP_VERIFY_VAR, zip_verify);
-#endif
 	DataManager::SetProgress(0);
 
+	// The package stays open for the updater, which then maps the very file
+	// that was verified. Block maps (a path starting with '@') are mapped by
+	// name.
 	MemMapping map;
-	if (sysMapFile(path, &map) != 0) {
+	int package_fd = -1;
+	if (path[0] != '@')
+		package_fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (package_fd >= 0 ? sysMapFd(package_fd, &map) != 0 : sysMapFile(path, &map) != 0) {
 		LOGERR("Failed to sysMapFile '%s'\n", path);
-        return -1;
-    }
+		if (package_fd >= 0)
+			close(package_fd);
+		return -1;
+	}
+	if (prepared) {
+		// The path was checked before it was opened, so check the file
+		// that was mapped too
+		struct stat st;
+		if (package_fd < 0 || fstat(package_fd, &st) != 0 || !Same_Stat(st, prep->st)) {
+			LOGINFO("'%s' changed since the install look-ahead, checking it again\n", path);
+			prepared = false;
+		}
+	}
 
 	if (zip_verify) {
 		gui_print("Verifying zip signature...\n");
-		ret_val = verify_file(map.addr, map.length);
+		if (prepared)
+			ret_val = prep->begin_ret;
+		else
+			ret_val = verify_begin(&verify, map.addr, map.length);
 		if (ret_val != VERIFY_SUCCESS) {
 			LOGERR("Zip signature verification failed: %i\n", ret_val);
-			sysReleaseMap(&map);
+			Release_Package(&map, package_fd);
+			return -1;
+		}
+	}
+	if (prepared && zip_verify)
+		DataManager::SetProgress(VERIFICATION_PROGRESS_FRACTION);
+	else if (md5_return == 0 || zip_verify)
+		Ingest_Package(&map, md5_return == 0 ? md5sum : NULL, zip_verify ? &verify : NULL, true, NULL);
+
+	if (md5_return == 0 && md5sum->compare_md5digest() == -2) { // md5 did not match
+		LOGERR("Aborting zip install\n");
+		if (zip_verify && !prepared)
+			verify_end(&verify, map.addr, map.length);
+		Release_Package(&map, package_fd);
+		return INSTALL_CORRUPT;
+	}
+	if (zip_verify) {
+		if (prepared)
+			ret_val = prep->end_ret;
+		else
+			ret_val = verify_end(&verify, map.addr, map.length);
+		if (ret_val != VERIFY_SUCCESS) {
+			LOGERR("Zip signature verification failed: %i\n", ret_val);
+			Release_Package(&map, package_fd);
 			return -1;
 		} else {
 			gui_print("Zip signature verified successfully.\n");
@@ -293,10 +654,101 @@ extern "C" int TWinstall_zip(const char* path, int* wipe_cache) {
 	ret_val = mzOpenZipArchive(map.addr, map.length, &Zip);
 	if (ret_val != 0) {
 		LOGERR("Zip file is corrupt!\n", path);
-		sysReleaseMap(&map);
+		Release_Package(&map, package_fd);
 		return INSTALL_CORRUPT;
 	}
-	ret_val = Run_Update_Binary(path, &Zip, wipe_cache);
-	sysReleaseMap(&map);
+	ret_val = Run_Update_Binary(path, &Zip, package_fd, wipe_cache, prepared ? prep : NULL, queue);
+	Release_Package(&map, package_fd);
+	return ret_val;
+}
+
+extern "C" int TWinstall_zip(const char* path, int* wipe_cache) {
+	return Install_Package(path, wipe_cache, NULL, NULL);
+}
+
+TWInstallQueue::TWInstallQueue() {
+	prep = NULL;
+	thread_running = false;
+}
+
+TWInstallQueue::~TWInstallQueue() {
+	Cancel();
+}
+
+void TWInstallQueue::Set_Next(const string& path) {
+	next_path = path;
+}
+
+void TWInstallQueue::Start_Lookahead() {
+	if (next_path.empty() || prep != NULL)
+		return;
+	if (next_path == "error" || strncmp(next_path.c_str(), "/sideload", 9) == 0)
+		return;
+	// The running zip may unmount or format any partition of the device
+	// (/data for a zip on /data/media), which fails with EBUSY while the
+	// look-ahead has the next zip open. Only removable storage and paths
+	// off the partitions, like /tmp, are left alone.
+	TWPartition* Part = PartitionManager.Find_Partition_By_Path(next_path);
+	if (Part != NULL && !Part->IsRemovable()) {
+		LOGINFO("Not preparing '%s' ahead, it is on %s\n", next_path.c_str(), Part->Mount_Point.c_str());
+		return;
+	}
+
+	prep = new TWInstallPrep(next_path);
+#ifndef TW_OEM_BUILD
+	DataManager::GetValue(TW_SIGNED_ZIP_VERIFY_VAR, prep->zip_verify);
+#endif
+	if (pthread_create(&thread, NULL, Lookahead_Thread, prep) != 0) {
+		LOGINFO("Unable to start install look-ahead for '%s'\n", next_path.c_str());
+		delete prep;
+		prep = NULL;
+		return;
+	}
+	thread_running = true;
+	LOGINFO("Preparing '%s' while the current zip installs\n", next_path.c_str());
+}
+
+void* TWInstallQueue::Lookahead_Thread(void* cookie) {
+	Prepare_Package((TWInstallPrep*)cookie);
+	return NULL;
+}
+
+void TWInstallQueue::Cancel() {
+	if (prep == NULL)
+		return;
+	prep->cancel.set_value(1);
+	if (thread_running) {
+		pthread_join(thread, NULL);
+		thread_running = false;
+	}
+	if (prep->binary_ready)
+		unlink(LOOKAHEAD_BINARY);
+	delete prep;
+	prep = NULL;
+}
+
+int TWInstallQueue::Install(const string& path, int* wipe_cache) {
+	TWInstallPrep* ready;
+	int ret_val;
+
+	if (prep != NULL && prep->path != path)
+		Cancel();
+	if (thread_running) {
+		// Usually long done; if not, the rest of its work is needed now anyway
+		pthread_join(thread, NULL);
+		thread_running = false;
+	}
+	// The install may start the look-ahead for the zip after this one
+	ready = prep;
+	prep = NULL;
+
+	ret_val = Install_Package(path.c_str(), wipe_cache, ready, this);
+
+	if (ready != NULL) {
+		// Only still set if the install stopped before its updater ran
+		if (ready->binary_ready)
+			unlink(LOOKAHEAD_BINARY);
+		delete ready;
+	}
 	return ret_val;
 }
@@ -9,6 +9,36 @@ int TWinstall_zip(const char* path, int* wipe_cache);
 
 #ifdef __cplusplus
 }
+
+#include <pthread.h>
+#include <string>
+
+struct TWInstallPrep;
+
+// Installs a queue of zips one after another. While the updater of one zip
+// runs, the next zip in the queue is checked (MD5 and signature) and its
+// update-binary extracted on a background thread, so that work is already
+// done when its turn comes. Only zips on removable storage or in /tmp are
+// looked ahead at, the updater may unmount the others. The look-ahead is
+// dropped if an install fails.
+class TWInstallQueue
+{
+public:
+	TWInstallQueue();
+	~TWInstallQueue();                                       // Cancels any look-ahead still running
+	void Set_Next(const std::string& path);                  // Zip to look ahead at during the next Install, "" for none
+	int Install(const std::string& path, int* wipe_cache);   // Installs path, same results as TWinstall_zip
+	void Cancel();                                           // Stops the look-ahead and drops what it prepared
+	void Start_Lookahead();                                  // Called by the installer once the updater is running
+
+private:
+	static void* Lookahead_Thread(void* cookie);
+
+	std::string next_path;
+	TWInstallPrep* prep;
+	pthread_t thread;
+	bool thread_running;
+};
 #endif
 
 #endif  // RECOVERY_TWINSTALL_H_
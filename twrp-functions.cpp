@@ -539,6 +539,9 @@ void TWFunc::Update_Intent_File(string Intent) {
 // reboot: Reboot the system. Return -1 on error, no return on success
 int TWFunc::tw_reboot(RebootCommand command)
 {
+	// Write out any settings still waiting on the save thread
+	DataManager::Flush();
+
 	// Always force a sync before we reboot
 	sync();
 	Update_Log_File();
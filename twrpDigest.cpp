@@ -49,23 +49,33 @@ void twrpDigest::setfn(string fn) {
 }
 
 int twrpDigest::computeMD5(void) {
-	string line;
-	struct MD5Context md5c;
 	FILE *file;
 	int len;
 	unsigned char buf[1024];
-	MD5Init(&md5c);
+	startMD5();
 	file = fopen(md5fn.c_str(), "rb");
 	if (file == NULL)
 		return -1;
 	while ((len = fread(buf, 1, sizeof(buf), file)) > 0) {
-		MD5Update(&md5c, buf, len);
+		updateMD5(buf, len);
 	}
 	fclose(file);
-	MD5Final(md5sum, &md5c);
+	finishMD5();
 	return 0;
 }
 
+void twrpDigest::startMD5(void) {
+	MD5Init(&md5c);
+}
+
+void twrpDigest::updateMD5(const unsigned char* buf, size_t len) {
+	MD5Update(&md5c, buf, len);
+}
+
+void twrpDigest::finishMD5(void) {
+	MD5Final(md5sum, &md5c);
+}
+
 int twrpDigest::write_md5digest(void) {
 	int i;
 	string md5string, md5file;
@@ -121,19 +131,29 @@ int twrpDigest::read_md5digest(void) {
 */
 
 int twrpDigest::verify_md5digest(void) {
-	string buf;
-	char hex[3];
-	int i, ret;
-	string md5string;
+	int ret;
 
 	ret = read_md5digest();
 	if (ret != 0)
 		return ret;
+	computeMD5();
+	return compare_md5digest();
+}
+
+int twrpDigest::compare_md5digest(void) {
+	string buf;
+	char hex[3];
+	int i;
+	string md5string;
+
 	stringstream ss(line);
 	vector<string> tokens;
 	while (ss >> buf)
 		tokens.push_back(buf);
-	computeMD5();
+	if (tokens.empty()) {
+		gui_print("Skipping MD5 check: MD5 file unreadable\n");
+		return 1;
+	}
 	for (i = 0; i < 16; ++i) {
 		snprintf(hex, 3, "%02x", md5sum[i]);
 		md5string += hex;
@@ -30,9 +30,19 @@ public:
 	int verify_md5digest(void);
 	int write_md5digest(void);
 
-private:
+	// Streaming use, for callers that already read the file for other
+	// reasons: read_md5digest() first, feed the whole file through
+	// updateMD5() after startMD5(), then finishMD5() and
+	// compare_md5digest(), which returns the verify_md5digest() codes.
 	int read_md5digest(void);
+	void startMD5(void);
+	void updateMD5(const unsigned char* buf, size_t len);
+	void finishMD5(void);
+	int compare_md5digest(void);
+
+private:
 	string md5fn;
 	string line;
+	struct MD5Context md5c;
 	unsigned char md5sum[MD5LENGTH];
 };
@@ -15,14 +15,17 @@
  */
 
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/ioctl.h>
@@ -33,6 +36,7 @@
 #include "edify/expr.h"
 #include "mincrypt/sha.h"
 #include "minzip/DirUtil.h"
+#include "mmcutils/zero_range.h"
 #include "updater.h"
 
 #define BLOCKSIZE 4096
@@ -42,10 +46,6 @@
 // erase to mean fill the region with zeroes.
 #define DEBUG_ERASE  0
 
-#ifndef BLKDISCARD
-#define BLKDISCARD _IO(0x12,119)
-#endif
-
 char* PrintSha1(const uint8_t* digest);
 
 typedef struct {
@@ -93,6 +93,24 @@ static void readblock(int fd, uint8_t* data, size_t size) {
     }
 }
 
+// Like readblock(), but reads at an offset without moving the file
+// position, so it can run while the writer seeks and writes.
+static void readblock_at(int fd, uint8_t* data, size_t size, off64_t offset) {
+    size_t so_far = 0;
+    while (so_far < size) {
+        ssize_t r = pread64(fd, data+so_far, size-so_far, offset+so_far);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "read failed: %s\n", strerror(errno));
+            return;
+        } else if (r == 0) {
+            fprintf(stderr, "read failed: unexpected end of file\n");
+            return;
+        }
+        so_far += r;
+    }
+}
+
 static void writeblock(int fd, const uint8_t* data, size_t size) {
     size_t written = 0;
     while (written < size) {
@@ -120,20 +138,6 @@ static void check_lseek(int fd, off64_t offset, int whence) {
     }
 }
 
-static void allocate(size_t size, uint8_t** buffer, size_t* buffer_alloc) {
-    // if the buffer's big enough, reuse it.
-    if (size <= *buffer_alloc) return;
-
-    free(*buffer);
-
-    *buffer = (uint8_t*) malloc(size);
-    if (*buffer == NULL) {
-        fprintf(stderr, "failed to allocate %zu bytes\n", size);
-        exit(1);
-    }
-    *buffer_alloc = size;
-}
-
 typedef struct {
     int fd;
     RangeSet* tgt;
@@ -197,10 +201,14 @@ static ssize_t RangeSinkWrite(const uint8_t* data, ssize_t size, void* token) {
 // written, it sets rss to the destination location and signals the
 // condition.  When the background thread is done writing, it clears
 // rss and signals the condition again.
+//
+// When an interrupted update is resumed, the new data that the
+// transfers already on disk used is skipped.
 
 typedef struct {
     ZipArchive* za;
     const ZipEntry* entry;
+    size_t skip;
 
     RangeSinkState* rss;
 
@@ -211,6 +219,13 @@ typedef struct {
 static bool receive_new_data(const unsigned char* data, int size, void* cookie) {
     NewThreadInfo* nti = (NewThreadInfo*) cookie;
 
+    if (nti->skip > 0) {
+        size_t skip = (size_t)size < nti->skip ? (size_t)size : nti->skip;
+        data += skip;
+        size -= skip;
+        nti->skip -= skip;
+    }
+
     while (size > 0) {
         // Wait for nti->rss to be non-NULL, indicating some of this
         // data is wanted.
@@ -245,40 +260,77 @@ static void* unzip_new_data(void* cookie) {
     return NULL;
 }
 
-// Do a source/target load for move/bsdiff/imgdiff in version 1.
+// Transfer list commands, once parsed.  The whole list is parsed
+// before anything is executed so that BlockImageUpdateFn() can look
+// ahead at what upcoming commands read.
+
+typedef enum {
+    TRANSFER_MOVE,
+    TRANSFER_BSDIFF,
+    TRANSFER_IMGDIFF,
+    TRANSFER_STASH,
+    TRANSFER_ZERO,
+    TRANSFER_NEW,
+    TRANSFER_ERASE,
+    TRANSFER_UNKNOWN,           // stops the update when its turn comes
+} TransferType;
+
+typedef struct {
+    int stash_id;
+    RangeSet* locs;             // where the stashed data goes in the source
+    int producer;               // index of the stash command that filled it
+} StashRef;
+
+typedef struct {
+    TransferType type;
+    char* style;                // as named in the transfer list
+    RangeSet* tgt;              // blocks written (NULL for stash)
+    RangeSet* src;              // blocks read from the image, or NULL
+    RangeSet* src_locs;         // version 2: where src goes in the source
+    StashRef* stashes;          // version 2: stashes merged into the source
+    int stash_count;
+    int src_blocks;
+    int stash_id;               // stash: slot filled
+    size_t patch_offset;
+    size_t patch_len;
+
+    // Index of the last earlier transfer that writes any block this
+    // one reads, or -1.  Its sources can't be read before that one is
+    // on disk.
+    int depends_on;
+
+    // Set as the transfer goes through the pipeline.
+    uint8_t* data;              // the source, then the patched result
+    size_t data_len;            // bytes of result in data
+    size_t mem;                 // bytes counted against the read-ahead
+    bool patched;
+    bool overrun;               // the patch made more than tgt can hold
+    bool spilled;               // the result is saved in the checkpoint
+} Transfer;
+
+static bool IsPatch(const Transfer* t) {
+    return t->type == TRANSFER_BSDIFF || t->type == TRANSFER_IMGDIFF;
+}
+
+// Parse a source/target for move/bsdiff/imgdiff in version 1.
 // 'wordsave' is the save_ptr of a strtok_r()-in-progress.  We expect
 // to parse the remainder of the string as:
 //
 //    <src_range> <tgt_range>
 //
-// The source range is loaded into the provided buffer, reallocating
-// it to make it larger if necessary.  The target ranges are returned
-// in *tgt, if tgt is non-NULL.
+// The target range is left out for stash, which only loads a source.
 
-static void LoadSrcTgtVersion1(char* wordsave, RangeSet** tgt, int* src_blocks,
-                               uint8_t** buffer, size_t* buffer_alloc, int fd) {
+static void ParseSrcTgtVersion1(char* wordsave, Transfer* t, bool want_tgt) {
     char* word;
 
     word = strtok_r(NULL, " ", &wordsave);
-    RangeSet* src = parse_range(word);
+    t->src = parse_range(word);
+    t->src_blocks = t->src->size;
 
-    if (tgt != NULL) {
+    if (want_tgt) {
         word = strtok_r(NULL, " ", &wordsave);
-        *tgt = parse_range(word);
+        t->tgt = parse_range(word);
     }
-
-    allocate(src->size * BLOCKSIZE, buffer, buffer_alloc);
-    size_t p = 0;
-    int i;
-    for (i = 0; i < src->count; ++i) {
-        check_lseek(fd, (off64_t)src->pos[i*2] * BLOCKSIZE, SEEK_SET);
-        size_t sz = (src->pos[i*2+1] - src->pos[i*2]) * BLOCKSIZE;
-        readblock(fd, *buffer+p, sz);
-        p += sz;
-    }
-
-    *src_blocks = src->size;
-    free(src);
 }
 
 static void MoveRange(uint8_t* dest, RangeSet* locs, const uint8_t* source) {
@@ -296,7 +348,7 @@ static void MoveRange(uint8_t* dest, RangeSet* locs, const uint8_t* source) {
     }
 }
 
-// Do a source/target load for move/bsdiff/imgdiff in version 2.
+// Parse a source/target for move/bsdiff/imgdiff in version 2.
 // 'wordsave' is the save_ptr of a strtok_r()-in-progress.  We expect
 // to parse the remainder of the string as one of:
 //
@@ -309,42 +361,24 @@ static void MoveRange(uint8_t* dest, RangeSet* locs, const uint8_t* source) {
 //    <tgt_range> <src_block_count> <src_range> <src_loc> <[stash_id:stash_range] ...>
 //        (loads data from both source image and stashes)
 //
-// On return, buffer is filled with the loaded source data (rearranged
-// and combined with stashed data as necessary).  buffer may be
-// reallocated if needed to accommodate the source data.  *tgt is the
-// target RangeSet.  Any stashes required are taken from stash_table
-// and free()'d after being used.
-
-static void LoadSrcTgtVersion2(char* wordsave, RangeSet** tgt, int* src_blocks,
-                               uint8_t** buffer, size_t* buffer_alloc, int fd,
-                               uint8_t** stash_table) {
-    char* word;
+// LoadTransfer() later fills the source buffer from these: the source
+// ranges are read and rearranged according to src_loc, then the
+// stashed data is moved in and the stashes are freed.
 
-    if (tgt != NULL) {
-        word = strtok_r(NULL, " ", &wordsave);
-        *tgt = parse_range(word);
-    }
+static void ParseSrcTgtVersion2(char* wordsave, Transfer* t) {
+    char* word;
 
     word = strtok_r(NULL, " ", &wordsave);
-    *src_blocks = strtol(word, NULL, 0);
+    t->tgt = parse_range(word);
 
-    allocate(*src_blocks * BLOCKSIZE, buffer, buffer_alloc);
+    word = strtok_r(NULL, " ", &wordsave);
+    t->src_blocks = strtol(word, NULL, 0);
 
     word = strtok_r(NULL, " ", &wordsave);
     if (word[0] == '-' && word[1] == '\0') {
         // no source ranges, only stashes
     } else {
-        RangeSet* src = parse_range(word);
-
-        size_t p = 0;
-        int i;
-        for (i = 0; i < src->count; ++i) {
-            check_lseek(fd, (off64_t)src->pos[i*2] * BLOCKSIZE, SEEK_SET);
-            size_t sz = (src->pos[i*2+1] - src->pos[i*2]) * BLOCKSIZE;
-            readblock(fd, *buffer+p, sz);
-            p += sz;
-        }
-        free(src);
+        t->src = parse_range(word);
 
         word = strtok_r(NULL, " ", &wordsave);
         if (word == NULL) {
@@ -352,8 +386,7 @@ static void LoadSrcTgtVersion2(char* wordsave, RangeSet** tgt, int* src_blocks,
             return;
         }
 
-        RangeSet* locs = parse_range(word);
-        MoveRange(*buffer, locs, *buffer);
+        t->src_locs = parse_range(word);
     }
 
     while ((word = strtok_r(NULL, " ", &wordsave)) != NULL) {
@@ -362,14 +395,960 @@ static void LoadSrcTgtVersion2(char* wordsave, RangeSet** tgt, int* src_blocks,
         // stashed data should go.
         char* colonsave = NULL;
         char* colon = strtok_r(word, ":", &colonsave);
-        int stash_id = strtol(colon, NULL, 0);
+        t->stashes = realloc(t->stashes, (t->stash_count + 1) * sizeof(StashRef));
+        if (t->stashes == NULL) {
+            fprintf(stderr, "failed to allocate stash list\n");
+            exit(1);
+        }
+        t->stashes[t->stash_count].stash_id = strtol(colon, NULL, 0);
         colon = strtok_r(NULL, ":", &colonsave);
-        RangeSet* locs = parse_range(colon);
-        MoveRange(*buffer, locs, stash_table[stash_id]);
-        free(stash_table[stash_id]);
-        stash_table[stash_id] = NULL;
-        free(locs);
+        t->stashes[t->stash_count].locs = parse_range(colon);
+        ++t->stash_count;
+    }
+}
+
+// Parse one transfer list line into *t.  Returns false for a style
+// we don't know, which is left in t as TRANSFER_UNKNOWN.
+
+static bool ParseTransfer(char* line, int version, Transfer* t) {
+    char* wordsave;
+    char* word;
+
+    memset(t, 0, sizeof(*t));
+    t->stash_id = -1;
+    t->depends_on = -1;
+    t->style = strtok_r(line, " ", &wordsave);
+
+    if (strcmp("move", t->style) == 0) {
+        t->type = TRANSFER_MOVE;
+    } else if (strcmp("bsdiff", t->style) == 0) {
+        t->type = TRANSFER_BSDIFF;
+    } else if (strcmp("imgdiff", t->style) == 0) {
+        t->type = TRANSFER_IMGDIFF;
+    } else if (strcmp("stash", t->style) == 0) {
+        t->type = TRANSFER_STASH;
+    } else if (strcmp("zero", t->style) == 0) {
+        t->type = TRANSFER_ZERO;
+    } else if (strcmp("new", t->style) == 0) {
+        t->type = TRANSFER_NEW;
+    } else if (strcmp("erase", t->style) == 0) {
+        t->type = TRANSFER_ERASE;
+    } else {
+        t->type = TRANSFER_UNKNOWN;
+        return false;
+    }
+
+    switch (t->type) {
+      case TRANSFER_BSDIFF:
+      case TRANSFER_IMGDIFF:
+        word = strtok_r(NULL, " ", &wordsave);
+        t->patch_offset = strtoul(word, NULL, 0);
+        word = strtok_r(NULL, " ", &wordsave);
+        t->patch_len = strtoul(word, NULL, 0);
+        // fall through
+      case TRANSFER_MOVE:
+        if (version == 1) {
+            ParseSrcTgtVersion1(wordsave, t, true);
+        } else {
+            ParseSrcTgtVersion2(wordsave, t);
+        }
+        break;
+
+      case TRANSFER_STASH:
+        word = strtok_r(NULL, " ", &wordsave);
+        t->stash_id = strtol(word, NULL, 0);
+        // Even though the "stash" style only appears in version 2,
+        // the version 1 source format is exactly what it uses.
+        ParseSrcTgtVersion1(wordsave, t, false);
+        break;
+
+      default:
+        word = strtok_r(NULL, " ", &wordsave);
+        t->tgt = parse_range(word);
+        break;
+    }
+    return true;
+}
+
+static void FreeTransfer(Transfer* t) {
+    int i;
+    free(t->tgt);
+    free(t->src);
+    free(t->src_locs);
+    for (i = 0; i < t->stash_count; ++i) {
+        free(t->stashes[i].locs);
+    }
+    free(t->stashes);
+    free(t->data);
+}
+
+// Whether the transfer writes t->tgt on disk.  (A debug "erase" is
+// a zero fill; a real one discards, which is a write as far as later
+// reads are concerned.)
+static bool WritesTarget(const Transfer* t) {
+    return t->tgt != NULL && t->type != TRANSFER_UNKNOWN;
+}
+
+// Fill in depends_on for every transfer, and the producer of every
+// stash it uses.  The creator of the list guarantees that no block is
+// read after it has been written by a later command, so the only
+// ordering reads need is after the last earlier write to the same
+// blocks.
+//
+// Returns, for each of the *block_count blocks the list touches, the
+// index of the last transfer that writes it (or -1).
+
+static int* ComputeDependencies(Transfer* transfers, int count, int* block_count) {
+    int max_block = 0;
+    int max_stash = 0;
+    int i, j, b;
+
+    for (i = 0; i < count; ++i) {
+        RangeSet* sets[2] = { transfers[i].tgt, transfers[i].src };
+        for (j = 0; j < 2; ++j) {
+            if (sets[j] != NULL && sets[j]->count > 0 &&
+                sets[j]->pos[sets[j]->count*2-1] > max_block) {
+                max_block = sets[j]->pos[sets[j]->count*2-1];
+            }
+        }
+        if (transfers[i].stash_id > max_stash) {
+            max_stash = transfers[i].stash_id;
+        }
+    }
+
+    int* last_writer = malloc((max_block + 1) * sizeof(int));
+    int* producer = malloc((max_stash + 1) * sizeof(int));
+    if (last_writer == NULL || producer == NULL) {
+        fprintf(stderr, "failed to allocate %d-block write map\n", max_block + 1);
+        exit(1);
+    }
+    for (b = 0; b <= max_block; ++b) {
+        last_writer[b] = -1;
+    }
+    for (j = 0; j <= max_stash; ++j) {
+        producer[j] = -1;
+    }
+
+    for (i = 0; i < count; ++i) {
+        Transfer* t = transfers + i;
+        if (t->src != NULL) {
+            for (j = 0; j < t->src->count; ++j) {
+                for (b = t->src->pos[j*2]; b < t->src->pos[j*2+1]; ++b) {
+                    if (last_writer[b] > t->depends_on) {
+                        t->depends_on = last_writer[b];
+                    }
+                }
+            }
+        }
+        for (j = 0; j < t->stash_count; ++j) {
+            int stash_id = t->stashes[j].stash_id;
+            t->stashes[j].producer = (stash_id >= 0 && stash_id <= max_stash) ? producer[stash_id] : -1;
+        }
+        if (t->type == TRANSFER_STASH) {
+            producer[t->stash_id] = i;
+        }
+        if (WritesTarget(t)) {
+            for (j = 0; j < t->tgt->count; ++j) {
+                for (b = t->tgt->pos[j*2]; b < t->tgt->pos[j*2+1]; ++b) {
+                    last_writer[b] = i;
+                }
+            }
+        }
+    }
+
+    free(producer);
+    *block_count = max_block + 1;
+    return last_writer;
+}
+
+// Checkpoints.
+//
+// So that an interrupted update can carry on where it stopped rather
+// than start over on blocks it has already rewritten, the update keeps
+// its state in a directory named for the block device, under
+// /cache/recovery (or /tmp, if there's no /cache to use):
+//
+//    progress    - the SHA-1 of the transfer list, the index of the
+//                  first transfer not known to be on disk, the blocks
+//                  written so far, and a few blocks that no later
+//                  transfer writes, with their SHA-1, to recognise
+//                  the partition by
+//    stash-<n>   - the data stashed by transfer n, kept until the
+//                  transfer that uses it is committed
+//    result-<n>  - the output of transfer n when its target overlaps
+//                  its own source, kept until it is committed
+//    sha1-<x>    - what range_sha1() returned, before the update
+//                  started, for the ranges whose text has SHA-1 x
+//
+// range_sha1() only keeps its answers in memory; block_image_update()
+// writes them out when it starts afresh, and they're only read back
+// while there's progress to resume.  A directory without progress is
+// stale and removed, as is the directory once the update completes.
+// Progress left by a different transfer list is thrown away too, and
+// that update starts over from the first transfer.
+
+#define CHECKPOINT_INTERVAL 32768       // blocks (128MB) between checkpoints
+#define CHECKPOINT_CHECK_BLOCKS 16
+
+static const char* checkpoint_bases[] = { "/cache/recovery", "/tmp" };
+
+static char* DigestString(const void* data, int len) {
+    uint8_t digest[SHA_DIGEST_SIZE];
+    SHA_hash(data, len, digest);
+    return PrintSha1(digest);
+}
+
+// Returns the checkpoint directory for blockdev.  If there is none it
+// is made when create is true; otherwise (or if that fails) NULL is
+// returned.
+static char* CheckpointDir(const char* blockdev, bool create) {
+    char* id = DigestString(blockdev, strlen(blockdev));
+    char* dir = NULL;
+    char path[PATH_MAX];
+    struct stat st;
+    size_t i;
+
+    for (i = 0; i < sizeof(checkpoint_bases) / sizeof(checkpoint_bases[0]); ++i) {
+        snprintf(path, sizeof(path), "%s/blockimg-%s", checkpoint_bases[i], id);
+        if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+            dir = strdup(path);
+            goto done;
+        }
+    }
+    if (!create) {
+        goto done;
+    }
+    for (i = 0; i < sizeof(checkpoint_bases) / sizeof(checkpoint_bases[0]); ++i) {
+        if (stat(checkpoint_bases[i], &st) != 0 || !S_ISDIR(st.st_mode) ||
+            access(checkpoint_bases[i], W_OK) != 0) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/blockimg-%s", checkpoint_bases[i], id);
+        if (mkdir(path, 0700) == 0) {
+            dir = strdup(path);
+            goto done;
+        }
+        fprintf(stderr, "failed to create %s: %s\n", path, strerror(errno));
+    }
+
+  done:
+    free(id);
+    return dir;
+}
+
+static bool SyncDir(const char* dir) {
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd < 0 || fsync(fd) != 0) {
+        fprintf(stderr, "failed to sync %s: %s\n", dir, strerror(errno));
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    close(fd);
+    return true;
+}
+
+// Replaces dir/name with len bytes of data.  Once this returns true
+// the new contents are on disk under that name.
+static bool WriteCheckpointFile(const char* dir, const char* name,
+                                const void* data, size_t len) {
+    char path[PATH_MAX];
+    char temp[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    snprintf(temp, sizeof(temp), "%s.tmp", path);
+
+    int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        fprintf(stderr, "failed to create %s: %s\n", temp, strerror(errno));
+        return false;
+    }
+    size_t written = 0;
+    while (written < len) {
+        ssize_t w = write(fd, (const uint8_t*)data + written, len - written);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        written += w;
+    }
+    if (written < len || fsync(fd) != 0) {
+        fprintf(stderr, "failed to write %s: %s\n", temp, strerror(errno));
+        close(fd);
+        unlink(temp);
+        return false;
+    }
+    close(fd);
+    if (rename(temp, path) != 0) {
+        fprintf(stderr, "failed to rename %s: %s\n", temp, strerror(errno));
+        unlink(temp);
+        return false;
+    }
+    return SyncDir(dir);
+}
+
+// Returns the contents of dir/name, null-terminated, or NULL if the
+// file can't be read.  *len (if len isn't NULL) is set to its size.
+static uint8_t* ReadCheckpointFile(const char* dir, const char* name, size_t* len) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        if (errno != ENOENT) {
+            fprintf(stderr, "failed to open %s: %s\n", path, strerror(errno));
+        }
+        return NULL;
+    }
+    struct stat st;
+    uint8_t* data = NULL;
+    if (fstat(fd, &st) != 0 || (data = malloc(st.st_size + 1)) == NULL) {
+        fprintf(stderr, "failed to read %s: %s\n", path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    size_t so_far = 0;
+    while (so_far < (size_t)st.st_size) {
+        ssize_t r = read(fd, data + so_far, st.st_size - so_far);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) {
+            fprintf(stderr, "failed to read %s: %s\n", path,
+                    r < 0 ? strerror(errno) : "unexpected end of file");
+            close(fd);
+            free(data);
+            return NULL;
+        }
+        so_far += r;
+    }
+    close(fd);
+    data[so_far] = '\0';
+    if (len != NULL) {
+        *len = so_far;
+    }
+    return data;
+}
+
+static void RemoveCheckpointFile(const char* dir, const char* name) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    if (unlink(path) != 0 && errno != ENOENT) {
+        fprintf(stderr, "failed to remove %s: %s\n", path, strerror(errno));
+    }
+}
+
+// Removes everything in dir, and dir itself too if remove_dir is true.
+static void ClearCheckpoint(const char* dir, bool remove_dir) {
+    DIR* d = opendir(dir);
+    if (d == NULL) {
+        fprintf(stderr, "failed to open %s: %s\n", dir, strerror(errno));
+        return;
+    }
+    struct dirent* de;
+    while ((de = readdir(d)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+        RemoveCheckpointFile(dir, de->d_name);
+    }
+    closedir(d);
+    if (remove_dir && rmdir(dir) != 0) {
+        fprintf(stderr, "failed to remove %s: %s\n", dir, strerror(errno));
+    }
+}
+
+// What range_sha1() has read from each block device so far, for
+// block_image_update() to record when it starts.
+
+typedef struct {
+    char* blockdev;
+    char* record;               // sha1-<SHA-1 of the ranges text>
+    char* sha1;
+} SourceSha1;
+
+static SourceSha1* source_sha1s = NULL;
+static int source_sha1_count = 0;
+
+static void RememberSourceSha1(const char* blockdev, const char* record, const char* sha1) {
+    int i;
+    for (i = 0; i < source_sha1_count; ++i) {
+        if (strcmp(source_sha1s[i].blockdev, blockdev) == 0 &&
+            strcmp(source_sha1s[i].record, record) == 0) {
+            free(source_sha1s[i].sha1);
+            source_sha1s[i].sha1 = strdup(sha1);
+            return;
+        }
+    }
+    SourceSha1* grown = realloc(source_sha1s, (source_sha1_count + 1) * sizeof(SourceSha1));
+    if (grown == NULL) {
+        return;
+    }
+    source_sha1s = grown;
+    source_sha1s[source_sha1_count].blockdev = strdup(blockdev);
+    source_sha1s[source_sha1_count].record = strdup(record);
+    source_sha1s[source_sha1_count].sha1 = strdup(sha1);
+    ++source_sha1_count;
+}
+
+// Writes what range_sha1() read from blockdev to dir, and forgets it.
+// Returns false if a record couldn't be written.
+static bool SaveSourceSha1s(const char* dir, const char* blockdev) {
+    bool ok = true;
+    int i, kept = 0;
+    for (i = 0; i < source_sha1_count; ++i) {
+        SourceSha1* s = source_sha1s + i;
+        if (strcmp(s->blockdev, blockdev) != 0) {
+            source_sha1s[kept++] = *s;
+            continue;
+        }
+        if (ok && !WriteCheckpointFile(dir, s->record, s->sha1, strlen(s->sha1))) {
+            ok = false;
+        }
+        free(s->blockdev);
+        free(s->record);
+        free(s->sha1);
+    }
+    source_sha1_count = kept;
+    return ok;
+}
+
+typedef struct {
+    char* list_sha1;
+    int next;
+    int blocks_so_far;
+    char* check_sha1;
+    int check[CHECKPOINT_CHECK_BLOCKS];
+    int check_count;
+} Progress;
+
+static char* CheckBlocksDigest(int fd, const int* blocks, int count) {
+    uint8_t buffer[BLOCKSIZE];
+    SHA_CTX ctx;
+    int i;
+
+    SHA_init(&ctx);
+    for (i = 0; i < count; ++i) {
+        readblock_at(fd, buffer, BLOCKSIZE, (off64_t)blocks[i] * BLOCKSIZE);
+        SHA_update(&ctx, buffer, BLOCKSIZE);
+    }
+    return PrintSha1(SHA_final(&ctx));
+}
+
+// Reads the progress file in dir into *p, whose strings point into
+// *text.  Returns false (and leaves *text NULL) if there's no
+// progress, or it doesn't fit the partition open on fd.
+static bool LoadProgress(const char* dir, int fd, Progress* p, char** text) {
+    char* save;
+    char* word;
+
+    *text = (char*) ReadCheckpointFile(dir, "progress", NULL);
+    if (*text == NULL) {
+        return false;
+    }
+
+    p->list_sha1 = strtok_r(*text, "\n", &save);
+    word = strtok_r(NULL, "\n", &save);
+    p->next = word ? strtol(word, NULL, 0) : -1;
+    word = strtok_r(NULL, "\n", &save);
+    p->blocks_so_far = word ? strtol(word, NULL, 0) : 0;
+    p->check_sha1 = strtok_r(NULL, "\n", &save);
+    p->check_count = 0;
+    while (p->check_count < CHECKPOINT_CHECK_BLOCKS &&
+           (word = strtok_r(NULL, " \n", &save)) != NULL) {
+        p->check[p->check_count++] = strtol(word, NULL, 0);
+    }
+
+    if (p->list_sha1 == NULL || p->next < 0 || p->check_sha1 == NULL || p->check_count == 0) {
+        fprintf(stderr, "ignoring malformed progress in %s\n", dir);
+    } else {
+        char* digest = CheckBlocksDigest(fd, p->check, p->check_count);
+        bool match = strcmp(digest, p->check_sha1) == 0;
+        free(digest);
+        if (match) {
+            return true;
+        }
+        printf("progress in %s is not for the current contents of the partition\n", dir);
+    }
+    free(*text);
+    *text = NULL;
+    return false;
+}
+
+// The transfers are run as a pipeline:
+//
+//  - a loader thread reads the sources (and fills and drains the
+//    stash table) in list order, running ahead of the writes as far
+//    as PIPELINE_READAHEAD bytes of buffers allow, but never reading
+//    blocks that a transfer not yet on disk still has to write;
+//
+//  - worker threads apply bsdiff/imgdiff patches into memory;
+//
+//  - the calling thread writes the results, zeroes, new data and
+//    discards in list order, exactly as the serial loop used to.
+//
+// Writes happen in list order and every transfer is loaded before any
+// later one is written, so each read sees the same data it would have
+// seen running the list one command at a time.
+
+#define PIPELINE_READAHEAD (64 * 1024 * 1024)
+#define PIPELINE_MAX_WORKERS 4
+
+typedef struct {
+    Transfer* transfers;
+    int count;
+    int fd;
+    uint8_t** stash_table;
+    uint8_t* patch_start;
+    const char* checkpoint_dir; // NULL when not keeping checkpoints
+    int resume_from;            // first transfer run (by this attempt)
+
+    pthread_mutex_t mu;
+    pthread_cond_t cv;
+    int loaded;                 // transfers [0, loaded) have their sources
+    int written;                // transfers [0, written) are on disk
+    int next_patch;             // next transfer for a worker to look at
+    size_t in_flight;           // bytes of buffers loaded but not written
+    size_t max_in_flight;
+    bool spill_failed;          // the checkpoint is missing data
+} TransferPipeline;
+
+static void ReadRanges(int fd, RangeSet* src, uint8_t* buffer) {
+    size_t p = 0;
+    int i;
+    for (i = 0; i < src->count; ++i) {
+        size_t sz = (src->pos[i*2+1] - src->pos[i*2]) * BLOCKSIZE;
+        readblock_at(fd, buffer+p, sz, (off64_t)src->pos[i*2] * BLOCKSIZE);
+        p += sz;
+    }
+}
+
+static uint8_t* AllocateBuffer(size_t size) {
+    uint8_t* buffer = (uint8_t*) malloc(size);
+    if (buffer == NULL) {
+        fprintf(stderr, "failed to allocate %zu bytes\n", size);
+        exit(1);
+    }
+    return buffer;
+}
+
+// Bytes of buffers the transfer needs between being loaded and being
+// written.
+static size_t TransferMemory(const Transfer* t) {
+    if (t->type == TRANSFER_MOVE) {
+        int blocks = t->src_blocks > t->tgt->size ? t->src_blocks : t->tgt->size;
+        return (size_t)blocks * BLOCKSIZE;
+    } else if (IsPatch(t)) {
+        return ((size_t)t->src_blocks + t->tgt->size) * BLOCKSIZE;
+    }
+    return 0;
+}
+
+// Saves data in the checkpoint as dir/name, if checkpoints are being
+// kept.  If that fails, so does resuming past this point.
+static void SpillToCheckpoint(TransferPipeline* tp, const char* name,
+                              const uint8_t* data, size_t len) {
+    if (tp->checkpoint_dir == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&tp->mu);
+    bool failed = tp->spill_failed;
+    pthread_mutex_unlock(&tp->mu);
+
+    if (!failed && !WriteCheckpointFile(tp->checkpoint_dir, name, data, len)) {
+        pthread_mutex_lock(&tp->mu);
+        tp->spill_failed = true;
+        pthread_mutex_unlock(&tp->mu);
+    }
+}
+
+// When resuming at a transfer whose target overlaps its own source,
+// the source may be half overwritten; use the result saved before
+// it was written instead.
+static bool LoadResult(TransferPipeline* tp, Transfer* t, int index) {
+    char name[32];
+    size_t len;
+
+    snprintf(name, sizeof(name), "result-%d", index);
+    uint8_t* data = ReadCheckpointFile(tp->checkpoint_dir, name, &len);
+    if (data == NULL) {
+        return false;
+    }
+    if (len > (size_t)t->tgt->size * BLOCKSIZE ||
+        (t->type == TRANSFER_MOVE && len != (size_t)t->tgt->size * BLOCKSIZE)) {
+        fprintf(stderr, "%s is the wrong size (%zu bytes)\n", name, len);
+        exit(1);
+    }
+    printf("  using result saved before interruption\n");
+    t->data = data;
+    t->data_len = len;
+    t->patched = true;
+    t->spilled = true;
+    return true;
+}
+
+static void LoadTransfer(TransferPipeline* tp, Transfer* t) {
+    int index = t - tp->transfers;
+    char name[32];
+    int i;
+
+    if (t->type == TRANSFER_STASH) {
+        uint8_t* buffer = AllocateBuffer((size_t)t->src_blocks * BLOCKSIZE);
+        ReadRanges(tp->fd, t->src, buffer);
+        free(tp->stash_table[t->stash_id]);
+        tp->stash_table[t->stash_id] = buffer;
+        snprintf(name, sizeof(name), "stash-%d", index);
+        SpillToCheckpoint(tp, name, buffer, (size_t)t->src_blocks * BLOCKSIZE);
+        return;
+    }
+    if (t->type != TRANSFER_MOVE && !IsPatch(t)) {
+        return;
+    }
+    if (index == tp->resume_from && tp->checkpoint_dir != NULL && LoadResult(tp, t, index)) {
+        return;
+    }
+
+    size_t size = (size_t)t->src_blocks * BLOCKSIZE;
+    if (t->type == TRANSFER_MOVE) {
+        size = t->mem;
+    }
+    t->data = AllocateBuffer(size);
+    if (t->src != NULL) {
+        ReadRanges(tp->fd, t->src, t->data);
+        if (t->src_locs != NULL) {
+            MoveRange(t->data, t->src_locs, t->data);
+        }
+    }
+    for (i = 0; i < t->stash_count; ++i) {
+        int stash_id = t->stashes[i].stash_id;
+        uint8_t* stash = tp->stash_table[stash_id];
+        if (t->stashes[i].producer >= 0 && t->stashes[i].producer < tp->resume_from) {
+            // stashed before the interruption
+            snprintf(name, sizeof(name), "stash-%d", t->stashes[i].producer);
+            stash = ReadCheckpointFile(tp->checkpoint_dir, name, NULL);
+            if (stash == NULL) {
+                fprintf(stderr, "failed to load %s\n", name);
+                exit(1);
+            }
+        }
+        MoveRange(t->data, t->stashes[i].locs, stash);
+        free(stash);
+        tp->stash_table[stash_id] = NULL;
+    }
+}
+
+static void* LoaderThread(void* cookie) {
+    TransferPipeline* tp = (TransferPipeline*) cookie;
+    int i;
+
+    for (i = tp->resume_from; i < tp->count; ++i) {
+        Transfer* t = tp->transfers + i;
+        t->mem = TransferMemory(t);
+
+        pthread_mutex_lock(&tp->mu);
+        while (tp->written <= t->depends_on ||
+               (tp->in_flight > 0 && tp->in_flight + t->mem > PIPELINE_READAHEAD)) {
+            pthread_cond_wait(&tp->cv, &tp->mu);
+        }
+        tp->in_flight += t->mem;
+        if (tp->in_flight > tp->max_in_flight) {
+            tp->max_in_flight = tp->in_flight;
+        }
+        pthread_mutex_unlock(&tp->mu);
+
+        LoadTransfer(tp, t);
+
+        pthread_mutex_lock(&tp->mu);
+        tp->loaded = i + 1;
+        pthread_cond_broadcast(&tp->cv);
+        pthread_mutex_unlock(&tp->mu);
+    }
+    return NULL;
+}
+
+typedef struct {
+    uint8_t* buffer;
+    size_t size;
+    size_t pos;
+    bool overrun;
+} PatchSinkState;
+
+// Collects patch output for tgt in memory.  Once tgt is full it
+// accepts no more, like RangeSinkWrite() does on disk.
+static ssize_t PatchSinkWrite(const uint8_t* data, ssize_t size, void* token) {
+    PatchSinkState* pss = (PatchSinkState*) token;
+
+    if (pss->pos >= pss->size) {
+        pss->overrun = true;
+        return 0;
+    }
+    if ((size_t)size > pss->size - pss->pos) {
+        size = pss->size - pss->pos;
+    }
+    memcpy(pss->buffer + pss->pos, data, size);
+    pss->pos += size;
+    return size;
+}
+
+static void PatchTransfer(TransferPipeline* tp, Transfer* t) {
+    Value patch_value;
+    patch_value.type = VAL_BLOB;
+    patch_value.size = t->patch_len;
+    patch_value.data = (char*)(tp->patch_start + t->patch_offset);
+
+    PatchSinkState pss;
+    pss.size = (size_t)t->tgt->size * BLOCKSIZE;
+    pss.buffer = AllocateBuffer(pss.size);
+    pss.pos = 0;
+    pss.overrun = false;
+
+    if (t->type == TRANSFER_IMGDIFF) {
+        // The pipeline already patches one transfer per worker, and only
+        // counts their buffers in in_flight, so each patch runs serially
+        // here rather than starting chunk threads of its own.
+        ApplyImagePatchThreads(t->data, t->src_blocks * BLOCKSIZE,
+                               &patch_value,
+                               &PatchSinkWrite, &pss, NULL, NULL, 1);
+    } else {
+        ApplyBSDiffPatch(t->data, t->src_blocks * BLOCKSIZE,
+                         &patch_value, 0,
+                         &PatchSinkWrite, &pss, NULL);
+    }
+
+    free(t->data);
+    t->data = pss.buffer;
+    t->data_len = pss.pos;
+    t->overrun = pss.overrun;
+}
+
+static void* PatchWorker(void* cookie) {
+    TransferPipeline* tp = (TransferPipeline*) cookie;
+
+    pthread_mutex_lock(&tp->mu);
+    while (true) {
+        while (tp->next_patch < tp->loaded &&
+               (!IsPatch(tp->transfers + tp->next_patch) ||
+                tp->transfers[tp->next_patch].patched)) {
+            ++tp->next_patch;
+        }
+        if (tp->next_patch >= tp->count) {
+            break;
+        }
+        if (tp->next_patch >= tp->loaded) {
+            pthread_cond_wait(&tp->cv, &tp->mu);
+            continue;
+        }
+
+        Transfer* t = tp->transfers + tp->next_patch++;
+        pthread_mutex_unlock(&tp->mu);
+        PatchTransfer(tp, t);
+        pthread_mutex_lock(&tp->mu);
+        t->patched = true;
+        pthread_cond_broadcast(&tp->cv);
+    }
+    pthread_mutex_unlock(&tp->mu);
+    return NULL;
+}
+
+static void WriteRanges(int fd, RangeSet* tgt, const uint8_t* buffer) {
+    size_t p = 0;
+    int i;
+    for (i = 0; i < tgt->count; ++i) {
+        check_lseek(fd, (off64_t)tgt->pos[i*2] * BLOCKSIZE, SEEK_SET);
+        size_t sz = (tgt->pos[i*2+1] - tgt->pos[i*2]) * BLOCKSIZE;
+        writeblock(fd, buffer+p, sz);
+        p += sz;
+    }
+}
+
+// The writer's side of the checkpoints.  Transfers are committed
+// every CHECKPOINT_INTERVAL blocks, and also before any write to a
+// block that a transfer since the last checkpoint has read: rerunning
+// from a checkpoint has to read what the first attempt read.  When a
+// transfer's target overlaps its own source its result is saved
+// first, for the same reason.
+
+typedef struct {
+    bool enabled;
+    char* dir;
+    char* list_sha1;
+    int next;                   // transfers [0, next) are committed
+    int uncommitted;            // blocks written since then
+    int* final_writer;          // per block, the last transfer to write it
+    int* last_read;             // per block, the last transfer to read it
+    int check[CHECKPOINT_CHECK_BLOCKS];
+    int check_count;
+    bool overdue;               // one was wanted before there were check blocks
+} Checkpoint;
+
+static void DisableCheckpoints(Checkpoint* cp, TransferPipeline* tp) {
+    fprintf(stderr, "not keeping checkpoints; if interrupted, the update will have to start over\n");
+    RemoveCheckpointFile(cp->dir, "progress");
+    SyncDir(cp->dir);
+    cp->enabled = false;
+
+    pthread_mutex_lock(&tp->mu);
+    tp->spill_failed = true;
+    pthread_mutex_unlock(&tp->mu);
+}
+
+// Records that transfers [0, next) are on disk.
+static void CommitCheckpoint(Checkpoint* cp, TransferPipeline* tp, int next,
+                             int blocks_so_far) {
+    char name[32];
+    int i, j;
+
+    if (!cp->enabled || next <= cp->next) {
+        return;
+    }
+    if (cp->check_count == 0) {
+        // Until a block is in its final state there's nothing to
+        // tell this partition apart by.
+        cp->overdue = true;
+        return;
+    }
+    pthread_mutex_lock(&tp->mu);
+    bool failed = tp->spill_failed;
+    pthread_mutex_unlock(&tp->mu);
+    if (failed) {
+        DisableCheckpoints(cp, tp);
+        return;
+    }
+    if (fsync(tp->fd) != 0) {
+        fprintf(stderr, "failed to sync block device: %s\n", strerror(errno));
+        DisableCheckpoints(cp, tp);
+        return;
+    }
+
+    char* check_sha1 = CheckBlocksDigest(tp->fd, cp->check, cp->check_count);
+    size_t size = strlen(cp->list_sha1) + strlen(check_sha1) +
+                  (CHECKPOINT_CHECK_BLOCKS + 2) * 12 + 8;
+    char* text = (char*) AllocateBuffer(size);
+    int len = snprintf(text, size, "%s\n%d\n%d\n%s\n",
+                       cp->list_sha1, next, blocks_so_far, check_sha1);
+    for (i = 0; i < cp->check_count; ++i) {
+        len += snprintf(text + len, size - len, "%d ", cp->check[i]);
+    }
+    text[len - 1] = '\n';
+    bool ok = WriteCheckpointFile(cp->dir, "progress", text, len);
+    free(text);
+    free(check_sha1);
+    if (!ok) {
+        DisableCheckpoints(cp, tp);
+        return;
+    }
+
+    // Drop what was only needed to redo the transfers just committed.
+    for (i = cp->next; i < next; ++i) {
+        Transfer* t = tp->transfers + i;
+        for (j = 0; j < t->stash_count; ++j) {
+            snprintf(name, sizeof(name), "stash-%d", t->stashes[j].producer);
+            RemoveCheckpointFile(cp->dir, name);
+        }
+        if (t->spilled) {
+            snprintf(name, sizeof(name), "result-%d", i);
+            RemoveCheckpointFile(cp->dir, name);
+        }
+    }
+    cp->next = next;
+    cp->uncommitted = 0;
+    cp->overdue = false;
+}
+
+// Called before transfer i is written.
+static void CheckpointBeforeWrite(Checkpoint* cp, TransferPipeline* tp, int i,
+                                  int blocks_so_far) {
+    Transfer* t = tp->transfers + i;
+    bool clobbers = false;
+    bool own_source = false;
+    char name[32];
+    int j, b;
+
+    if (!cp->enabled) {
+        return;
+    }
+    if (t->src != NULL) {
+        for (j = 0; j < t->src->count; ++j) {
+            for (b = t->src->pos[j*2]; b < t->src->pos[j*2+1]; ++b) {
+                cp->last_read[b] = i;
+            }
+        }
+    }
+    if (!WritesTarget(t)) {
+        return;
+    }
+    for (j = 0; j < t->tgt->count; ++j) {
+        for (b = t->tgt->pos[j*2]; b < t->tgt->pos[j*2+1]; ++b) {
+            if (cp->last_read[b] >= cp->next) {
+                clobbers = true;
+                own_source = own_source || cp->last_read[b] == i;
+            }
+        }
+    }
+    if (!clobbers) {
+        return;
     }
+
+    CommitCheckpoint(cp, tp, i, blocks_so_far);
+    if (own_source && t->data != NULL && cp->enabled) {
+        size_t len = t->type == TRANSFER_MOVE ? (size_t)t->tgt->size * BLOCKSIZE : t->data_len;
+        snprintf(name, sizeof(name), "result-%d", i);
+        SpillToCheckpoint(tp, name, t->data, len);
+        t->spilled = true;
+
+        pthread_mutex_lock(&tp->mu);
+        bool failed = tp->spill_failed;
+        pthread_mutex_unlock(&tp->mu);
+        if (failed) {
+            DisableCheckpoints(cp, tp);
+        }
+    }
+}
+
+// Called after transfer i is written.
+static void CheckpointAfterWrite(Checkpoint* cp, TransferPipeline* tp, int i,
+                                 int blocks_so_far) {
+    Transfer* t = tp->transfers + i;
+    int found = 0;
+    int j, b;
+
+    if (!cp->enabled || !WritesTarget(t)) {
+        return;
+    }
+    if (t->type == TRANSFER_MOVE || t->type == TRANSFER_NEW || IsPatch(t)) {
+        // Blocks no later transfer writes keep these contents from
+        // now on, so they can tell whether the partition is still the
+        // one the progress describes.
+        for (j = 0; j < t->tgt->count && found < CHECKPOINT_CHECK_BLOCKS; ++j) {
+            for (b = t->tgt->pos[j*2]; b < t->tgt->pos[j*2+1] &&
+                     found < CHECKPOINT_CHECK_BLOCKS; ++b) {
+                if (cp->final_writer[b] == i) {
+                    cp->check[found++] = b;
+                }
+            }
+        }
+        if (found > 0) {
+            cp->check_count = found;
+        }
+    }
+
+    cp->uncommitted += t->tgt->size;
+    if (cp->uncommitted >= CHECKPOINT_INTERVAL || (cp->overdue && cp->check_count > 0)) {
+        CommitCheckpoint(cp, tp, i + 1, blocks_so_far);
+    }
+}
+
+// Every set_progress costs the recovery a redraw of the progress bar,
+// so transfers report at most every PROGRESS_INTERVAL_MS.
+#define PROGRESS_INTERVAL_MS 100
+
+static void ReportProgress(FILE* cmd_pipe, long long* last_ms,
+                           int blocks_so_far, int total_blocks, bool force) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    long long now = ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+    if (!force && now - *last_ms < PROGRESS_INTERVAL_MS) {
+        return;
+    }
+    *last_ms = now;
+    fprintf(cmd_pipe, "set_progress %.4f\n", (double)blocks_so_far / total_blocks);
+    fflush(cmd_pipe);
 }
 
 // args:
@@ -450,7 +1429,7 @@ Value* BlockImageUpdateFn(const char* name, State* state, int argc, Expr* argv[]
     //        at all.
     //
     //        The format of <...> differs between versions 1 and 2;
-    //        see the LoadSrcTgtVersion{1,2}() functions for a
+    //        see the ParseSrcTgtVersion{1,2}() functions for a
     //        description of what's expected.
     //
     //    stash <stash_id> <src_range>
@@ -475,23 +1454,9 @@ Value* BlockImageUpdateFn(const char* name, State* state, int argc, Expr* argv[]
     // already compressed, we lose very little by not compressing
     // their concatenation.)
 
-    pthread_t new_data_thread;
-    NewThreadInfo nti;
-    nti.za = za;
-    nti.entry = new_entry;
-    nti.rss = NULL;
-    pthread_mutex_init(&nti.mu, NULL);
-    pthread_cond_init(&nti.cv, NULL);
-
-    pthread_attr_t attr;
-    pthread_attr_init(&attr);
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
-    pthread_create(&new_data_thread, &attr, unzip_new_data, &nti);
-
     int i, j;
 
     char* linesave;
-    char* wordsave;
 
     int fd = open(blockdev_filename->data, O_RDWR);
     if (fd < 0) {
@@ -500,7 +1465,6 @@ Value* BlockImageUpdateFn(const char* name, State* state, int argc, Expr* argv[]
     }
 
     char* line;
-    char* word;
 
     // The data in transfer_list_value is not necessarily
     // null-terminated, so we need to copy it to a new buffer and add
@@ -536,8 +1500,10 @@ Value* BlockImageUpdateFn(const char* name, State* state, int argc, Expr* argv[]
     // shouldn't happen, but avoid divide by zero.
     if (total_blocks == 0) ++total_blocks;
     int blocks_so_far = 0;
+    long long last_progress_ms = 0;
 
     uint8_t** stash_table = NULL;
+    int stash_max_blocks = 0;
     if (version >= 2) {
         // Next line is how many stash entries are needed simultaneously.
         line = strtok_r(NULL, "\n", &linesave);
@@ -550,88 +1516,192 @@ Value* BlockImageUpdateFn(const char* name, State* state, int argc, Expr* argv[]
         }
 
         // Next line is the maximum number of blocks that will be
-        // stashed simultaneously.  This could be used to verify that
-        // enough memory or scratch disk space is available.
+        // stashed simultaneously.  The checkpoint needs room for them.
         line = strtok_r(NULL, "\n", &linesave);
-        int stash_max_blocks = strtol(line, NULL, 0);
+        stash_max_blocks = strtol(line, NULL, 0);
     }
 
-    uint8_t* buffer = NULL;
-    size_t buffer_alloc = 0;
-
     // third and subsequent lines are all individual transfer commands.
+    // Parsing stops after a style we don't know; the commands before
+    // it still run, and the update stops when it's reached.
+    int transfer_count = 0;
+    int transfer_alloc = 0;
+    Transfer* transfers = NULL;
     for (line = strtok_r(NULL, "\n", &linesave); line;
          line = strtok_r(NULL, "\n", &linesave)) {
-
-        char* style;
-        style = strtok_r(line, " ", &wordsave);
-
-        if (strcmp("move", style) == 0) {
-            RangeSet* tgt;
-            int src_blocks;
-            if (version == 1) {
-                LoadSrcTgtVersion1(wordsave, &tgt, &src_blocks,
-                                   &buffer, &buffer_alloc, fd);
-            } else if (version == 2) {
-                LoadSrcTgtVersion2(wordsave, &tgt, &src_blocks,
-                                   &buffer, &buffer_alloc, fd, stash_table);
+        if (transfer_count == transfer_alloc) {
+            transfer_alloc = transfer_alloc ? transfer_alloc * 2 : 256;
+            transfers = realloc(transfers, transfer_alloc * sizeof(Transfer));
+            if (transfers == NULL) {
+                fprintf(stderr, "failed to allocate %d transfers\n", transfer_alloc);
+                exit(1);
             }
-
-            printf("  moving %d blocks\n", src_blocks);
-
-            size_t p = 0;
-            for (i = 0; i < tgt->count; ++i) {
-                check_lseek(fd, (off64_t)tgt->pos[i*2] * BLOCKSIZE, SEEK_SET);
-                size_t sz = (tgt->pos[i*2+1] - tgt->pos[i*2]) * BLOCKSIZE;
-                writeblock(fd, buffer+p, sz);
-                p += sz;
+        }
+        if (!ParseTransfer(line, version, transfers + transfer_count++)) {
+            break;
+        }
+    }
+    int block_count;
+    int* final_writer = ComputeDependencies(transfers, transfer_count, &block_count);
+
+    // Pick up an interrupted attempt at this update, if there was one.
+    Checkpoint cp;
+    memset(&cp, 0, sizeof(cp));
+    cp.dir = CheckpointDir(blockdev_filename->data, true);
+    cp.list_sha1 = DigestString(transfer_list_value->data, transfer_list_value->size);
+    cp.final_writer = final_writer;
+    int resume_from = 0;
+    if (cp.dir != NULL) {
+        Progress progress;
+        char* text;
+        bool resuming = false;
+        cp.enabled = true;
+        if (LoadProgress(cp.dir, fd, &progress, &text)) {
+            resuming = strcmp(progress.list_sha1, cp.list_sha1) == 0 &&
+                       progress.next <= transfer_count;
+            if (!resuming) {
+                // That attempt's checkpoints are of no use to this list.
+                printf("%s was partly updated by a different package; starting over\n",
+                       blockdev_filename->data);
+                free(text);
             }
-
-            blocks_so_far += tgt->size;
-            fprintf(cmd_pipe, "set_progress %.4f\n", (double)blocks_so_far / total_blocks);
-            fflush(cmd_pipe);
-
-            free(tgt);
-
-        } else if (strcmp("stash", style) == 0) {
-            word = strtok_r(NULL, " ", &wordsave);
-            int stash_id = strtol(word, NULL, 0);
-            int src_blocks;
-            size_t stash_alloc = 0;
-
-            // Even though the "stash" style only appears in version
-            // 2, the version 1 source loader happens to do exactly
-            // what we want to read data into the stash_table.
-            LoadSrcTgtVersion1(wordsave, NULL, &src_blocks,
-                               stash_table + stash_id, &stash_alloc, fd);
-
-        } else if (strcmp("zero", style) == 0 ||
-                   (DEBUG_ERASE && strcmp("erase", style) == 0)) {
-            word = strtok_r(NULL, " ", &wordsave);
-            RangeSet* tgt = parse_range(word);
-
-            printf("  zeroing %d blocks\n", tgt->size);
-
-            allocate(BLOCKSIZE, &buffer, &buffer_alloc);
-            memset(buffer, 0, BLOCKSIZE);
-            for (i = 0; i < tgt->count; ++i) {
-                check_lseek(fd, (off64_t)tgt->pos[i*2] * BLOCKSIZE, SEEK_SET);
-                for (j = tgt->pos[i*2]; j < tgt->pos[i*2+1]; ++j) {
-                    writeblock(fd, buffer, BLOCKSIZE);
+        }
+        if (resuming) {
+            resume_from = progress.next;
+            blocks_so_far = progress.blocks_so_far;
+            memcpy(cp.check, progress.check, sizeof(cp.check));
+            cp.check_count = progress.check_count;
+            free(text);
+            printf("resuming at transfer %d of %d\n", resume_from, transfer_count);
+
+            for (i = resume_from; i < transfer_count; ++i) {
+                for (j = 0; j < transfers[i].stash_count; ++j) {
+                    int producer = transfers[i].stashes[j].producer;
+                    char path[PATH_MAX];
+                    snprintf(path, sizeof(path), "%s/stash-%d", cp.dir, producer);
+                    if (producer >= 0 && producer < resume_from && access(path, R_OK) != 0) {
+                        ErrorAbort(state, "can't resume: %s is missing", path);
+                        goto done;
+                    }
                 }
             }
+        } else {
+            // Starting afresh: the source range_sha1() checked is what
+            // it has to answer with if this attempt is interrupted.
+            ClearCheckpoint(cp.dir, false);
+            if (!SaveSourceSha1s(cp.dir, blockdev_filename->data)) {
+                printf("can't record the source in %s; not keeping checkpoints\n", cp.dir);
+                cp.enabled = false;
+            }
+        }
+
+        if (cp.enabled && resume_from == 0 &&
+            FreeSpaceForFile(cp.dir) < (size_t)stash_max_blocks * BLOCKSIZE) {
+            printf("not enough room in %s to stash %d blocks\n", cp.dir, stash_max_blocks);
+            cp.enabled = false;
+        }
+    }
+    if (cp.enabled) {
+        cp.next = resume_from;
+        cp.last_read = malloc(block_count * sizeof(int));
+        if (cp.last_read == NULL) {
+            fprintf(stderr, "failed to allocate %d-block read map\n", block_count);
+            exit(1);
+        }
+        for (i = 0; i < block_count; ++i) {
+            cp.last_read[i] = -1;
+        }
+    }
+
+    pthread_t new_data_thread;
+    NewThreadInfo nti;
+    nti.za = za;
+    nti.entry = new_entry;
+    nti.skip = 0;
+    nti.rss = NULL;
+    pthread_mutex_init(&nti.mu, NULL);
+    pthread_cond_init(&nti.cv, NULL);
+    for (i = 0; i < resume_from; ++i) {
+        if (transfers[i].type == TRANSFER_NEW) {
+            nti.skip += (size_t)transfers[i].tgt->size * BLOCKSIZE;
+        }
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+    pthread_create(&new_data_thread, &attr, unzip_new_data, &nti);
+
+    TransferPipeline tp;
+    tp.transfers = transfers;
+    tp.count = transfer_count;
+    tp.fd = fd;
+    tp.stash_table = stash_table;
+    tp.patch_start = patch_start;
+    tp.checkpoint_dir = cp.enabled ? cp.dir : NULL;
+    tp.resume_from = resume_from;
+    pthread_mutex_init(&tp.mu, NULL);
+    pthread_cond_init(&tp.cv, NULL);
+    tp.loaded = resume_from;
+    tp.written = resume_from;
+    tp.next_patch = resume_from;
+    tp.in_flight = 0;
+    tp.max_in_flight = 0;
+    tp.spill_failed = false;
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int worker_count = cpus < 1 ? 1 : (cpus > PIPELINE_MAX_WORKERS ? PIPELINE_MAX_WORKERS : (int)cpus);
+    pthread_t loader_thread;
+    pthread_t worker_threads[PIPELINE_MAX_WORKERS];
+    pthread_create(&loader_thread, &attr, LoaderThread, &tp);
+    for (i = 0; i < worker_count; ++i) {
+        pthread_create(&worker_threads[i], &attr, PatchWorker, &tp);
+    }
+
+    for (i = resume_from; i < transfer_count; ++i) {
+        Transfer* t = transfers + i;
+
+        pthread_mutex_lock(&tp.mu);
+        while (tp.loaded <= i || (IsPatch(t) && !t->patched)) {
+            pthread_cond_wait(&tp.cv, &tp.mu);
+        }
+        pthread_mutex_unlock(&tp.mu);
+
+        CheckpointBeforeWrite(&cp, &tp, i, blocks_so_far);
+
+        if (t->type == TRANSFER_MOVE) {
+            printf("  moving %d blocks\n", t->src_blocks);
 
-            if (style[0] == 'z') {   // "zero" but not "erase"
-                blocks_so_far += tgt->size;
-                fprintf(cmd_pipe, "set_progress %.4f\n", (double)blocks_so_far / total_blocks);
-                fflush(cmd_pipe);
+            WriteRanges(fd, t->tgt, t->data);
+
+            blocks_so_far += t->tgt->size;
+            ReportProgress(cmd_pipe, &last_progress_ms, blocks_so_far, total_blocks, false);
+
+        } else if (t->type == TRANSFER_STASH) {
+            // the loader has already put the data in the stash table
+
+        } else if (t->type == TRANSFER_ZERO ||
+                   (DEBUG_ERASE && t->type == TRANSFER_ERASE)) {
+            printf("  zeroing %d blocks\n", t->tgt->size);
+
+            // all ranges in one call, which flushes the device once
+            uint64_t* ranges = malloc(t->tgt->count * 2 * sizeof(uint64_t));
+            for (j = 0; j < t->tgt->count; ++j) {
+                ranges[j*2] = t->tgt->pos[j*2] * (uint64_t)BLOCKSIZE;
+                ranges[j*2+1] = (t->tgt->pos[j*2+1] - t->tgt->pos[j*2]) * (uint64_t)BLOCKSIZE;
             }
+            if (zero_ranges(fd, ranges, t->tgt->count) < 0) {
+                fprintf(stderr, "zeroing failed: %s\n", strerror(errno));
+            }
+            free(ranges);
 
-            free(tgt);
-        } else if (strcmp("new", style) == 0) {
+            if (t->type == TRANSFER_ZERO) {   // "zero" but not "erase"
+                blocks_so_far += t->tgt->size;
+                ReportProgress(cmd_pipe, &last_progress_ms, blocks_so_far, total_blocks, false);
+            }
 
-            word = strtok_r(NULL, " ", &wordsave);
-            RangeSet* tgt = parse_range(word);
+        } else if (t->type == TRANSFER_NEW) {
+            RangeSet* tgt = t->tgt;
 
             printf("  writing %d blocks of new data\n", tgt->size);
 
@@ -651,34 +1721,12 @@ Value* BlockImageUpdateFn(const char* name, State* state, int argc, Expr* argv[]
             pthread_mutex_unlock(&nti.mu);
 
             blocks_so_far += tgt->size;
-            fprintf(cmd_pipe, "set_progress %.4f\n", (double)blocks_so_far / total_blocks);
-            fflush(cmd_pipe);
-
-            free(tgt);
-
-        } else if (strcmp("bsdiff", style) == 0 ||
-                   strcmp("imgdiff", style) == 0) {
-            word = strtok_r(NULL, " ", &wordsave);
-            size_t patch_offset = strtoul(word, NULL, 0);
-            word = strtok_r(NULL, " ", &wordsave);
-            size_t patch_len = strtoul(word, NULL, 0);
-
-            RangeSet* tgt;
-            int src_blocks;
-            if (version == 1) {
-                LoadSrcTgtVersion1(wordsave, &tgt, &src_blocks,
-                                   &buffer, &buffer_alloc, fd);
-            } else if (version == 2) {
-                LoadSrcTgtVersion2(wordsave, &tgt, &src_blocks,
-                                   &buffer, &buffer_alloc, fd, stash_table);
-            }
+            ReportProgress(cmd_pipe, &last_progress_ms, blocks_so_far, total_blocks, false);
 
-            printf("  patching %d blocks to %d\n", src_blocks, tgt->size);
+        } else if (IsPatch(t)) {
+            RangeSet* tgt = t->tgt;
 
-            Value patch_value;
-            patch_value.type = VAL_BLOB;
-            patch_value.size = patch_len;
-            patch_value.data = (char*)(patch_start + patch_offset);
+            printf("  patching %d blocks to %d\n", t->src_blocks, tgt->size);
 
             RangeSinkState rss;
             rss.fd = fd;
@@ -687,14 +1735,12 @@ Value* BlockImageUpdateFn(const char* name, State* state, int argc, Expr* argv[]
             rss.p_remain = (tgt->pos[1] - tgt->pos[0]) * BLOCKSIZE;
             check_lseek(fd, (off64_t)tgt->pos[0] * BLOCKSIZE, SEEK_SET);
 
-            if (style[0] == 'i') {      // imgdiff
-                ApplyImagePatch(buffer, src_blocks * BLOCKSIZE,
-                                &patch_value,
-                                &RangeSinkWrite, &rss, NULL, NULL);
-            } else {
-                ApplyBSDiffPatch(buffer, src_blocks * BLOCKSIZE,
-                                 &patch_value, 0,
-                                 &RangeSinkWrite, &rss, NULL);
+            if (t->data_len > 0) {
+                RangeSinkWrite(t->data, t->data_len, &rss);
+            }
+            if (t->overrun) {
+                fprintf(stderr, "range sink write overrun");
+                exit(1);
             }
 
             // We expect the output of the patcher to fill the tgt ranges exactly.
@@ -703,46 +1749,61 @@ Value* BlockImageUpdateFn(const char* name, State* state, int argc, Expr* argv[]
             }
 
             blocks_so_far += tgt->size;
-            fprintf(cmd_pipe, "set_progress %.4f\n", (double)blocks_so_far / total_blocks);
-            fflush(cmd_pipe);
+            ReportProgress(cmd_pipe, &last_progress_ms, blocks_so_far, total_blocks, false);
 
-            free(tgt);
-        } else if (!DEBUG_ERASE && strcmp("erase", style) == 0) {
+        } else if (!DEBUG_ERASE && t->type == TRANSFER_ERASE) {
             struct stat st;
             if (fstat(fd, &st) == 0 && S_ISBLK(st.st_mode)) {
-                word = strtok_r(NULL, " ", &wordsave);
-                RangeSet* tgt = parse_range(word);
+                RangeSet* tgt = t->tgt;
 
                 printf("  erasing %d blocks\n", tgt->size);
 
-                for (i = 0; i < tgt->count; ++i) {
-                    uint64_t range[2];
-                    // offset in bytes
-                    range[0] = tgt->pos[i*2] * (uint64_t)BLOCKSIZE;
-                    // len in bytes
-                    range[1] = (tgt->pos[i*2+1] - tgt->pos[i*2]) * (uint64_t)BLOCKSIZE;
-
-                    if (ioctl(fd, BLKDISCARD, &range) < 0) {
+                for (j = 0; j < tgt->count; ++j) {
+                    if (discard_range(fd, tgt->pos[j*2] * (uint64_t)BLOCKSIZE,
+                                      (tgt->pos[j*2+1] - tgt->pos[j*2]) * (uint64_t)BLOCKSIZE) < 0) {
                         printf("    blkdiscard failed: %s\n", strerror(errno));
                     }
                 }
-
-                free(tgt);
             } else {
                 printf("  ignoring erase (not block device)\n");
             }
         } else {
-            fprintf(stderr, "unknown transfer style \"%s\"\n", style);
+            fprintf(stderr, "unknown transfer style \"%s\"\n", t->style);
             exit(1);
         }
+
+        CheckpointAfterWrite(&cp, &tp, i, blocks_so_far);
+
+        free(t->data);
+        t->data = NULL;
+        pthread_mutex_lock(&tp.mu);
+        tp.written = i + 1;
+        tp.in_flight -= t->mem;
+        pthread_cond_broadcast(&tp.cv);
+        pthread_mutex_unlock(&tp.mu);
     }
 
+    pthread_join(loader_thread, NULL);
+    for (i = 0; i < worker_count; ++i) {
+        pthread_join(worker_threads[i], NULL);
+    }
     pthread_join(new_data_thread, NULL);
+    ReportProgress(cmd_pipe, &last_progress_ms, blocks_so_far, total_blocks, true);
     success = true;
 
-    free(buffer);
+    if (cp.dir != NULL) {
+        ClearCheckpoint(cp.dir, true);
+    }
+    free(cp.dir);
+    free(cp.list_sha1);
+    free(cp.last_read);
+    free(final_writer);
+    for (i = 0; i < transfer_count; ++i) {
+        FreeTransfer(transfers + i);
+    }
+    free(transfers);
     printf("wrote %d blocks; expected %d\n", blocks_so_far, total_blocks);
-    printf("max alloc needed was %zu\n", buffer_alloc);
+    printf("max alloc needed was %zu\n", tp.max_in_flight);
 
   done:
     free(transfer_list);
@@ -757,6 +1818,7 @@ Value* RangeSha1Fn(const char* name, State* state, int argc, Expr* argv[]) {
     Value* blockdev_filename;
     Value* ranges;
     const uint8_t* digest = NULL;
+    char* saved = NULL;
     if (ReadValueArgs(state, argv, 2, &blockdev_filename, &ranges) < 0) {
         return NULL;
     }
@@ -776,6 +1838,34 @@ Value* RangeSha1Fn(const char* name, State* state, int argc, Expr* argv[]) {
         goto done;
     }
 
+    // While an update of the partition is partway done, answer with
+    // what the ranges held before it started, so the script's check
+    // of the source lets block_image_update() carry on with it.
+    char record[64];
+    char* id = DigestString(ranges->data, strlen(ranges->data));
+    snprintf(record, sizeof(record), "sha1-%s", id);
+    free(id);
+    bool in_progress = false;
+    char* dir = CheckpointDir(blockdev_filename->data, false);
+    if (dir != NULL) {
+        Progress progress;
+        char* text;
+        if (LoadProgress(dir, fd, &progress, &text)) {
+            in_progress = true;
+            free(text);
+            saved = (char*) ReadCheckpointFile(dir, record, NULL);
+        } else {
+            ClearCheckpoint(dir, true);
+        }
+        free(dir);
+    }
+    if (saved != NULL) {
+        printf("%s is partway through an update; using the SHA-1 from before it started\n",
+               blockdev_filename->data);
+        close(fd);
+        goto done;
+    }
+
     RangeSet* rs = parse_range(ranges->data);
     uint8_t buffer[BLOCKSIZE];
 
@@ -793,10 +1883,18 @@ Value* RangeSha1Fn(const char* name, State* state, int argc, Expr* argv[]) {
     digest = SHA_final(&ctx);
     close(fd);
 
+    if (!in_progress) {
+        char* hex = PrintSha1(digest);
+        RememberSourceSha1(blockdev_filename->data, record, hex);
+        free(hex);
+    }
+
   done:
     FreeValue(blockdev_filename);
     FreeValue(ranges);
-    if (digest == NULL) {
+    if (saved != NULL) {
+        return StringValue(saved);
+    } else if (digest == NULL) {
         return StringValue(strdup(""));
     } else {
         return StringValue(PrintSha1(digest));
@@ -18,6 +18,9 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/stat.h>
 
 #include "edify/expr.h"
 #include "updater.h"
@@ -37,8 +40,77 @@
 #define SELINUX_CONTEXTS_ZIP "file_contexts"
 #define SELINUX_CONTEXTS_TMP "/tmp/file_contexts"
 
+// Set by TWRP (see Run_Update_Binary() in twinstall.cpp): the package it
+// verified, still open, and an unnamed file with the central directory it
+// parsed (see mzWriteZipDirectory()), so the package is neither opened
+// nor parsed a second time.  Other recoveries don't set them.
+#define PACKAGE_FD_ENV "UPDATER_PACKAGE_FD"
+#define PACKAGE_DIRECTORY_FD_ENV "UPDATER_PACKAGE_DIRECTORY_FD"
+
 struct selabel_handle *sehandle;
 
+// Take over the descriptor named by the environment variable 'name', if
+// any, so it is neither passed on to programs the script runs nor used
+// twice.  Returns -1 if there is none.
+static int TakeEnvFd(const char* name) {
+    const char* value = getenv(name);
+    int fd = -1;
+    if (value != NULL) {
+        char* end;
+        long l = strtol(value, &end, 10);
+        if (*value != '\0' && *end == '\0' && l >= 0 && l < INT_MAX &&
+            fcntl((int)l, F_SETFD, FD_CLOEXEC) == 0) {
+            fd = (int)l;
+        }
+        unsetenv(name);
+    }
+    return fd;
+}
+
+// Map the package and open it as a zip, from what the recovery handed
+// over where that is still the same file.
+static int OpenPackage(const char* package_filename, MemMapping* map, ZipArchive* za) {
+    int package_fd = TakeEnvFd(PACKAGE_FD_ENV);
+    int directory_fd = TakeEnvFd(PACKAGE_DIRECTORY_FD_ENV);
+    int mapped = -1;
+
+    if (package_fd >= 0) {
+        struct stat fd_st, path_st;
+        if (package_filename[0] != '@' &&
+            fstat(package_fd, &fd_st) == 0 && stat(package_filename, &path_st) == 0 &&
+            fd_st.st_dev == path_st.st_dev && fd_st.st_ino == path_st.st_ino) {
+            mapped = sysMapFd(package_fd, map);
+        } else if (directory_fd >= 0) {
+            // Not the package we were asked to install; neither is its directory
+            close(directory_fd);
+            directory_fd = -1;
+        }
+        close(package_fd);
+    }
+    if (mapped != 0 && sysMapFile(package_filename, map) != 0) {
+        printf("failed to map package %s\n", package_filename);
+        if (directory_fd >= 0) close(directory_fd);
+        return 3;
+    }
+
+    if (directory_fd >= 0) {
+        int err = mzOpenZipArchiveDirectory(map->addr, map->length, directory_fd, za);
+        close(directory_fd);
+        if (err == 0) {
+            return 0;
+        }
+        printf("can't use the package directory from the recovery; parsing it\n");
+    }
+
+    int err = mzOpenZipArchive(map->addr, map->length, za);
+    if (err != 0) {
+        printf("failed to open package %s: %s\n",
+               package_filename, strerror(err));
+        return 3;
+    }
+    return 0;
+}
+
 int main(int argc, char** argv) {
     // Various things log information to stdout or stderr more or less
     // at random (though we've tried to standardize on stdout).  The
@@ -72,17 +144,10 @@ int main(int argc, char** argv) {
 
     const char* package_filename = argv[3];
     MemMapping map;
-    if (sysMapFile(package_filename, &map) != 0) {
-        printf("failed to map package %s\n", argv[3]);
-        return 3;
-    }
     ZipArchive za;
-    int err;
-    err = mzOpenZipArchive(map.addr, map.length, &za);
+    int err = OpenPackage(package_filename, &map, &za);
     if (err != 0) {
-        printf("failed to open package %s: %s\n",
-               argv[3], strerror(err));
-        return 3;
+        return err;
     }
 
     const ZipEntry* script_entry = mzFindZipEntry(&za, SCRIPT_NAME);
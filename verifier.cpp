@@ -113,7 +113,34 @@ static bool read_pkcs7(uint8_t* pkcs7_der, size_t pkcs7_der_len, uint8_t** sig_d
 // Return VERIFY_SUCCESS, VERIFY_FAILURE (if any error is encountered
 // or no key matches the signature).
 int verify_file(unsigned char* addr, size_t length) {
-    //ui->SetProgress(0.0);
+    VerifyContext ctx;
+    int ret = verify_begin(&ctx, addr, length);
+    if (ret != VERIFY_SUCCESS)
+        return ret;
+
+#define BUFFER_SIZE 4096
+
+    double frac = -1.0;
+    size_t so_far = 0;
+    while (so_far < ctx.signed_len) {
+        size_t size = ctx.signed_len - so_far;
+        if (size > BUFFER_SIZE) size = BUFFER_SIZE;
+
+        verify_update(&ctx, addr + so_far, size);
+        so_far += size;
+
+        double f = so_far / (double)ctx.signed_len;
+        if (f > frac + 0.02 || size == so_far) {
+            //ui->SetProgress(f);
+            frac = f;
+        }
+    }
+
+    return verify_end(&ctx, addr, length);
+}
+
+int verify_begin(VerifyContext* ctx, unsigned char* addr, size_t length) {
+    memset(ctx, 0, sizeof(*ctx));
 
     int numKeys;
     Certificate* pKeys = load_keys(PUBLIC_KEYS_FILE, &numKeys);
@@ -136,6 +163,7 @@ int verify_file(unsigned char* addr, size_t length) {
 
     if (length < FOOTER_SIZE) {
         LOGE("not big enough to contain footer\n");
+        free(pKeys);
         return VERIFY_FAILURE;
     }
 
@@ -143,6 +171,7 @@ int verify_file(unsigned char* addr, size_t length) {
 
     if (footer[2] != 0xff || footer[3] != 0xff) {
         LOGE("footer is wrong\n");
+        free(pKeys);
         return VERIFY_FAILURE;
     }
 
@@ -153,6 +182,7 @@ int verify_file(unsigned char* addr, size_t length) {
 
     if (signature_start <= FOOTER_SIZE) {
         LOGE("Signature start is in the footer");
+        free(pKeys);
         return VERIFY_FAILURE;
     }
 
@@ -164,6 +194,7 @@ int verify_file(unsigned char* addr, size_t length) {
 
     if (length < eocd_size) {
         LOGE("not big enough to contain EOCD\n");
+        free(pKeys);
         return VERIFY_FAILURE;
     }
 
@@ -180,6 +211,7 @@ int verify_file(unsigned char* addr, size_t length) {
     if (eocd[0] != 0x50 || eocd[1] != 0x4b ||
         eocd[2] != 0x05 || eocd[3] != 0x06) {
         LOGE("signature length doesn't match EOCD marker\n");
+        free(pKeys);
         return VERIFY_FAILURE;
     }
 
@@ -192,45 +224,55 @@ int verify_file(unsigned char* addr, size_t length) {
             // which could be exploitable.  Fail verification if
             // this sequence occurs anywhere after the real one.
             LOGE("EOCD marker occurs after start of EOCD\n");
+            free(pKeys);
             return VERIFY_FAILURE;
         }
     }
 
-#define BUFFER_SIZE 4096
-
-    bool need_sha1 = false;
-    bool need_sha256 = false;
-    for (i = 0; i < numKeys; ++i) {
+    for (i = 0; i < (size_t)numKeys; ++i) {
         switch (pKeys[i].hash_len) {
-            case SHA_DIGEST_SIZE: need_sha1 = true; break;
-            case SHA256_DIGEST_SIZE: need_sha256 = true; break;
+            case SHA_DIGEST_SIZE: ctx->need_sha1 = true; break;
+            case SHA256_DIGEST_SIZE: ctx->need_sha256 = true; break;
         }
     }
 
-    SHA_CTX sha1_ctx;
-    SHA256_CTX sha256_ctx;
-    SHA_init(&sha1_ctx);
-    SHA256_init(&sha256_ctx);
+    ctx->keys = pKeys;
+    ctx->num_keys = numKeys;
+    ctx->signed_len = signed_len;
+    ctx->signature_start = signature_start;
+    ctx->eocd_size = eocd_size;
+    SHA_init(&ctx->sha1_ctx);
+    SHA256_init(&ctx->sha256_ctx);
+    return VERIFY_SUCCESS;
+}
 
-    double frac = -1.0;
-    size_t so_far = 0;
-    while (so_far < signed_len) {
-        size_t size = signed_len - so_far;
-        if (size > BUFFER_SIZE) size = BUFFER_SIZE;
+void verify_update(VerifyContext* ctx, const unsigned char* data, size_t len) {
+    if (ctx->hashed >= ctx->signed_len)
+        return;
+    if (len > ctx->signed_len - ctx->hashed)
+        len = ctx->signed_len - ctx->hashed;
+    if (ctx->need_sha1) SHA_update(&ctx->sha1_ctx, data, len);
+    if (ctx->need_sha256) SHA256_update(&ctx->sha256_ctx, data, len);
+    ctx->hashed += len;
+}
 
-        if (need_sha1) SHA_update(&sha1_ctx, addr + so_far, size);
-        if (need_sha256) SHA256_update(&sha256_ctx, addr + so_far, size);
-        so_far += size;
+// Checks the signature in the comment against the hashes of the signed
+// data, trying every loaded key.
+static int verify_signature(VerifyContext* ctx, unsigned char* addr, size_t length) {
+    Certificate* pKeys = ctx->keys;
+    int numKeys = ctx->num_keys;
+    size_t eocd_size = ctx->eocd_size;
+    size_t signature_start = ctx->signature_start;
+    unsigned char* eocd = addr + length - eocd_size;
+    size_t i;
 
-        double f = so_far / (double)signed_len;
-        if (f > frac + 0.02 || size == so_far) {
-            //ui->SetProgress(f);
-            frac = f;
-        }
+    if (ctx->hashed != ctx->signed_len) {
+        LOGE("only %zu of %zu signed bytes were hashed\n", ctx->hashed, ctx->signed_len);
+        return VERIFY_FAILURE;
     }
 
-    const uint8_t* sha1 = SHA_final(&sha1_ctx);
-    const uint8_t* sha256 = SHA256_final(&sha256_ctx);
+    const uint8_t* sha1 = SHA_final(&ctx->sha1_ctx);
+    const uint8_t* sha256 = SHA256_final(&ctx->sha256_ctx);
 
     uint8_t* sig_der = NULL;
     size_t sig_der_length = 0;
@@ -302,6 +344,13 @@ int verify_file(unsigned char* addr, size_t length) {
     return VERIFY_FAILURE;
 }
 
+int verify_end(VerifyContext* ctx, unsigned char* addr, size_t length) {
+    int ret = verify_signature(ctx, addr, length);
+    free(ctx->keys);
+    ctx->keys = NULL;
+    return ret;
+}
+
 // Reads a file containing one or more public keys as produced by
 // DumpPublicKey:  this is an RSAPublicKey struct as it would appear
 // as a C source literal, eg:
@@ -19,6 +19,8 @@
 
 #include "mincrypt/p256.h"
 #include "mincrypt/rsa.h"
+#include "mincrypt/sha.h"
+#include "mincrypt/sha256.h"
 
 #define ASSUMED_UPDATE_BINARY_NAME  "META-INF/com/google/android/update-binary"
 
@@ -50,6 +52,30 @@ typedef struct {
  */
 int verify_file(unsigned char* addr, size_t length);
 
+/* The same check in steps, so the signed data can be hashed while the
+ * package is being read for something else.  verify_begin() loads the
+ * keys and checks the footer, verify_update() is then fed the package
+ * in order from its start (anything past the signed part is ignored),
+ * and verify_end() checks the signature and frees the keys.  Nothing
+ * needs to be freed if verify_begin() fails.
+ */
+typedef struct {
+    Certificate* keys;
+    int num_keys;
+    size_t signed_len;       // bytes from the start covered by the signature
+    size_t hashed;           // bytes hashed so far
+    size_t signature_start;  // from the end of the file
+    size_t eocd_size;
+    bool need_sha1;
+    bool need_sha256;
+    SHA_CTX sha1_ctx;
+    SHA256_CTX sha256_ctx;
+} VerifyContext;
+
+int verify_begin(VerifyContext* ctx, unsigned char* addr, size_t length);
+void verify_update(VerifyContext* ctx, const unsigned char* data, size_t len);
+int verify_end(VerifyContext* ctx, unsigned char* addr, size_t length);
+
 Certificate* load_keys(const char* filename, int* numKeys);
 
 #define VERIFY_SUCCESS        0